@@ -0,0 +1,64 @@
+// clksync.c
+// See clksync.h. Everything is uint32_t milliseconds; differences are taken as signed
+// so the arithmetic survives either clock wrapping.
+
+#include "garage_proto.h"
+#include "clksync.h"
+
+void GP_FLASH clk_init(clk_t *p_clk, uint32_t receiver)
+{
+  p_clk->receiver = receiver;
+  p_clk->offset = GP_OFFSET_UNKNOWN;
+  p_clk->rtt_ms = 0;
+  p_clk->best_ms = 0;
+  p_clk->t0 = 0;
+  p_clk->asked_ms = 0;
+  p_clk->requests = 0;
+  p_clk->samples = 0;
+  p_clk->updates = 0;
+}
+
+// Is it time for another TIME_REQ? Every time we are asked until CLK_BURST answers
+// have come back, then every CLK_INTERVAL_MS.
+int GP_FLASH clk_due(const clk_t *p_clk, uint32_t now_ms)
+{
+  if (p_clk->asked_ms == 0 || p_clk->samples < CLK_BURST)
+    return 1;
+  return now_ms - p_clk->asked_ms >= CLK_INTERVAL_MS;
+}
+
+// We are about to send a TIME_REQ. Returns t0 to put in it.
+uint32_t GP_FLASH clk_request(clk_t *p_clk, uint32_t now_ms)
+{
+  p_clk->t0 = now_ms;
+  p_clk->asked_ms = now_ms ? now_ms : 1;
+  p_clk->requests++;
+  return now_ms;
+}
+
+// An answer arrived at t3. Returns 1 if it replaced the offset, 0 if we kept the one we
+// had and -1 if it wasn't an answer to our last request.
+int GP_FLASH clk_sample(clk_t *p_clk, uint32_t t0, uint32_t t1, uint32_t t2, uint32_t t3)
+{
+  int32_t rtt, offset;
+  uint32_t allowed;
+
+  if (p_clk->asked_ms == 0 || t0 != p_clk->t0)
+    return -1;
+  rtt = (int32_t)(t3 - t0) - (int32_t)(t2 - t1);
+  if (rtt < 0)
+    return -1;
+  p_clk->samples++;
+
+  // The rtt to beat, aged since the best sample was taken
+  allowed = p_clk->rtt_ms + (t3 - p_clk->best_ms) / CLK_AGE_MS;
+  if (p_clk->offset != GP_OFFSET_UNKNOWN && (uint32_t)rtt > allowed)
+    return 0;
+
+  offset = ((int32_t)(t1 - t0) + (int32_t)(t2 - t3)) / 2;
+  p_clk->offset = offset == GP_OFFSET_UNKNOWN ? offset + 1 : offset;
+  p_clk->rtt_ms = rtt;
+  p_clk->best_ms = t3;
+  p_clk->updates++;
+  return 1;
+}
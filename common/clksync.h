@@ -0,0 +1,45 @@
+// clksync.h
+// Sender side of the TIME exchange (see garage_proto.h): an estimate of how far the
+// receiver's clock is from ours, so the receiver can turn our timestamps into its own
+// and measure detection -> received end to end.
+//
+// Every exchange gives four times, t0 and t3 on our clock, t1 and t2 on the receiver's:
+//
+//   offset = ((t1 - t0) + (t2 - t3)) / 2     rtt = (t3 - t0) - (t2 - t1)
+//
+// The offset is exact if the request and the answer took equally long, and the error
+// is at most rtt / 2 either way, so we keep the sample with the smallest rtt. A good
+// sample slowly goes stale as the two crystals drift apart: the rtt we compare against
+// grows by 1 ms every CLK_AGE_MS until a fresh sample beats it.
+//
+// The offset is only good for one receiver; start over with clk_init when the sender
+// moves to another. No SDK code in here.
+
+#ifndef __CLKSYNC__H
+
+  #define __CLKSYNC__H
+
+  #include "gp_port.h"
+
+  #define CLK_BURST 4             // exchanges in a row after clk_init
+  #define CLK_INTERVAL_MS 60000   // then one every minute
+  #define CLK_AGE_MS 10000
+
+  typedef struct {
+    uint32_t receiver;      // receiver id the offset belongs to
+    int32_t offset;         // receiver clock - our clock, GP_OFFSET_UNKNOWN until the first sample
+    uint32_t rtt_ms;        // rtt of the sample the offset came from
+    uint32_t best_ms;       // when we took that sample
+    uint32_t t0;            // our clock when the outstanding request went out
+    uint32_t asked_ms;      // when we last asked (0 == never)
+    uint32_t requests;      // TIME_REQ sent
+    uint32_t samples;       // answers that came back
+    uint32_t updates;       // answers good enough to replace the offset
+  } clk_t;
+
+  void clk_init(clk_t *p_clk, uint32_t receiver);
+  int clk_due(const clk_t *p_clk, uint32_t now_ms);
+  uint32_t clk_request(clk_t *p_clk, uint32_t now_ms);
+  int clk_sample(clk_t *p_clk, uint32_t t0, uint32_t t1, uint32_t t2, uint32_t t3);
+
+#endif
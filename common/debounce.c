@@ -0,0 +1,75 @@
+// debounce.c
+// See debounce.h. All the times are milliseconds from whatever clock the caller
+// uses. Unsigned subtraction only survives that clock wrapping if it wraps at 2^32 ms:
+// the sender's clock_ms (functions.c) does, system_get_time() / 1000 doesn't.
+
+#include "debounce.h"
+
+void GP_FLASH debounce_init(debounce_t *p_db, uint16_t mask, uint16_t levels, uint32_t settle_ms)
+{
+  p_db->mask = mask;
+  p_db->stable = levels & mask;
+  p_db->count0 = 0;
+  p_db->count1 = 0;
+  p_db->active = 0;
+  p_db->changed = 0;
+  p_db->sample_ms = settle_ms / DEBOUNCE_SAMPLES ? settle_ms / DEBOUNCE_SAMPLES : 1;
+  p_db->first_ms = 0;
+  p_db->latency_ms = 0;
+  p_db->max_latency_ms = 0;
+  p_db->transitions = 0;
+  p_db->bounces = 0;
+  p_db->samples = 0;
+}
+
+// Record an edge on any of the pins. This one is called from the GPIO interrupt so it
+// is deliberately NOT marked GP_FLASH ... on the ESP8266 it stays in IRAM.
+void debounce_edge(debounce_t *p_db, uint32_t now_ms)
+{
+  if (!p_db->active) {
+    p_db->active = 1;
+    p_db->first_ms = now_ms;
+  }
+}
+
+// One sample of all the pins (levels is the raw input register; we only look at the
+// mask bits). Returns the pins whose transition was confirmed by this sample, 0 if
+// none; p_db->stable holds the new levels. Once every pin agrees with its confirmed
+// level again the burst is over and p_db->active drops to 0: stop sampling until the
+// next edge. While any pin still differs it is 1, even if no edge set it (one that
+// came in while the sample was being taken, or a sample taken on a timer): a pin left
+// halfway through its count would otherwise never be confirmed.
+uint16_t GP_FLASH debounce_sample(debounce_t *p_db, uint16_t levels, uint32_t now_ms)
+{
+  uint16_t delta = (levels ^ p_db->stable) & p_db->mask;
+  uint16_t toggled;
+  uint32_t n;
+
+  p_db->samples++;
+
+  // Count up the pins that differ, clear the ones that don't. A pin whose counter is
+  // back at zero while it still differs has done DEBOUNCE_SAMPLES in a row.
+  p_db->count1 = (p_db->count1 ^ p_db->count0) & delta;
+  p_db->count0 = ~p_db->count0 & delta;
+  toggled = delta & ~(p_db->count0 | p_db->count1);
+  p_db->stable ^= toggled;
+
+  if (toggled) {
+    for (n = toggled; n; n &= n - 1)
+      p_db->transitions++;
+    p_db->changed = 1;
+    p_db->latency_ms = now_ms - p_db->first_ms;
+    if (p_db->latency_ms > p_db->max_latency_ms)
+      p_db->max_latency_ms = p_db->latency_ms;
+  }
+
+  // Everything settled
+  if ((delta & ~toggled) == 0) {
+    if (!p_db->changed)
+      p_db->bounces++;
+    p_db->changed = 0;
+    p_db->active = 0;
+  } else
+    p_db->active = 1;
+  return toggled;
+}
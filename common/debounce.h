@@ -0,0 +1,46 @@
+// debounce.h
+// Debounce for a whole bank of (very noisy) door switches at once. The GPIO interrupt
+// calls debounce_edge on any edge of any of the pins and starts the sampling; from then
+// on something calls debounce_sample every sample_ms with one read of the GPIO input
+// register until the burst is over.
+//
+// Each pin has a two bit counter of how many samples in a row it has read different
+// from its confirmed level. The counters are kept "vertically": bit n of count0 and
+// count1 belongs to pin n, so one handful of AND/XOR operations steps all sixteen of
+// them at once and the cost of a sample doesn't depend on how many doors there are. A
+// pin is confirmed after DEBOUNCE_SAMPLES differing samples in a row (settle_ms); any
+// sample that agrees with the confirmed level starts its count over. Bursts that
+// settle back to where they started are counted but never reported.
+//
+// There is no SDK code in here so the same logic builds on Linux.
+
+#ifndef __DEBOUNCE__H
+
+  #define __DEBOUNCE__H
+
+  #include "gp_port.h"
+
+  // Samples in a row a pin has to differ before we believe it (what two bits count)
+  #define DEBOUNCE_SAMPLES 4
+
+  typedef struct {
+    uint16_t mask;            // the pins we watch
+    uint16_t stable;          // last confirmed levels (mask bits only)
+    uint16_t count0;          // vertical counter, low bit, one bit per pin
+    uint16_t count1;          // vertical counter, high bit
+    uint8_t active;           // a burst is being debounced: keep sampling
+    uint8_t changed;          // something was confirmed during this burst
+    uint32_t sample_ms;       // time between samples, settle_ms / DEBOUNCE_SAMPLES
+    uint32_t first_ms;        // time of the first edge of the current burst
+    uint32_t latency_ms;      // first edge -> confirmed, for the last transition
+    uint32_t max_latency_ms;  // worst latency seen since boot
+    uint32_t transitions;     // confirmed pin transitions
+    uint32_t bounces;         // bursts that settled back to the stable levels
+    uint32_t samples;         // calls to debounce_sample
+  } debounce_t;
+
+  void debounce_init(debounce_t *p_db, uint16_t mask, uint16_t levels, uint32_t settle_ms);
+  void debounce_edge(debounce_t *p_db, uint32_t now_ms);
+  uint16_t debounce_sample(debounce_t *p_db, uint16_t levels, uint32_t now_ms);
+
+#endif
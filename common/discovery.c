@@ -0,0 +1,168 @@
+// discovery.c
+// Receiver discovery and failover for the sender. See discovery.h.
+
+#include "discovery.h"
+
+// Pick the best receiver we know: fewest failures, then the most recently heard.
+// Returns its index or -1 if the list is empty.
+static int GP_FLASH disc_best(const disc_t *p_disc)
+{
+  int i, best = -1;
+  const disc_entry_t *p_e, *p_b;
+
+  for (i = 0; i < DISC_MAX; i++) {
+    p_e = &p_disc->entry[i];
+    if (p_e->id == 0)
+      continue;
+    if (best >= 0) {
+      p_b = &p_disc->entry[best];
+      if (p_e->fails > p_b->fails)
+        continue;
+      if (p_e->fails == p_b->fails && (int32_t)(p_e->heard_ms - p_b->heard_ms) <= 0)
+        continue;
+    }
+    best = i;
+  }
+  return best;
+}
+
+// Move to the best receiver left after the current one failed or left. Returns 1 if
+// there is one to report to.
+static int GP_FLASH disc_switch(disc_t *p_disc)
+{
+  p_disc->current = disc_best(p_disc);
+  p_disc->failovers++;
+  if (p_disc->current < 0) {
+    // Nobody left ... start probing again, quickly
+    disc_probe_reset(p_disc);
+    return 0;
+  }
+  return 1;
+}
+
+void GP_FLASH disc_init(disc_t *p_disc, uint32_t now_ms)
+{
+  int i;
+
+  for (i = 0; i < DISC_MAX; i++)
+    p_disc->entry[i].id = 0;
+  p_disc->current = -1;
+  p_disc->probe_ms = DISC_PROBE_MIN_MS;
+  p_disc->boot_ms = now_ms;
+  p_disc->first_ms = 0;
+  p_disc->announces = 0;
+  p_disc->failovers = 0;
+}
+
+// A receiver announced itself. Add it (or refresh its address). If the list is full the
+// worst candidate that isn't the current receiver makes room. Returns 1 if this gave
+// us a current receiver where we had none, i.e. the caller can start sending.
+int GP_FLASH disc_heard(disc_t *p_disc, uint32_t id, const uint8_t *p_ip, uint32_t now_ms)
+{
+  int i, slot = -1;
+  disc_entry_t *p_e;
+
+  p_disc->announces++;
+  if (id == 0)
+    return 0;
+
+  for (i = 0; i < DISC_MAX; i++) {
+    p_e = &p_disc->entry[i];
+    if (p_e->id == id) {
+      slot = i;
+      break;
+    }
+    if (slot < 0 && p_e->id == 0)
+      slot = i;
+  }
+
+  if (slot < 0) {
+    // Full: evict the candidate with the most failures, the longest silent first
+    for (i = 0; i < DISC_MAX; i++) {
+      if (i == p_disc->current)
+        continue;
+      if (slot < 0 || p_disc->entry[i].fails > p_disc->entry[slot].fails ||
+          (p_disc->entry[i].fails == p_disc->entry[slot].fails &&
+           (int32_t)(p_disc->entry[i].heard_ms - p_disc->entry[slot].heard_ms) < 0))
+        slot = i;
+    }
+  }
+
+  p_e = &p_disc->entry[slot];
+  if (p_e->id != id)
+    p_e->fails = 0;
+  p_e->id = id;
+  for (i = 0; i < 4; i++)
+    p_e->ip[i] = p_ip[i];
+  p_e->heard_ms = now_ms;
+
+  if (p_disc->current < 0) {
+    p_disc->current = slot;
+    return 1;
+  }
+  return 0;
+}
+
+// A receiver left (the soft-AP saw it disassociate). Returns 1 if it was the current
+// receiver and we moved on to another one, -1 if it was and there is no other.
+int GP_FLASH disc_forget(disc_t *p_disc, uint32_t id)
+{
+  int i;
+
+  for (i = 0; i < DISC_MAX; i++) {
+    if (p_disc->entry[i].id != id || id == 0)
+      continue;
+    p_disc->entry[i].id = 0;
+    if (i != p_disc->current)
+      return 0;
+    return disc_switch(p_disc) ? 1 : -1;
+  }
+  return 0;
+}
+
+// Reliable delivery gave up on the current receiver. Charge it a failure (forget it
+// after DISC_MAX_FAILS) and pick the best candidate, which may be the same one if it
+// is all we have. Returns 1 if there is a receiver to try next.
+int GP_FLASH disc_failed(disc_t *p_disc)
+{
+  disc_entry_t *p_e;
+
+  if (p_disc->current < 0)
+    return 0;
+  p_e = &p_disc->entry[p_disc->current];
+  if (++p_e->fails >= DISC_MAX_FAILS)
+    p_e->id = 0;
+  return disc_switch(p_disc);
+}
+
+// The current receiver ACKed something.
+void GP_FLASH disc_delivered(disc_t *p_disc, uint32_t now_ms)
+{
+  if (p_disc->current < 0)
+    return;
+  p_disc->entry[p_disc->current].fails = 0;
+  if (p_disc->first_ms == 0)
+    p_disc->first_ms = (now_ms - p_disc->boot_ms) ? now_ms - p_disc->boot_ms : 1;
+}
+
+// The receiver to report to, or NULL if we don't know one yet.
+const disc_entry_t * GP_FLASH disc_current(const disc_t *p_disc)
+{
+  return p_disc->current < 0 ? NULL : &p_disc->entry[p_disc->current];
+}
+
+// Time to send a DISCOVER. Returns how long to wait before the next one; the interval
+// doubles each time up to DISC_PROBE_MAX_MS.
+uint32_t GP_FLASH disc_probe(disc_t *p_disc)
+{
+  uint32_t wait = p_disc->probe_ms;
+
+  p_disc->probe_ms = wait * 2 > DISC_PROBE_MAX_MS ? DISC_PROBE_MAX_MS : wait * 2;
+  return wait;
+}
+
+// Probe quickly again, e.g. because a station just joined.
+void GP_FLASH disc_probe_reset(disc_t *p_disc)
+{
+  p_disc->probe_ms = DISC_PROBE_MIN_MS;
+}
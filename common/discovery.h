@@ -0,0 +1,56 @@
+// discovery.h
+// The sender's list of receivers. Instead of reporting to a hard-coded address the
+// sender broadcasts a GP_TYPE_DISCOVER frame on the soft-AP subnet and every receiver
+// that hears it answers with a GP_TYPE_ANNOUNCE (see garage_proto.h). We keep up to
+// DISC_MAX of them and report to one, the current receiver, until it stops answering.
+//
+// Failover: when reliable delivery gives up on the current receiver (see reliable.h) it
+// is charged a failure and we switch to the candidate with the fewest failures, the
+// most recently heard first. A receiver that fails DISC_MAX_FAILS times in a row, or
+// leaves the soft-AP, is forgotten. Any ACK clears its failures.
+//
+// While no receiver is known the sender keeps probing, starting at DISC_PROBE_MIN_MS
+// and doubling up to DISC_PROBE_MAX_MS. first_ms records how long it took from
+// disc_init to the first delivered report; DISC_TARGET_MS is what we aim for.
+//
+// All times are milliseconds from whatever clock the caller uses. No SDK code in here.
+
+#ifndef __DISCOVERY__H
+
+  #define __DISCOVERY__H
+
+  #include "gp_port.h"
+
+  #define DISC_MAX 4
+  #define DISC_MAX_FAILS 3
+  #define DISC_PROBE_MIN_MS 100
+  #define DISC_PROBE_MAX_MS 5000
+  #define DISC_TARGET_MS 3000
+
+  typedef struct {
+    uint32_t id;            // receiver id (gp_mac_id), 0 == free slot
+    uint8_t ip[4];          // its IPv4 address, a.b.c.d
+    uint8_t fails;          // give-ups since its last ACK
+    uint32_t heard_ms;      // when it last announced itself
+  } disc_entry_t;
+
+  typedef struct {
+    disc_entry_t entry[DISC_MAX];
+    int8_t current;         // index of the receiver we report to, -1 if none
+    uint32_t probe_ms;      // wait before the next DISCOVER
+    uint32_t boot_ms;       // when we started looking
+    uint32_t first_ms;      // boot -> first delivered report, 0 until then
+    uint32_t announces;     // ANNOUNCE frames heard
+    uint32_t failovers;     // switches of the current receiver after a failure or leave
+  } disc_t;
+
+  void disc_init(disc_t *p_disc, uint32_t now_ms);
+  int disc_heard(disc_t *p_disc, uint32_t id, const uint8_t *p_ip, uint32_t now_ms);
+  int disc_forget(disc_t *p_disc, uint32_t id);
+  int disc_failed(disc_t *p_disc);
+  void disc_delivered(disc_t *p_disc, uint32_t now_ms);
+  const disc_entry_t *disc_current(const disc_t *p_disc);
+  uint32_t disc_probe(disc_t *p_disc);
+  void disc_probe_reset(disc_t *p_disc);
+
+#endif
@@ -0,0 +1,104 @@
+// evqueue.c
+// See evqueue.h. A plain ring buffer; slot i (counting from the oldest) lives at
+// (head + i) % EVQ_SIZE.
+
+#include "evqueue.h"
+
+#define EVQ_AT(p_q, i) (p_q)->event[((p_q)->head + (i)) % EVQ_SIZE]
+
+void GP_FLASH evq_init(evq_t *p_q, uint32_t coalesce_ms)
+{
+  p_q->head = 0;
+  p_q->count = 0;
+  p_q->sent = 0;
+  p_q->base_seq = 0;
+  p_q->next_seq = 0;
+  p_q->coalesce_ms = coalesce_ms;
+  p_q->queued = 0;
+  p_q->coalesced = 0;
+  p_q->overflow = 0;
+  p_q->delivered = 0;
+}
+
+// Queue a change. now_ms becomes the event's timestamp.
+void GP_FLASH evq_push(evq_t *p_q, uint16_t pins, uint32_t now_ms)
+{
+  gp_event_t *p_last;
+  uint8_t i;
+
+  p_q->queued++;
+
+  // Coalesce against the newest event, but only if it hasn't been sent
+  if (p_q->count > p_q->sent) {
+    p_last = &EVQ_AT(p_q, p_q->count - 1);
+    if (p_last->pins == pins) {
+      p_q->coalesced++;
+      return;
+    }
+    // The one before the newest, sent or not, tells us what state the newest event moved
+    // away from. A lone event has nothing before it in the queue, so it is never
+    // cancelled.
+    if (now_ms - p_last->timestamp < p_q->coalesce_ms && p_q->count >= 2 &&
+        EVQ_AT(p_q, p_q->count - 2).pins == pins) {
+      p_q->count--;
+      p_q->coalesced += 2;
+      return;
+    }
+  }
+
+  // Full: make room by dropping the oldest event nobody has seen yet
+  if (p_q->count == EVQ_SIZE) {
+    for (i = p_q->sent; i < p_q->count - 1; i++)
+      EVQ_AT(p_q, i) = EVQ_AT(p_q, i + 1);
+    p_q->count--;
+    p_q->overflow++;
+  }
+
+  EVQ_AT(p_q, p_q->count).pins = pins;
+  EVQ_AT(p_q, p_q->count).timestamp = now_ms;
+  p_q->count++;
+}
+
+// Fill in the events (device id, type and flags are up to the caller) for the next
+// frame: up to GP_BATCH_MAX events from the front of the queue. Events that were sent
+// before keep their sequence numbers, so a retransmit is the same frame again. Returns
+// the number of events, 0 if the queue is empty.
+int GP_FLASH evq_take(evq_t *p_q, gp_frame_t *p_frame)
+{
+  uint8_t i, n = p_q->count < GP_BATCH_MAX ? p_q->count : GP_BATCH_MAX;
+
+  if (n == 0)
+    return 0;
+
+  if (p_q->sent == 0)
+    p_q->base_seq = p_q->next_seq;
+  if (n > p_q->sent) {
+    p_q->next_seq += n - p_q->sent;
+    p_q->sent = n;
+  }
+
+  p_frame->type = n == 1 ? GP_TYPE_REPORT : GP_TYPE_BATCH;
+  p_frame->seq = p_q->base_seq;
+  p_frame->count = n;
+  for (i = 0; i < n; i++)
+    p_frame->event[i] = EVQ_AT(p_q, i);
+
+  return n;
+}
+
+// The receiver has everything up to and including seq. Drop those events from the
+// front of the queue. Returns how many were dropped.
+int GP_FLASH evq_ack(evq_t *p_q, uint32_t seq)
+{
+  int n = 0;
+
+  while (p_q->sent && (int32_t)(p_q->base_seq - seq) <= 0) {
+    p_q->head = (p_q->head + 1) % EVQ_SIZE;
+    p_q->count--;
+    p_q->sent--;
+    p_q->base_seq++;
+    p_q->delivered++;
+    n++;
+  }
+  return n;
+}
@@ -0,0 +1,47 @@
+// evqueue.h
+// The sender's queue of door events waiting to be delivered. Changes go in here first;
+// whenever the link is up and nothing is in flight the front of the queue goes out as
+// one report or batch frame (see garage_proto.h) and stays queued until the receiver
+// ACKs it. While the receiver is away events simply pile up and are flushed in batches
+// of GP_BATCH_MAX once it is back.
+//
+// Fixed size, no malloc: EVQ_SIZE events (8 bytes each). If it fills up we drop the
+// oldest event that hasn't been sent yet and count it in overflow.
+//
+// Redundant transitions are coalesced: a new event with the same pins as the last
+// queued one is dropped, and a new event that undoes the last queued one within
+// coalesce_ms (open -> closed -> open) cancels it, as long as there is an event before
+// that one (sent or not) to say what it undid. Only events that haven't been sent yet
+// are touched. Sequence numbers are handed out when an event is first put in a
+// frame, so coalescing never leaves gaps for the receiver to count as lost.
+
+#ifndef __EVQUEUE__H
+
+  #define __EVQUEUE__H
+
+  #include "garage_proto.h"
+
+  #ifndef EVQ_SIZE
+    #define EVQ_SIZE 32
+  #endif
+
+  typedef struct {
+    gp_event_t event[EVQ_SIZE];
+    uint8_t head;           // index of the oldest event
+    uint8_t count;          // events queued
+    uint8_t sent;           // events at the front that already have sequence numbers
+    uint32_t base_seq;      // sequence number of the event at head (if sent > 0)
+    uint32_t next_seq;      // next sequence number to hand out
+    uint32_t coalesce_ms;
+    uint32_t queued;        // events pushed
+    uint32_t coalesced;     // events dropped or cancelled as redundant
+    uint32_t overflow;      // events lost because the queue was full
+    uint32_t delivered;     // events ACKed
+  } evq_t;
+
+  void evq_init(evq_t *p_q, uint32_t coalesce_ms);
+  void evq_push(evq_t *p_q, uint16_t pins, uint32_t now_ms);
+  int evq_take(evq_t *p_q, gp_frame_t *p_frame);
+  int evq_ack(evq_t *p_q, uint32_t seq);
+
+#endif
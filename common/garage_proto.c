@@ -0,0 +1,506 @@
+// garage_proto.c
+// Encode and decode the binary frames described in garage_proto.h. No malloc, no libc
+// and no alignment assumptions: we build the frame one byte at a time so the exact same
+// code runs on the LX106, the ESP32 and a Linux box.
+
+#include "garage_proto.h"
+
+void GP_FLASH gp_put16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+void GP_FLASH gp_put32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+uint16_t GP_FLASH gp_get16(const uint8_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t GP_FLASH gp_get32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Length of the optional fields after a report's or batch's events
+static int GP_FLASH gp_tail_len(uint8_t flags)
+{
+  return ((flags & GP_FLAG_LIVENESS) ? GP_LIVENESS_LEN : 0) + ((flags & GP_FLAG_TRACE) ? GP_TRACE_LEN : 0);
+}
+
+// Write the optional fields after the events, which end at offset n. Returns the
+// frame length.
+static int GP_FLASH gp_tail_encode(const gp_frame_t *p_frame, uint8_t *p_buf, int n)
+{
+  if (p_frame->flags & GP_FLAG_LIVENESS) {
+    gp_put32(&p_buf[n], p_frame->next_ms);
+    n += GP_LIVENESS_LEN;
+  }
+  if (p_frame->flags & GP_FLAG_TRACE) {
+    n += GP_TRACE_LEN;
+    gp_stamp(p_buf, n, p_frame->tx_time, p_frame->offset);
+  }
+  return n;
+}
+
+// Encode a frame into p_buf. Returns the number of bytes written (send exactly that
+// many!) or 0 if the buffer is too small or the frame doesn't make sense.
+int GP_FLASH gp_encode(const gp_frame_t *p_frame, uint8_t *p_buf, size_t len)
+{
+  int i, n, tail = gp_tail_len(p_frame->flags);
+
+  if (len < GP_HEADER_LEN)
+    return 0;
+
+  p_buf[0] = GP_MAGIC;
+  p_buf[1] = GP_VERSION;
+  p_buf[2] = p_frame->type;
+  p_buf[3] = p_frame->flags;
+
+  switch (p_frame->type) {
+
+    case GP_TYPE_REPORT:
+      if (len < (size_t)(GP_REPORT_LEN + tail))
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      gp_put32(&p_buf[8], p_frame->seq);
+      gp_put16(&p_buf[12], p_frame->event[0].pins);
+      gp_put32(&p_buf[14], p_frame->event[0].timestamp);
+      return gp_tail_encode(p_frame, p_buf, GP_REPORT_LEN);
+
+    case GP_TYPE_BATCH:
+      n = GP_BATCH_HEADER_LEN + p_frame->count * GP_EVENT_LEN;
+      if (p_frame->count == 0 || p_frame->count > GP_BATCH_MAX || len < (size_t)(n + tail))
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      gp_put32(&p_buf[8], p_frame->seq);
+      p_buf[12] = p_frame->count;
+      for (i = 0; i < p_frame->count; i++) {
+        gp_put16(&p_buf[GP_BATCH_HEADER_LEN + i * GP_EVENT_LEN], p_frame->event[i].pins);
+        gp_put32(&p_buf[GP_BATCH_HEADER_LEN + i * GP_EVENT_LEN + 2], p_frame->event[i].timestamp);
+      }
+      return gp_tail_encode(p_frame, p_buf, n);
+
+    case GP_TYPE_ACK:
+      if (len < GP_ACK_LEN)
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      gp_put32(&p_buf[8], p_frame->seq);
+      return GP_ACK_LEN;
+
+    case GP_TYPE_DISCOVER:
+    case GP_TYPE_ANNOUNCE:
+      if (len < GP_DISCOVER_LEN)
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      return GP_DISCOVER_LEN;
+
+    case GP_TYPE_TIME_REQ:
+      if (len < GP_TIME_REQ_LEN)
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      gp_put32(&p_buf[8], p_frame->seq);
+      return GP_TIME_REQ_LEN;
+
+    case GP_TYPE_TIME:
+      if (len < GP_TIME_LEN)
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      gp_put32(&p_buf[8], p_frame->seq);
+      gp_put32(&p_buf[12], p_frame->rx_time);
+      gp_put32(&p_buf[16], p_frame->tx_time);
+      return GP_TIME_LEN;
+
+    // Only the header; the receiver writes the body of a STATS frame itself
+    case GP_TYPE_STATS_REQ:
+    case GP_TYPE_STATS:
+      n = p_frame->type == GP_TYPE_STATS ? GP_STATS_HEADER_LEN : GP_STATS_REQ_LEN;
+      if (len < (size_t)n)
+        return 0;
+      gp_put16(&p_buf[4], (uint16_t)p_frame->seq);
+      if (p_frame->type == GP_TYPE_STATS)
+        gp_put16(&p_buf[6], (uint16_t)p_frame->device_id);
+      return n;
+
+    case GP_TYPE_SUBSCRIBE:
+      if (len < GP_SUBSCRIBE_LEN)
+        return 0;
+      gp_put16(&p_buf[4], (uint16_t)p_frame->seq);
+      gp_put32(&p_buf[6], p_frame->device_id);
+      return GP_SUBSCRIBE_LEN;
+
+    // Header only again; the receiver writes the entries straight into the buffer
+    case GP_TYPE_NOTIFY:
+      if (p_frame->count > GP_NOTIFY_MAX || len < (size_t)(GP_NOTIFY_HEADER_LEN + p_frame->count * GP_NOTIFY_ENTRY_LEN))
+        return 0;
+      gp_put32(&p_buf[4], p_frame->device_id);
+      gp_put32(&p_buf[8], p_frame->seq);
+      gp_put32(&p_buf[12], p_frame->tx_time);
+      p_buf[16] = p_frame->count;
+      return GP_NOTIFY_HEADER_LEN + p_frame->count * GP_NOTIFY_ENTRY_LEN;
+
+    default:
+      return 0;
+  }
+}
+
+// Pick up the optional fields (GP_FLAG_LIVENESS, GP_FLAG_TRACE) that follow the
+// events at offset n.
+static int GP_FLASH gp_tail_decode(const uint8_t *p_buf, size_t len, int n, gp_frame_t *p_frame)
+{
+  if (len < (size_t)(n + gp_tail_len(p_frame->flags)))
+    return GP_ERR_SHORT;
+  if (p_frame->flags & GP_FLAG_LIVENESS) {
+    p_frame->next_ms = gp_get32(&p_buf[n]);
+    n += GP_LIVENESS_LEN;
+  }
+  if (p_frame->flags & GP_FLAG_TRACE) {
+    p_frame->tx_time = gp_get32(&p_buf[n]);
+    p_frame->offset = (int32_t)gp_get32(&p_buf[n + 4]);
+  }
+  return 0;
+}
+
+// Decode a received datagram. Returns 0 on success or one of the GP_ERR_* codes. We
+// check the header before touching anything else so junk gets rejected cheaply.
+int GP_FLASH gp_decode(const uint8_t *p_buf, size_t len, gp_frame_t *p_frame)
+{
+  int i;
+
+  if (len < GP_HEADER_LEN)
+    return GP_ERR_SHORT;
+  if (p_buf[0] != GP_MAGIC)
+    return GP_ERR_MAGIC;
+  if (p_buf[1] != GP_VERSION)
+    return GP_ERR_VERSION;
+
+  p_frame->type = p_buf[2];
+  p_frame->flags = p_buf[3];
+
+  switch (p_frame->type) {
+
+    case GP_TYPE_REPORT:
+      if (len < GP_REPORT_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get32(&p_buf[8]);
+      p_frame->count = 1;
+      p_frame->event[0].pins = gp_get16(&p_buf[12]);
+      p_frame->event[0].timestamp = gp_get32(&p_buf[14]);
+      return gp_tail_decode(p_buf, len, GP_REPORT_LEN, p_frame);
+
+    case GP_TYPE_BATCH:
+      if (len < GP_BATCH_HEADER_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get32(&p_buf[8]);
+      p_frame->count = p_buf[12];
+      if (p_frame->count == 0 || p_frame->count > GP_BATCH_MAX)
+        return GP_ERR_TYPE;
+      if (len < (size_t)(GP_BATCH_HEADER_LEN + p_frame->count * GP_EVENT_LEN))
+        return GP_ERR_SHORT;
+      for (i = 0; i < p_frame->count; i++) {
+        p_frame->event[i].pins = gp_get16(&p_buf[GP_BATCH_HEADER_LEN + i * GP_EVENT_LEN]);
+        p_frame->event[i].timestamp = gp_get32(&p_buf[GP_BATCH_HEADER_LEN + i * GP_EVENT_LEN + 2]);
+      }
+      return gp_tail_decode(p_buf, len, GP_BATCH_HEADER_LEN + p_frame->count * GP_EVENT_LEN, p_frame);
+
+    case GP_TYPE_ACK:
+      if (len < GP_ACK_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get32(&p_buf[8]);
+      p_frame->count = 0;
+      return 0;
+
+    case GP_TYPE_DISCOVER:
+    case GP_TYPE_ANNOUNCE:
+      if (len < GP_DISCOVER_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = 0;
+      p_frame->count = 0;
+      return 0;
+
+    case GP_TYPE_TIME_REQ:
+    case GP_TYPE_TIME:
+      if (len < (p_frame->type == GP_TYPE_TIME ? GP_TIME_LEN : GP_TIME_REQ_LEN))
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get32(&p_buf[8]);
+      p_frame->count = 0;
+      if (p_frame->type == GP_TYPE_TIME) {
+        p_frame->rx_time = gp_get32(&p_buf[12]);
+        p_frame->tx_time = gp_get32(&p_buf[16]);
+      }
+      return 0;
+
+    case GP_TYPE_STATS_REQ:
+    case GP_TYPE_STATS:
+      if (len < (p_frame->type == GP_TYPE_STATS ? GP_STATS_HEADER_LEN : GP_STATS_REQ_LEN))
+        return GP_ERR_SHORT;
+      p_frame->seq = gp_get16(&p_buf[4]);
+      p_frame->device_id = p_frame->type == GP_TYPE_STATS ? gp_get16(&p_buf[6]) : 0;
+      p_frame->count = 0;
+      return 0;
+
+    case GP_TYPE_SUBSCRIBE:
+      if (len < GP_SUBSCRIBE_LEN)
+        return GP_ERR_SHORT;
+      p_frame->seq = gp_get16(&p_buf[4]);
+      p_frame->device_id = gp_get32(&p_buf[6]);
+      p_frame->count = 0;
+      return 0;
+
+    case GP_TYPE_NOTIFY:
+      if (len < GP_NOTIFY_HEADER_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get32(&p_buf[8]);
+      p_frame->tx_time = gp_get32(&p_buf[12]);
+      p_frame->count = p_buf[16];
+      if (p_frame->count > GP_NOTIFY_MAX)
+        return GP_ERR_TYPE;
+      if (len < (size_t)(GP_NOTIFY_HEADER_LEN + p_frame->count * GP_NOTIFY_ENTRY_LEN))
+        return GP_ERR_SHORT;
+      return 0;
+
+    // The summary; the stack names are only for gp_decode_health
+    case GP_TYPE_HEALTH:
+      if (len < GP_HEALTH_HEADER_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->tx_time = gp_get32(&p_buf[8]);
+      p_frame->seq = gp_get32(&p_buf[12]);
+      p_frame->next_ms = gp_get32(&p_buf[16]);
+      p_frame->event[0].pins = gp_get16(&p_buf[20]);
+      p_frame->event[0].timestamp = gp_get16(&p_buf[22]);
+      p_frame->event[1].pins = 0xffff;
+      p_frame->count = 0;
+      if (p_buf[24] > GP_HEALTH_STACKS)
+        return GP_ERR_TYPE;
+      if (len < (size_t)(GP_HEALTH_HEADER_LEN + p_buf[24] * GP_HEALTH_STACK_LEN))
+        return GP_ERR_SHORT;
+      for (i = 0; i < p_buf[24]; i++) {
+        if (gp_get16(&p_buf[GP_HEALTH_HEADER_LEN + i * GP_HEALTH_STACK_LEN + 4]) < p_frame->event[1].pins)
+          p_frame->event[1].pins = gp_get16(&p_buf[GP_HEALTH_HEADER_LEN + i * GP_HEALTH_STACK_LEN + 4]);
+      }
+      return 0;
+
+    case GP_TYPE_OTA_DATA:
+    case GP_TYPE_OTA_REQ:
+      if (len < (p_frame->type == GP_TYPE_OTA_DATA ? GP_OTA_DATA_HEADER_LEN : GP_OTA_REQ_LEN))
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get32(&p_buf[8]);
+      p_frame->next_ms = gp_get32(&p_buf[12]);
+      p_frame->tx_time = p_frame->type == GP_TYPE_OTA_DATA ? gp_get32(&p_buf[16]) : 0;
+      p_frame->count = p_frame->type == GP_TYPE_OTA_REQ ? p_buf[16] : 0;
+      return 0;
+
+    case GP_TYPE_TUNE:
+    case GP_TYPE_TUNE_ACK:
+      if (len < GP_TUNE_HEADER_LEN)
+        return GP_ERR_SHORT;
+      p_frame->device_id = gp_get32(&p_buf[4]);
+      p_frame->seq = gp_get16(&p_buf[8]);
+      p_frame->event[0].pins = p_buf[10];
+      p_frame->count = p_buf[11];
+      if (p_frame->count > GP_TUNE_MAX)
+        return GP_ERR_TYPE;
+      if (len < (size_t)(GP_TUNE_HEADER_LEN + p_frame->count * GP_TUNE_ENTRY_LEN))
+        return GP_ERR_SHORT;
+      return 0;
+
+    default:
+      return GP_ERR_TYPE;
+  }
+}
+
+// Build the ACK for a received report or batch: same device, highest sequence number
+// in the frame. Returns the ACK length or 0.
+int GP_FLASH gp_encode_ack(const gp_frame_t *p_frame, uint8_t *p_buf, size_t len)
+{
+  gp_frame_t ack;
+
+  ack.type = GP_TYPE_ACK;
+  ack.flags = 0;
+  ack.device_id = p_frame->device_id;
+  ack.seq = p_frame->seq + (p_frame->count ? p_frame->count - 1 : 0);
+  ack.count = 0;
+  return gp_encode(&ack, p_buf, len);
+}
+
+// Encode a HEALTH frame. Returns its length or 0 if p_buf is too small.
+int GP_FLASH gp_encode_health(const gp_health_t *p_health, uint8_t *p_buf, size_t len)
+{
+  int i, j, n = GP_HEALTH_HEADER_LEN + p_health->count * GP_HEALTH_STACK_LEN;
+  uint8_t *p;
+
+  if (p_health->count > GP_HEALTH_STACKS || len < (size_t)n)
+    return 0;
+  p_buf[0] = GP_MAGIC;
+  p_buf[1] = GP_VERSION;
+  p_buf[2] = GP_TYPE_HEALTH;
+  p_buf[3] = 0;
+  gp_put32(&p_buf[4], p_health->device_id);
+  gp_put32(&p_buf[8], p_health->uptime_ms);
+  gp_put32(&p_buf[12], p_health->heap_free);
+  gp_put32(&p_buf[16], p_health->heap_min);
+  gp_put16(&p_buf[20], p_health->vdd_mv);
+  gp_put16(&p_buf[22], p_health->callback_us);
+  p_buf[24] = p_health->count;
+  for (i = 0; i < p_health->count; i++) {
+    p = &p_buf[GP_HEALTH_HEADER_LEN + i * GP_HEALTH_STACK_LEN];
+    for (j = 0; j < 4; j++)
+      p[j] = (uint8_t)p_health->stack[i].name[j];
+    gp_put16(&p[4], p_health->stack[i].unused);
+  }
+  return n;
+}
+
+// All of a HEALTH frame, stacks included. Returns 0 or a GP_ERR_* code.
+int GP_FLASH gp_decode_health(const uint8_t *p_buf, size_t len, gp_health_t *p_health)
+{
+  const uint8_t *p;
+  gp_frame_t frame;
+  int i, j, result;
+
+  result = gp_decode(p_buf, len, &frame);
+  if (result != 0)
+    return result;
+  if (frame.type != GP_TYPE_HEALTH)
+    return GP_ERR_TYPE;
+  p_health->device_id = frame.device_id;
+  p_health->uptime_ms = frame.tx_time;
+  p_health->heap_free = frame.seq;
+  p_health->heap_min = frame.next_ms;
+  p_health->vdd_mv = frame.event[0].pins;
+  p_health->callback_us = (uint16_t)frame.event[0].timestamp;
+  p_health->count = p_buf[24];
+  for (i = 0; i < p_health->count; i++) {
+    p = &p_buf[GP_HEALTH_HEADER_LEN + i * GP_HEALTH_STACK_LEN];
+    for (j = 0; j < 4; j++)
+      p_health->stack[i].name[j] = (char)p[j];
+    p_health->stack[i].unused = gp_get16(&p[4]);
+  }
+  return 0;
+}
+
+// Encode an OTA_DATA or OTA_REQ frame. Returns its length or 0 if p_buf is too small.
+int GP_FLASH gp_encode_ota(const gp_ota_t *p_ota, uint8_t *p_buf, size_t len)
+{
+  int i, n = p_ota->type == GP_TYPE_OTA_DATA ? GP_OTA_DATA_HEADER_LEN + p_ota->len : GP_OTA_REQ_LEN;
+
+  if (len < (size_t)n || (p_ota->type == GP_TYPE_OTA_DATA && p_ota->len > GP_OTA_CHUNK))
+    return 0;
+  p_buf[0] = GP_MAGIC;
+  p_buf[1] = GP_VERSION;
+  p_buf[2] = p_ota->type;
+  p_buf[3] = 0;
+  gp_put32(&p_buf[4], p_ota->device_id);
+  gp_put32(&p_buf[8], p_ota->id);
+  gp_put32(&p_buf[12], p_ota->offset);
+  if (p_ota->type == GP_TYPE_OTA_REQ) {
+    p_buf[16] = p_ota->status;
+    return n;
+  }
+  gp_put32(&p_buf[16], p_ota->total);
+  for (i = 0; i < p_ota->len; i++)
+    p_buf[GP_OTA_DATA_HEADER_LEN + i] = p_ota->p_data[i];
+  return n;
+}
+
+// All of an OTA_DATA or OTA_REQ frame of len bytes (auth trailer already taken off).
+// The data is left where it is; p_data points into p_buf. Returns 0 or a GP_ERR_* code.
+int GP_FLASH gp_decode_ota(const uint8_t *p_buf, size_t len, gp_ota_t *p_ota)
+{
+  gp_frame_t frame;
+  int result;
+
+  result = gp_decode(p_buf, len, &frame);
+  if (result != 0)
+    return result;
+  if (frame.type != GP_TYPE_OTA_DATA && frame.type != GP_TYPE_OTA_REQ)
+    return GP_ERR_TYPE;
+  p_ota->type = frame.type;
+  p_ota->device_id = frame.device_id;
+  p_ota->id = frame.seq;
+  p_ota->offset = frame.next_ms;
+  p_ota->total = frame.tx_time;
+  p_ota->status = frame.count;
+  p_ota->p_data = &p_buf[GP_OTA_DATA_HEADER_LEN];
+  p_ota->len = frame.type == GP_TYPE_OTA_DATA ? len - GP_OTA_DATA_HEADER_LEN : 0;
+  if (p_ota->len > GP_OTA_CHUNK)
+    return GP_ERR_TYPE;
+  return 0;
+}
+
+// Encode a TUNE or TUNE_ACK frame. Returns its length or 0 if p_buf is too small.
+int GP_FLASH gp_encode_tune(const gp_tune_t *p_tune, uint8_t *p_buf, size_t len)
+{
+  int i, n = GP_TUNE_HEADER_LEN + p_tune->count * GP_TUNE_ENTRY_LEN;
+
+  if (p_tune->count > GP_TUNE_MAX || len < (size_t)n)
+    return 0;
+  p_buf[0] = GP_MAGIC;
+  p_buf[1] = GP_VERSION;
+  p_buf[2] = p_tune->type;
+  p_buf[3] = 0;
+  gp_put32(&p_buf[4], p_tune->device_id);
+  gp_put16(&p_buf[8], p_tune->seq);
+  p_buf[10] = p_tune->op;
+  p_buf[11] = p_tune->count;
+  for (i = 0; i < p_tune->count; i++) {
+    p_buf[GP_TUNE_HEADER_LEN + i * GP_TUNE_ENTRY_LEN] = p_tune->entry[i].id;
+    gp_put32(&p_buf[GP_TUNE_HEADER_LEN + i * GP_TUNE_ENTRY_LEN + 1], p_tune->entry[i].value);
+  }
+  return n;
+}
+
+// All of a TUNE or TUNE_ACK frame of len bytes (auth trailer already taken off).
+// Returns 0 or a GP_ERR_* code.
+int GP_FLASH gp_decode_tune(const uint8_t *p_buf, size_t len, gp_tune_t *p_tune)
+{
+  gp_frame_t frame;
+  int i, result;
+
+  result = gp_decode(p_buf, len, &frame);
+  if (result != 0)
+    return result;
+  if (frame.type != GP_TYPE_TUNE && frame.type != GP_TYPE_TUNE_ACK)
+    return GP_ERR_TYPE;
+  p_tune->type = frame.type;
+  p_tune->device_id = frame.device_id;
+  p_tune->seq = (uint16_t)frame.seq;
+  p_tune->op = (uint8_t)frame.event[0].pins;
+  p_tune->count = frame.count;
+  for (i = 0; i < p_tune->count; i++) {
+    p_tune->entry[i].id = p_buf[GP_TUNE_HEADER_LEN + i * GP_TUNE_ENTRY_LEN];
+    p_tune->entry[i].value = gp_get32(&p_buf[GP_TUNE_HEADER_LEN + i * GP_TUNE_ENTRY_LEN + 1]);
+  }
+  return 0;
+}
+
+// Receiver id from a 6 byte MAC address: the last four bytes, most significant first.
+uint32_t GP_FLASH gp_mac_id(const uint8_t *p_mac)
+{
+  return ((uint32_t)p_mac[2] << 24) | ((uint32_t)p_mac[3] << 16) | ((uint32_t)p_mac[4] << 8) | p_mac[5];
+}
+
+// (Re)write the trace trailer (always the last GP_TRACE_LEN bytes) of an encoded report
+// or batch of len bytes. The sender
+// calls this right before every transmission, retransmits included, so tx_time and
+// offset are always for this copy and this receiver.
+void GP_FLASH gp_stamp(uint8_t *p_buf, int len, uint32_t tx_time, int32_t offset)
+{
+  gp_put32(&p_buf[len - GP_TRACE_LEN], tx_time);
+  gp_put32(&p_buf[len - GP_TRACE_LEN + 4], (uint32_t)offset);
+}
@@ -0,0 +1,402 @@
+// garage_proto.h
+// The wire format spoken between the sender (ESP8266) and the receiver (ESP32). Both
+// firmwares compile garage_proto.c so there is exactly one definition of the frame.
+//
+// Every datagram starts with the same 4 byte header: magic, version, type and flags.
+// A report frame then carries the device id, a sequence number, the pin bitmask and
+// the sender's timestamp. All multi-byte fields are little endian and every frame is
+// sent at its exact length ... no more 2 KB of zeros on the air! A bare report is
+// GP_REPORT_LEN (18) bytes; the liveness, trace and auth trailers its flags ask for
+// (below) come on top.
+//
+//   offset  size  field
+//        0     1  magic (GP_MAGIC)
+//        1     1  version (GP_VERSION)
+//        2     1  type (GP_TYPE_*)
+//        3     1  flags (GP_FLAG_*)
+//        4     4  device id (ESP8266 chip id)
+//        8     4  sequence number
+//       12     2  pin bitmask (bit n == GPIOn level)
+//       14     4  timestamp (milliseconds since sender boot)
+//
+// A batch frame carries several events from one sender in a single datagram (the
+// low power mode collects events while asleep and ships them in one go):
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_BATCH
+//        4     4  device id
+//        8     4  sequence number of the first event (event i has seq + i)
+//       12     1  event count (1 .. GP_BATCH_MAX)
+//       13   6*n  events: pin bitmask (2) and timestamp (4) each
+//
+// Frames with GP_FLAG_ACK_REQ set are answered by the receiver with an ACK frame. ACKs
+// are cumulative: "I have everything from you up to and including seq".
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_ACK
+//        4     4  device id being acknowledged
+//        8     4  sequence number
+//
+// Senders find receivers with a DISCOVER broadcast on the soft-AP subnet; every
+// receiver that hears it answers (unicast) with an ANNOUNCE. Both are 8 bytes:
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_DISCOVER or GP_TYPE_ANNOUNCE
+//        4     4  device id of the sender (DISCOVER) or receiver id (ANNOUNCE)
+//
+// A receiver id is the last four bytes of its station MAC (gp_mac_id), so a sender can
+// match the soft-AP's "station left" event to the receiver it was talking to.
+//
+// Heartbeats (GP_FLAG_HEARTBEAT) don't use up a sequence number; they repeat the next
+// one. The first frame after a sender boots carries GP_FLAG_BOOT so the receiver knows
+// the sequence numbers started over. Every boot starts them from a random number: from
+// 0 each time, a sender that rebooted after a few changes would send a BOOT frame the
+// receiver already has in its window, and its reports would be taken for retransmits.
+//
+// Liveness. A report or batch with GP_FLAG_LIVENESS set carries the sender's promise
+// of when it will send again, right after the last event. The receiver holds it to
+// that to tell a quiet door from a dead sender (see heartbeat.h):
+//
+//   offset  size  field
+//        n     4  next frame within this many milliseconds
+//
+// Latency tracing. An event's timestamp is when the sender first saw the edge. A report
+// or batch with GP_FLAG_TRACE set carries an 8 byte trailer after everything else: when
+// the frame was (re)transmitted, and the sender's estimate of receiver clock minus its
+// own clock (GP_OFFSET_UNKNOWN until it has one). That gives the receiver detection ->
+// transmit -> received without the two clocks agreeing:
+//
+//   offset  size  field
+//        n     4  transmit time (milliseconds since sender boot)
+//      n+4     4  clock offset, receiver - sender, milliseconds (signed)
+//
+// Authentication. A report or batch with GP_FLAG_AUTH set ends in a GP_AUTH_LEN byte
+// trailer (epoch, counter and a SipHash tag over everything before it) that proves it
+// came from the sender whose id it carries and isn't a replay. It goes after all the
+// other trailers and is added last; see gpauth.h. Receivers strip it before gp_decode.
+//
+// The offset comes from a TIME exchange, NTP style. The sender asks with its clock
+// (t0), the receiver answers with t0 echoed, its clock when the request arrived (t1)
+// and when the answer left (t2). See clksync.h.
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_TIME_REQ or GP_TYPE_TIME
+//        4     4  device id of the sender
+//        8     4  t0
+//       12     4  t1 (GP_TYPE_TIME only)
+//       16     4  t2 (GP_TYPE_TIME only)
+//
+// Anyone can ask a receiver for its statistics with a STATS_REQ. The answer is one
+// STATS frame per request, no bigger than GP_MAX_FRAME; page GP_STATS_SUMMARY is the
+// receiver wide summary, anything else is a device table slot to start from and the
+// answer says where to carry on (GP_STATS_END when done). The body layout belongs to
+// the receiver (see stats.h there); gp_decode only checks the header and the page.
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_STATS_REQ or GP_TYPE_STATS
+//        4     2  page
+//        6     2  next page (GP_TYPE_STATS only)
+//        8     -  body (GP_TYPE_STATS only)
+//
+// Local consumers (a home automation bridge, a wall display, a logger) follow the door
+// state with a SUBSCRIBE to port 8266. The subscription lasts lease seconds; send it
+// again before then to keep it (halfway is a good time), or with a lease of 0 to drop
+// it. A new subscriber gets the whole device table back as NOTIFY frames with
+// GP_FLAG_SNAPSHOT set (at least one, empty if there are no senders yet), which also
+// says it was accepted. A renewal gets no answer unless it has GP_FLAG_SNAPSHOT set
+// too; that is how a consumer that missed a NOTIFY resyncs.
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_SUBSCRIBE
+//        4     2  lease (seconds)
+//        6     4  consumer id
+//
+// The consumer id is whatever the consumer likes, GP_CONSUMER_ID_MIN or above so it is
+// never a sender's chip id (those are 24 bits). A receiver with a key only takes signed
+// SUBSCRIBEs (see gpauth.h); the id picks the key, like a sender's chip id does.
+//
+// After that changes come as NOTIFY frames, each carrying the current state of up to
+// GP_NOTIFY_MAX doors. The receiver coalesces: a door that changed several times since
+// the last NOTIFY shows up once, with where it is now and how many changes that was.
+// The notify sequence number counts frames per subscriber, so a gap means one was lost.
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_NOTIFY
+//        4     4  receiver id
+//        8     4  notify sequence number
+//       12     4  sent (receiver clock, ms)
+//       16     1  entry count (0 .. GP_NOTIFY_MAX)
+//       17  15*n  entries: device id (4), pin bitmask (2), state (GP_STATE_*, 1),
+//                 changes so far (4), last change (receiver clock, ms, 4)
+//
+// Health. Every so often a sender sends a HEALTH frame along with a heartbeat: how
+// much heap it has and the least it ever had, how close each stack came to its end,
+// the longest a timer callback took since the last one and its supply voltage. The
+// receiver keeps the latest per sender and answers with its own for stats page
+// GP_STATS_HEALTH. Fire and forget, never signed (it moves no door), and a receiver
+// only takes it from a sender it already knows.
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_HEALTH
+//        4     4  device id (sender) or receiver id
+//        8     4  uptime (ms)
+//       12     4  free heap (bytes)
+//       16     4  lowest free heap since boot (bytes)
+//       20     2  supply voltage (mV, 0 if not measured)
+//       22     2  longest timer callback since the last HEALTH frame (us, 65535 or more)
+//       24     1  stack count (0 .. GP_HEALTH_STACKS)
+//       25   6*n  stacks: name (4 chars, zero padded), bytes never used (2)
+//
+// Firmware updates. gpota (receiver/host) sends a sender a delta (see gpdelta.h) in
+// OTA_DATA frames of up to GP_OTA_CHUNK bytes, to GP_OTA_PORT on the sender. The
+// transfer id is the CRC-32 of the new image, so a restarted transfer of the same image
+// carries on and a different one starts over. The sender pulls: it answers every
+// OTA_DATA with an OTA_REQ that says which offset it wants next, or how it ended
+// (GP_OTA_*). Offset 0 starts a transfer. A sender only takes OTA_DATA frames that
+// carry the auth trailer under its key (see gpauth.h). The epoch in the trailer is the
+// image version: it must be above the last one the sender took (GP_OTA_OLD if it isn't)
+// and the same all through the transfer.
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_OTA_DATA
+//        4     4  device id (the sender being updated)
+//        8     4  transfer id
+//       12     4  offset in the delta
+//       16     4  delta length
+//       20     n  delta bytes
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_OTA_REQ
+//        4     4  device id
+//        8     4  transfer id
+//       12     4  offset wanted next
+//       16     1  status (GP_OTA_*)
+//
+// Tuning. gptune (receiver/host) reads and sets a sender's tunables (heartbeat
+// intervals, debounce window and so on, see gptune.h) with a TUNE frame to GP_PORT on
+// the sender, which is where its reports come from. The sender answers every TUNE it
+// takes with a TUNE_ACK: the same request number, a status and the entries asked for
+// with the values now in force. A SET is all or nothing; if one entry is out of range
+// none of them is taken. Only a sender with a key takes TUNE frames, and only ones that
+// carry the auth trailer under that key and are newer than the last it took (see
+// gpauth.h).
+//
+//   offset  size  field
+//        0     4  header, type GP_TYPE_TUNE or GP_TYPE_TUNE_ACK
+//        4     4  device id (the sender being tuned)
+//        8     2  request number
+//       10     1  TUNE: op (GP_TUNE_GET etc.), TUNE_ACK: status (GP_TUNE_OK etc.)
+//       11     1  entry count (0 .. GP_TUNE_MAX; a GET of none means all of them)
+//       12   5*n  entries: tunable id (GP_TUNE_HB_MIN etc., 1), value (4)
+
+#ifndef __GARAGE_PROTO__H
+
+  #define __GARAGE_PROTO__H
+
+  #include "gp_port.h"
+
+  #define GP_PORT 8266
+  #define GP_OTA_PORT 8267
+
+  #define GP_MAGIC 0x47
+  #define GP_VERSION 1
+
+  // Frame types
+  #define GP_TYPE_REPORT 1
+  #define GP_TYPE_BATCH 2
+  #define GP_TYPE_ACK 3
+  #define GP_TYPE_DISCOVER 4
+  #define GP_TYPE_ANNOUNCE 5
+  #define GP_TYPE_TIME_REQ 6
+  #define GP_TYPE_TIME 7
+  #define GP_TYPE_STATS_REQ 8
+  #define GP_TYPE_STATS 9
+  #define GP_TYPE_SUBSCRIBE 10
+  #define GP_TYPE_NOTIFY 11
+  #define GP_TYPE_HEALTH 12
+  #define GP_TYPE_OTA_DATA 13
+  #define GP_TYPE_OTA_REQ 14
+  #define GP_TYPE_TUNE 15
+  #define GP_TYPE_TUNE_ACK 16
+
+  // Frame flags
+  #define GP_FLAG_CHANGE 0x01
+  #define GP_FLAG_ACK_REQ 0x02
+  #define GP_FLAG_HEARTBEAT 0x04
+  #define GP_FLAG_BOOT 0x08
+  #define GP_FLAG_TRACE 0x10
+  #define GP_FLAG_LIVENESS 0x20
+  #define GP_FLAG_SNAPSHOT 0x40     // NOTIFY: part of the answer to a SUBSCRIBE
+  #define GP_FLAG_AUTH 0x80         // report/batch/OTA_DATA/TUNE: ends in the auth trailer (gpauth.h)
+
+  #define GP_HEADER_LEN 4
+  #define GP_REPORT_LEN 18
+  #define GP_BATCH_HEADER_LEN 13
+  #define GP_EVENT_LEN 6
+  #define GP_BATCH_MAX 8
+  #define GP_ACK_LEN 12
+  #define GP_DISCOVER_LEN 8
+  #define GP_ANNOUNCE_LEN 8
+  #define GP_TRACE_LEN 8
+  #define GP_LIVENESS_LEN 4
+  #define GP_AUTH_LEN 16
+  #define GP_TIME_REQ_LEN 12
+  #define GP_TIME_LEN 20
+  #define GP_STATS_REQ_LEN 6
+  #define GP_STATS_HEADER_LEN 8
+  #define GP_SUBSCRIBE_LEN 10
+  #define GP_CONSUMER_ID_MIN 0x01000000
+  #define GP_NOTIFY_HEADER_LEN 17
+  #define GP_NOTIFY_ENTRY_LEN 15
+  #define GP_HEALTH_HEADER_LEN 25
+  #define GP_HEALTH_STACK_LEN 6
+  #define GP_HEALTH_STACKS 8
+  #define GP_OTA_DATA_HEADER_LEN 20
+  #define GP_OTA_REQ_LEN 17
+  #define GP_OTA_CHUNK 1024
+  #define GP_TUNE_HEADER_LEN 12
+  #define GP_TUNE_ENTRY_LEN 5
+
+  #define GP_OFFSET_UNKNOWN ((int32_t)0x80000000)
+  #define GP_STATS_SUMMARY 0xffff
+  #define GP_STATS_HEALTH 0xfffe
+  #define GP_STATS_END 0xffff
+
+  // Biggest frame either side will ever send. Use it to size receive buffers. The one
+  // exception is OTA_DATA, which only gpota sends and only a sender receives.
+  #define GP_MAX_FRAME 128
+  #define GP_OTA_MAX_FRAME (GP_OTA_DATA_HEADER_LEN + GP_OTA_CHUNK + GP_AUTH_LEN)
+  #define GP_NOTIFY_MAX ((GP_MAX_FRAME - GP_NOTIFY_HEADER_LEN) / GP_NOTIFY_ENTRY_LEN)
+  #define GP_TUNE_MAX ((GP_MAX_FRAME - GP_TUNE_HEADER_LEN - GP_AUTH_LEN) / GP_TUNE_ENTRY_LEN)
+
+  // NOTIFY entry state bits
+  #define GP_STATE_OPEN 0x01          // the pins say the door is open
+  #define GP_STATE_SILENT 0x02        // the sender missed its liveness deadline
+  #define GP_STATE_OPEN_TOO_LONG 0x04 // open for longer than the receiver allows
+
+  // OTA_REQ status
+  #define GP_OTA_MORE 0       // send from offset
+  #define GP_OTA_DONE 1       // image written and checked, rebooting into it
+  #define GP_OTA_BASE 2       // the delta is against an image we aren't running
+  #define GP_OTA_FIT 3        // the image doesn't fit in a flash slot
+  #define GP_OTA_BAD 4        // the delta is corrupt, or the image came out wrong
+  #define GP_OTA_CURRENT 5    // already running that image
+  #define GP_OTA_OLD 6        // signed with a version no newer than the last one we took
+
+  // TUNE ops
+  #define GP_TUNE_GET 0       // what are they now
+  #define GP_TUNE_SET 1       // use these until the next reboot
+  #define GP_TUNE_SAVE 2      // use these, and keep them in flash
+  #define GP_TUNE_DEFAULTS 3  // back to what the firmware was built with, in flash too
+
+  // TUNE_ACK status
+  #define GP_TUNE_OK 0
+  #define GP_TUNE_UNKNOWN 1   // a tunable id this sender doesn't have
+  #define GP_TUNE_RANGE 2     // a value out of range; nothing was changed
+  #define GP_TUNE_BAD 3       // an op we don't know
+  #define GP_TUNE_FLASH 4     // the sender couldn't write its flash; nothing was changed
+
+  // Decode errors (gp_decode returns 0 on success)
+  #define GP_ERR_SHORT -1
+  #define GP_ERR_MAGIC -2
+  #define GP_ERR_VERSION -3
+  #define GP_ERR_TYPE -4
+  #define GP_ERR_AUTH -5      // gpauth.h: missing or wrong tag
+  #define GP_ERR_REPLAY -6    // gpauth.h: seen that one before
+
+  // One door event: the pin bitmask and when it was seen.
+  typedef struct {
+    uint16_t pins;
+    uint32_t timestamp;
+  } gp_event_t;
+
+  // A decoded frame. A report is simply a frame with one event; a batch has count events
+  // with consecutive sequence numbers starting at seq. An ACK has no events, DISCOVER
+  // and ANNOUNCE have nothing but the id. TIME frames keep t0 in seq, t1 in rx_time and
+  // t2 in tx_time. STATS frames keep the page in seq and the next page in device_id.
+  // SUBSCRIBE keeps the lease in seq and the consumer id in device_id. NOTIFY keeps the
+  // receiver id in device_id, the sent time in tx_time and the entry count in count;
+  // read the entries with gp_get*. HEALTH keeps the uptime in tx_time, the free heap in
+  // seq, the lowest free heap in next_ms, the voltage in event[0].pins, the longest
+  // callback in event[0].timestamp and the fewest unused bytes of any stack in
+  // event[1].pins (0xffff if it sent none); gp_decode_health has the rest. OTA_DATA and
+  // OTA_REQ keep the transfer id in seq and the offset in next_ms; OTA_DATA the delta
+  // length in tx_time, OTA_REQ the status in count. gp_decode_ota has the data. TUNE and
+  // TUNE_ACK keep the request number in seq, the op or status in event[0].pins and the
+  // entry count in count; gp_decode_tune has the entries.
+  typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t device_id;
+    uint32_t seq;
+    uint8_t count;
+    gp_event_t event[GP_BATCH_MAX];
+    uint32_t tx_time;     // GP_FLAG_TRACE: sender clock when the frame went out
+    int32_t offset;       // GP_FLAG_TRACE: receiver clock - sender clock
+    uint32_t rx_time;     // receiver clock when it arrived; not on the wire (except TIME)
+    uint32_t next_ms;     // GP_FLAG_LIVENESS: the sender's next frame is due within this
+  } gp_frame_t;
+
+  // Everything in a HEALTH frame
+  typedef struct {
+    char name[4];         // zero padded, not terminated if it is 4 long
+    uint16_t unused;      // bytes of the stack never touched
+  } gp_stack_t;
+
+  typedef struct {
+    uint32_t device_id;
+    uint32_t uptime_ms;
+    uint32_t heap_free;
+    uint32_t heap_min;
+    uint16_t vdd_mv;
+    uint16_t callback_us;
+    uint8_t count;
+    gp_stack_t stack[GP_HEALTH_STACKS];
+  } gp_health_t;
+
+  // Everything in an OTA_DATA or OTA_REQ frame
+  typedef struct {
+    uint8_t type;
+    uint32_t device_id;
+    uint32_t id;              // transfer id: CRC-32 of the new image
+    uint32_t offset;
+    uint32_t total;           // OTA_DATA: delta length
+    uint8_t status;           // OTA_REQ: GP_OTA_*
+    const uint8_t *p_data;    // OTA_DATA: len bytes of the delta from offset
+    uint16_t len;
+  } gp_ota_t;
+
+  // Everything in a TUNE or TUNE_ACK frame
+  typedef struct {
+    uint8_t id;               // GP_TUNE_HB_MIN etc. (gptune.h)
+    uint32_t value;
+  } gp_tunable_t;
+
+  typedef struct {
+    uint8_t type;
+    uint32_t device_id;
+    uint16_t seq;
+    uint8_t op;               // TUNE: GP_TUNE_GET etc., TUNE_ACK: GP_TUNE_OK etc.
+    uint8_t count;
+    gp_tunable_t entry[GP_TUNE_MAX];
+  } gp_tune_t;
+
+  int gp_encode(const gp_frame_t *p_frame, uint8_t *p_buf, size_t len);
+  int gp_decode(const uint8_t *p_buf, size_t len, gp_frame_t *p_frame);
+  int gp_encode_ack(const gp_frame_t *p_frame, uint8_t *p_buf, size_t len);
+  int gp_encode_health(const gp_health_t *p_health, uint8_t *p_buf, size_t len);
+  int gp_decode_health(const uint8_t *p_buf, size_t len, gp_health_t *p_health);
+  int gp_encode_ota(const gp_ota_t *p_ota, uint8_t *p_buf, size_t len);
+  int gp_decode_ota(const uint8_t *p_buf, size_t len, gp_ota_t *p_ota);
+  int gp_encode_tune(const gp_tune_t *p_tune, uint8_t *p_buf, size_t len);
+  int gp_decode_tune(const uint8_t *p_buf, size_t len, gp_tune_t *p_tune);
+  uint32_t gp_mac_id(const uint8_t *p_mac);
+  void gp_stamp(uint8_t *p_buf, int len, uint32_t tx_time, int32_t offset);
+
+  // Little endian helpers ... handy for anyone building on top of the frame format.
+  void gp_put16(uint8_t *p, uint16_t v);
+  void gp_put32(uint8_t *p, uint32_t v);
+  uint16_t gp_get16(const uint8_t *p);
+  uint32_t gp_get32(const uint8_t *p);
+
+#endif
@@ -0,0 +1,22 @@
+// gp_port.h
+// Tiny portability shim for the code in common/. The same source files are compiled
+// by the ESP8266 non-OS SDK (sender), by ESP-IDF (receiver) and by a plain Linux gcc.
+// The only real difference we care about is that on the ESP8266 every function that
+// isn't marked ICACHE_FLASH_ATTR ends up in the (very small) IRAM. The sender Makefile
+// defines GARAGE_ESP8266 so we can put the common code in flash like everything else.
+
+#ifndef __GP_PORT__H
+
+  #define __GP_PORT__H
+
+  #include <stdint.h>
+  #include <stddef.h>
+
+  #ifdef GARAGE_ESP8266
+    #include "c_types.h"
+    #define GP_FLASH ICACHE_FLASH_ATTR
+  #else
+    #define GP_FLASH
+  #endif
+
+#endif
@@ -0,0 +1,181 @@
+// gpauth.c
+// See gpauth.h. SipHash-2-4 straight from the paper, reading the message a byte at a
+// time so it doesn't care about alignment (the LX106 faults on unaligned loads).
+
+#include "gpauth.h"
+#include "garage_proto.h"
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+  do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+  } while (0)
+
+static uint64_t GP_FLASH gp_get64(const uint8_t *p)
+{
+  return (uint64_t)gp_get32(p) | ((uint64_t)gp_get32(&p[4]) << 32);
+}
+
+// SipHash-2-4 of len bytes under a 16 byte key
+uint64_t GP_FLASH gp_siphash(const uint8_t *p_key, const uint8_t *p_data, size_t len)
+{
+  uint64_t k0 = gp_get64(p_key), k1 = gp_get64(&p_key[8]);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t m, b = (uint64_t)len << 56;
+  size_t i, left = len & 7;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    m = gp_get64(&p_data[i]);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  // The last 0 .. 7 bytes, with the length in the top byte
+  while (left--)
+    b |= (uint64_t)p_data[i + left] << (8 * left);
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static int GP_FLASH gp_hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Parse a key written as 32 hex digits (how it sits in user_config.h or sdkconfig).
+// Returns 0, or -1 if it isn't exactly that.
+int GP_FLASH gp_auth_key(const char *p_hex, uint8_t *p_key)
+{
+  int i, hi, lo;
+
+  for (i = 0; i < GP_AUTH_KEY_LEN; i++) {
+    hi = gp_hex_digit(p_hex[2 * i]);
+    if (hi < 0)
+      return -1;
+    lo = gp_hex_digit(p_hex[2 * i + 1]);
+    if (lo < 0)
+      return -1;
+    p_key[i] = (uint8_t)(hi << 4 | lo);
+  }
+  return p_hex[2 * i] == '\0' ? 0 : -1;
+}
+
+// A sender's key from the master key and its chip id (see gpauth.h)
+void GP_FLASH gp_auth_derive(const uint8_t *p_master, uint32_t device_id, uint8_t *p_key)
+{
+  uint8_t input[5];
+  uint64_t half;
+  int i;
+
+  gp_put32(input, device_id);
+  for (i = 0; i < 2; i++) {
+    input[4] = (uint8_t)i;
+    half = gp_siphash(p_master, input, sizeof(input));
+    gp_put32(&p_key[8 * i], (uint32_t)half);
+    gp_put32(&p_key[8 * i + 4], (uint32_t)(half >> 32));
+  }
+}
+
+// Sign an encoded report or batch of len bytes in place: set GP_FLAG_AUTH, append the
+// auth trailer and use up a counter value. size is how big p_buf is. Returns the new
+// length (send exactly that many), or 0 if it doesn't fit. The frame before the
+// trailer is left alone, so a retransmit can stamp it again (gp_stamp with the old
+// len) and sign it again.
+int GP_FLASH gp_auth_sign(gp_auth_t *p_auth, uint8_t *p_buf, int len, size_t size)
+{
+  uint64_t tag;
+
+  if (len < GP_HEADER_LEN || size < (size_t)(len + GP_AUTH_LEN))
+    return 0;
+
+  p_buf[3] |= GP_FLAG_AUTH;
+  gp_put32(&p_buf[len], p_auth->epoch);
+  gp_put32(&p_buf[len + 4], p_auth->counter++);
+  tag = gp_siphash(p_auth->key, p_buf, len + 8);
+  gp_put32(&p_buf[len + 8], (uint32_t)tag);
+  gp_put32(&p_buf[len + 12], (uint32_t)(tag >> 32));
+  return len + GP_AUTH_LEN;
+}
+
+// Check the auth trailer of a received frame of len bytes. Returns the length without
+// the trailer and hands back its epoch and counter (see gp_replay_check), or
+// GP_ERR_AUTH if there is no trailer or the tag is wrong. The tag is compared in
+// constant time so the time it takes says nothing about how close a guess was.
+int GP_FLASH gp_auth_verify(const uint8_t *p_key, const uint8_t *p_buf, int len, uint32_t *p_epoch, uint32_t *p_counter)
+{
+  uint8_t expect[GP_AUTH_TAG_LEN], diff = 0;
+  uint64_t tag;
+  int i, n = len - GP_AUTH_LEN;
+
+  if (n < GP_HEADER_LEN || !(p_buf[3] & GP_FLAG_AUTH))
+    return GP_ERR_AUTH;
+
+  tag = gp_siphash(p_key, p_buf, n + 8);
+  gp_put32(expect, (uint32_t)tag);
+  gp_put32(&expect[4], (uint32_t)(tag >> 32));
+  for (i = 0; i < GP_AUTH_TAG_LEN; i++)
+    diff |= expect[i] ^ p_buf[n + 8 + i];
+  if (diff)
+    return GP_ERR_AUTH;
+
+  *p_epoch = gp_get32(&p_buf[n]);
+  *p_counter = gp_get32(&p_buf[n + 4]);
+  return n;
+}
+
+// Has this (epoch, counter) been seen before? Returns 0 and remembers it if not,
+// GP_ERR_REPLAY if it has or it is too old to tell. Only call this for a frame whose
+// tag checked out.
+int GP_FLASH gp_replay_check(gp_replay_t *p_replay, uint32_t epoch, uint32_t counter)
+{
+  uint32_t back;
+
+  // First frame from this sender, or it rebooted
+  if (p_replay->window == 0 || epoch > p_replay->epoch) {
+    p_replay->epoch = epoch;
+    p_replay->counter = counter;
+    p_replay->window = 1;
+    return 0;
+  }
+  if (epoch < p_replay->epoch)
+    return GP_ERR_REPLAY;
+
+  // Newer than anything so far: slide the window up
+  if (counter > p_replay->counter) {
+    back = counter - p_replay->counter;
+    p_replay->window = back < GP_REPLAY_WINDOW ? (p_replay->window << back) | 1 : 1;
+    p_replay->counter = counter;
+    return 0;
+  }
+
+  // Older: fine once, if it is still inside the window
+  back = p_replay->counter - counter;
+  if (back >= GP_REPLAY_WINDOW || (p_replay->window & (1UL << back)))
+    return GP_ERR_REPLAY;
+  p_replay->window |= 1UL << back;
+  return 0;
+}
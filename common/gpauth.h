@@ -0,0 +1,97 @@
+// gpauth.h
+// Frame authentication: who may tell a receiver that a door moved. Without it anyone
+// on the soft-AP can send "GPIO2 N: 0" to port 8266 and be believed.
+//
+// Every report and batch from a sender with a key gets GP_FLAG_AUTH and a 16 byte
+// trailer after everything else (trace trailer included):
+//
+//   offset  size  field
+//        n     4  epoch (bumped every time the sender boots, kept in flash)
+//      n+4     4  counter (every transmission, retransmits included, starts at 0 per epoch)
+//      n+8     8  tag: SipHash-2-4 of bytes 0 .. n+7 under the sender's key
+//
+// The MAC is SipHash-2-4 (Aumasson and Bernstein): a 64 bit tag under a 128 bit key,
+// nothing but 64 bit adds, rotates and xors, no tables and no multiplies. That suits
+// the LX106, which has neither a crypto unit nor a fast multiplier; AES or Poly1305 in
+// software cost several times as much there. 64 bits is plenty for a tag an attacker
+// has to guess online, one datagram per try.
+//
+// Keys. Each sender has its own key, derived from one master key (which only the
+// receivers keep) and its chip id:
+//
+//   key = SipHash(master, id | 0) . SipHash(master, id | 1)     (id little endian, 5 bytes)
+//
+// so a sender that gets opened up only gives away its own key. gpkey (receiver/host)
+// prints the AUTH_KEY line for a sender's user_config.h.
+//
+// Replays. epoch and counter only ever go up for a given key, so the receiver keeps
+// the highest pair it has seen and a GP_REPLAY_WINDOW bit window below it: frames a
+// little out of order still get in, each exactly once; anything older or already seen
+// is a replay. A new epoch starts the window over. All of that only happens after the
+// tag checked out, so a forger can't move the window.
+//
+// Cost per frame, on air: GP_AUTH_LEN (16) bytes more, 30 -> 46 for a heartbeat, 73 ->
+// 89 for a full batch; about 130 us more at 1 Mbit/s, next to nothing at 802.11n rates.
+// CPU, estimated from what gcc -m32 -O2 makes of gp_siphash (a 32 bit machine doing the
+// 64 bit arithmetic in register pairs, like the LX106):
+// about 155 instructions per 8 bytes of message and 490 for setup, the last block and
+// finalisation. The tag covers the frame plus 8 bytes, so a heartbeat is about 1 100
+// instructions, roughly 1 200 cycles or 15 us at 80 MHz, and a full batch about 2 200
+// cycles (28 us), plus flash cache misses the first time round. The sender measures
+// the real figure on every signature (auth_cycles, printed with DEBUG_ON); authbench
+// (receiver/host) checks the host side and counts its cycles.
+//
+// SUBSCRIBE frames are signed the same way, under the key gp_auth_derive gives for the
+// consumer id in them (gpkey prints it), with the consumer's own epoch and counter. A
+// receiver with a key takes no others, so nobody can drop a consumer's subscription or
+// subscribe somebody else's address without that consumer's key.
+//
+// What this doesn't cover: DISCOVER, TIME, STATS and HEALTH frames are not signed (they
+// don't change any door state or who hears about it), nor are ACKs. A forged ACK can only make a
+// sender stop retransmitting one change; its next heartbeat carries the state anyway. And a
+// receiver that reboots has forgotten every window, so it will take one replayed frame
+// from before the reboot per sender, until that sender's next real frame.
+//
+// Firmware updates run the other way. gpota signs every OTA_DATA frame with the
+// sender's key (derived from the master key like gpkey does), and the sender ignores
+// OTA_DATA frames that fail the check (it has no OTA without a key). There is no replay
+// window for them: a replayed chunk is either the same bytes at the same offset of the
+// same transfer, or it belongs to another transfer and is dropped. The epoch is the
+// image version instead, and the sender keeps the last one it took in flash, so a
+// recorded transfer played again as a whole is turned away too: it isn't newer.
+//
+// So do TUNE frames (gptune). A sender takes only signed ones (without a key it takes
+// none), and only if epoch and counter are above the last TUNE it took; gptune uses the
+// time in seconds and microseconds for them. The sender writes that pair to flash before
+// a TUNE takes effect, so a recorded TUNE is just as old after a reboot.
+
+#ifndef __GPAUTH__H
+
+  #define __GPAUTH__H
+
+  #include "gp_port.h"
+
+  #define GP_AUTH_KEY_LEN 16
+  #define GP_AUTH_TAG_LEN 8
+  #define GP_REPLAY_WINDOW 32
+
+  typedef struct {
+    uint8_t key[GP_AUTH_KEY_LEN];
+    uint32_t epoch;
+    uint32_t counter;     // next counter to send
+  } gp_auth_t;
+
+  typedef struct {
+    uint32_t epoch;       // highest epoch seen
+    uint32_t counter;     // highest counter seen in that epoch
+    uint32_t window;      // bit i: counter - i was seen. 0 == nothing seen yet
+  } gp_replay_t;
+
+  uint64_t gp_siphash(const uint8_t *p_key, const uint8_t *p_data, size_t len);
+  int gp_auth_key(const char *p_hex, uint8_t *p_key);
+  void gp_auth_derive(const uint8_t *p_master, uint32_t device_id, uint8_t *p_key);
+  int gp_auth_sign(gp_auth_t *p_auth, uint8_t *p_buf, int len, size_t size);
+  int gp_auth_verify(const uint8_t *p_key, const uint8_t *p_buf, int len, uint32_t *p_epoch, uint32_t *p_counter);
+  int gp_replay_check(gp_replay_t *p_replay, uint32_t epoch, uint32_t counter);
+
+#endif
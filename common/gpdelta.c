@@ -0,0 +1,285 @@
+// gpdelta.c
+// See gpdelta.h. gpd_feed is a byte at a time state machine for the op headers, so a
+// delta can be cut anywhere; literals and copies move whole runs at once.
+
+#include "gpdelta.h"
+#include "garage_proto.h"
+
+#define GPD_STATE_HEAD 0
+#define GPD_STATE_OP 1
+#define GPD_STATE_LEN 2
+#define GPD_STATE_ARG 3
+#define GPD_STATE_LITERAL 4
+#define GPD_STATE_FILL 5
+#define GPD_STATE_DONE 6
+
+#define GPD_BYTES(p_gpd) ((uint8_t *)(p_gpd)->block)
+
+// CRC-32 (the zlib / Ethernet one) a nibble at a time: a 64 byte table instead of 1 KB
+static const uint32_t gpd_crc_table[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+// Carry on a CRC-32 over len more bytes. Start with 0.
+uint32_t GP_FLASH gpd_crc32(uint32_t crc, const uint8_t *p_data, size_t len)
+{
+  size_t i;
+
+  crc = ~crc;
+  for (i = 0; i < len; i++) {
+    crc ^= p_data[i];
+    crc = (crc >> 4) ^ gpd_crc_table[crc & 15];
+    crc = (crc >> 4) ^ gpd_crc_table[crc & 15];
+  }
+  return ~crc;
+}
+
+// Read the header at the start of a delta. Returns 0 or a GPD_ERR_* code.
+int GP_FLASH gpd_header(const uint8_t *p_buf, size_t len, gpd_header_t *p_header)
+{
+  if (len < GPD_HEADER_LEN)
+    return GPD_ERR_SHORT;
+  if (gp_get32(p_buf) != GPD_MAGIC)
+    return GPD_ERR_MAGIC;
+  p_header->base_len = gp_get32(&p_buf[4]);
+  p_header->base_crc = gp_get32(&p_buf[8]);
+  p_header->len = gp_get32(&p_buf[12]);
+  p_header->crc = gp_get32(&p_buf[16]);
+  return 0;
+}
+
+void GP_FLASH gpd_init(gpd_t *p_gpd, const gpd_io_t *p_io, void *p_ctx)
+{
+  p_gpd->p_io = p_io;
+  p_gpd->p_ctx = p_ctx;
+  p_gpd->in = 0;
+  p_gpd->out = 0;
+  p_gpd->written = 0;
+  p_gpd->crc = 0;
+  p_gpd->base_pos = 0;
+  p_gpd->state = GPD_STATE_HEAD;
+}
+
+// Hand what is in the block to write
+static int GP_FLASH gpd_flush(gpd_t *p_gpd)
+{
+  uint32_t n = p_gpd->out - p_gpd->written;
+
+  if (n == 0)
+    return 0;
+  if (p_gpd->p_io->write(p_gpd->p_ctx, p_gpd->written, GPD_BYTES(p_gpd), n) != 0)
+    return GPD_ERR_IO;
+  p_gpd->written = p_gpd->out;
+  return 0;
+}
+
+// n bytes were just put in the block at the current output position
+static int GP_FLASH gpd_produced(gpd_t *p_gpd, uint32_t n)
+{
+  p_gpd->crc = gpd_crc32(p_gpd->crc, &GPD_BYTES(p_gpd)[p_gpd->out - p_gpd->written], n);
+  p_gpd->out += n;
+  if (p_gpd->out - p_gpd->written == GPD_BLOCK)
+    return gpd_flush(p_gpd);
+  return 0;
+}
+
+// Room left in the block, at most want
+static uint32_t GP_FLASH gpd_room(const gpd_t *p_gpd, uint32_t want)
+{
+  uint32_t room = GPD_BLOCK - (p_gpd->out - p_gpd->written);
+
+  return want < room ? want : room;
+}
+
+// An op is done. Was that the last of the image?
+static int GP_FLASH gpd_next(gpd_t *p_gpd)
+{
+  int result;
+
+  if (p_gpd->out < p_gpd->header.len) {
+    p_gpd->state = GPD_STATE_OP;
+    return GPD_MORE;
+  }
+  if ((result = gpd_flush(p_gpd)) != 0)
+    return result;
+  p_gpd->state = GPD_STATE_DONE;
+  return p_gpd->crc == p_gpd->header.crc ? GPD_DONE : GPD_ERR_CRC;
+}
+
+// Copy len bytes from the base at offset. Goes straight into the block.
+static int GP_FLASH gpd_copy(gpd_t *p_gpd, uint32_t offset, uint32_t len)
+{
+  uint32_t n;
+  int result;
+
+  if (offset > p_gpd->header.base_len || len > p_gpd->header.base_len - offset)
+    return GPD_ERR_CORRUPT;
+  while (len) {
+    n = gpd_room(p_gpd, len);
+    if (p_gpd->p_io->read_base(p_gpd->p_ctx, offset, &GPD_BYTES(p_gpd)[p_gpd->out - p_gpd->written], n) != 0)
+      return GPD_ERR_IO;
+    if ((result = gpd_produced(p_gpd, n)) != 0)
+      return result;
+    offset += n;
+    len -= n;
+  }
+  p_gpd->base_pos = offset;
+  return 0;
+}
+
+// Copy len bytes of our own output from distance back. What has been written comes
+// back through read_image; what is still in the block is copied a byte at a time, so
+// an overlapping copy repeats itself the way LZ77 means it to.
+static int GP_FLASH gpd_self(gpd_t *p_gpd, uint32_t distance, uint32_t len)
+{
+  uint8_t *p_block = GPD_BYTES(p_gpd);
+  uint32_t from, n, i, at;
+  int result;
+
+  if (distance == 0 || distance > p_gpd->out)
+    return GPD_ERR_CORRUPT;
+  while (len) {
+    from = p_gpd->out - distance;
+    at = p_gpd->out - p_gpd->written;
+    n = gpd_room(p_gpd, len);
+    if (from < p_gpd->written) {
+      if (n > p_gpd->written - from)
+        n = p_gpd->written - from;
+      if (p_gpd->p_io->read_image(p_gpd->p_ctx, from, &p_block[at], n) != 0)
+        return GPD_ERR_IO;
+    } else {
+      for (i = 0; i < n; i++)
+        p_block[at + i] = p_block[from - p_gpd->written + i];
+    }
+    if ((result = gpd_produced(p_gpd, n)) != 0)
+      return result;
+    len -= n;
+  }
+  return 0;
+}
+
+// The op's length is known; what comes next
+static int GP_FLASH gpd_start(gpd_t *p_gpd)
+{
+  if (p_gpd->len == 0 || p_gpd->len > p_gpd->header.len - p_gpd->out)
+    return GPD_ERR_CORRUPT;
+  p_gpd->arg = 0;
+  p_gpd->shift = 0;
+  switch (p_gpd->kind) {
+    case GPD_LITERAL:
+      p_gpd->state = GPD_STATE_LITERAL;
+      break;
+    case GPD_FILL:
+      p_gpd->state = GPD_STATE_FILL;
+      break;
+    default:
+      p_gpd->state = GPD_STATE_ARG;
+      break;
+  }
+  return GPD_MORE;
+}
+
+// One more varint byte into arg. Returns 1 when it is complete.
+static int GP_FLASH gpd_varint(gpd_t *p_gpd, uint8_t c)
+{
+  if (p_gpd->shift > 28)
+    return GPD_ERR_CORRUPT;
+  p_gpd->arg |= (uint32_t)(c & 0x7f) << p_gpd->shift;
+  p_gpd->shift += 7;
+  return (c & 0x80) ? 0 : 1;
+}
+
+// Take the next len bytes of the delta. Returns GPD_MORE until the whole image is out
+// and checked, then GPD_DONE; or a GPD_ERR_* code, after which the delta is no good.
+int GP_FLASH gpd_feed(gpd_t *p_gpd, const uint8_t *p_data, size_t len)
+{
+  uint32_t n, i;
+  size_t at = 0;
+  int32_t move;
+  int result;
+
+  while (at < len) {
+    switch (p_gpd->state) {
+
+      case GPD_STATE_HEAD:
+        p_gpd->head[p_gpd->in++] = p_data[at++];
+        if (p_gpd->in < GPD_HEADER_LEN)
+          continue;
+        if ((result = gpd_header(p_gpd->head, GPD_HEADER_LEN, &p_gpd->header)) == 0)
+          result = gpd_next(p_gpd);
+        break;
+
+      case GPD_STATE_OP:
+        p_gpd->kind = p_data[at] & 3;
+        p_gpd->len = p_data[at] >> 2;
+        p_gpd->in++;
+        at++;
+        if (p_gpd->len == 0) {
+          p_gpd->arg = 0;
+          p_gpd->shift = 0;
+          p_gpd->state = GPD_STATE_LEN;
+          continue;
+        }
+        result = gpd_start(p_gpd);
+        break;
+
+      case GPD_STATE_LEN:
+        p_gpd->in++;
+        if ((result = gpd_varint(p_gpd, p_data[at++])) <= 0)
+          break;
+        p_gpd->len = p_gpd->arg;
+        result = gpd_start(p_gpd);
+        break;
+
+      case GPD_STATE_ARG:
+        p_gpd->in++;
+        if ((result = gpd_varint(p_gpd, p_data[at++])) <= 0)
+          break;
+        if (p_gpd->kind == GPD_COPY) {
+          // Zigzag: 0, -1, 1, -2 ... as 0, 1, 2, 3 ...
+          move = (int32_t)(p_gpd->arg >> 1) ^ -(int32_t)(p_gpd->arg & 1);
+          result = gpd_copy(p_gpd, p_gpd->base_pos + (uint32_t)move, p_gpd->len);
+        } else {
+          result = gpd_self(p_gpd, p_gpd->arg, p_gpd->len);
+        }
+        if (result == 0)
+          result = gpd_next(p_gpd);
+        break;
+
+      case GPD_STATE_LITERAL:
+        n = gpd_room(p_gpd, p_gpd->len);
+        if (n > len - at)
+          n = len - at;
+        for (i = 0; i < n; i++)
+          GPD_BYTES(p_gpd)[p_gpd->out - p_gpd->written + i] = p_data[at + i];
+        at += n;
+        p_gpd->in += n;
+        p_gpd->len -= n;
+        if ((result = gpd_produced(p_gpd, n)) == 0 && p_gpd->len == 0)
+          result = gpd_next(p_gpd);
+        break;
+
+      case GPD_STATE_FILL:
+        p_gpd->in++;
+        while (p_gpd->len) {
+          n = gpd_room(p_gpd, p_gpd->len);
+          for (i = 0; i < n; i++)
+            GPD_BYTES(p_gpd)[p_gpd->out - p_gpd->written + i] = p_data[at];
+          if ((result = gpd_produced(p_gpd, n)) != 0)
+            return result;
+          p_gpd->len -= n;
+        }
+        at++;
+        result = gpd_next(p_gpd);
+        break;
+
+      // Nothing may follow the image
+      default:
+        return GPD_ERR_CORRUPT;
+    }
+    if (result < 0)
+      return result;
+  }
+  return p_gpd->state == GPD_STATE_DONE ? GPD_DONE : GPD_MORE;
+}
@@ -0,0 +1,98 @@
+// gpdelta.h
+// Firmware deltas for over the air updates (see sender/ota.c and gpota in receiver/host).
+// A delta turns the image a sender is running (the base) into a new one. It is a header
+// and a stream of ops. The new image is produced front to back; neither it nor the delta
+// is ever held in RAM. gpd_feed takes the delta in whatever pieces the network hands
+// over and keeps one GPD_BLOCK of output before it goes to flash.
+//
+//   offset  size  field
+//        0     4  magic (GPD_MAGIC, "GPD1")
+//        4     4  base length (0: no base, the delta is the whole image, compressed)
+//        8     4  base CRC-32
+//       12     4  image length
+//       16     4  image CRC-32
+//       20     -  ops
+//
+// Every op starts with one byte: the kind in the low two bits, the length in the other
+// six (1 .. 63; 0 means a varint length follows). Varints are little endian groups of
+// seven bits with the top bit set on all but the last.
+//
+//   GPD_LITERAL  length bytes follow and go to the output as they are
+//   GPD_COPY     a zigzag varint follows: where in the base to copy from, relative to
+//                where the last copy from the base ended. Code that moved by the same
+//                amount as the code before it costs one byte (the bsdiff idea)
+//   GPD_SELF     a varint follows: how far back in the output to copy from. The copy
+//                may overlap what it writes, LZ77 style
+//   GPD_FILL     one byte follows, repeated length times (padding, erased flash)
+//
+// Integrity: the sender checks the base CRC against the image it is running before it
+// takes anything (a delta for another build would write garbage), and the image CRC
+// twice, over what gpd_feed produced and again over what is in flash afterwards.
+//
+// The IO is three callbacks so the same code runs against SPI flash on the ESP8266
+// and against memory on the host. All of them return 0, or anything else to give up.
+// write always gets a whole GPD_BLOCK at an offset that is a multiple of it, except
+// for the last one, and its buffer is word aligned.
+
+#ifndef __GPDELTA__H
+
+  #define __GPDELTA__H
+
+  #include "gp_port.h"
+
+  #define GPD_MAGIC 0x31445047
+  #define GPD_HEADER_LEN 20
+  #define GPD_BLOCK 256
+
+  // Op kinds
+  #define GPD_LITERAL 0
+  #define GPD_COPY 1
+  #define GPD_SELF 2
+  #define GPD_FILL 3
+
+  // gpd_feed results
+  #define GPD_MORE 0
+  #define GPD_DONE 1
+  #define GPD_ERR_SHORT -1    // gpd_header: not a whole header
+  #define GPD_ERR_MAGIC -2    // not a delta
+  #define GPD_ERR_CORRUPT -3  // an op that makes no sense, or more image than the header says
+  #define GPD_ERR_IO -4       // a callback gave up
+  #define GPD_ERR_CRC -5      // the image came out wrong
+
+  typedef struct {
+    uint32_t base_len;
+    uint32_t base_crc;
+    uint32_t len;
+    uint32_t crc;
+  } gpd_header_t;
+
+  typedef struct {
+    int (*read_base)(void *p_ctx, uint32_t offset, uint8_t *p_buf, uint32_t len);
+    int (*read_image)(void *p_ctx, uint32_t offset, uint8_t *p_buf, uint32_t len);
+    int (*write)(void *p_ctx, uint32_t offset, const uint8_t *p_buf, uint32_t len);
+  } gpd_io_t;
+
+  typedef struct {
+    uint32_t block[GPD_BLOCK / 4];  // image bytes not written yet (word aligned for flash)
+    const gpd_io_t *p_io;
+    void *p_ctx;
+    gpd_header_t header;
+    uint8_t head[GPD_HEADER_LEN];
+    uint32_t in;          // delta bytes taken
+    uint32_t out;         // image bytes produced
+    uint32_t written;     // image bytes handed to write (the rest are in block)
+    uint32_t crc;         // of the image so far
+    uint32_t base_pos;    // where the last GPD_COPY ended
+    uint32_t len;         // current op: length still to do
+    uint32_t arg;         // current op: varint being read
+    uint8_t shift;
+    uint8_t kind;
+    uint8_t state;
+  } gpd_t;
+
+  uint32_t gpd_crc32(uint32_t crc, const uint8_t *p_data, size_t len);
+  int gpd_header(const uint8_t *p_buf, size_t len, gpd_header_t *p_header);
+  void gpd_init(gpd_t *p_gpd, const gpd_io_t *p_io, void *p_ctx);
+  int gpd_feed(gpd_t *p_gpd, const uint8_t *p_data, size_t len);
+
+#endif
@@ -0,0 +1,109 @@
+// gptune.c
+// See gptune.h.
+
+#include "gptune.h"
+
+// What each tunable may be set to, by id. Wide enough to trade a lot of latency for
+// power and back, narrow enough that no value stops the sender from working: the
+// debounce has to leave a sample period of at least 1 ms, and a deep sleep can't be
+// longer than the SDK's 32 bit microsecond count (about 71 minutes).
+static const uint32_t gp_tune_min[GP_TUNE_COUNT + 1] = { 0, 1000, 1000, 0, 4, 0, 10000, 10, 1000 };
+static const uint32_t gp_tune_max[GP_TUNE_COUNT + 1] = { 0, 3600000, 3600000, 50, 1000, 60000, 86400000, 4200, 60000 };
+
+// Start from the values the firmware was built with (GP_TUNE_COUNT + 1 of them, by id)
+void GP_FLASH gp_tune_init(gp_tunables_t *p_tun, const uint32_t *p_defaults)
+{
+  int i;
+
+  for (i = 0; i <= GP_TUNE_COUNT; i++) {
+    p_tun->value[i] = p_defaults[i];
+    p_tun->defaults[i] = p_defaults[i];
+  }
+}
+
+// A whole set of values (by id) that makes sense: each one in range, and the idle
+// heartbeat no shorter than the busy one. Returns 0 or GP_TUNE_RANGE.
+int GP_FLASH gp_tune_check(const uint32_t *p_values)
+{
+  int i;
+
+  for (i = 1; i <= GP_TUNE_COUNT; i++) {
+    if (p_values[i] < gp_tune_min[i] || p_values[i] > gp_tune_max[i])
+      return GP_TUNE_RANGE;
+  }
+  if (p_values[GP_TUNE_HB_MAX] < p_values[GP_TUNE_HB_MIN])
+    return GP_TUNE_RANGE;
+  return 0;
+}
+
+// Do what a TUNE frame (already checked for our device id and its signature) asks and
+// fill in the TUNE_ACK. *p_changed gets a bit (1 << id) for every tunable whose value
+// is now different. Returns the status, which is in the answer too.
+int GP_FLASH gp_tune_handle(gp_tunables_t *p_tun, const gp_tune_t *p_req, gp_tune_t *p_ack, uint32_t *p_changed)
+{
+  uint32_t values[GP_TUNE_COUNT + 1];
+  int i, status = GP_TUNE_OK;
+
+  *p_changed = 0;
+  p_ack->type = GP_TYPE_TUNE_ACK;
+  p_ack->device_id = p_req->device_id;
+  p_ack->seq = p_req->seq;
+  p_ack->count = p_req->count;
+  for (i = 0; i < p_req->count; i++)
+    p_ack->entry[i].id = p_req->entry[i].id;
+
+  for (i = 0; i <= GP_TUNE_COUNT; i++)
+    values[i] = p_tun->value[i];
+  switch (p_req->op) {
+    case GP_TUNE_GET:
+      break;
+
+    case GP_TUNE_SET:
+    case GP_TUNE_SAVE:
+      for (i = 0; i < p_req->count && status == GP_TUNE_OK; i++) {
+        if (p_req->entry[i].id == 0 || p_req->entry[i].id > GP_TUNE_COUNT)
+          status = GP_TUNE_UNKNOWN;
+        else
+          values[p_req->entry[i].id] = p_req->entry[i].value;
+      }
+      if (status == GP_TUNE_OK)
+        status = gp_tune_check(values);
+      break;
+
+    case GP_TUNE_DEFAULTS:
+      for (i = 0; i <= GP_TUNE_COUNT; i++)
+        values[i] = p_tun->defaults[i];
+      break;
+
+    default:
+      p_ack->count = 0;
+      status = GP_TUNE_BAD;
+      break;
+  }
+
+  // All or nothing
+  if (status == GP_TUNE_OK) {
+    for (i = 1; i <= GP_TUNE_COUNT; i++) {
+      if (values[i] != p_tun->value[i])
+        *p_changed |= (uint32_t)1 << i;
+      p_tun->value[i] = values[i];
+    }
+  }
+
+  // Answer with what is in force now: the ones asked about, or all of them
+  if (p_req->count == 0 && status != GP_TUNE_BAD) {
+    p_ack->count = GP_TUNE_COUNT;
+    for (i = 0; i < GP_TUNE_COUNT; i++)
+      p_ack->entry[i].id = i + 1;
+  }
+  for (i = 0; i < p_ack->count; i++) {
+    if (p_ack->entry[i].id == 0 || p_ack->entry[i].id > GP_TUNE_COUNT) {
+      p_ack->entry[i].value = 0;
+      status = status == GP_TUNE_OK ? GP_TUNE_UNKNOWN : status;
+    } else {
+      p_ack->entry[i].value = p_tun->value[p_ack->entry[i].id];
+    }
+  }
+  p_ack->op = status;
+  return status;
+}
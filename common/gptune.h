@@ -0,0 +1,48 @@
+// gptune.h
+// The sender's tunables and what a TUNE frame does to them (see garage_proto.h for the
+// frame). The numbers that trade latency against power, and that used to mean editing
+// user_config.h and reflashing, can be read and changed at runtime:
+//
+//   id  name       unit  what
+//    1  hb_min     ms    heartbeat right after a change (HEARTBEAT_MIN_MS)
+//    2  hb_max     ms    heartbeat once the door is idle (HEARTBEAT_MAX_MS)
+//    3  hb_jitter  %     heartbeats up to this much early (HEARTBEAT_JITTER_PCT)
+//    4  debounce   ms    how long a pin holds a new level before we believe it (DEBOUNCE_MS)
+//    5  coalesce   ms    changes this close together that cancel out are dropped (COALESCE_MS)
+//    6  health     ms    between HEALTH frames (HEALTH_INTERVAL_MS)
+//    7  sleep      s     low power: longest deep sleep (SLEEP_HEARTBEAT_S)
+//    8  awake      ms    low power: how long to look for a receiver (AWAKE_TIMEOUT_MS)
+//
+// gp_tune_handle does all the checking and none of the applying: it answers the frame
+// and says which tunables changed; the sender (sender/tune.c) re-arms its timers for
+// those and writes them to flash if asked. No SDK code in here, so receiver/host
+// tunesim runs the same parser.
+
+#ifndef __GPTUNE__H
+
+  #define __GPTUNE__H
+
+  #include "gp_port.h"
+  #include "garage_proto.h"
+
+  #define GP_TUNE_HB_MIN 1
+  #define GP_TUNE_HB_MAX 2
+  #define GP_TUNE_HB_JITTER 3
+  #define GP_TUNE_DEBOUNCE 4
+  #define GP_TUNE_COALESCE 5
+  #define GP_TUNE_HEALTH 6
+  #define GP_TUNE_SLEEP 7
+  #define GP_TUNE_AWAKE 8
+  #define GP_TUNE_COUNT 8
+
+  // Current values, and the ones the firmware was built with, by id (0 is unused)
+  typedef struct {
+    uint32_t value[GP_TUNE_COUNT + 1];
+    uint32_t defaults[GP_TUNE_COUNT + 1];
+  } gp_tunables_t;
+
+  void gp_tune_init(gp_tunables_t *p_tun, const uint32_t *p_defaults);
+  int gp_tune_check(const uint32_t *p_values);
+  int gp_tune_handle(gp_tunables_t *p_tun, const gp_tune_t *p_req, gp_tune_t *p_ack, uint32_t *p_changed);
+
+#endif
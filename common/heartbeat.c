@@ -0,0 +1,54 @@
+// heartbeat.c
+// See heartbeat.h.
+
+#include "heartbeat.h"
+
+// xorshift32, plenty for spreading heartbeats
+static uint32_t GP_FLASH hb_random(hb_t *p_hb)
+{
+  uint32_t x = p_hb->rand;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  p_hb->rand = x;
+  return x;
+}
+
+// seed only has to differ between senders (the chip id will do). min_ms == max_ms and
+// jitter_pct == 0 give the old fixed cadence.
+void GP_FLASH hb_init(hb_t *p_hb, uint32_t min_ms, uint32_t max_ms, uint32_t jitter_pct, uint32_t seed)
+{
+  p_hb->min_ms = min_ms;
+  p_hb->max_ms = max_ms < min_ms ? min_ms : max_ms;
+  p_hb->jitter_pct = jitter_pct > 100 ? 100 : jitter_pct;
+  p_hb->interval_ms = min_ms;
+  p_hb->rand = seed ? seed : 1;
+  p_hb->beats = 0;
+  p_hb->resets = 0;
+}
+
+// Something happened (a change went out). Back to the short interval.
+void GP_FLASH hb_activity(hb_t *p_hb)
+{
+  if (p_hb->interval_ms != p_hb->min_ms)
+    p_hb->resets++;
+  p_hb->interval_ms = p_hb->min_ms;
+}
+
+// How long to wait before the next heartbeat: the interval minus the jitter.
+uint32_t GP_FLASH hb_wait(hb_t *p_hb)
+{
+  uint32_t cut = p_hb->interval_ms / 100 * p_hb->jitter_pct;
+
+  if (cut == 0)
+    return p_hb->interval_ms;
+  return p_hb->interval_ms - hb_random(p_hb) % (cut + 1);
+}
+
+// A heartbeat went out. Nothing happened since the last one, so stretch.
+void GP_FLASH hb_sent(hb_t *p_hb)
+{
+  p_hb->beats++;
+  p_hb->interval_ms = p_hb->interval_ms > p_hb->max_ms / 2 ? p_hb->max_ms : p_hb->interval_ms * 2;
+}
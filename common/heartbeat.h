@@ -0,0 +1,38 @@
+// heartbeat.h
+// When the sender says "still here". Changes go out the moment the debounce confirms
+// them; heartbeats only prove the sender is alive, so with a soft-AP full of doors they
+// should cost as little airtime as possible:
+//
+//   - Right after a change (and at boot) the interval is min_ms. Every heartbeat after
+//     that doubles it, up to max_ms, so an idle door settles down to one heartbeat every
+//     max_ms while a busy one stays chatty.
+//   - Each wait is shortened by a random 0 .. jitter_pct percent, so doors that booted
+//     together (power cut) don't keep transmitting in the same instant.
+//   - Jitter only ever makes a wait shorter, so the un-jittered interval is a promise:
+//     the sender puts it in every frame (GP_FLAG_LIVENESS) and the receiver calls the
+//     sender silent if nothing arrives in time (see devices.h on the receiver).
+//
+// No SDK code in here, and the caller owns the timer.
+
+#ifndef __HEARTBEAT__H
+
+  #define __HEARTBEAT__H
+
+  #include "gp_port.h"
+
+  typedef struct {
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t jitter_pct;
+    uint32_t interval_ms;   // the promise: the next heartbeat comes within this
+    uint32_t rand;          // jitter PRNG state
+    uint32_t beats;         // heartbeats sent
+    uint32_t resets;        // times activity pulled the interval back to min_ms
+  } hb_t;
+
+  void hb_init(hb_t *p_hb, uint32_t min_ms, uint32_t max_ms, uint32_t jitter_pct, uint32_t seed);
+  void hb_activity(hb_t *p_hb);
+  uint32_t hb_wait(hb_t *p_hb);
+  void hb_sent(hb_t *p_hb);
+
+#endif
@@ -0,0 +1,102 @@
+// reliable.c
+// See reliable.h. RTT arithmetic is integer milliseconds with the usual gains:
+// srtt += (sample - srtt) / 8, rttvar += (|sample - srtt| - rttvar) / 4 and
+// rto = srtt + 4 * rttvar, clamped to [REL_MIN_RTO_MS, REL_MAX_RTO_MS].
+
+#include "reliable.h"
+
+static uint32_t GP_FLASH rel_clamp(uint32_t rto)
+{
+  if (rto < REL_MIN_RTO_MS)
+    return REL_MIN_RTO_MS;
+  if (rto > REL_MAX_RTO_MS)
+    return REL_MAX_RTO_MS;
+  return rto;
+}
+
+void GP_FLASH rel_init(rel_t *p_rel)
+{
+  p_rel->inflight = 0;
+  p_rel->retries = 0;
+  p_rel->seq = 0;
+  p_rel->sent_ms = 0;
+  p_rel->last_ms = 0;
+  p_rel->srtt_ms = 0;
+  p_rel->rttvar_ms = 0;
+  p_rel->rto_ms = REL_INITIAL_RTO_MS;
+  p_rel->acked = 0;
+  p_rel->retransmits = 0;
+  p_rel->failed = 0;
+}
+
+// A new frame (whose highest sequence number is seq) just went out. It replaces
+// whatever was in flight; the receiver's ACKs are cumulative so an ACK for the new
+// frame covers the old one too.
+void GP_FLASH rel_sent(rel_t *p_rel, uint32_t seq, uint32_t now_ms)
+{
+  p_rel->inflight = 1;
+  p_rel->retries = 0;
+  p_rel->seq = seq;
+  p_rel->sent_ms = now_ms;
+  p_rel->last_ms = now_ms;
+}
+
+// An ACK for seq arrived. Returns 1 if it completes the frame in flight.
+int GP_FLASH rel_ack(rel_t *p_rel, uint32_t seq, uint32_t now_ms)
+{
+  uint32_t sample, delta;
+
+  if (!p_rel->inflight || (int32_t)(seq - p_rel->seq) < 0)
+    return 0;
+
+  if (p_rel->retries == 0) {
+    sample = now_ms - p_rel->sent_ms;
+    if (p_rel->srtt_ms == 0) {
+      p_rel->srtt_ms = sample ? sample : 1;
+      p_rel->rttvar_ms = sample / 2;
+    } else {
+      delta = sample > p_rel->srtt_ms ? sample - p_rel->srtt_ms : p_rel->srtt_ms - sample;
+      p_rel->rttvar_ms = p_rel->rttvar_ms - p_rel->rttvar_ms / 4 + delta / 4;
+      p_rel->srtt_ms = p_rel->srtt_ms - p_rel->srtt_ms / 8 + sample / 8;
+    }
+    p_rel->rto_ms = rel_clamp(p_rel->srtt_ms + 4 * p_rel->rttvar_ms);
+  }
+
+  p_rel->inflight = 0;
+  p_rel->acked++;
+  return 1;
+}
+
+// Milliseconds until the frame in flight should be retransmitted. 0 means now (or
+// nothing is in flight).
+uint32_t GP_FLASH rel_wait(const rel_t *p_rel, uint32_t now_ms)
+{
+  uint32_t elapsed, rto;
+
+  if (!p_rel->inflight)
+    return 0;
+
+  rto = rel_clamp(p_rel->rto_ms << p_rel->retries);
+  elapsed = now_ms - p_rel->last_ms;
+  return elapsed >= rto ? 0 : rto - elapsed;
+}
+
+// The retransmission timer fired. Returns 1 if the caller should resend the frame in
+// flight, 0 if there is nothing to do yet (or nothing in flight) and -1 if we have run
+// out of retries and given up on it.
+int GP_FLASH rel_expired(rel_t *p_rel, uint32_t now_ms)
+{
+  if (!p_rel->inflight || rel_wait(p_rel, now_ms) != 0)
+    return 0;
+
+  if (p_rel->retries >= REL_MAX_RETRIES) {
+    p_rel->inflight = 0;
+    p_rel->failed++;
+    return -1;
+  }
+
+  p_rel->retries++;
+  p_rel->retransmits++;
+  p_rel->last_ms = now_ms;
+  return 1;
+}
@@ -0,0 +1,44 @@
+// reliable.h
+// Acknowledged delivery for door state changes. The sender keeps (at most) one change
+// frame in flight; the receiver answers it with a GP_TYPE_ACK frame carrying the
+// highest sequence number it has. If no ACK turns up within the retransmission timeout
+// (RTO) the frame goes out again, with the RTO doubled each time, until REL_MAX_RETRIES.
+//
+// The RTO adapts to the link the TCP way (RFC 6298): a smoothed RTT and RTT variance
+// are updated from every ACK of a frame that was only sent once (Karn's rule ... an ACK
+// for a retransmitted frame could belong to either copy, so it tells us nothing).
+//
+// All times are milliseconds from whatever clock the caller uses. No SDK code in here.
+
+#ifndef __RELIABLE__H
+
+  #define __RELIABLE__H
+
+  #include "gp_port.h"
+
+  #define REL_INITIAL_RTO_MS 200
+  #define REL_MIN_RTO_MS 50
+  #define REL_MAX_RTO_MS 3000
+  #define REL_MAX_RETRIES 6
+
+  typedef struct {
+    uint8_t inflight;       // a frame is waiting for its ACK
+    uint8_t retries;        // retransmissions of the frame in flight
+    uint32_t seq;           // highest sequence number in the frame in flight
+    uint32_t sent_ms;       // when the frame in flight was first sent
+    uint32_t last_ms;       // when it was last (re)sent
+    uint32_t srtt_ms;       // smoothed round trip time, 0 until the first sample
+    uint32_t rttvar_ms;     // round trip time variance
+    uint32_t rto_ms;        // current retransmission timeout
+    uint32_t acked;         // frames delivered
+    uint32_t retransmits;   // frames sent more than once
+    uint32_t failed;        // frames we gave up on
+  } rel_t;
+
+  void rel_init(rel_t *p_rel);
+  void rel_sent(rel_t *p_rel, uint32_t seq, uint32_t now_ms);
+  int rel_ack(rel_t *p_rel, uint32_t seq, uint32_t now_ms);
+  uint32_t rel_wait(const rel_t *p_rel, uint32_t now_ms);
+  int rel_expired(rel_t *p_rel, uint32_t now_ms);
+
+#endif
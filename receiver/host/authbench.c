@@ -0,0 +1,472 @@
+// authbench.c
+// Host-side test and benchmark of frame authentication: SipHash and the auth trailer
+// (gpauth.c in common/) and the receive side check (rxauth.c, the real code). No
+// sockets; frames are built with gp_encode and handed straight to rxauth_check.
+//
+//   ./authbench [-n iterations]
+//
+// Checks, exit non-zero on failure:
+//   - gp_siphash against the SipHash-2-4 reference vectors (key 00..0f, message
+//     00 01 02 ..), and key parsing
+//   - a signed report gets in once and decodes to what was sent; the same bytes again,
+//     any single byte changed, another sender's key, a truncated or unsigned report,
+//     and a report from an older epoch are all rejected
+//   - out of order frames inside GP_REPLAY_WINDOW get in exactly once, older ones don't
+//   - a sender that reboots (new epoch) is back in straight away
+//   - frames that aren't reports, batches or SUBSCRIBEs go through untouched, signed or not
+//   - a signed SUBSCRIBE (or unsubscribe) from a consumer id gets in once and decodes to
+//     its lease; unsigned, replayed, under a sender's id and key or another consumer's
+//     key it doesn't
+//   - no key lets everything in, a bad key lets no report in
+//   - a full sender table turns new senders away, forgeries never take a slot
+//
+// Then the cost per frame, in cycles (the TSC on x86, nanoseconds elsewhere): SipHash
+// over what the tag covers for each frame size the sender sends, signing, verifying
+// and the whole rxauth_check for a known sender and for forgeries from made up ids
+// (the flood case). See gpauth.h for what that means on the ESP8266.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "rxauth.h"
+
+#define CHECK_NAME "authbench"
+#include "check.h"
+
+#define BENCH_MASTER "000102030405060708090a0b0c0d0e0f"
+#define BENCH_DEVICE 0x00c0ffee
+
+const char *TAG = "authbench";
+
+// SipHash-2-4 reference outputs for the first few message lengths, and two longer ones
+static const struct {
+  size_t len;
+  uint64_t hash;
+} bench_vectors[] = {
+  { 0, 0x726fdb47dd0e0e31ULL },
+  { 1, 0x74f839c593dc67fdULL },
+  { 2, 0x0d6c8009d9a94f5aULL },
+  { 3, 0x85676696d7fb7e2dULL },
+  { 7, 0xab0200f58b01d137ULL },
+  { 8, 0x93f5f5799a932462ULL },
+  { 15, 0xa129ca6149be45e5ULL },
+  { 63, 0x958a324ceb064572ULL },
+};
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// A heartbeat like the ESP8266's: one event, liveness and trace trailers. Returns its
+// length before signing.
+static int bench_report(uint32_t device_id, uint32_t seq, uint8_t *p_buf)
+{
+  gp_frame_t frame;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.type = GP_TYPE_REPORT;
+  frame.flags = GP_FLAG_HEARTBEAT | GP_FLAG_TRACE | GP_FLAG_LIVENESS;
+  frame.device_id = device_id;
+  frame.seq = seq;
+  frame.count = 1;
+  frame.event[0].pins = 0x0004;
+  frame.event[0].timestamp = 1000 + seq;
+  frame.tx_time = 1000 + seq;
+  frame.next_ms = 5000;
+  return gp_encode(&frame, p_buf, GP_MAX_FRAME);
+}
+
+// A batch of count events, trailers as above
+static int bench_batch(uint32_t device_id, uint8_t count, uint8_t *p_buf)
+{
+  gp_frame_t frame;
+  int i;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.type = GP_TYPE_BATCH;
+  frame.flags = GP_FLAG_CHANGE | GP_FLAG_ACK_REQ | GP_FLAG_TRACE | GP_FLAG_LIVENESS;
+  frame.device_id = device_id;
+  frame.count = count;
+  for (i = 0; i < count; i++)
+    frame.event[i].pins = (uint16_t)i;
+  return gp_encode(&frame, p_buf, GP_MAX_FRAME);
+}
+
+// Sign a fresh report with p_auth's next counter. Returns the signed length.
+static int bench_signed(gp_auth_t *p_auth, uint32_t device_id, uint32_t seq, uint8_t *p_buf)
+{
+  return gp_auth_sign(p_auth, p_buf, bench_report(device_id, seq, p_buf), GP_MAX_FRAME);
+}
+
+static void bench_vectors_check(void)
+{
+  uint8_t key[GP_AUTH_KEY_LEN], data[64], parsed[GP_AUTH_KEY_LEN];
+  size_t i;
+
+  for (i = 0; i < sizeof(key); i++)
+    key[i] = (uint8_t)i;
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = (uint8_t)i;
+  for (i = 0; i < sizeof(bench_vectors) / sizeof(bench_vectors[0]); i++)
+    CHECK(gp_siphash(key, data, bench_vectors[i].len) == bench_vectors[i].hash);
+
+  CHECK(gp_auth_key(BENCH_MASTER, parsed) == 0 && memcmp(parsed, key, sizeof(key)) == 0);
+  CHECK(gp_auth_key("000102030405060708090A0B0C0D0E0F", parsed) == 0 && memcmp(parsed, key, sizeof(key)) == 0);
+  CHECK(gp_auth_key("000102030405060708090a0b0c0d0e0", parsed) != 0);
+  CHECK(gp_auth_key("000102030405060708090a0b0c0d0e0f0", parsed) != 0);
+  CHECK(gp_auth_key("000102030405060708090a0b0c0d0e0g", parsed) != 0);
+  CHECK(gp_auth_key("", parsed) != 0);
+  printf("authbench: SipHash-2-4 reference vectors and key parsing ok\n");
+}
+
+static void bench_accept_reject(void)
+{
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_MAX_FRAME], copy[GP_MAX_FRAME];
+  gp_auth_t auth, other;
+  gp_frame_t frame;
+  int len, plain, n, i, rejected;
+
+  gp_auth_key(BENCH_MASTER, master);
+  memset(&auth, 0, sizeof(auth));
+  gp_auth_derive(master, BENCH_DEVICE, auth.key);
+  auth.epoch = 7;
+  CHECK(rxauth_init(BENCH_MASTER) == 0);
+
+  // A good one, and it decodes to what we sent
+  plain = bench_report(BENCH_DEVICE, 42, buf);
+  len = gp_auth_sign(&auth, buf, plain, sizeof(buf));
+  CHECK(len == plain + GP_AUTH_LEN);
+  memcpy(copy, buf, len);
+  n = rxauth_check(buf, len);
+  CHECK(n == plain);
+  CHECK(gp_decode(buf, n, &frame) == 0 && frame.device_id == BENCH_DEVICE && frame.seq == 42 &&
+        frame.next_ms == 5000 && frame.tx_time == 1042 && (frame.flags & GP_FLAG_AUTH));
+
+  // The same bytes again
+  CHECK(rxauth_check(copy, len) == GP_ERR_REPLAY);
+
+  // Every single byte changed, trailer included. A changed magic or type isn't a report
+  // any more, so rxauth_check lets it through and gp_decode has to throw it out.
+  rejected = 0;
+  len = bench_signed(&auth, BENCH_DEVICE, 43, buf);
+  for (i = 0; i < len; i++) {
+    memcpy(copy, buf, len);
+    copy[i] ^= 0x01;
+    n = rxauth_check(copy, len);
+    rejected += n < 0 || gp_decode(copy, n, &frame) != 0;
+  }
+  CHECK(rejected == len);
+  // ... and the untouched original still gets in: the bad copies moved nothing
+  CHECK(rxauth_check(buf, len) == len - GP_AUTH_LEN);
+
+  // Another sender's key, truncated, unsigned
+  memset(&other, 0, sizeof(other));
+  gp_auth_derive(master, BENCH_DEVICE + 1, other.key);
+  len = bench_signed(&other, BENCH_DEVICE, 44, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+  len = bench_signed(&auth, BENCH_DEVICE, 44, buf);
+  CHECK(rxauth_check(buf, len - 1) == GP_ERR_AUTH);
+  CHECK(rxauth_check(buf, 12) == GP_ERR_AUTH);
+  len = bench_report(BENCH_DEVICE, 45, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+  len = bench_batch(BENCH_DEVICE, 3, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+
+  // Not a report or batch: straight through, signed or not
+  buf[0] = GP_MAGIC;
+  buf[1] = GP_VERSION;
+  buf[2] = GP_TYPE_DISCOVER;
+  buf[3] = 0;
+  gp_put32(&buf[4], BENCH_DEVICE);
+  CHECK(rxauth_check(buf, GP_DISCOVER_LEN) == GP_DISCOVER_LEN);
+  buf[3] = GP_FLAG_AUTH;
+  CHECK(rxauth_check(buf, GP_DISCOVER_LEN) == GP_DISCOVER_LEN);
+
+  CHECK(rxauth_stats.accepted == 2 && rxauth_stats.replayed == 1 && rxauth_stats.plain == 2);
+  CHECK(rxauth_rejected() == rxauth_stats.forged + 3);
+  printf("authbench: good frame in once, replay, %d single byte changes, wrong key, truncated and "
+         "unsigned frames out\n", rejected);
+}
+
+static void bench_window(void)
+{
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_REPLAY_WINDOW + 8][GP_MAX_FRAME];
+  int len[GP_REPLAY_WINDOW + 8], i;
+  gp_auth_t auth;
+
+  gp_auth_key(BENCH_MASTER, master);
+  memset(&auth, 0, sizeof(auth));
+  gp_auth_derive(master, BENCH_DEVICE, auth.key);
+  auth.epoch = 1;
+  rxauth_init(BENCH_MASTER);
+
+  for (i = 0; i < GP_REPLAY_WINDOW + 8; i++)
+    len[i] = bench_signed(&auth, BENCH_DEVICE, i, buf[i]);
+
+  // Newest first, then the rest backwards: everything inside the window gets in once,
+  // the 8 that fell out of it don't
+  CHECK(rxauth_check(buf[GP_REPLAY_WINDOW + 7], len[GP_REPLAY_WINDOW + 7]) > 0);
+  for (i = GP_REPLAY_WINDOW + 6; i >= 0; i--) {
+    if (i > 7)
+      CHECK(rxauth_check(buf[i], len[i]) > 0);
+    else
+      CHECK(rxauth_check(buf[i], len[i]) == GP_ERR_REPLAY);
+  }
+  for (i = 8; i < GP_REPLAY_WINDOW + 8; i++)
+    CHECK(rxauth_check(buf[i], len[i]) == GP_ERR_REPLAY);
+
+  // Gaps are fine; the skipped ones can still come in late
+  auth.counter += 5;
+  len[0] = bench_signed(&auth, BENCH_DEVICE, 100, buf[0]);
+  CHECK(rxauth_check(buf[0], len[0]) > 0);
+  auth.counter -= 3;
+  len[1] = bench_signed(&auth, BENCH_DEVICE, 99, buf[1]);
+  CHECK(rxauth_check(buf[1], len[1]) > 0);
+  CHECK(rxauth_check(buf[1], len[1]) == GP_ERR_REPLAY);
+
+  // Reboot: a new epoch starts at counter 0 and is in straight away. Anything from the
+  // old epoch is history.
+  len[2] = bench_signed(&auth, BENCH_DEVICE, 101, buf[2]);
+  auth.epoch = 2;
+  auth.counter = 0;
+  len[3] = bench_signed(&auth, BENCH_DEVICE, 0, buf[3]);
+  CHECK(rxauth_check(buf[3], len[3]) > 0);
+  CHECK(rxauth_check(buf[2], len[2]) == GP_ERR_REPLAY);
+  len[4] = bench_signed(&auth, BENCH_DEVICE, 1, buf[4]);
+  CHECK(rxauth_check(buf[4], len[4]) > 0);
+
+  printf("authbench: replay window of %d, out of order inside it once each, older out, new epoch in\n",
+         GP_REPLAY_WINDOW);
+}
+
+// A SUBSCRIBE from consumer_id, signed with p_auth if it isn't NULL. Returns its length.
+static int bench_subscribe(gp_auth_t *p_auth, uint32_t consumer_id, uint16_t lease_s, uint8_t *p_buf)
+{
+  gp_frame_t frame;
+  int len;
+
+  memset(&frame, 0, sizeof(frame));
+  frame.type = GP_TYPE_SUBSCRIBE;
+  frame.seq = lease_s;
+  frame.device_id = consumer_id;
+  len = gp_encode(&frame, p_buf, GP_MAX_FRAME);
+  return p_auth != NULL ? gp_auth_sign(p_auth, p_buf, len, GP_MAX_FRAME) : len;
+}
+
+static void bench_subscribes(void)
+{
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_MAX_FRAME], copy[GP_MAX_FRAME];
+  gp_auth_t auth, other;
+  gp_frame_t frame;
+  int len, n;
+
+  gp_auth_key(BENCH_MASTER, master);
+  rxauth_init(BENCH_MASTER);
+  memset(&auth, 0, sizeof(auth));
+  auth.epoch = 1700000000;
+  gp_auth_derive(master, GP_CONSUMER_ID_MIN + 1, auth.key);
+
+  // Signed, once
+  len = bench_subscribe(&auth, GP_CONSUMER_ID_MIN + 1, 600, buf);
+  memcpy(copy, buf, len);
+  n = rxauth_check(buf, len);
+  CHECK(n == GP_SUBSCRIBE_LEN && gp_decode(buf, n, &frame) == 0 && frame.seq == 600 &&
+        frame.device_id == GP_CONSUMER_ID_MIN + 1);
+  CHECK(rxauth_check(copy, len) == GP_ERR_REPLAY);
+  // Unsubscribing takes a signature just the same
+  len = bench_subscribe(NULL, GP_CONSUMER_ID_MIN + 1, 0, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+  len = bench_subscribe(&auth, GP_CONSUMER_ID_MIN + 1, 0, buf);
+  CHECK(rxauth_check(buf, len) == GP_SUBSCRIBE_LEN);
+
+  // Another consumer's key, and a sender's id under its own good key
+  memset(&other, 0, sizeof(other));
+  gp_auth_derive(master, GP_CONSUMER_ID_MIN + 2, other.key);
+  len = bench_subscribe(&other, GP_CONSUMER_ID_MIN + 1, 600, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+  gp_auth_derive(master, BENCH_DEVICE, other.key);
+  len = bench_subscribe(&other, BENCH_DEVICE, 600, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+  CHECK(rxauth_check(buf, 8) == GP_ERR_AUTH);
+
+  // No key: an unsigned one goes straight through
+  rxauth_init("");
+  len = bench_subscribe(NULL, GP_CONSUMER_ID_MIN + 1, 600, buf);
+  CHECK(rxauth_check(buf, len) == len);
+
+  printf("authbench: SUBSCRIBE signed by its consumer once, unsigned, replayed or a sender's key out\n");
+}
+
+static void bench_modes_and_table(void)
+{
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_MAX_FRAME];
+  gp_auth_t auth;
+  uint32_t i;
+  int len;
+
+  // No key: everything in, nothing counted
+  CHECK(rxauth_init("") == 0 && rxauth_stats.mode == RXAUTH_OFF);
+  len = bench_report(BENCH_DEVICE, 1, buf);
+  CHECK(rxauth_check(buf, len) == len);
+  // A bad key: no report gets in, however it is signed
+  CHECK(rxauth_init("not a key") != 0 && rxauth_stats.mode == RXAUTH_BROKEN);
+  CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+
+  // Forgeries from made up ids take no slots, so every real sender still fits
+  gp_auth_key(BENCH_MASTER, master);
+  rxauth_init(BENCH_MASTER);
+  memset(&auth, 0, sizeof(auth));
+  for (i = 1; i <= RXAUTH_TABLE_SIZE; i++) {
+    len = bench_signed(&auth, 0x10000000 + i, 1, buf);
+    CHECK(rxauth_check(buf, len) == GP_ERR_AUTH);
+  }
+  for (i = 1; i <= RXAUTH_TABLE_SIZE; i++) {
+    gp_auth_derive(master, i, auth.key);
+    len = bench_signed(&auth, i, 1, buf);
+    CHECK(rxauth_check(buf, len) > 0);
+  }
+  CHECK(rxauth_stats.accepted == RXAUTH_TABLE_SIZE && rxauth_stats.forged == RXAUTH_TABLE_SIZE);
+  // One more genuine sender doesn't fit
+  gp_auth_derive(master, RXAUTH_TABLE_SIZE + 1, auth.key);
+  len = bench_signed(&auth, RXAUTH_TABLE_SIZE + 1, 1, buf);
+  CHECK(rxauth_check(buf, len) == GP_ERR_REPLAY && rxauth_stats.full == 1);
+
+  printf("authbench: no key lets everything in, a bad key nothing; %u senders fit, forgeries take no slot\n",
+         RXAUTH_TABLE_SIZE);
+}
+
+// Cycles per call of gp_siphash over len bytes
+static double bench_siphash(const uint8_t *p_key, const uint8_t *p_data, size_t len, uint32_t iterations)
+{
+  volatile uint64_t sink = 0;
+  uint64_t start;
+  uint32_t i;
+
+  start = bench_cycles();
+  for (i = 0; i < iterations; i++)
+    sink += gp_siphash(p_key, p_data, len);
+  (void)sink;
+  return (double)(bench_cycles() - start) / iterations;
+}
+
+static void bench_cost(uint32_t iterations)
+{
+  static const struct {
+    const char *name;
+    int events;             // 0: heartbeat report
+  } sizes[] = { { "heartbeat", 0 }, { "batch of 1", 1 }, { "batch of 4", 4 }, { "batch of 8", GP_BATCH_MAX } };
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_MAX_FRAME], *p_frames;
+  uint32_t epoch, counter, i, n = iterations < 100000 ? iterations : 100000;
+  uint64_t start;
+  gp_auth_t auth;
+  size_t k;
+  int len, plain, *p_len;
+  char detail[64];
+  double cycles;
+
+  gp_auth_key(BENCH_MASTER, master);
+  memset(&auth, 0, sizeof(auth));
+  gp_auth_derive(master, BENCH_DEVICE, auth.key);
+
+  printf("authbench: cost per frame in %s, %u iterations\n",
+#if defined(__x86_64__) || defined(__i386__)
+         "TSC cycles",
+#else
+         "ns",
+#endif
+         iterations);
+
+  // What the tag covers: the frame plus epoch and counter
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    plain = sizes[k].events ? bench_batch(BENCH_DEVICE, sizes[k].events, buf) : bench_report(BENCH_DEVICE, 1, buf);
+    cycles = bench_siphash(auth.key, buf, plain + 8, iterations);
+    snprintf(detail, sizeof(detail), "%-10s %2d -> %2d bytes on air, %2d hashed", sizes[k].name, plain,
+             plain + GP_AUTH_LEN, plain + 8);
+    printf("  siphash  %-44s %7.1f (%.2f per byte)\n", detail, cycles, cycles / (plain + 8));
+  }
+
+  // Sign, as the sender does for every transmission
+  plain = bench_report(BENCH_DEVICE, 1, buf);
+  start = bench_cycles();
+  for (i = 0; i < iterations; i++)
+    len = gp_auth_sign(&auth, buf, plain, sizeof(buf));
+  printf("  sign     %-44s %7.1f\n", "heartbeat", (double)(bench_cycles() - start) / iterations);
+
+  start = bench_cycles();
+  for (i = 0; i < iterations; i++)
+    CHECK(gp_auth_verify(auth.key, buf, len, &epoch, &counter) == plain);
+  printf("  verify   %-44s %7.1f\n", "heartbeat", (double)(bench_cycles() - start) / iterations);
+
+  // The whole receive side check, n genuine frames from one known sender ...
+  p_frames = malloc((size_t)n * GP_MAX_FRAME);
+  p_len = malloc((size_t)n * sizeof(int));
+  if (p_frames == NULL || p_len == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  rxauth_init(BENCH_MASTER);
+  auth.epoch = 1;
+  auth.counter = 0;
+  for (i = 0; i < n; i++)
+    p_len[i] = bench_signed(&auth, BENCH_DEVICE, i, &p_frames[(size_t)i * GP_MAX_FRAME]);
+  start = bench_cycles();
+  for (i = 0; i < n; i++)
+    rxauth_check(&p_frames[(size_t)i * GP_MAX_FRAME], p_len[i]);
+  printf("  rxauth   %-44s %7.1f\n", "known sender, accepted", (double)(bench_cycles() - start) / n);
+  CHECK(rxauth_stats.accepted == n);
+
+  // ... and n forgeries, each from an id we haven't met (key derivation included)
+  for (i = 0; i < n; i++)
+    p_len[i] = bench_signed(&auth, 0x20000000 + i, i, &p_frames[(size_t)i * GP_MAX_FRAME]);
+  start = bench_cycles();
+  for (i = 0; i < n; i++)
+    rxauth_check(&p_frames[(size_t)i * GP_MAX_FRAME], p_len[i]);
+  printf("  rxauth   %-44s %7.1f\n", "forged, unknown id, rejected", (double)(bench_cycles() - start) / n);
+  CHECK(rxauth_stats.forged == n);
+
+  free(p_frames);
+  free(p_len);
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t iterations = 1000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n': iterations = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (iterations == 0)
+    iterations = 1;
+
+  bench_vectors_check();
+  bench_accept_reject();
+  bench_window();
+  bench_subscribes();
+  bench_modes_and_table();
+  bench_cost(iterations);
+
+  printf("authbench: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,30 @@
+// check.h
+// The CHECK the host tests share: if cond is false, count it in failures and say where.
+// Define CHECK_NAME (the program, for the "name: FAIL" line) before including this.
+// With CHECK_PRINT_MAX defined only that many failures are printed; the rest are still
+// counted, for tests that can fail the same check a million times.
+
+#ifndef __CHECK__H
+
+  #define __CHECK__H
+
+  #include <stdio.h>
+
+  #ifndef CHECK_NAME
+    #error "Define CHECK_NAME before including check.h"
+  #endif
+
+  #ifndef CHECK_PRINT_MAX
+    #define CHECK_PRINT_MAX 0x7fffffff
+  #endif
+
+  static int failures;
+
+  #define CHECK(cond) do { \
+      if (!(cond)) { \
+        if (failures++ < CHECK_PRINT_MAX) \
+          printf(CHECK_NAME ": FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      } \
+    } while (0)
+
+#endif
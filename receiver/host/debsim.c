@@ -0,0 +1,285 @@
+// debsim.c
+// Host-side test of the sender's debouncer (see debounce.h in common/) with a bank of
+// bouncy door switches. No GPIO: we play the switches on a simulated millisecond clock
+// and drive the debouncer the way user_main.c does (an edge starts a sample every
+// sample_ms until the burst is over, each sample one read of all the pins).
+//
+//   ./debsim [-H hours] [-v]
+//
+// For 1, 3, 6 and 16 pins:
+//   - every door moves now and then (at least a second apart), bouncing for up to
+//     SIM_BOUNCE_MS before it settles
+//   - every pin also sees short glitches (1 to 3 ms) that must never be reported
+//   - on top of that the cost of one debounce_sample, in ns, for each pin count
+//
+// Checks, exit non-zero on failure: every move is reported exactly once with the level
+// it settled at, no glitch or bounce is reported, every report comes within
+// SIM_BOUNCE_MS + DEBOUNCE_MS + one sample of the move, a sample that finds a pin still
+// counting keeps the debouncer active even with no edge behind it, and a sample costs
+// about the same with 16 pins as with 1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debounce.h"
+
+#define DEBOUNCE_MS 50        // the sender's default (see user_config.h)
+#define SIM_BOUNCE_MS 20
+#define SIM_MOVE_MEAN_MS 30000
+#define SIM_GLITCH_MEAN_MS 20000
+#define SIM_COST_SAMPLES 20000000
+
+static const uint32_t sim_pins[] = { 1, 3, 6, 16 };
+
+typedef struct {
+  uint8_t level;          // what the pin reads
+  uint8_t settled;        // where the door really is
+  uint8_t reported;       // the debouncer has reported the last move
+  uint32_t moved_ms;      // last move
+  uint32_t bounce_until;
+  uint32_t glitch_until;
+  uint32_t next_move;
+  uint32_t next_glitch;
+} sim_pin_t;
+
+typedef struct {
+  uint32_t moves;
+  uint32_t reports;
+  uint32_t glitches;
+  uint32_t wrong;         // reported a level the door isn't at
+  uint32_t twice;         // reported the same move again
+  uint32_t missed;
+  uint32_t latency_max;
+  uint64_t latency_sum;
+  uint32_t samples;
+  uint32_t bounces;
+  double sample_ns;
+} sim_result_t;
+
+static int verbose;
+static uint32_t sim_hours = 2;
+static uint32_t sim_rand = 88172645u;
+
+static uint32_t sim_random(void)
+{
+  sim_rand ^= sim_rand << 13;
+  sim_rand ^= sim_rand >> 17;
+  sim_rand ^= sim_rand << 5;
+  return sim_rand;
+}
+
+// Uniform wait with the given mean, and never less than a second for door moves
+static uint32_t sim_wait(uint32_t mean_ms)
+{
+  return 1000 + sim_random() % (2 * mean_ms);
+}
+
+static uint64_t sim_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void sim_run(uint32_t count, sim_result_t *p_result)
+{
+  sim_pin_t pins[16];
+  debounce_t db;
+  uint16_t mask = (uint16_t)((1u << count) - 1), levels, last, toggled;
+  uint32_t now, end = sim_hours * 3600000, next_sample = 0, i, latency;
+  uint8_t sampling = 0;
+
+  memset(p_result, 0, sizeof(*p_result));
+  memset(pins, 0, sizeof(pins));
+  for (i = 0; i < count; i++) {
+    pins[i].level = pins[i].settled = sim_random() & 1;
+    pins[i].reported = 1;
+    pins[i].next_move = sim_wait(SIM_MOVE_MEAN_MS);
+    pins[i].next_glitch = sim_wait(SIM_GLITCH_MEAN_MS);
+  }
+  for (i = 0, last = 0; i < count; i++)
+    last |= pins[i].level << i;
+  debounce_init(&db, mask, last, DEBOUNCE_MS);
+
+  for (now = 1; now < end; now++) {
+    // The switches
+    for (i = 0, levels = 0; i < count; i++) {
+      sim_pin_t *p = &pins[i];
+
+      if (now >= p->next_move) {
+        p->settled ^= 1;
+        p->reported = 0;
+        p->moved_ms = now;
+        p->bounce_until = now + sim_random() % (SIM_BOUNCE_MS + 1);
+        p->next_move = now + sim_wait(SIM_MOVE_MEAN_MS);
+        p_result->moves++;
+      }
+      if (now >= p->next_glitch && now >= p->bounce_until) {
+        p->glitch_until = now + 1 + sim_random() % 3;
+        p->next_glitch = now + sim_wait(SIM_GLITCH_MEAN_MS);
+        p_result->glitches++;
+      }
+
+      if (now < p->bounce_until)
+        p->level = sim_random() & 1;
+      else if (now < p->glitch_until)
+        p->level = !p->settled;
+      else
+        p->level = p->settled;
+      levels |= p->level << i;
+    }
+
+    // The GPIO interrupt and the door task
+    if (levels != last) {
+      debounce_edge(&db, now);
+      if (!sampling) {
+        sampling = 1;
+        next_sample = now + db.sample_ms;
+      }
+      last = levels;
+    }
+
+    // debounce_function
+    if (!sampling || now < next_sample)
+      continue;
+    // The other input register bits are junk the mask has to keep out
+    toggled = debounce_sample(&db, levels | (0xa5a5 & ~mask), now);
+    if (db.active)
+      next_sample = now + db.sample_ms;
+    else
+      sampling = 0;
+
+    for (i = 0; i < count; i++) {
+      sim_pin_t *p = &pins[i];
+
+      if (!(toggled & (1u << i)))
+        continue;
+      p_result->reports++;
+      if (((db.stable >> i) & 1) != p->settled) {
+        p_result->wrong++;
+        printf("debsim: FAIL %u pins: pin %u reported %u at %u ms, the door is at %u\n", count, i,
+               (db.stable >> i) & 1, now, p->settled);
+        continue;
+      }
+      if (p->reported) {
+        p_result->twice++;
+        printf("debsim: FAIL %u pins: pin %u reported twice at %u ms\n", count, i, now);
+        continue;
+      }
+      p->reported = 1;
+      latency = now - p->moved_ms;
+      p_result->latency_sum += latency;
+      if (latency > p_result->latency_max)
+        p_result->latency_max = latency;
+      if (verbose)
+        printf("  %9u ms: pin %u -> %u after %u ms\n", now, i, p->settled, latency);
+    }
+  }
+
+  // A move in the last moments may not have been confirmed yet
+  for (i = 0; i < count; i++) {
+    if (!pins[i].reported && end - pins[i].moved_ms > SIM_BOUNCE_MS + 2 * DEBOUNCE_MS) {
+      p_result->missed++;
+      printf("debsim: FAIL %u pins: pin %u moved at %u ms and was never reported\n", count, i, pins[i].moved_ms);
+    }
+  }
+  p_result->samples = db.samples;
+  p_result->bounces = db.bounces;
+}
+
+// What one sample costs with count pins changing at random
+// A pin that moved with no edge seen (lost, or it came in while a sample was being
+// taken) is still counted through to the end. Returns the number of failures.
+static int sim_no_edge(void)
+{
+  debounce_t db;
+  uint16_t toggled = 0;
+  uint32_t i;
+
+  debounce_init(&db, 1, 0, DEBOUNCE_MS);
+  for (i = 0; i < DEBOUNCE_SAMPLES; i++) {
+    toggled |= debounce_sample(&db, 1, i);
+    if (!toggled && !db.active) {
+      printf("debsim: FAIL no edge: inactive after %u samples with the pin still counting\n", i + 1);
+      return 1;
+    }
+  }
+  if (toggled != 1 || db.stable != 1 || db.active) {
+    printf("debsim: FAIL no edge: toggled %x, stable %x, active %u\n", toggled, db.stable, db.active);
+    return 1;
+  }
+  return 0;
+}
+
+static double sim_cost(uint32_t count)
+{
+  debounce_t db;
+  uint16_t mask = (uint16_t)((1u << count) - 1), *p_levels, sink = 0;
+  uint32_t i;
+  uint64_t start;
+
+  p_levels = malloc(4096 * sizeof(*p_levels));
+  for (i = 0; i < 4096; i++)
+    p_levels[i] = (uint16_t)sim_random();
+  debounce_init(&db, mask, 0, DEBOUNCE_MS);
+
+  start = sim_ns();
+  for (i = 0; i < SIM_COST_SAMPLES; i++)
+    sink ^= debounce_sample(&db, p_levels[i & 4095], i);
+  start = sim_ns() - start;
+
+  free(p_levels);
+  if (sink == 0x5a5a)
+    printf(" ");
+  return (double)start / SIM_COST_SAMPLES;
+}
+
+int main(int argc, char *argv[])
+{
+  sim_result_t result;
+  uint32_t i, limit = SIM_BOUNCE_MS + DEBOUNCE_MS + DEBOUNCE_MS / DEBOUNCE_SAMPLES;
+  double first = 0;
+  int opt, failures = 0;
+
+  while ((opt = getopt(argc, argv, "H:v")) != -1) {
+    switch (opt) {
+      case 'H': sim_hours = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-H hours] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  printf("debsim: %u h, settle %u ms (%u samples), bounces up to %u ms\n", sim_hours, DEBOUNCE_MS,
+         DEBOUNCE_SAMPLES, SIM_BOUNCE_MS);
+  printf("pins   moves  reported  glitches  latency mean ms  max ms  samples  bursts ignored  ns/sample\n");
+  for (i = 0; i < sizeof(sim_pins) / sizeof(sim_pins[0]); i++) {
+    sim_run(sim_pins[i], &result);
+    result.sample_ns = sim_cost(sim_pins[i]);
+    if (i == 0)
+      first = result.sample_ns;
+    printf("%4u  %6u  %8u  %8u  %15.1f  %6u  %7u  %14u  %9.2f\n", sim_pins[i], result.moves, result.reports,
+           result.glitches, result.reports ? (double)result.latency_sum / result.reports : 0, result.latency_max,
+           result.samples, result.bounces, result.sample_ns);
+
+    failures += result.wrong + result.twice + result.missed;
+    if (result.latency_max > limit) {
+      printf("debsim: FAIL %u pins: a move took %u ms to report, allowed %u\n", sim_pins[i], result.latency_max, limit);
+      failures++;
+    }
+    if (result.sample_ns > 4 * first + 2) {
+      printf("debsim: FAIL %u pins: %.2f ns per sample against %.2f with one pin\n", sim_pins[i], result.sample_ns, first);
+      failures++;
+    }
+  }
+
+  failures += sim_no_edge();
+
+  printf("debsim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
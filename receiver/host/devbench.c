@@ -0,0 +1,377 @@
+// devbench.c
+// Host-side benchmark of the receiver's device table: device_update and device_lookup
+// (devices.c, the real code) called directly, no sockets, on a simulated clock.
+//
+//   ./devbench [-u updates] [-v]
+//
+// For 1,000, 4,000 and as many senders as the table takes (three quarters of
+// DEVICE_TABLE_SIZE), with chip ids that run on from each other like real ones do:
+//   update   device_update for a heartbeat from a random sender, liveness timer rearm
+//            included (-u of them, default 2,000,000)
+//   lookup   device_lookup of a random sender we know, and of one we don't
+//
+// Then the table is filled until it says DEVICE_FULL, one sender reboots a few times
+// and one opens and closes its two doors (the Makefile builds this with two pins in
+// DOOR_OPEN_MASK). Checks, exit non-zero on failure: at least 100,000 updates a second
+// at every size; the table takes exactly three quarters of DEVICE_TABLE_SIZE senders,
+// turns the next one away and still takes frames from the ones it has; every sender
+// can be looked up and an unknown one can't; a BOOT frame starts the sequence over
+// whether it goes back or forward, unless it is a copy of one we already have; each
+// door is timed, alerted on and counted on its own; and the events of a traced batch
+// are timed by when the sender saw them, never running backwards.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "garage_proto.h"
+#include "devices.h"
+
+#define BENCH_ID_BASE 0x00a3c000
+#define BENCH_MIN_RATE 100000
+
+static int verbose;
+static uint32_t bench_updates = 2000000;
+static uint32_t bench_rand = 2463534242u;
+
+static uint32_t bench_random(void)
+{
+  bench_rand ^= bench_rand << 13;
+  bench_rand ^= bench_rand >> 17;
+  bench_rand ^= bench_rand << 5;
+  return bench_rand;
+}
+
+static uint64_t bench_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void bench_frame(gp_frame_t *p_frame, uint32_t device_id, uint32_t seq, uint32_t now)
+{
+  p_frame->type = GP_TYPE_REPORT;
+  p_frame->flags = GP_FLAG_HEARTBEAT | GP_FLAG_LIVENESS;
+  p_frame->device_id = device_id;
+  p_frame->seq = seq;
+  p_frame->count = 1;
+  p_frame->event[0].pins = 0;
+  p_frame->event[0].timestamp = now;
+  p_frame->next_ms = 60000;
+}
+
+// n senders say hello, then bench_updates heartbeats from random ones. Returns the
+// number of failures.
+static int bench_run(uint32_t n)
+{
+  uint32_t *p_seq = calloc(n, sizeof(*p_seq));
+  uint32_t *p_picks = malloc(bench_updates * sizeof(*p_picks));
+  uint32_t i, now = 0, found = 0;
+  uint64_t start, update_ns, lookup_ns, miss_ns;
+  gp_frame_t frame;
+  int failures = 0;
+
+  device_table_init(0);
+  for (i = 0; i < n; i++) {
+    bench_frame(&frame, BENCH_ID_BASE + i, 0, now);
+    if (device_update(&frame, i, now, NULL) == DEVICE_FULL) {
+      printf("devbench: FAIL %u senders: sender %u turned away\n", n, i);
+      failures++;
+    }
+    p_seq[i] = 1;
+  }
+  // Pick the senders up front so we only time the table
+  for (i = 0; i < bench_updates; i++)
+    p_picks[i] = bench_random() % n;
+
+  start = bench_ns();
+  for (i = 0; i < bench_updates; i++) {
+    bench_frame(&frame, BENCH_ID_BASE + p_picks[i], p_seq[p_picks[i]]++, now);
+    device_update(&frame, p_picks[i], now, NULL);
+    if ((i & 127) == 0)
+      now++;
+  }
+  update_ns = bench_ns() - start;
+
+  start = bench_ns();
+  for (i = 0; i < bench_updates; i++)
+    found += device_lookup(BENCH_ID_BASE + p_picks[i]) != NULL;
+  lookup_ns = bench_ns() - start;
+
+  start = bench_ns();
+  for (i = 0; i < bench_updates; i++)
+    found += device_lookup(BENCH_ID_BASE + n + p_picks[i]) != NULL;
+  miss_ns = bench_ns() - start;
+
+  printf("%7u  %9.1f  %13.0f  %9.1f  %9.1f\n", n, (double)update_ns / bench_updates,
+         bench_updates * 1e9 / update_ns, (double)lookup_ns / bench_updates, (double)miss_ns / bench_updates);
+  if (bench_updates * 1e9 / update_ns < BENCH_MIN_RATE) {
+    printf("devbench: FAIL %u senders: fewer than %u updates a second\n", n, BENCH_MIN_RATE);
+    failures++;
+  }
+  if (found != bench_updates) {
+    printf("devbench: FAIL %u senders: %u lookups found, expected %u\n", n, found, bench_updates);
+    failures++;
+  }
+  if (device_count() != n) {
+    printf("devbench: FAIL %u senders: the table holds %u\n", n, device_count());
+    failures++;
+  }
+
+  free(p_picks);
+  free(p_seq);
+  return failures;
+}
+
+// Fill the table until it says no. Returns the number of failures.
+static int bench_fill(void)
+{
+  uint32_t i, max = DEVICE_TABLE_SIZE / 4 * 3;
+  gp_frame_t frame;
+  int failures = 0;
+
+  device_table_init(0);
+  for (i = 0; i < DEVICE_TABLE_SIZE; i++) {
+    bench_frame(&frame, BENCH_ID_BASE + i, 0, 0);
+    if (device_update(&frame, i, 0, NULL) == DEVICE_FULL)
+      break;
+  }
+  if (verbose)
+    printf("table of %u took %u senders\n", DEVICE_TABLE_SIZE, i);
+  if (i != max) {
+    printf("devbench: FAIL the table took %u senders, expected %u\n", i, max);
+    failures++;
+  }
+  bench_frame(&frame, BENCH_ID_BASE, 1, 1);
+  if (device_update(&frame, 0, 1, NULL) == DEVICE_FULL) {
+    printf("devbench: FAIL a full table turned away a sender it has\n");
+    failures++;
+  }
+  if (device_lookup(BENCH_ID_BASE + max) != NULL) {
+    printf("devbench: FAIL a sender the table turned away can be looked up\n");
+    failures++;
+  }
+  return failures;
+}
+
+// One change frame from BENCH_ID_BASE, seq and pins as given
+static int bench_change(uint32_t seq, uint8_t flags, uint16_t pins)
+{
+  gp_frame_t frame;
+
+  bench_frame(&frame, BENCH_ID_BASE, seq, 0);
+  frame.flags = GP_FLAG_CHANGE | flags;
+  frame.event[0].pins = pins;
+  return device_update(&frame, 0, 0, NULL);
+}
+
+// A sender that reboots: back to 0, a copy of that boot frame, then forward to 500
+// (a low power sender whose RTC memory survived but whose first frame was lost). Then
+// one that reboots after two changes, below seq 32: from 0 again its BOOT frame is a
+// dup, from a random number (what senders do) it is taken. Returns the number of
+// failures.
+static int bench_boot(void)
+{
+  device_t *p_dev;
+  int result, failures = 0;
+
+  device_table_init(0);
+  bench_change(100, GP_FLAG_BOOT, 0);
+  bench_change(101, 0, 4);
+  bench_change(0, GP_FLAG_BOOT, 0);
+  result = bench_change(0, GP_FLAG_BOOT, 0);
+  p_dev = device_lookup(BENCH_ID_BASE);
+  if (p_dev->boots != 1 || p_dev->dups != 1 || (result & (1 << DEVICE_FRESH_SHIFT))) {
+    printf("devbench: FAIL reboot to seq 0: %u boots, %u dups\n", p_dev->boots, p_dev->dups);
+    failures++;
+  }
+  bench_change(1, 0, 4);
+  result = bench_change(500, GP_FLAG_BOOT, 0);
+  if (p_dev->boots != 2 || p_dev->lost != 0 || p_dev->last_seq != 500 || !(result & (1 << DEVICE_FRESH_SHIFT))) {
+    printf("devbench: FAIL reboot to seq 500: %u boots, %u lost, last seq %u\n", p_dev->boots, p_dev->lost,
+           p_dev->last_seq);
+    failures++;
+  }
+
+  device_table_init(0);
+  bench_change(0, GP_FLAG_BOOT, 0);
+  bench_change(1, 0, 4);
+  bench_change(2, 0, 0);
+  result = bench_change(0, GP_FLAG_BOOT, 4);
+  p_dev = device_lookup(BENCH_ID_BASE);
+  if (p_dev->boots != 0 || p_dev->pins != 0 || (result & (1 << DEVICE_FRESH_SHIFT))) {
+    printf("devbench: FAIL reboot below seq 32 to 0: %u boots, pins %04x\n", p_dev->boots, p_dev->pins);
+    failures++;
+  }
+  result = bench_change(0x9e3779b9, GP_FLAG_BOOT, 4);
+  if (p_dev->boots != 1 || p_dev->pins != 4 || !(result & (1 << DEVICE_FRESH_SHIFT))) {
+    printf("devbench: FAIL reboot below seq 32 to a random seq: %u boots, pins %04x\n", p_dev->boots,
+           p_dev->pins);
+    failures++;
+  }
+  result = bench_change(0x9e3779ba, 0, 0);
+  if (p_dev->pins != 0 || !(result & (1 << DEVICE_FRESH_SHIFT))) {
+    printf("devbench: FAIL the change after a reboot to a random seq: pins %04x\n", p_dev->pins);
+    failures++;
+  }
+  return failures;
+}
+
+// Two doors on one sender: A opens, B opens, A closes, B stays open past the alert.
+// Then a sender whose first frame is a heartbeat with a door open, as after a receiver
+// restart: the door is open and alerted on. Returns the number of failures.
+static int bench_doors(void)
+{
+  uint16_t a = device_door_pin(0), b = device_door_pin(DEVICE_DOORS - 1);
+  gp_frame_t frame;
+  device_t *p_dev;
+  int alert, door = -1, alerts = 0, failures = 0;
+  uint32_t now;
+
+  if (DEVICE_DOORS < 2) {
+    printf("devbench: FAIL built with %d door(s) per sender, the door check needs 2\n", DEVICE_DOORS);
+    return 1;
+  }
+  device_table_init(0);
+  bench_frame(&frame, BENCH_ID_BASE, 0, 0);
+  frame.flags = GP_FLAG_CHANGE;
+  device_update(&frame, 0, 1000, &p_dev);
+  frame.seq++;
+  frame.event[0].pins = a;
+  device_update(&frame, 0, 2000, NULL);
+  frame.seq++;
+  frame.event[0].pins = a | b;
+  device_update(&frame, 0, 5000, NULL);
+  frame.seq++;
+  frame.event[0].pins = b;
+  device_update(&frame, 0, 12000, NULL);
+
+  if (p_dev->open != b || p_dev->door[0].doorstats.opens != 1 || p_dev->door[0].doorstats.last_ms != 10000 ||
+      p_dev->door[1].doorstats.opens != 1 || p_dev->door[1].open_since != 5000) {
+    printf("devbench: FAIL doors: open %04x, door A %u opens last %u ms, door B %u opens since %u\n", p_dev->open,
+           p_dev->door[0].doorstats.opens, p_dev->door[0].doorstats.last_ms, p_dev->door[1].doorstats.opens,
+           p_dev->door[1].open_since);
+    failures++;
+  }
+
+  // Only B was left open, so only B's alert fires
+  for (now = 12000; now <= 5000 + DOOR_OPEN_ALERT_MS + 1000; now += TW_TICK_MS) {
+    while (device_expired(now, &alert, &door) != NULL) {
+      if (alert == DEVICE_OPEN_TOO_LONG)
+        alerts++;
+      if (alert != DEVICE_OPEN_TOO_LONG || door != 1 || now < 5000 + DOOR_OPEN_ALERT_MS) {
+        printf("devbench: FAIL doors: alert %d for door %d at %u ms\n", alert, door, now);
+        failures++;
+      }
+    }
+  }
+  if (alerts != 1 || p_dev->door[1].open_alerts != 1 || p_dev->door[0].open_alerts != 0) {
+    printf("devbench: FAIL doors: %d alerts, door A %u, door B %u\n", alerts, p_dev->door[0].open_alerts,
+           p_dev->door[1].open_alerts);
+    failures++;
+  }
+
+  device_table_init(0);
+  bench_frame(&frame, BENCH_ID_BASE, 0, 0);
+  frame.event[0].pins = a;
+  device_update(&frame, 0, 1000, &p_dev);
+  for (alerts = 0, now = 1000; now <= 1000 + DOOR_OPEN_ALERT_MS + 1000; now += TW_TICK_MS) {
+    while (device_expired(now, &alert, &door) != NULL)
+      alerts += alert == DEVICE_OPEN_TOO_LONG;
+  }
+  if (p_dev->open != a || alerts != 1 || p_dev->door[0].open_alerts != 1) {
+    printf("devbench: FAIL heartbeat first: open %04x, %d alerts\n", p_dev->open, alerts);
+    failures++;
+  }
+  return failures;
+}
+
+// A batch that waited on the sender: door A opened and closed and door B opened, all
+// well before the batch arrived. Then a frame whose offset puts B closing before it
+// opened. Returns the number of failures.
+static int bench_batch(void)
+{
+  uint16_t a = device_door_pin(0), b = device_door_pin(DEVICE_DOORS - 1);
+  gp_frame_t frame;
+  device_t *p_dev;
+  int failures = 0;
+
+  device_table_init(0);
+  bench_frame(&frame, BENCH_ID_BASE, 0, 0);
+  frame.flags = GP_FLAG_CHANGE;
+  device_update(&frame, 0, 1000, &p_dev);
+
+  // Sender clock 100000 is receiver clock 10000
+  frame.type = GP_TYPE_BATCH;
+  frame.flags = GP_FLAG_CHANGE | GP_FLAG_TRACE;
+  frame.seq = 1;
+  frame.count = 3;
+  frame.event[0].pins = a;
+  frame.event[0].timestamp = 100000;
+  frame.event[1].pins = 0;
+  frame.event[1].timestamp = 103000;
+  frame.event[2].pins = b;
+  frame.event[2].timestamp = 104000;
+  frame.offset = -90000;
+  frame.rx_time = 20000;
+  device_update(&frame, 0, 20000, NULL);
+  if (p_dev->open != b || p_dev->door[0].doorstats.opens != 1 || p_dev->door[0].doorstats.last_ms != 3000 ||
+      p_dev->door[1].open_since != 14000) {
+    printf("devbench: FAIL batch: open %04x, door A %u opens last %u ms, door B open since %u\n", p_dev->open,
+           p_dev->door[0].doorstats.opens, p_dev->door[0].doorstats.last_ms, p_dev->door[1].open_since);
+    failures++;
+  }
+
+  frame.type = GP_TYPE_REPORT;
+  frame.seq = 4;
+  frame.count = 1;
+  frame.event[0].pins = 0;
+  frame.event[0].timestamp = 100000;
+  frame.offset = -95000;
+  frame.rx_time = 21000;
+  device_update(&frame, 0, 21000, NULL);
+  if (p_dev->open != 0 || p_dev->door[1].doorstats.last_ms != 0) {
+    printf("devbench: FAIL batch: a door closed before it opened, open %04x, door B last %u ms\n", p_dev->open,
+           p_dev->door[1].doorstats.last_ms);
+    failures++;
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[])
+{
+  const uint32_t senders[] = { 1000, 4000, DEVICE_TABLE_SIZE / 4 * 3 };
+  uint32_t i;
+  int opt, failures = 0;
+
+  while ((opt = getopt(argc, argv, "u:v")) != -1) {
+    switch (opt) {
+      case 'u': bench_updates = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-u updates] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (bench_updates == 0) {
+    fprintf(stderr, "devbench: -u must be more than 0\n");
+    return 1;
+  }
+
+  printf("devbench: table of %u slots, %u updates per run\n", DEVICE_TABLE_SIZE, bench_updates);
+  printf("senders  update ns      updates/s  lookup ns   miss ns\n");
+  for (i = 0; i < sizeof(senders) / sizeof(senders[0]); i++)
+    if (senders[i] <= DEVICE_TABLE_SIZE / 4 * 3)
+      failures += bench_run(senders[i]);
+  failures += bench_fill();
+  failures += bench_boot();
+  failures += bench_doors();
+  failures += bench_batch();
+
+  printf("devbench: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,362 @@
+// discsim.c
+// Host-side test of receiver discovery and failover (see discovery.h). One simulated
+// sender runs the same common/ code as the ESP8266 (discovery, event queue, reliable
+// delivery) against several simulated receivers on the loopback interface, each with
+// its own address (127.0.0.2, 127.0.0.3, ...) and a schedule of joining and leaving.
+//
+//   ./discsim [-n receivers] [-t seconds] [-c change ms] [-v]
+//
+// There is no broadcast on loopback, so the sender's DISCOVER goes to every address in
+// turn; only receivers that are currently up answer. Two ways of leaving are tested:
+// a receiver that leaves cleanly (the soft-AP would tell the sender: disc_forget) and
+// one that silently stops answering (reliable delivery gives up: disc_failed).
+//
+// Prints boot -> first delivered report against DISC_TARGET_MS, every failover and
+// how long the sender went without a delivery, and exits non-zero if the target was
+// missed or any event that went into the queue never reached a receiver.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "discovery.h"
+#include "evqueue.h"
+#include "reliable.h"
+
+#define SIM_MAX_RECEIVERS 8
+#define SIM_DEVICE_ID 0x8266
+#define SIM_COALESCE_MS 50
+#define SIM_DRAIN_MS 10000
+#define SIM_JOIN_ROUNDS 5
+
+#define SIM_JOIN 0x01
+#define SIM_DIE 0x02
+#define SIM_LEAVE 0x04
+#define SIM_REJOIN 0x08
+
+// What happens to a receiver, and when (ms after boot). 0 == never.
+typedef struct {
+  uint32_t join_ms;       // associates and starts answering
+  uint32_t die_ms;        // silently stops answering (no leave event)
+  uint32_t leave_ms;      // leaves the soft-AP (sender gets a leave event)
+  uint32_t rejoin_ms;     // comes back
+} sim_plan_t;
+
+typedef struct {
+  int sock;
+  uint32_t id;
+  uint8_t ip[4];
+  uint8_t up;
+  uint8_t done;           // SIM_* steps of the plan already taken
+  uint32_t frames;
+  sim_plan_t plan;
+} sim_receiver_t;
+
+static sim_receiver_t rx[SIM_MAX_RECEIVERS];
+static uint32_t receivers = 3;
+static int verbose;
+
+// Sequence numbers that reached some receiver
+static uint8_t *p_seen;
+static uint32_t seen_size;
+
+static uint64_t boot_us;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Milliseconds since the simulated sender booted
+static uint32_t now_ms(void)
+{
+  return (uint32_t)((now_us() - boot_us) / 1000);
+}
+
+// Default schedule: receivers join a little apart (DHCP), the first one dies without a
+// word, the second leaves cleanly and the first comes back later.
+static void sim_plan(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < receivers; i++) {
+    memset(&rx[i].plan, 0, sizeof(rx[i].plan));
+    rx[i].plan.join_ms = 200 + 400 * i;
+  }
+  rx[0].plan.die_ms = 2000;
+  rx[0].plan.rejoin_ms = 11000;
+  if (receivers > 1)
+    rx[1].plan.leave_ms = 10000;
+}
+
+static int sim_open(sim_receiver_t *p_rx, uint32_t i)
+{
+  struct sockaddr_in addr;
+
+  p_rx->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (p_rx->sock < 0)
+    return -1;
+  p_rx->ip[0] = 127;
+  p_rx->ip[1] = 0;
+  p_rx->ip[2] = 0;
+  p_rx->ip[3] = 2 + i;
+  p_rx->id = 0x1000 + i;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(GP_PORT);
+  memcpy(&addr.sin_addr, p_rx->ip, 4);
+  return bind(p_rx->sock, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+// One receiver: answer DISCOVER with ANNOUNCE and ACK reports, while it is up.
+static void sim_receive(sim_receiver_t *p_rx)
+{
+  uint8_t buffer[GP_MAX_FRAME];
+  struct sockaddr_in source;
+  socklen_t socklen;
+  gp_frame_t frame, reply;
+  uint32_t i;
+  int len;
+
+  while (1) {
+    socklen = sizeof(source);
+    len = recvfrom(p_rx->sock, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&source, &socklen);
+    if (len < 0)
+      return;
+    if (!p_rx->up || gp_decode(buffer, len, &frame) != 0)
+      continue;
+
+    if (frame.type == GP_TYPE_DISCOVER) {
+      reply.type = GP_TYPE_ANNOUNCE;
+      reply.flags = 0;
+      reply.device_id = p_rx->id;
+      len = gp_encode(&reply, buffer, sizeof(buffer));
+      sendto(p_rx->sock, buffer, len, 0, (struct sockaddr *)&source, socklen);
+      continue;
+    }
+
+    if (frame.type != GP_TYPE_REPORT && frame.type != GP_TYPE_BATCH)
+      continue;
+    p_rx->frames++;
+    for (i = 0; i < frame.count; i++) {
+      if (frame.seq + i < seen_size)
+        p_seen[frame.seq + i] = 1;
+    }
+    if (frame.flags & GP_FLAG_ACK_REQ) {
+      len = gp_encode_ack(&frame, buffer, sizeof(buffer));
+      sendto(p_rx->sock, buffer, len, 0, (struct sockaddr *)&source, socklen);
+    }
+  }
+}
+
+// Is it time for this step of the plan? Each step happens once.
+static int sim_due(sim_receiver_t *p_rx, uint32_t at_ms, uint8_t step, uint32_t now)
+{
+  if (at_ms == 0 || now < at_ms || (p_rx->done & step))
+    return 0;
+  p_rx->done |= step;
+  return 1;
+}
+
+// Walk the schedule. Returns the id of a receiver that left cleanly this tick, 1 if one
+// joined (the soft-AP would tell the sender about both) or 0.
+static uint32_t sim_schedule(sim_receiver_t *p_rx, uint32_t now)
+{
+  const sim_plan_t *p = &p_rx->plan;
+
+  if (sim_due(p_rx, p->join_ms, SIM_JOIN, now) || sim_due(p_rx, p->rejoin_ms, SIM_REJOIN, now)) {
+    p_rx->up = 1;
+    printf("%6u ms: receiver %04x joins\n", now, p_rx->id);
+    return 1;
+  } else if (sim_due(p_rx, p->die_ms, SIM_DIE, now)) {
+    p_rx->up = 0;
+    printf("%6u ms: receiver %04x stops answering\n", now, p_rx->id);
+  } else if (sim_due(p_rx, p->leave_ms, SIM_LEAVE, now)) {
+    p_rx->up = 0;
+    printf("%6u ms: receiver %04x leaves\n", now, p_rx->id);
+    return p_rx->id;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t seconds = 14, change_ms = 250, rounds = 0;
+  uint32_t now, last_change = 0, next_probe = 0, last_ack = 0, worst_gap = 0, i, missing = 0;
+  uint8_t buffer[GP_MAX_FRAME], frame_buf[GP_MAX_FRAME];
+  int sock, opt, len, frame_len = 0, result;
+  struct sockaddr_in dest, source;
+  socklen_t socklen;
+  gp_frame_t frame;
+  const disc_entry_t *p_cur;
+  uint16_t pins = 0;
+  disc_t disc;
+  evq_t queue;
+  rel_t rel;
+
+  while ((opt = getopt(argc, argv, "n:t:c:v")) != -1) {
+    switch (opt) {
+      case 'n': receivers = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'c': change_ms = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-n receivers] [-t seconds] [-c change ms] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (receivers == 0 || receivers > SIM_MAX_RECEIVERS || change_ms == 0) {
+    fprintf(stderr, "need 1 .. %d receivers and a non-zero change interval\n", SIM_MAX_RECEIVERS);
+    return 1;
+  }
+
+  sim_plan();
+  for (i = 0; i < receivers; i++) {
+    if (sim_open(&rx[i], i) < 0) {
+      perror("receiver socket");
+      return 1;
+    }
+  }
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  seen_size = seconds * 1000 / change_ms + 1;
+  p_seen = calloc(seen_size, 1);
+  if (p_seen == NULL) {
+    perror("calloc");
+    return 1;
+  }
+
+  boot_us = now_us();
+  disc_init(&disc, 0);
+  evq_init(&queue, SIM_COALESCE_MS);
+  rel_init(&rel);
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(GP_PORT);
+
+  while ((now = now_ms()) < seconds * 1000 + SIM_DRAIN_MS) {
+
+    // The world
+    for (i = 0; i < receivers; i++) {
+      result = sim_schedule(&rx[i], now);
+      if (result == 1) {
+        // Our wifi_event_callback: probe a few rounds even if we know a receiver
+        rounds = SIM_JOIN_ROUNDS;
+        disc_probe_reset(&disc);
+        next_probe = now;
+      } else if (result && disc_forget(&disc, result) < 0) {
+        disc_probe_reset(&disc);
+      }
+      sim_receive(&rx[i]);
+    }
+
+    // The door. Random pins so coalescing doesn't eat everything.
+    if (now < seconds * 1000 && now - last_change >= change_ms) {
+      last_change = now;
+      pins = (pins + 1 + rand() % 3) & 3;
+      evq_push(&queue, pins, now);
+    }
+    if (now >= seconds * 1000 && queue.count == 0 && !rel.inflight)
+      break;
+
+    // Look for receivers (the sender's discover_function)
+    if ((disc_current(&disc) == NULL || rounds) && (int32_t)(now - next_probe) >= 0) {
+      if (rounds)
+        rounds--;
+      frame.type = GP_TYPE_DISCOVER;
+      frame.flags = 0;
+      frame.device_id = SIM_DEVICE_ID;
+      len = gp_encode(&frame, buffer, sizeof(buffer));
+      for (i = 0; i < receivers; i++) {
+        memcpy(&dest.sin_addr, rx[i].ip, 4);
+        sendto(sock, buffer, len, 0, (struct sockaddr *)&dest, sizeof(dest));
+      }
+      next_probe = now + disc_probe(&disc);
+    }
+
+    // Our receive_callback
+    while (1) {
+      socklen = sizeof(source);
+      len = recvfrom(sock, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&source, &socklen);
+      if (len < 0)
+        break;
+      if (gp_decode(buffer, len, &frame) != 0)
+        continue;
+      if (frame.type == GP_TYPE_ANNOUNCE) {
+        if (verbose)
+          printf("%6u ms: announce from %04x\n", now, frame.device_id);
+        disc_heard(&disc, frame.device_id, (uint8_t *)&source.sin_addr, now);
+      } else if (frame.type == GP_TYPE_ACK && frame.device_id == SIM_DEVICE_ID) {
+        evq_ack(&queue, frame.seq);
+        if (rel_ack(&rel, frame.seq, now)) {
+          if (disc.first_ms == 0)
+            printf("%6u ms: first report delivered (target %d ms)\n", now, DISC_TARGET_MS);
+          disc_delivered(&disc, now);
+          if (last_ack && now - last_ack > worst_gap)
+            worst_gap = now - last_ack;
+          last_ack = now;
+        }
+      }
+    }
+
+    // Our retransmit_function
+    result = rel_expired(&rel, now);
+    if (result == -1) {
+      p_cur = disc_current(&disc);
+      printf("%6u ms: gave up on receiver %04x\n", now, p_cur ? p_cur->id : 0);
+      if (!disc_failed(&disc))
+        disc_probe_reset(&disc);
+    }
+
+    // Our report_flush, always to whoever is current right now
+    p_cur = disc_current(&disc);
+    if (p_cur != NULL) {
+      memcpy(&dest.sin_addr, p_cur->ip, 4);
+      if (result == 1) {
+        sendto(sock, frame_buf, frame_len, 0, (struct sockaddr *)&dest, sizeof(dest));
+      } else if (!rel.inflight && queue.count) {
+        evq_take(&queue, &frame);
+        frame.flags = GP_FLAG_CHANGE | GP_FLAG_ACK_REQ;
+        frame.device_id = SIM_DEVICE_ID;
+        frame_len = gp_encode(&frame, frame_buf, sizeof(frame_buf));
+        sendto(sock, frame_buf, frame_len, 0, (struct sockaddr *)&dest, sizeof(dest));
+        rel_sent(&rel, frame.seq + frame.count - 1, now);
+      }
+    }
+
+    usleep(1000);
+  }
+
+  for (i = 0; i < queue.next_seq && i < seen_size; i++)
+    missing += !p_seen[i];
+
+  printf("discsim: %u receivers, first delivery %u ms (target %d), %u failovers, %u announces, "
+         "worst gap %u ms\n", receivers, disc.first_ms, DISC_TARGET_MS, disc.failovers,
+         disc.announces, worst_gap);
+  printf("discsim: %u events queued, %u coalesced, %u overflowed, %u delivered, %u still queued, "
+         "%u never reached a receiver\n", queue.queued, queue.coalesced, queue.overflow,
+         queue.delivered, queue.count, missing);
+  for (i = 0; i < receivers; i++)
+    printf("discsim: receiver %04x got %u frames\n", rx[i].id, rx[i].frames);
+
+  if (disc.first_ms == 0 || disc.first_ms > DISC_TARGET_MS || missing || queue.count) {
+    printf("discsim: FAIL\n");
+    return 1;
+  }
+  printf("discsim: PASS\n");
+  return 0;
+}
@@ -0,0 +1,141 @@
+// dlogsim.c
+// Host-side check of the receiver's deferred log ring (dlog.c, the real code) with
+// several producers at once, the way the receiver has them: the receive task, the lwIP
+// tcpip thread (rawrx.c) and pipeline_task all log while dlog_task reads.
+//
+//   ./dlogsim [-p producers] [-n records each]
+//
+// Each producer thread writes -n records (default 1,000,000) numbered 0, 1, 2, ... as
+// fast as it can; one consumer thread reads them back with dlog_read. A full ring
+// drops records, so the consumer sometimes holds back to make that happen as well.
+// Checks, exit non-zero on failure: every record read was written and is read once,
+// each producer's records come out in the order it wrote them and intact, and written +
+// dropped adds up to what the producers tried to log and everything written is read.
+// Run once with 1 producer (the old single producer case) and then with -p (default 4).
+// The producers only really race each other on a host with more than one core.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "dlog.h"
+
+#define SIM_PRODUCERS_MAX 16
+
+// dlog.c wants these from the rest of the receiver
+const char *TAG = "dlogsim";
+void rxhealth_watch(const char *p_name)
+{
+}
+
+static uint32_t sim_records = 1000000;
+static uint32_t sim_finished;     // producers that are done
+
+static void *sim_producer(void *arg)
+{
+  uint32_t id = (uint32_t)(uintptr_t)arg, i;
+
+  for (i = 0; i < sim_records; i++) {
+    DLOG(DLOG_INFO, DLOG_EVENT, id, i, ~i, id ^ i);
+    // Give the others (and the reader, on a single core host) a go now and then
+    if ((i & 63) == 63)
+      sched_yield();
+  }
+  __atomic_fetch_add(&sim_finished, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// Returns the number of failures
+static int sim_run(uint32_t producers)
+{
+  pthread_t threads[SIM_PRODUCERS_MAX];
+  uint32_t next[SIM_PRODUCERS_MAX], i, read = 0, skipped = 0, stalls = 0;
+  uint64_t tried = (uint64_t)producers * sim_records;
+  int failures = 0, finished = 0;
+  dlog_rec_t rec;
+
+  sim_finished = 0;
+  dlog_init(DLOG_INFO);
+  memset(next, 0, sizeof(next));
+  for (i = 0; i < producers; i++)
+    pthread_create(&threads[i], NULL, sim_producer, (void *)(uintptr_t)i);
+
+  while (1) {
+    if (!dlog_read(&rec)) {
+      if (finished)
+        break;
+      // Once every producer is done, one last pass picks up what is left
+      finished = __atomic_load_n(&sim_finished, __ATOMIC_ACQUIRE) == producers;
+      sched_yield();
+      continue;
+    }
+    read++;
+    // Let the ring fill up now and then
+    if ((read & 0xffff) == 0) {
+      stalls++;
+      usleep(200);
+    }
+    if (rec.a >= producers || rec.type != DLOG_EVENT || rec.c != ~rec.b || rec.d != (rec.a ^ rec.b)) {
+      if (failures++ < 5)
+        printf("dlogsim: FAIL %u producers: bad record %u %u %u %u\n", producers, rec.a, rec.b, rec.c, rec.d);
+      continue;
+    }
+    if (rec.b < next[rec.a]) {
+      if (failures++ < 5)
+        printf("dlogsim: FAIL %u producers: producer %u record %u after %u\n", producers, rec.a, rec.b,
+               next[rec.a] - 1);
+      continue;
+    }
+    skipped += rec.b - next[rec.a];
+    next[rec.a] = rec.b + 1;
+  }
+  for (i = 0; i < producers; i++) {
+    pthread_join(threads[i], NULL);
+    skipped += sim_records - next[i];
+  }
+
+  printf("%9u  %10llu  %10u  %10u  %10u  %6u\n", producers, (unsigned long long)tried, dlog_stats.written,
+         dlog_stats.dropped, read, stalls);
+  if ((uint64_t)dlog_stats.written + dlog_stats.dropped != tried) {
+    printf("dlogsim: FAIL %u producers: %u written + %u dropped, %llu logged\n", producers, dlog_stats.written,
+           dlog_stats.dropped, (unsigned long long)tried);
+    failures++;
+  }
+  if (read != dlog_stats.written || skipped != dlog_stats.dropped) {
+    printf("dlogsim: FAIL %u producers: read %u of %u written, %u missing of %u dropped\n", producers, read,
+           dlog_stats.written, skipped, dlog_stats.dropped);
+    failures++;
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t producers = 4;
+  int opt, failures = 0;
+
+  while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+    switch (opt) {
+      case 'p': producers = atoi(optarg); break;
+      case 'n': sim_records = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-p producers] [-n records each]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (producers == 0 || producers > SIM_PRODUCERS_MAX || sim_records == 0) {
+    fprintf(stderr, "dlogsim: 1 to %u producers and at least one record each\n", SIM_PRODUCERS_MAX);
+    return 1;
+  }
+
+  printf("dlogsim: ring of %u records\n", DLOG_RING_SIZE);
+  printf("producers      logged     written     dropped        read  stalls\n");
+  failures += sim_run(1);
+  failures += sim_run(producers);
+
+  printf("dlogsim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,340 @@
+// doorbench.c
+// Host-side benchmark of the receiver's per-door analytics (doorstats.c) behind
+// device_update (devices.c, the real code). No sockets; we call them directly on a
+// simulated clock, a second at a time.
+//
+//   ./doorbench [-d simulated days] [-v]
+//
+// For 100, 1,000 and 10,000 doors, each with an open time of its own (10 s to 2
+// minutes, give or take half) and a closed time of 10 minutes to 3 hours (a tenth of
+// them 1 to 10 minutes, the busy ones):
+//   update   device_update for an open or close frame, the analytics included
+//   stats    the same opens and closes replayed straight into doorstats_open and
+//            doorstats_close, to show what the analytics alone cost per event
+//
+// A fifth of the doors are left open ten times as long as usual once, after the first
+// day. Checks, exit non-zero on failure: every one of those is flagged unusual when the
+// door closes; at most one ordinary opening in a thousand is; every 97th door's last
+// DOORSTATS_HOURS hours (doorstats_day, as the status page sees them) match a brute
+// force count over its whole history, once a simulated hour, the opening going on
+// included; each door's baseline ends up within a third of its real average open
+// time; and the per event costs at 10,000 doors stay within 10 times those at 100
+// (they should be about the same; the slack is for cache misses and a noisy host).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "garage_proto.h"
+#include "devices.h"
+#include "doorstats.h"
+
+#define BENCH_SAMPLE 97           // every this many doors is checked against its history
+#define BENCH_LONG 10             // the unusual opening, times the door's average
+
+static const uint32_t bench_doors[] = { 100, 1000, 10000 };
+
+typedef struct {
+  uint32_t start, end;            // end == 0: still open
+} bench_opening_t;
+
+typedef struct {
+  uint32_t mean_ms;               // how long it usually stays open
+  uint32_t gap_ms;                // ... and closed, at most
+  uint32_t next;                  // next door due in the same second, or 0
+  uint32_t seq;
+  uint32_t opened_ms;
+  uint32_t long_after;            // the first opening after this is the long one, 0 == none
+  uint32_t open_total_ms;         // its ordinary openings really were, for the baseline check
+  uint32_t ordinary;
+  uint8_t open;
+  uint8_t long_now;               // this opening is the long one
+  uint8_t caught;
+  bench_opening_t *p_history;     // sampled doors only
+  uint32_t history, history_max;
+} bench_door_t;
+
+// One open or close, kept to replay into doorstats alone
+typedef struct {
+  uint32_t door;
+  uint32_t time_ms;
+  uint32_t open_since;            // 0 for an open
+} bench_event_t;
+
+typedef struct {
+  double update_ns;
+  double stats_ns;
+  uint32_t events;
+  uint32_t injected;
+  uint32_t caught;
+  uint32_t false_alarms;
+  uint32_t compared;
+  uint32_t failures;
+} bench_result_t;
+
+static int verbose;
+static uint32_t bench_days = 3;
+static uint32_t bench_rand = 2463534242u;
+
+static uint32_t bench_random(void)
+{
+  bench_rand ^= bench_rand << 13;
+  bench_rand ^= bench_rand >> 17;
+  bench_rand ^= bench_rand << 5;
+  return bench_rand;
+}
+
+static uint64_t bench_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Put door i on the list for the second its next move falls in
+static void bench_schedule(uint32_t *p_due, bench_door_t *p_doors, uint32_t i, uint32_t at_ms, uint32_t end_s)
+{
+  uint32_t s = at_ms / 1000;
+
+  if (s >= end_s)
+    return;
+  p_doors[i].next = p_due[s];
+  p_due[s] = i + 1;
+}
+
+// The last DOORSTATS_HOURS hours of door i the slow way, from everything it ever did.
+// The window starts DOORSTATS_HOURS - 1 hours before the hour now_ms is in, the hours
+// counted from first_ms like the door's buckets.
+static int bench_compare(const bench_door_t *p, uint32_t i, const device_t *p_dev, uint32_t first_ms,
+                         uint32_t now_ms)
+{
+  uint32_t from = first_ms + (now_ms - first_ms) / DOORSTATS_HOUR_MS * DOORSTATS_HOUR_MS;
+  uint32_t cycles = 0, open_ms = 0, h, start, end;
+  doorstats_day_t day;
+
+  from = from > (DOORSTATS_HOURS - 1) * DOORSTATS_HOUR_MS ? from - (DOORSTATS_HOURS - 1) * DOORSTATS_HOUR_MS : 0;
+  for (h = 0; h < p->history; h++) {
+    if (p->p_history[h].start >= from)
+      cycles++;
+    start = p->p_history[h].start > from ? p->p_history[h].start : from;
+    end = p->p_history[h].end ? p->p_history[h].end : now_ms;
+    if (end > start)
+      open_ms += end - start;
+  }
+
+  doorstats_day(&p_dev->door[0].doorstats, (p_dev->open & device_door_pin(0)) != 0, p_dev->door[0].open_since,
+                now_ms, &day);
+  if (day.cycles != cycles || day.open_ms != open_ms) {
+    printf("doorbench: FAIL door %u at %u ms: %u openings, %u ms open, should be %u and %u\n", i + 1, now_ms,
+           day.cycles, day.open_ms, cycles, open_ms);
+    return 1;
+  }
+  return 0;
+}
+
+static void bench_run(uint32_t n, bench_result_t *p_result)
+{
+  uint32_t end_s = bench_days * 86400, i, next, s, now, first_ms = 500, events = 0, max_events = 1 << 16;
+  uint32_t *p_due = calloc(end_s, sizeof(*p_due));
+  bench_door_t *p_doors = calloc(n, sizeof(*p_doors));
+  bench_event_t *p_events;
+  bench_door_t *p;
+  doorstats_t *p_stats;
+  device_t *p_dev;
+  gp_frame_t frame;
+  uint64_t t, update_ns = 0;
+  int alert, door, result;
+
+  memset(p_result, 0, sizeof(*p_result));
+  device_table_init(0);
+
+  memset(&frame, 0, sizeof(frame));
+  frame.type = GP_TYPE_REPORT;
+  frame.flags = GP_FLAG_CHANGE;
+  frame.count = 1;
+
+  // Everybody says hello, door shut, at first_ms, then opens some time in the first
+  // closed spell
+  p_events = malloc(max_events * sizeof(*p_events));
+  for (i = 0; i < n; i++) {
+    p = &p_doors[i];
+    p->mean_ms = 10000 + bench_random() % 110001;
+    p->gap_ms = i % 10 == 0 ? 60000 + bench_random() % 540001 : 600000 + bench_random() % 10200001;
+    if (i % 5 == 2)
+      p->long_after = 86400000 + bench_random() % ((bench_days - 1) * 43200000u);
+
+    frame.device_id = i + 1;
+    frame.seq = p->seq++;
+    frame.event[0].pins = 0;
+    device_update(&frame, i + 1, first_ms, NULL);
+    bench_schedule(p_due, p_doors, i, first_ms + 1 + bench_random() % p->gap_ms, end_s);
+  }
+
+  for (s = 0; s < end_s; s++) {
+    for (i = p_due[s]; i; ) {
+      p = &p_doors[i - 1];
+      now = s * 1000 + bench_random() % 1000;
+      frame.device_id = i;
+      frame.seq = p->seq++;
+      frame.event[0].pins = p->open ? 0 : device_door_pin(0);
+      t = bench_ns();
+      result = device_update(&frame, i, now, &p_dev);
+      update_ns += bench_ns() - t;
+
+      if (events == max_events) {
+        max_events *= 2;
+        p_events = realloc(p_events, max_events * sizeof(*p_events));
+      }
+      p_events[events].door = i - 1;
+      p_events[events].time_ms = now;
+      p_events[events].open_since = p->open ? p->opened_ms : 0;
+      events++;
+
+      p->open = !p->open;
+      if (p->open) {
+        p->opened_ms = now;
+        if (i % BENCH_SAMPLE == 1) {
+          if (p->history == p->history_max) {
+            p->history_max = p->history_max ? 2 * p->history_max : 64;
+            p->p_history = realloc(p->p_history, p->history_max * sizeof(*p->p_history));
+          }
+          p->p_history[p->history].start = now;
+          p->p_history[p->history++].end = 0;
+        }
+        p->long_now = p->long_after && now >= p->long_after;
+        if (p->long_now)
+          p->long_after = 0;
+        // Half to one and a half times its usual, or the long one
+        now += p->long_now ? BENCH_LONG * p->mean_ms : p->mean_ms / 2 + bench_random() % (p->mean_ms + 1);
+      } else {
+        if (p->p_history)
+          p->p_history[p->history - 1].end = now;
+        if (p->long_now) {
+          p_result->injected++;
+          p->caught = (result & DEVICE_UNUSUAL) != 0;
+          p_result->caught += p->caught;
+          if (!p->caught)
+            printf("doorbench: FAIL %u doors: door %u open %u ms (usually %u) not flagged, threshold %u ms\n", n,
+                   i, now - p->opened_ms, p->mean_ms, doorstats_threshold(&p_dev->door[0].doorstats));
+        } else {
+          p->open_total_ms += now - p->opened_ms;
+          p->ordinary++;
+          if (result & DEVICE_UNUSUAL) {
+            p_result->false_alarms++;
+            if (verbose)
+              printf("  door %u open %u ms (usually %u) flagged\n", i, now - p->opened_ms, p->mean_ms);
+          }
+        }
+        p->long_now = 0;
+        now += 1000 + bench_random() % p->gap_ms;
+      }
+      next = p->next;
+      bench_schedule(p_due, p_doors, i - 1, now, end_s);
+      i = next;
+    }
+
+    // The open too long alerts are somebody else's business, but the wheel needs turning
+    while (device_expired(s * 1000 + 999, &alert, &door) != NULL)
+      ;
+
+    // Once an hour, off the hour, the sampled doors against their history
+    if (s % 3600 == 1234) {
+      for (i = 0; i < n; i += BENCH_SAMPLE) {
+        p_result->compared++;
+        p_result->failures += bench_compare(&p_doors[i], i, device_lookup(i + 1), first_ms, s * 1000 + 999);
+      }
+    }
+  }
+
+  // Everybody learned what's usual for them
+  for (i = 0; i < n; i++) {
+    p = &p_doors[i];
+    p_dev = device_lookup(i + 1);
+    if (p->ordinary < 4 * DOORSTATS_WARMUP)
+      continue;
+    t = p->open_total_ms / p->ordinary;
+    if (p_dev->door[0].doorstats.ewma_ms < t - t / 3 || p_dev->door[0].doorstats.ewma_ms > t + t / 3) {
+      printf("doorbench: FAIL %u doors: door %u baseline %u ms, it's really %u ms\n", n, i + 1,
+             p_dev->door[0].doorstats.ewma_ms, (uint32_t)t);
+      p_result->failures++;
+    }
+  }
+  if (p_result->caught != p_result->injected)
+    p_result->failures++;
+  if (p_result->false_alarms > events / 1000) {
+    printf("doorbench: FAIL %u doors: %u ordinary openings flagged\n", n, p_result->false_alarms);
+    p_result->failures++;
+  }
+
+  // The same events again, into the analytics alone
+  p_stats = calloc(n, sizeof(*p_stats));
+  for (i = 0; i < n; i++)
+    doorstats_init(&p_stats[i], first_ms);
+  t = bench_ns();
+  for (i = 0; i < events; i++) {
+    if (p_events[i].open_since)
+      doorstats_close(&p_stats[p_events[i].door], p_events[i].open_since, p_events[i].time_ms);
+    else
+      doorstats_open(&p_stats[p_events[i].door], p_events[i].time_ms, 1);
+  }
+  t = bench_ns() - t;
+
+  p_result->events = events;
+  p_result->update_ns = events ? (double)update_ns / events : 0;
+  p_result->stats_ns = events ? (double)t / events : 0;
+  for (i = 0; i < n; i++)
+    free(p_doors[i].p_history);
+  free(p_stats);
+  free(p_events);
+  free(p_doors);
+  free(p_due);
+}
+
+int main(int argc, char *argv[])
+{
+  bench_result_t results[sizeof(bench_doors) / sizeof(bench_doors[0])];
+  bench_result_t *p_first = &results[0], *p_last;
+  uint32_t i, count = sizeof(bench_doors) / sizeof(bench_doors[0]);
+  int opt, failures = 0;
+
+  while ((opt = getopt(argc, argv, "d:v")) != -1) {
+    switch (opt) {
+      case 'd': bench_days = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-d simulated days] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (bench_days < 2 || bench_days > 40) {
+    fprintf(stderr, "2 to 40 simulated days: the long openings come after the first\n");
+    return 1;
+  }
+
+  printf("doorbench: %u simulated days, %u hour buckets, unusual past %u mean deviations, %u bytes a door\n",
+         bench_days, DOORSTATS_HOURS, DOORSTATS_ANOMALY_K, (unsigned)sizeof(doorstats_t));
+  printf("  doors    events  stats ns  update ns  long  caught  false  compared\n");
+  for (i = 0; i < count; i++) {
+    bench_run(bench_doors[i], &results[i]);
+    printf("%7u  %8u  %8.1f  %9.1f  %4u  %6u  %5u  %8u\n", bench_doors[i], results[i].events,
+           results[i].stats_ns, results[i].update_ns, results[i].injected, results[i].caught,
+           results[i].false_alarms, results[i].compared);
+    failures += results[i].failures;
+  }
+
+  p_last = &results[count - 1];
+  if (p_last->stats_ns > 10 * p_first->stats_ns) {
+    printf("doorbench: FAIL analytics cost grew from %.1f to %.1f ns\n", p_first->stats_ns, p_last->stats_ns);
+    failures++;
+  }
+  if (p_last->update_ns > 10 * p_first->update_ns) {
+    printf("doorbench: FAIL update cost grew from %.1f to %.1f ns\n", p_first->update_ns, p_last->update_ns);
+    failures++;
+  }
+
+  printf("doorbench: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
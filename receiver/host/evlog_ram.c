@@ -0,0 +1,65 @@
+// evlog_ram.c
+// Host build: the event log's "flash" is a RAM array that behaves like NOR flash ...
+// erase sets bytes to 0xff and writes can only clear bits. Set EVLOG_RAM_SIZE to try
+// other partition sizes. The lock is a pthread mutex, the host's tasks are threads.
+
+#include <string.h>
+#include <pthread.h>
+#include "evlog.h"
+
+#ifndef EVLOG_RAM_SIZE
+  #define EVLOG_RAM_SIZE (64 * 1024)
+#endif
+
+static uint8_t evlog_ram[EVLOG_RAM_SIZE];
+static int evlog_ram_ready;
+static pthread_mutex_t evlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void evlog_lock(void)
+{
+  pthread_mutex_lock(&evlog_mutex);
+}
+
+void evlog_unlock(void)
+{
+  pthread_mutex_unlock(&evlog_mutex);
+}
+
+int evlog_flash_open(uint32_t *p_size)
+{
+  // A fresh "chip" comes erased
+  if (!evlog_ram_ready) {
+    memset(evlog_ram, 0xff, sizeof(evlog_ram));
+    evlog_ram_ready = 1;
+  }
+  *p_size = sizeof(evlog_ram);
+  return 0;
+}
+
+int evlog_flash_read(uint32_t offset, void *p_buf, uint32_t len)
+{
+  if (offset + len > sizeof(evlog_ram))
+    return -1;
+  memcpy(p_buf, &evlog_ram[offset], len);
+  return 0;
+}
+
+int evlog_flash_write(uint32_t offset, const void *p_buf, uint32_t len)
+{
+  const uint8_t *p_src = p_buf;
+  uint32_t i;
+
+  if (offset + len > sizeof(evlog_ram))
+    return -1;
+  for (i = 0; i < len; i++)
+    evlog_ram[offset + i] &= p_src[i];
+  return 0;
+}
+
+int evlog_flash_erase(uint32_t offset, uint32_t len)
+{
+  if (offset % EVLOG_SECTOR_SIZE || len % EVLOG_SECTOR_SIZE || offset + len > sizeof(evlog_ram))
+    return -1;
+  memset(&evlog_ram[offset], 0xff, len);
+  return 0;
+}
@@ -0,0 +1,209 @@
+// evqsim.c
+// Host-side test of the sender's event queue (see evqueue.h in common/): what goes in,
+// what gets coalesced, and what comes out in frames and is let go of on an ACK. No
+// radio: we play the door and the receiver on a simulated millisecond clock.
+//
+//   ./evqsim [-n steps] [-v]
+//
+// First a few fixed cases, then -n (default 1,000,000) random steps of door changes,
+// frames taken, ACKs (some of them lost, some for less than the frame) and receiver
+// outages long enough to fill the queue.
+//
+// Checks, exit non-zero on failure: a change to the pins already queued is dropped; a
+// change back within coalesce_ms cancels the newest event, but only if the one before
+// it (sent or not) has those pins, so a lone event is never cancelled; once later is
+// kept; events in a frame are never coalesced or dropped; a full queue drops the oldest
+// unsent event; a retransmit is the same frame; sequence numbers come out without gaps;
+// every event pushed is delivered, still queued, coalesced or counted as overflow; and
+// the last event delivered is the door's last state.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evqueue.h"
+
+#define CHECK_NAME "evqsim"
+#define CHECK_PRINT_MAX 10
+#include "check.h"
+
+#define SIM_COALESCE_MS 500
+
+static int verbose;
+static uint32_t sim_steps = 1000000;
+static uint32_t sim_rand = 2463534242u;
+
+static uint32_t sim_random(void)
+{
+  sim_rand ^= sim_rand << 13;
+  sim_rand ^= sim_rand >> 17;
+  sim_rand ^= sim_rand << 5;
+  return sim_rand;
+}
+
+// The pins of queued event i, counting from the oldest
+static uint16_t sim_pins(evq_t *p_q, int i)
+{
+  return p_q->event[(p_q->head + i) % EVQ_SIZE].pins;
+}
+
+static void sim_fixed(void)
+{
+  evq_t q;
+  gp_frame_t frame, again;
+  int i;
+
+  // Same pins twice: the second is dropped
+  evq_init(&q, SIM_COALESCE_MS);
+  evq_push(&q, 1, 0);
+  evq_push(&q, 1, 10);
+  CHECK(q.count == 1 && q.coalesced == 1);
+
+  // A lone event undone is kept: we can't tell what it moved away from
+  evq_push(&q, 0, 20);
+  CHECK(q.count == 2 && sim_pins(&q, 1) == 0);
+
+  // open -> closed -> open inside coalesce_ms: the closed goes, so does the second open
+  evq_push(&q, 1, 30);
+  CHECK(q.count == 1 && sim_pins(&q, 0) == 1 && q.coalesced == 3);
+
+  // ... but not once coalesce_ms has gone by
+  evq_push(&q, 0, 40);
+  evq_push(&q, 1, 40 + SIM_COALESCE_MS);
+  CHECK(q.count == 3);
+
+  // Events in a frame are left alone, and a retransmit is the same frame
+  evq_init(&q, SIM_COALESCE_MS);
+  evq_push(&q, 1, 0);
+  evq_push(&q, 0, 1000);
+  CHECK(evq_take(&q, &frame) == 2 && frame.type == GP_TYPE_BATCH && frame.seq == 0 && frame.count == 2);
+  evq_push(&q, 0, 1010);
+  CHECK(q.count == 3 && sim_pins(&q, 2) == 0);
+
+  // The sent event before the newest counts for a cancel; only the unsent one goes
+  evq_init(&q, SIM_COALESCE_MS);
+  evq_push(&q, 1, 0);
+  evq_push(&q, 0, 1000);
+  evq_take(&q, &frame);
+  evq_push(&q, 1, 1010);
+  evq_push(&q, 0, 1020);
+  CHECK(q.count == 2 && q.sent == 2 && q.coalesced == 2);
+  CHECK(evq_take(&q, &again) == 2 && again.seq == 0 && memcmp(again.event, frame.event, 2 * sizeof(gp_event_t)) == 0);
+
+  // An ACK for part of the frame lets go of that part; the rest keeps its number
+  evq_push(&q, 1, 2000);
+  CHECK(evq_ack(&q, 0) == 1 && q.count == 2 && q.sent == 1);
+  CHECK(evq_take(&q, &frame) == 2 && frame.seq == 1 && frame.type == GP_TYPE_BATCH);
+  CHECK(evq_ack(&q, 2) == 2 && q.count == 0 && q.delivered == 3);
+  CHECK(evq_ack(&q, 2) == 0);
+  CHECK(evq_take(&q, &frame) == 0);
+
+  // Full: the oldest unsent event makes room, the sent ones stay
+  evq_init(&q, 0);
+  evq_push(&q, 0, 0);
+  evq_take(&q, &frame);
+  for (i = 1; i <= EVQ_SIZE; i++)
+    evq_push(&q, i, i);
+  CHECK(q.count == EVQ_SIZE && q.overflow == 1 && sim_pins(&q, 0) == 0 && sim_pins(&q, 1) == 2);
+  CHECK(sim_pins(&q, EVQ_SIZE - 1) == EVQ_SIZE);
+}
+
+// Random doors, frames and ACKs against the rules above
+static void sim_random_run(void)
+{
+  evq_t q;
+  gp_frame_t frame;
+  uint32_t step, now = 0, expect_seq = 0, lost_acks = 0, partial_acks = 0, outages = 0, last_seq;
+  uint16_t pins = 0, delivered_pins = 0xffff, before[EVQ_SIZE];
+  uint8_t count, sent;
+  int i, n, down = 0, acked;
+
+  evq_init(&q, SIM_COALESCE_MS);
+  for (step = 0; step < sim_steps; step++) {
+    now += sim_random() % 400;
+
+    // The door: one of four pins changes (the same one twice running is a glitch back)
+    if (sim_random() % 3 == 0) {
+      pins ^= 1 << (sim_random() % 4);
+      count = q.count;
+      sent = q.sent;
+      for (i = 0; i < q.sent; i++)
+        before[i] = sim_pins(&q, i);
+      evq_push(&q, pins, now);
+      CHECK(q.sent == sent && q.count <= EVQ_SIZE && q.count >= sent);
+      for (i = 0; i < sent; i++)
+        CHECK(sim_pins(&q, i) == before[i]);
+      // Whatever happened, the newest event is the door as it is now
+      CHECK(q.count > 0 && sim_pins(&q, q.count - 1) == pins);
+      CHECK(q.count <= count + 1);
+    }
+
+    // The receiver goes away for a while now and then
+    if (down) {
+      down--;
+      continue;
+    }
+    if (sim_random() % 2000 == 0) {
+      down = 50 + sim_random() % 200;
+      outages++;
+      continue;
+    }
+
+    // A frame, and most of the time an ACK for it
+    if (sim_random() % 2 == 0 && (n = evq_take(&q, &frame)) > 0) {
+      CHECK(frame.seq == expect_seq && frame.count == n && n <= GP_BATCH_MAX);
+      CHECK(frame.type == (n == 1 ? GP_TYPE_REPORT : GP_TYPE_BATCH));
+      if (sim_random() % 5 == 0) {
+        lost_acks++;
+        continue;
+      }
+      last_seq = frame.seq + n - 1;
+      if (sim_random() % 4 == 0) {
+        last_seq = frame.seq + sim_random() % n;
+        partial_acks++;
+      }
+      acked = evq_ack(&q, last_seq);
+      CHECK(acked == (int)(last_seq - frame.seq + 1));
+      expect_seq = last_seq + 1;
+      delivered_pins = frame.event[acked - 1].pins;
+    }
+  }
+
+  // Everything out at the end
+  while ((n = evq_take(&q, &frame)) > 0) {
+    CHECK(frame.seq == expect_seq);
+    evq_ack(&q, frame.seq + n - 1);
+    expect_seq += n;
+    delivered_pins = frame.event[n - 1].pins;
+  }
+
+  if (verbose)
+    printf("%u steps: %u queued, %u coalesced, %u overflow, %u delivered, %u lost ACKs, %u partial, %u outages\n",
+           sim_steps, q.queued, q.coalesced, q.overflow, q.delivered, lost_acks, partial_acks, outages);
+  CHECK(q.queued == q.delivered + q.count + q.coalesced + q.overflow);
+  CHECK(q.delivered == expect_seq);
+  CHECK(q.overflow > 0 && q.coalesced > 0);
+  CHECK(delivered_pins == pins);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:v")) != -1) {
+    switch (opt) {
+      case 'n': sim_steps = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-n steps] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  sim_fixed();
+  sim_random_run();
+
+  printf("evqsim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
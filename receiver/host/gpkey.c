@@ -0,0 +1,45 @@
+// gpkey.c
+// Work out a sender's authentication key (see gpauth.h in common/) from the receivers'
+// master key and the sender's chip id, and print it the way the sender's user_config.h
+// wants it.
+//
+//   ./gpkey master-key chip-id
+//
+// master-key is the 32 hex digits in the receiver's sdkconfig (CONFIG_GP_AUTH_KEY),
+// chip-id the sender's system_get_chip_id() in hex, as its debug output prints it. A
+// door state consumer's key comes out the same way from its consumer id (see SUBSCRIBE
+// in garage_proto.h).
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gpauth.h"
+
+int main(int argc, char *argv[])
+{
+  uint8_t master[GP_AUTH_KEY_LEN], key[GP_AUTH_KEY_LEN];
+  unsigned long id;
+  char *p_end;
+  int i;
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s master-key chip-id\n", argv[0]);
+    return 1;
+  }
+  if (gp_auth_key(argv[1], master) != 0) {
+    fprintf(stderr, "gpkey: master key must be 32 hex digits\n");
+    return 1;
+  }
+  id = strtoul(argv[2], &p_end, 16);
+  if (*p_end != '\0' || id == 0 || id > 0xffffffffUL) {
+    fprintf(stderr, "gpkey: chip id must be a non-zero 32 bit hex number\n");
+    return 1;
+  }
+
+  gp_auth_derive(master, (uint32_t)id, key);
+  printf("#define AUTH_KEY \"");
+  for (i = 0; i < GP_AUTH_KEY_LEN; i++)
+    printf("%02x", key[i]);
+  printf("\"\n");
+  return 0;
+}
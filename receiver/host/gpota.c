@@ -0,0 +1,701 @@
+// gpota.c
+// Over the air firmware updates for the senders (see sender/ota.c and gpdelta.h):
+//
+//   ./gpota diff [-f] old.bin new.bin update.gpd
+//   ./gpota apply old.bin update.gpd new.bin
+//   ./gpota send [-a address] [-p port] [-k master key] [-V version] [-w window] -i chip id update.gpd
+//   ./gpota recv [-p port] [-k master key] [-V version] [-l loss %] -i chip id old.bin new.bin
+//
+// diff makes a delta from the image a sender runs to a new one and prints how big it
+// came out next to the image. -f leaves the old image out: the whole new image,
+// compressed against itself, for a sender that isn't running old.bin.
+//
+// apply does what a sender does with a delta: gpd_feed, GP_OTA_CHUNK bytes at a time,
+// into a flash that is erased a sector at a time. It prints how long that took and
+// exits non-zero unless the result checks out. The new image is written out.
+//
+// send hands a delta to a sender, to GP_OTA_PORT on its soft-AP address (192.168.4.1)
+// unless told otherwise. window chunks are kept in flight; the sender's OTA_REQs say
+// what it wants next, and when nothing comes back we go back to the last offset it
+// asked for. -k signs every frame with the sender's key, derived from the receivers'
+// master key like gpkey does, and the sender takes nothing else. The signature's epoch
+// is the image version, -V or else the time in seconds; the sender only takes one newer
+// than the last it took. Exits 0 once the sender says GP_OTA_DONE.
+//
+// recv plays the sender for make bench-ota: it runs old.bin, takes a transfer like
+// sender/ota.c does (loss % of the incoming frames dropped on purpose) and writes the
+// new image out. With -k, -V is the version it took last (0 unless given). Exits 0 if
+// it got one that checked out.
+//
+// The encoder is greedy. At each position it takes the longest of: the base at the
+// place the last copy from it would carry on to (a few changed bytes in otherwise
+// unchanged code, such as a call to a function that moved, cost a short literal and
+// a one byte copy), up to CHAIN_MAX earlier places in the base and in the new image
+// with the same next 8 bytes, and a run of one byte. Anything shorter than it costs to
+// say goes out as a literal.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "gpdelta.h"
+
+#define HASH_BITS 17
+#define CHAIN_MAX 32
+#define MIN_FILL 16
+#define SECTOR 4096
+#define FLASH_MAX (1024 * 1024)
+#define RETRY_MS 500
+#define RETRIES 20
+
+// A growing output buffer
+typedef struct {
+  uint8_t *p;
+  size_t len;
+  size_t size;
+} out_t;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint8_t *load(const char *p_path, size_t *p_len)
+{
+  FILE *p_file = fopen(p_path, "rb");
+  uint8_t *p_buf;
+  long len;
+
+  if (p_file == NULL) {
+    perror(p_path);
+    exit(1);
+  }
+  fseek(p_file, 0, SEEK_END);
+  len = ftell(p_file);
+  fseek(p_file, 0, SEEK_SET);
+  p_buf = malloc(len + 1);
+  if (fread(p_buf, 1, len, p_file) != (size_t)len) {
+    perror(p_path);
+    exit(1);
+  }
+  fclose(p_file);
+  *p_len = len;
+  return p_buf;
+}
+
+static void save(const char *p_path, const uint8_t *p_buf, size_t len)
+{
+  FILE *p_file = fopen(p_path, "wb");
+
+  if (p_file == NULL || fwrite(p_buf, 1, len, p_file) != len) {
+    perror(p_path);
+    exit(1);
+  }
+  fclose(p_file);
+}
+
+static void put(out_t *p_out, uint8_t c)
+{
+  if (p_out->len == p_out->size) {
+    p_out->size = p_out->size ? p_out->size * 2 : 65536;
+    p_out->p = realloc(p_out->p, p_out->size);
+  }
+  p_out->p[p_out->len++] = c;
+}
+
+static void put_varint(out_t *p_out, uint32_t v)
+{
+  while (v >= 0x80) {
+    put(p_out, (uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  put(p_out, (uint8_t)v);
+}
+
+static uint32_t varint_len(uint32_t v)
+{
+  uint32_t n = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static uint32_t zigzag(int32_t v)
+{
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static void put_op(out_t *p_out, int kind, uint32_t len)
+{
+  if (len < 64) {
+    put(p_out, (uint8_t)(kind | len << 2));
+  } else {
+    put(p_out, (uint8_t)kind);
+    put_varint(p_out, len);
+  }
+}
+
+static uint32_t op_len(uint32_t len)
+{
+  return len < 64 ? 1 : 1 + varint_len(len);
+}
+
+static uint32_t hash8(const uint8_t *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, 8);
+  return (uint32_t)((v * 0x9e3779b97f4a7c15ULL) >> (64 - HASH_BITS));
+}
+
+static uint32_t match(const uint8_t *p_a, const uint8_t *p_b, uint32_t max)
+{
+  uint32_t n = 0;
+
+  while (n < max && p_a[n] == p_b[n])
+    n++;
+  return n;
+}
+
+// Positions with the same next 8 bytes, newest first
+typedef struct {
+  int32_t *p_head;
+  int32_t *p_next;
+} chain_t;
+
+static void chain_init(chain_t *p_chain, size_t len)
+{
+  p_chain->p_head = malloc(sizeof(int32_t) << HASH_BITS);
+  memset(p_chain->p_head, 0xff, sizeof(int32_t) << HASH_BITS);
+  p_chain->p_next = malloc(sizeof(int32_t) * (len + 1));
+}
+
+static void chain_add(chain_t *p_chain, const uint8_t *p_buf, size_t len, uint32_t at)
+{
+  uint32_t h;
+
+  if (at + 8 > len)
+    return;
+  h = hash8(&p_buf[at]);
+  p_chain->p_next[at] = p_chain->p_head[h];
+  p_chain->p_head[h] = (int32_t)at;
+}
+
+// The best op at position i so far
+typedef struct {
+  int kind;
+  uint32_t len;
+  uint32_t arg;         // base offset (GPD_COPY) or distance (GPD_SELF)
+  int32_t gain;         // bytes saved over a literal
+} best_t;
+
+static void consider(best_t *p_best, int kind, uint32_t len, uint32_t arg, uint32_t base_pos)
+{
+  uint32_t cost = op_len(len) + (kind == GPD_COPY ? varint_len(zigzag((int32_t)(arg - base_pos))) : varint_len(arg));
+  int32_t gain = (int32_t)len - (int32_t)cost;
+
+  // Breaking up a literal costs another op header later
+  if (gain > 2 && gain > p_best->gain) {
+    p_best->kind = kind;
+    p_best->len = len;
+    p_best->arg = arg;
+    p_best->gain = gain;
+  }
+}
+
+static void flush_literal(out_t *p_out, const uint8_t *p_new, uint32_t from, uint32_t to, uint32_t *p_ops)
+{
+  if (to == from)
+    return;
+  put_op(p_out, GPD_LITERAL, to - from);
+  while (from < to)
+    put(p_out, p_new[from++]);
+  (*p_ops)++;
+}
+
+// Make a delta from p_old (NULL for none) to p_new
+static void encode(const uint8_t *p_old, uint32_t old_len, const uint8_t *p_new, uint32_t new_len, out_t *p_out,
+                   uint32_t *p_ops)
+{
+  uint32_t i = 0, literal = 0, base_pos = 0, copy_end = 0, run, at, k;
+  chain_t old_chain, new_chain;
+  uint8_t header[GPD_HEADER_LEN];
+  best_t best;
+  int32_t j;
+
+  gp_put32(header, GPD_MAGIC);
+  gp_put32(&header[4], old_len);
+  gp_put32(&header[8], p_old ? gpd_crc32(0, p_old, old_len) : 0);
+  gp_put32(&header[12], new_len);
+  gp_put32(&header[16], gpd_crc32(0, p_new, new_len));
+  for (k = 0; k < GPD_HEADER_LEN; k++)
+    put(p_out, header[k]);
+
+  chain_init(&old_chain, old_len);
+  chain_init(&new_chain, new_len);
+  for (at = 0; p_old && at < old_len; at++)
+    chain_add(&old_chain, p_old, old_len, at);
+
+  while (i < new_len) {
+    for (run = 1; i + run < new_len && p_new[i + run] == p_new[i]; run++);
+    if (run >= MIN_FILL) {
+      flush_literal(p_out, p_new, literal, i, p_ops);
+      put_op(p_out, GPD_FILL, run);
+      put(p_out, p_new[i]);
+      (*p_ops)++;
+      for (k = 0; k < run; k++)
+        chain_add(&new_chain, p_new, new_len, i + k);
+      i += run;
+      literal = i;
+      continue;
+    }
+
+    best.gain = 0;
+    best.len = 0;
+    if (p_old) {
+      // Carry on from the last copy, as if the bytes since were changed in place
+      at = base_pos + (i - copy_end);
+      if (at < old_len)
+        consider(&best, GPD_COPY, match(&p_old[at], &p_new[i], old_len - at < new_len - i ? old_len - at : new_len - i),
+                 at, base_pos);
+      if (i + 8 <= new_len)
+        for (j = old_chain.p_head[hash8(&p_new[i])], k = 0; j >= 0 && k < CHAIN_MAX; j = old_chain.p_next[j], k++)
+          consider(&best, GPD_COPY, match(&p_old[j], &p_new[i], old_len - j < new_len - i ? old_len - j : new_len - i),
+                   j, base_pos);
+    }
+    if (i + 8 <= new_len)
+      for (j = new_chain.p_head[hash8(&p_new[i])], k = 0; j >= 0 && k < CHAIN_MAX; j = new_chain.p_next[j], k++)
+        consider(&best, GPD_SELF, match(&p_new[j], &p_new[i], new_len - i), i - j, base_pos);
+
+    if (best.len == 0) {
+      chain_add(&new_chain, p_new, new_len, i);
+      i++;
+      continue;
+    }
+    flush_literal(p_out, p_new, literal, i, p_ops);
+    put_op(p_out, best.kind, best.len);
+    if (best.kind == GPD_COPY) {
+      put_varint(p_out, zigzag((int32_t)(best.arg - base_pos)));
+      base_pos = best.arg + best.len;
+      copy_end = i + best.len;
+    } else {
+      put_varint(p_out, best.arg);
+    }
+    (*p_ops)++;
+    for (k = 0; k < best.len; k++)
+      chain_add(&new_chain, p_new, new_len, i + k);
+    i += best.len;
+    literal = i;
+  }
+  flush_literal(p_out, p_new, literal, i, p_ops);
+
+  free(old_chain.p_head);
+  free(old_chain.p_next);
+  free(new_chain.p_head);
+  free(new_chain.p_next);
+}
+
+// A flash in memory for gpd_feed, erased a sector at a time like the real one
+typedef struct {
+  const uint8_t *p_base;
+  uint32_t base_len;
+  uint8_t *p_image;
+  uint32_t erases;
+} flash_t;
+
+static int flash_read_base(void *p_ctx, uint32_t offset, uint8_t *p_buf, uint32_t len)
+{
+  flash_t *p_flash = p_ctx;
+
+  if (offset + len > p_flash->base_len)
+    return -1;
+  memcpy(p_buf, &p_flash->p_base[offset], len);
+  return 0;
+}
+
+static int flash_read_image(void *p_ctx, uint32_t offset, uint8_t *p_buf, uint32_t len)
+{
+  flash_t *p_flash = p_ctx;
+
+  memcpy(p_buf, &p_flash->p_image[offset], len);
+  return 0;
+}
+
+static int flash_write(void *p_ctx, uint32_t offset, const uint8_t *p_buf, uint32_t len)
+{
+  flash_t *p_flash = p_ctx;
+  uint32_t i;
+
+  if (offset + len > FLASH_MAX || ((uintptr_t)p_buf & 3))
+    return -1;
+  if (offset % SECTOR == 0) {
+    memset(&p_flash->p_image[offset], 0xff, SECTOR);
+    p_flash->erases++;
+  }
+  // Flash can only clear bits, so writing over something not erased shows up
+  for (i = 0; i < len; i++)
+    p_flash->p_image[offset + i] &= p_buf[i];
+  return 0;
+}
+
+static const gpd_io_t flash_io = { flash_read_base, flash_read_image, flash_write };
+
+static void flash_init(flash_t *p_flash, const uint8_t *p_base, uint32_t base_len)
+{
+  p_flash->p_base = p_base;
+  p_flash->base_len = base_len;
+  p_flash->p_image = malloc(FLASH_MAX);
+  memset(p_flash->p_image, 0, FLASH_MAX);
+  p_flash->erases = 0;
+}
+
+static int cmd_diff(int argc, char **argv)
+{
+  int opt, full = 0;
+  uint8_t *p_old, *p_new;
+  size_t old_len, new_len;
+  out_t out = { NULL, 0, 0 };
+  uint32_t ops = 0;
+  uint64_t start;
+
+  while ((opt = getopt(argc, argv, "f")) != -1) {
+    if (opt != 'f')
+      return 2;
+    full = 1;
+  }
+  if (argc - optind != 3)
+    return 2;
+  p_old = load(argv[optind], &old_len);
+  p_new = load(argv[optind + 1], &new_len);
+
+  start = now_us();
+  encode(full ? NULL : p_old, full ? 0 : old_len, p_new, new_len, &out, &ops);
+  save(argv[optind + 2], out.p, out.len);
+  printf("gpota: %s %u -> %u bytes: %s of %zu bytes (%.1f%% of the image), %u ops, %.0f ms\n",
+         full ? "whole image" : "delta", full ? 0 : (unsigned)old_len, (unsigned)new_len, argv[optind + 2],
+         out.len, 100.0 * out.len / new_len, ops, (now_us() - start) / 1e3);
+  return 0;
+}
+
+static int cmd_apply(int argc, char **argv)
+{
+  uint8_t *p_old, *p_delta;
+  size_t old_len, delta_len, at, n;
+  gpd_header_t header;
+  flash_t flash;
+  gpd_t gpd;
+  int result = GPD_MORE;
+  uint64_t start;
+
+  if (argc != 4)
+    return 2;
+  p_old = load(argv[1], &old_len);
+  p_delta = load(argv[2], &delta_len);
+  if (gpd_header(p_delta, delta_len, &header) != 0 || header.len > FLASH_MAX) {
+    fprintf(stderr, "gpota: %s is not a delta that fits\n", argv[2]);
+    return 1;
+  }
+  if (header.base_len && (header.base_len > old_len || gpd_crc32(0, p_old, header.base_len) != header.base_crc)) {
+    fprintf(stderr, "gpota: %s is not the base of %s\n", argv[1], argv[2]);
+    return 1;
+  }
+
+  flash_init(&flash, p_old, old_len);
+  gpd_init(&gpd, &flash_io, &flash);
+  start = now_us();
+  for (at = 0; at < delta_len && result == GPD_MORE; at += n) {
+    n = delta_len - at < GP_OTA_CHUNK ? delta_len - at : GP_OTA_CHUNK;
+    result = gpd_feed(&gpd, &p_delta[at], n);
+  }
+  printf("gpota: applied %zu bytes to a %u byte image in %.2f ms, %u sectors erased: %s\n", delta_len, header.len,
+         (now_us() - start) / 1e3, flash.erases, result == GPD_DONE ? "OK" : "FAILED");
+  if (result != GPD_DONE || gpd_crc32(0, flash.p_image, header.len) != header.crc)
+    return 1;
+  save(argv[3], flash.p_image, header.len);
+  return 0;
+}
+
+static int open_udp(const char *p_addr, int port, struct sockaddr_in *p_dest, int bind_it)
+{
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+  memset(p_dest, 0, sizeof(*p_dest));
+  p_dest->sin_family = AF_INET;
+  p_dest->sin_port = htons(port);
+  inet_pton(AF_INET, p_addr, &p_dest->sin_addr);
+  if (bind_it && bind(sock, (struct sockaddr *)p_dest, sizeof(*p_dest)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+  return sock;
+}
+
+static const char *status_name(int status)
+{
+  static const char *names[] = { "more", "done", "not our base", "doesn't fit", "bad delta", "already running it",
+                                 "not newer than what it took last" };
+
+  return status < (int)(sizeof(names) / sizeof(names[0])) ? names[status] : "?";
+}
+
+static int cmd_send(int argc, char **argv)
+{
+  const char *p_addr = "192.168.4.1";
+  int opt, port = GP_OTA_PORT, window = 2, sock, tries = 0, n, signing = 0;
+  uint32_t device_id = 0, acked = 0, sent = 0, back = 0xffffffff, frames = 0, bytes = 0;
+  uint32_t version = (uint32_t)time(NULL);
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_OTA_MAX_FRAME], *p_delta;
+  struct sockaddr_in dest;
+  gpd_header_t header;
+  gp_auth_t auth;
+  gp_ota_t ota, req;
+  struct pollfd pfd;
+  size_t delta_len;
+  uint64_t start;
+
+  while ((opt = getopt(argc, argv, "a:p:k:V:w:i:")) != -1) {
+    switch (opt) {
+      case 'a':
+        p_addr = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'k':
+        if (gp_auth_key(optarg, master) != 0) {
+          fprintf(stderr, "gpota: the master key is 32 hex digits\n");
+          return 1;
+        }
+        signing = 1;
+        break;
+      case 'V':
+        version = strtoul(optarg, NULL, 0);
+        break;
+      case 'w':
+        window = atoi(optarg);
+        break;
+      case 'i':
+        device_id = strtoul(optarg, NULL, 16);
+        break;
+      default:
+        return 2;
+    }
+  }
+  if (argc - optind != 1 || device_id == 0 || window < 1)
+    return 2;
+  p_delta = load(argv[optind], &delta_len);
+  if (gpd_header(p_delta, delta_len, &header) != 0) {
+    fprintf(stderr, "gpota: %s is not a delta\n", argv[optind]);
+    return 1;
+  }
+  if (signing) {
+    gp_auth_derive(master, device_id, auth.key);
+    auth.epoch = version;
+    auth.counter = 0;
+  }
+
+  sock = open_udp(p_addr, port, &dest, 0);
+  ota.type = GP_TYPE_OTA_DATA;
+  ota.device_id = device_id;
+  ota.id = header.crc;
+  ota.total = delta_len;
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  start = now_us();
+
+  while (1) {
+    // Fill the window
+    while (sent < delta_len && sent < acked + (uint32_t)window * GP_OTA_CHUNK) {
+      ota.offset = sent;
+      ota.p_data = &p_delta[sent];
+      ota.len = delta_len - sent < GP_OTA_CHUNK ? delta_len - sent : GP_OTA_CHUNK;
+      n = gp_encode_ota(&ota, buf, sizeof(buf));
+      if (signing)
+        n = gp_auth_sign(&auth, buf, n, sizeof(buf));
+      sendto(sock, buf, n, 0, (struct sockaddr *)&dest, sizeof(dest));
+      frames++;
+      bytes += n;
+      sent += ota.len;
+    }
+
+    if (poll(&pfd, 1, RETRY_MS) <= 0) {
+      if (++tries > RETRIES) {
+        printf("gpota: no answer from %08x at offset %u\n", device_id, acked);
+        return 1;
+      }
+      sent = acked;
+      continue;
+    }
+    n = recv(sock, buf, sizeof(buf), 0);
+    if (n <= 0 || gp_decode_ota(buf, n, &req) != 0 || req.type != GP_TYPE_OTA_REQ || req.device_id != device_id ||
+        req.id != header.crc)
+      continue;
+    tries = 0;
+    if (req.status != GP_OTA_MORE) {
+      printf("gpota: %08x says %s after %u of %zu bytes, %u frames (%u bytes) in %.0f ms\n", device_id,
+             status_name(req.status), req.offset, delta_len, frames, bytes, (now_us() - start) / 1e3);
+      if (req.status == GP_OTA_BASE)
+        printf("gpota: it runs something else; send it a whole image (gpota diff -f)\n");
+      return req.status == GP_OTA_DONE ? 0 : 1;
+    }
+    if (req.offset > acked) {
+      acked = req.offset;
+    } else if (req.offset == acked && req.offset != back) {
+      // Asked for the same offset again: something got lost. Once per offset, or a
+      // whole window of out of order chunks would each send us back.
+      sent = acked;
+      back = acked;
+    }
+  }
+}
+
+static int cmd_recv(int argc, char **argv)
+{
+  int opt, port = GP_OTA_PORT, sock, n, loss = 0, active = 0, result, signing = 0;
+  uint32_t device_id = 0, next = 0, id = 0, epoch = 0, counter, dropped = 0, version = 0, new_version = 0;
+  uint8_t master[GP_AUTH_KEY_LEN], key[GP_AUTH_KEY_LEN], buf[GP_OTA_MAX_FRAME + 64], out[GP_OTA_REQ_LEN];
+  struct sockaddr_in addr, from;
+  socklen_t from_len;
+  gpd_header_t header;
+  gp_ota_t ota, req;
+  struct pollfd pfd;
+  uint8_t *p_old;
+  size_t old_len;
+  flash_t flash;
+  gpd_t gpd;
+
+  while ((opt = getopt(argc, argv, "p:k:V:l:i:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'k':
+        if (gp_auth_key(optarg, master) != 0)
+          return 2;
+        signing = 1;
+        break;
+      case 'V':
+        version = strtoul(optarg, NULL, 0);
+        break;
+      case 'l':
+        loss = atoi(optarg);
+        break;
+      case 'i':
+        device_id = strtoul(optarg, NULL, 16);
+        break;
+      default:
+        return 2;
+    }
+  }
+  if (argc - optind != 2 || device_id == 0)
+    return 2;
+  p_old = load(argv[optind], &old_len);
+  if (signing)
+    gp_auth_derive(master, device_id, key);
+  flash_init(&flash, p_old, old_len);
+  srand(device_id);
+
+  sock = open_udp("127.0.0.1", port, &addr, 1);
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  req.type = GP_TYPE_OTA_REQ;
+  req.device_id = device_id;
+
+  while (poll(&pfd, 1, RETRIES * RETRY_MS) > 0) {
+    from_len = sizeof(from);
+    n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+    if (n <= 0)
+      continue;
+    if (loss && rand() % 100 < loss) {
+      dropped++;
+      continue;
+    }
+    if (signing && (n = gp_auth_verify(key, buf, n, &epoch, &counter)) < 0)
+      continue;
+    if (gp_decode_ota(buf, n, &ota) != 0 || ota.type != GP_TYPE_OTA_DATA || ota.device_id != device_id)
+      continue;
+
+    req.status = GP_OTA_MORE;
+    if (ota.offset == 0 && (!active || ota.id != id)) {
+      id = ota.id;
+      next = 0;
+      active = 0;
+      new_version = epoch;
+      if (signing && epoch <= version)
+        req.status = GP_OTA_OLD;
+      else if (gpd_header(ota.p_data, ota.len, &header) != 0 || header.crc != ota.id)
+        req.status = GP_OTA_BAD;
+      else if (header.len > FLASH_MAX || header.base_len > FLASH_MAX)
+        req.status = GP_OTA_FIT;
+      else if (header.len <= old_len && gpd_crc32(0, p_old, header.len) == header.crc)
+        req.status = GP_OTA_CURRENT;
+      else if (header.base_len && (header.base_len > old_len ||
+                                   gpd_crc32(0, p_old, header.base_len) != header.base_crc))
+        req.status = GP_OTA_BASE;
+      else
+        active = 1;
+      gpd_init(&gpd, &flash_io, &flash);
+    }
+    if (active && ota.id == id && ota.offset == next && ota.len && epoch == new_version) {
+      result = gpd_feed(&gpd, ota.p_data, ota.len);
+      next += ota.len;
+      if (result == GPD_DONE)
+        req.status = gpd_crc32(0, flash.p_image, header.len) == header.crc ? GP_OTA_DONE : GP_OTA_BAD;
+      else if (result < 0 || next >= ota.total)
+        req.status = GP_OTA_BAD;
+    }
+    if (!active && req.status == GP_OTA_MORE)
+      continue;
+
+    req.id = id;
+    req.offset = next;
+    n = gp_encode_ota(&req, out, sizeof(out));
+    sendto(sock, out, n, 0, (struct sockaddr *)&from, from_len);
+    if (req.status != GP_OTA_MORE) {
+      printf("gpota: recv %s, %u sectors erased, %u frames dropped on purpose\n", status_name(req.status),
+             flash.erases, dropped);
+      if (req.status != GP_OTA_DONE)
+        return 1;
+      save(argv[optind + 1], flash.p_image, header.len);
+      return 0;
+    }
+  }
+  printf("gpota: recv gave up waiting at offset %u\n", next);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int result = 2;
+
+  if (argc >= 2 && strcmp(argv[1], "diff") == 0)
+    result = cmd_diff(argc - 1, argv + 1);
+  else if (argc >= 2 && strcmp(argv[1], "apply") == 0)
+    result = cmd_apply(argc - 1, argv + 1);
+  else if (argc >= 2 && strcmp(argv[1], "send") == 0)
+    result = cmd_send(argc - 1, argv + 1);
+  else if (argc >= 2 && strcmp(argv[1], "recv") == 0)
+    result = cmd_recv(argc - 1, argv + 1);
+  if (result == 2)
+    fprintf(stderr, "usage: %s diff [-f] old.bin new.bin update.gpd\n"
+                    "       %s apply old.bin update.gpd new.bin\n"
+                    "       %s send [-a address] [-p port] [-k master key] [-V version] [-w window] -i chip id "
+                    "update.gpd\n"
+                    "       %s recv [-p port] [-k master key] [-V version] [-l loss %%] -i chip id old.bin new.bin\n",
+            argv[0], argv[0], argv[0], argv[0]);
+  return result;
+}
@@ -0,0 +1,150 @@
+// gpstat.c
+// Ask a receiver for its statistics over the stats query endpoint (see stats.h in
+// ../main) and print them. Works against the real ESP32 just as well as receiver_host.
+//
+//   ./gpstat [-a address] [-p port] [-d] [-e] [-H]
+//
+// -d walks the device table too, one line per sender, with what its last HEALTH frame
+// said. -H adds the receiver's own heap, stacks and longest timer pass (see rxhealth.h).
+// -e exits non-zero if the receiver hasn't measured a single end to end latency (handy
+// in scripts, see make bench-stats). Exits non-zero if the receiver doesn't answer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "stats.h"
+
+#define TRIES 3
+#define WAIT_MS 500
+
+static int sock;
+static struct sockaddr_in dest;
+
+// Ask for page and wait for its answer. Returns the answer's length or -1.
+static int stats_query(uint16_t page, uint8_t *p_buf, gp_frame_t *p_frame)
+{
+  uint8_t request[GP_STATS_REQ_LEN];
+  gp_frame_t frame;
+  int try, len;
+
+  frame.type = GP_TYPE_STATS_REQ;
+  frame.flags = 0;
+  frame.seq = page;
+  gp_encode(&frame, request, sizeof(request));
+
+  for (try = 0; try < TRIES; try++) {
+    sendto(sock, request, sizeof(request), 0, (struct sockaddr *)&dest, sizeof(dest));
+    // Answers to an earlier try may still turn up; only take the page we asked for
+    while ((len = recv(sock, p_buf, GP_MAX_FRAME, 0)) > 0) {
+      if (gp_decode(p_buf, len, p_frame) == 0 && p_frame->type == GP_TYPE_STATS && p_frame->seq == page)
+        return len;
+    }
+  }
+  return -1;
+}
+
+static void print_hist(const char *label, const uint8_t *p)
+{
+  printf("  %-8s %8u samples  p50 %6u  p99 %6u  max %6u ms\n", label, gp_get32(&p[0]), gp_get32(&p[4]),
+         gp_get32(&p[8]), gp_get32(&p[12]));
+}
+
+int main(int argc, char *argv[])
+{
+  const char *address = "127.0.0.1";
+  int port = GP_PORT, devices = 0, expect = 0, health = 0;
+  uint8_t buffer[GP_MAX_FRAME];
+  struct timeval timeout = { 0, WAIT_MS * 1000 };
+  gp_frame_t frame;
+  gp_health_t rx_health;
+  uint32_t page;
+  int opt, len, n;
+
+  while ((opt = getopt(argc, argv, "a:p:deH")) != -1) {
+    switch (opt) {
+      case 'a': address = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'd': devices = 1; break;
+      case 'e': expect = 1; break;
+      case 'H': health = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-a address] [-p port] [-d] [-e] [-H]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port);
+  inet_pton(AF_INET, address, &dest.sin_addr);
+
+  len = stats_query(GP_STATS_SUMMARY, buffer, &frame);
+  if (len < STATS_SUMMARY_LEN) {
+    fprintf(stderr, "gpstat: no answer from %s\n", address);
+    return 1;
+  }
+
+  printf("receiver %08x, up %u s, %u packets, %u bad, %u overruns, %u devices, %u untimed events\n",
+         gp_get32(&buffer[8]), gp_get32(&buffer[12]) / 1000, gp_get32(&buffer[16]), gp_get32(&buffer[20]),
+         gp_get32(&buffer[24]), gp_get32(&buffer[28]), gp_get32(&buffer[32]));
+  print_hist("e2e", &buffer[STATS_OFF_E2E]);
+  print_hist("sender", &buffer[STATS_OFF_SENDER]);
+  print_hist("network", &buffer[STATS_OFF_NETWORK]);
+  printf("  proc     p50 %u  p99 %u  max %u cycles, %u stats requests dropped, %u devices silent, "
+         "%u frames rejected\n",
+         gp_get32(&buffer[STATS_OFF_PROC]), gp_get32(&buffer[STATS_OFF_PROC + 4]), gp_get32(&buffer[STATS_OFF_PROC + 8]),
+         gp_get32(&buffer[STATS_OFF_DROPPED]), gp_get32(&buffer[STATS_OFF_SILENT]), gp_get32(&buffer[STATS_OFF_REJECTED]));
+  if (expect && gp_get32(&buffer[STATS_OFF_E2E]) == 0) {
+    fprintf(stderr, "gpstat: no end to end latency recorded\n");
+    return 1;
+  }
+
+  if (health) {
+    len = stats_query(GP_STATS_HEALTH, buffer, &frame);
+    if (len < 0 || gp_decode_health(&buffer[GP_STATS_HEADER_LEN], len - GP_STATS_HEADER_LEN, &rx_health) != 0) {
+      fprintf(stderr, "gpstat: no health page from %s\n", address);
+      return 1;
+    }
+    printf("  heap     %u bytes free, %u at the least, longest timer pass %u us\n", rx_health.heap_free,
+           rx_health.heap_min, rx_health.callback_us);
+    for (n = 0; n < rx_health.count; n++)
+      printf("  stack    %-4.4s %6u bytes never used\n", rx_health.stack[n].name, rx_health.stack[n].unused);
+  }
+
+  if (!devices)
+    return 0;
+
+  printf("  device       events       lost       dups  reordered  worst e2e ms  heap low  stack   mV  cb us\n");
+  for (page = 0; page != GP_STATS_END; page = frame.device_id) {
+    len = stats_query((uint16_t)page, buffer, &frame);
+    if (len < 0) {
+      fprintf(stderr, "gpstat: no answer for page %u\n", page);
+      return 1;
+    }
+    for (n = GP_STATS_HEADER_LEN; n + STATS_DEVICE_LEN <= len; n += STATS_DEVICE_LEN) {
+      printf("  %08x %10u %10u %10u %10u %13u", gp_get32(&buffer[n]), gp_get32(&buffer[n + 4]),
+             gp_get32(&buffer[n + 8]), gp_get32(&buffer[n + 12]), gp_get32(&buffer[n + 16]),
+             gp_get32(&buffer[n + 20]));
+      // No HEALTH frame from it yet
+      if (gp_get32(&buffer[n + 24]) == 0)
+        printf("         -      -    -      -\n");
+      else
+        printf("  %8u  %5u %4u  %5u\n", gp_get32(&buffer[n + 24]), gp_get16(&buffer[n + 28]),
+               gp_get16(&buffer[n + 30]), gp_get16(&buffer[n + 32]));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,170 @@
+// gptune.c
+// Read and change a sender's tunables at runtime (see gptune.h in common/ and
+// sender/tune.c), to trade latency against power for one installation without
+// reflashing it.
+//
+//   ./gptune [-a address] [-p port] [-k master key] -i chip id
+//                                      print them all
+//   ./gptune ... -i chip id name ...   print some
+//   ./gptune ... -i chip id name=value ...
+//                                      set them until the sender reboots
+//   ./gptune ... -s -i chip id name=value ...
+//                                      set them and keep them in the sender's flash
+//   ./gptune ... -d -i chip id         back to the firmware's defaults, in flash too
+//
+// The sender is at its soft-AP address (192.168.4.1) on GP_PORT unless told otherwise.
+// With -k every TUNE is signed with the sender's key, derived from the receivers'
+// master key like gpkey does. A sender ignores anything else, and one built without
+// AUTH_KEY ignores TUNE frames altogether. The
+// epoch is the time and the counter the microseconds, so every frame is newer than the
+// last. Exits 0 if the sender said GP_TUNE_OK.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "gptune.h"
+
+#define RETRY_MS 500
+#define RETRIES 3
+
+// By id
+static const char *names[GP_TUNE_COUNT + 1] = {
+  "", "hb_min", "hb_max", "hb_jitter", "debounce", "coalesce", "health", "sleep", "awake"
+};
+static const char *units[GP_TUNE_COUNT + 1] = { "", "ms", "ms", "%", "ms", "ms", "ms", "s", "ms" };
+
+static const char *statuses[] = { "ok", "unknown tunable", "out of range, nothing changed", "bad op",
+                                  "flash write failed, nothing changed" };
+
+static int tune_id(const char *p_name, size_t len)
+{
+  int i;
+
+  for (i = 1; i <= GP_TUNE_COUNT; i++) {
+    if (strlen(names[i]) == len && strncmp(names[i], p_name, len) == 0)
+      return i;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *p_addr = "192.168.4.1";
+  uint8_t master[GP_AUTH_KEY_LEN], buf[GP_MAX_FRAME];
+  int opt, port = GP_PORT, sock, n, i, tries, signing = 0;
+  struct sockaddr_in dest;
+  struct pollfd pfd;
+  struct timeval tv;
+  gp_tune_t req, ack;
+  gp_auth_t auth;
+  char *p_eq;
+
+  req.type = GP_TYPE_TUNE;
+  req.device_id = 0;
+  req.op = GP_TUNE_GET;
+  req.count = 0;
+  while ((opt = getopt(argc, argv, "a:p:k:i:sd")) != -1) {
+    switch (opt) {
+      case 'a':
+        p_addr = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'k':
+        if (gp_auth_key(optarg, master) != 0) {
+          fprintf(stderr, "gptune: the master key is 32 hex digits\n");
+          return 1;
+        }
+        signing = 1;
+        break;
+      case 'i':
+        req.device_id = strtoul(optarg, NULL, 16);
+        break;
+      case 's':
+        req.op = GP_TUNE_SAVE;
+        break;
+      case 'd':
+        req.op = GP_TUNE_DEFAULTS;
+        break;
+      default:
+        req.device_id = 0;
+        break;
+    }
+  }
+
+  // name (get) or name=value (set), not both
+  for (i = optind; i < argc && req.device_id && req.count < GP_TUNE_MAX; i++) {
+    p_eq = strchr(argv[i], '=');
+    req.entry[req.count].id = tune_id(argv[i], p_eq ? (size_t)(p_eq - argv[i]) : strlen(argv[i]));
+    if (req.entry[req.count].id == 0) {
+      fprintf(stderr, "gptune: no tunable called %s\n", argv[i]);
+      return 1;
+    }
+    if (p_eq) {
+      req.entry[req.count].value = strtoul(p_eq + 1, NULL, 10);
+      if (req.op == GP_TUNE_GET)
+        req.op = GP_TUNE_SET;
+    }
+    if ((p_eq != NULL) != (req.op != GP_TUNE_GET) || req.op == GP_TUNE_DEFAULTS)
+      req.device_id = 0;
+    req.count++;
+  }
+  if (req.device_id == 0 || i < argc) {
+    fprintf(stderr, "usage: %s [-a address] [-p port] [-k master key] [-s | -d] -i chip id "
+                    "[name | name=value] ...\n       tunables:", argv[0]);
+    for (i = 1; i <= GP_TUNE_COUNT; i++)
+      fprintf(stderr, " %s (%s)", names[i], units[i]);
+    fprintf(stderr, "\n");
+    return 1;
+  }
+  if (signing)
+    gp_auth_derive(master, req.device_id, auth.key);
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port);
+  inet_pton(AF_INET, p_addr, &dest.sin_addr);
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  gettimeofday(&tv, NULL);
+  req.seq = (uint16_t)(tv.tv_sec ^ tv.tv_usec);
+
+  // A SET is the same SET however often it arrives, so just ask again
+  for (tries = 0; tries < RETRIES; tries++) {
+    n = gp_encode_tune(&req, buf, sizeof(buf));
+    if (signing) {
+      gettimeofday(&tv, NULL);
+      auth.epoch = (uint32_t)tv.tv_sec;
+      auth.counter = (uint32_t)tv.tv_usec;
+      n = gp_auth_sign(&auth, buf, n, sizeof(buf));
+    }
+    sendto(sock, buf, n, 0, (struct sockaddr *)&dest, sizeof(dest));
+    while (poll(&pfd, 1, RETRY_MS) > 0) {
+      n = recv(sock, buf, sizeof(buf), 0);
+      if (n <= 0 || gp_decode_tune(buf, n, &ack) != 0 || ack.type != GP_TYPE_TUNE_ACK ||
+          ack.device_id != req.device_id || ack.seq != req.seq)
+        continue;
+      for (i = 0; i < ack.count; i++) {
+        if (ack.entry[i].id >= 1 && ack.entry[i].id <= GP_TUNE_COUNT)
+          printf("%-10s %10u %s\n", names[ack.entry[i].id], ack.entry[i].value, units[ack.entry[i].id]);
+      }
+      if (ack.op != GP_TUNE_OK)
+        printf("gptune: %08x says %s\n", req.device_id, ack.op < 5 ? statuses[ack.op] : "?");
+      return ack.op == GP_TUNE_OK ? 0 : 1;
+    }
+  }
+  printf("gptune: no answer from %08x at %s:%d%s\n", req.device_id, p_addr, port,
+         signing ? "" : " (senders only take signed frames, -k)");
+  return 1;
+}
@@ -0,0 +1,275 @@
+// hbsim.c
+// Host-side simulation of the heartbeat policy (see heartbeat.h in common/) against the
+// receiver's liveness check (device_update and device_expired in devices.c, the real
+// code). No radio: N doors on one soft-AP, a simulated clock, a rough airtime model.
+//
+//   ./hbsim [-H hours] [-c mean seconds between door moves] [-l loss %] [-v]
+//
+// For 1 to 500 senders, each policy runs for the given hours (default 6):
+//   fixed     the old firmware: the whole state every 5 s
+//   adaptive  5 s after a change, doubling to 60 s while idle, 20% jitter
+//
+// Doors move at random (exponential, mean -c, default 30 minutes) and every change is
+// sent at once and retransmitted until it gets through. Frames are lost at random (-l,
+// default 1%). During the last hour every sender dies at a random moment and we time
+// how long the receiver takes to call it silent (the clock runs on long enough for the
+// last one to be noticed).
+//
+// Airtime is 802.11b at 11 Mbit/s with the long preamble: DIFS, the average backoff,
+// preamble, MAC + LLC + IP + UDP headers, our frame, SIFS and the MAC ACK. Rough, but
+// the same for both policies.
+//
+// Prints airtime (percent of the channel), frames per second and detection delay per
+// sender count. Exits non-zero if the adaptive policy uses more airtime than the fixed
+// one, a dead sender is never noticed, or one is noticed later than its promise allows.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "garage_proto.h"
+#include "heartbeat.h"
+#include "devices.h"
+
+#define SIM_TICK_MS 100
+
+// The sender's defaults (see user_config.h)
+#define SIM_HB_MIN_MS 5000
+#define SIM_HB_MAX_MS 60000
+#define SIM_HB_JITTER_PCT 20
+#define SIM_RETRY_MS 200
+
+// Airtime per frame: fixed cost plus header and payload bytes at SIM_RATE_MBPS
+#define SIM_FRAME_US (50 + 310 + 192 + 10 + 248)
+#define SIM_HEADER_BYTES 64
+#define SIM_RATE_MBPS 11
+
+static const uint32_t sim_senders[] = { 1, 10, 50, 100, 250, 500 };
+
+typedef struct {
+  hb_t hb;
+  uint32_t seq;
+  uint16_t pins;
+  uint32_t next_hb;       // when the heartbeat timer fires
+  uint32_t next_move;     // when the door moves next
+  uint32_t retry_at;      // a change is waiting to get through (0 == none)
+  uint32_t dead_at;       // when it dies
+  uint8_t dead;
+  uint8_t noticed;
+} sim_door_t;
+
+typedef struct {
+  double airtime_us;      // before the first death
+  uint64_t frames;        // before the first death
+  uint32_t detected;
+  uint32_t false_alarms;
+  uint64_t delay_sum_ms;
+  uint32_t delay_max_ms;
+} sim_result_t;
+
+static int verbose;
+static uint32_t sim_hours = 6;
+static uint32_t move_mean_s = 1800;
+static uint32_t loss_pct = 1;
+static uint32_t sim_rand = 12345;
+
+static uint32_t sim_random(void)
+{
+  sim_rand ^= sim_rand << 13;
+  sim_rand ^= sim_rand >> 17;
+  sim_rand ^= sim_rand << 5;
+  return sim_rand;
+}
+
+// Exponentially distributed wait with the given mean
+static uint32_t sim_exp_ms(uint32_t mean_s)
+{
+  double u = (sim_random() % 1000000 + 1) / 1000001.0;
+  double ms = -(double)mean_s * 1000.0 * log(u);
+
+  return ms > 1e9 ? 1000000000u : (uint32_t)ms + 1;
+}
+
+static double sim_airtime_us(int bytes)
+{
+  return SIM_FRAME_US + (double)(SIM_HEADER_BYTES + bytes) * 8 / SIM_RATE_MBPS;
+}
+
+// One frame from door i on the air. Returns 1 if the receiver got it.
+static int sim_send(sim_door_t *p_door, uint32_t i, uint8_t flags, uint32_t now, uint32_t first_death,
+                    sim_result_t *p_result)
+{
+  uint8_t buffer[GP_MAX_FRAME];
+  gp_frame_t frame;
+  int len;
+
+  frame.type = GP_TYPE_REPORT;
+  frame.flags = flags | GP_FLAG_TRACE | GP_FLAG_LIVENESS;
+  frame.device_id = i + 1;
+  frame.seq = p_door->seq;
+  frame.count = 1;
+  frame.event[0].pins = p_door->pins;
+  frame.event[0].timestamp = now;
+  frame.tx_time = now;
+  frame.offset = 0;
+  frame.next_ms = p_door->hb.interval_ms;
+  len = gp_encode(&frame, buffer, sizeof(buffer));
+
+  if (now < first_death) {
+    p_result->frames++;
+    p_result->airtime_us += sim_airtime_us(len);
+  }
+  if (sim_random() % 100 < loss_pct)
+    return 0;
+
+  device_update(&frame, i + 1, now, NULL);
+  // Changes are answered with an ACK frame
+  if ((flags & GP_FLAG_ACK_REQ) && now < first_death) {
+    p_result->frames++;
+    p_result->airtime_us += sim_airtime_us(GP_ACK_LEN);
+  }
+  return 1;
+}
+
+// A death is noticed at the latest three intervals plus the grace after the last frame
+// that got through, plus one timer wheel tick. The last frame went out at most one interval before
+// the death.
+#define SIM_DETECT_LIMIT_MS (3 * SIM_HB_MAX_MS + LIVENESS_GRACE_MS + TW_TICK_MS + SIM_TICK_MS)
+
+static void sim_run(uint32_t senders, int adaptive, sim_result_t *p_result)
+{
+  uint32_t first_death = (sim_hours - 1) * 3600000, end = sim_hours * 3600000 + SIM_DETECT_LIMIT_MS;
+  uint32_t now, i;
+  int alert, door;
+  sim_door_t *p_doors = calloc(senders, sizeof(*p_doors));
+  sim_door_t *p;
+  device_t *p_dev;
+
+  memset(p_result, 0, sizeof(*p_result));
+  device_table_init(0);
+
+  for (i = 0; i < senders; i++) {
+    p = &p_doors[i];
+    if (adaptive)
+      hb_init(&p->hb, SIM_HB_MIN_MS, SIM_HB_MAX_MS, SIM_HB_JITTER_PCT, i * 7919 + 1);
+    else
+      hb_init(&p->hb, SIM_HB_MIN_MS, SIM_HB_MIN_MS, 0, 1);
+    // Everybody boots within the first second (power came back)
+    p->next_hb = sim_random() % 1000;
+    p->next_move = sim_exp_ms(move_mean_s);
+    p->dead_at = first_death + sim_random() % 3600000;
+  }
+
+  for (now = 0; now < end; now += SIM_TICK_MS) {
+    for (i = 0; i < senders; i++) {
+      p = &p_doors[i];
+      if (p->dead)
+        continue;
+      if (now >= p->dead_at) {
+        p->dead = 1;
+        continue;
+      }
+
+      // The door moved: the change goes straight out and the heartbeat starts over
+      if (now >= p->next_move) {
+        p->pins ^= 1 << 2;
+        p->seq++;
+        if (adaptive)
+          hb_activity(&p->hb);
+        p->retry_at = now;
+        p->next_hb = now + hb_wait(&p->hb);
+        p->next_move = now + sim_exp_ms(move_mean_s);
+      }
+      if (p->retry_at && now >= p->retry_at)
+        p->retry_at = sim_send(p, i, GP_FLAG_CHANGE | GP_FLAG_ACK_REQ, now, first_death, p_result) ? 0 : now + SIM_RETRY_MS;
+
+      if (now >= p->next_hb) {
+        hb_sent(&p->hb);
+        sim_send(p, i, GP_FLAG_HEARTBEAT, now, first_death, p_result);
+        p->next_hb = now + hb_wait(&p->hb);
+      }
+    }
+
+    // The receiver's device_alerts
+    while ((p_dev = device_expired(now, &alert, &door)) != NULL) {
+      if (alert != DEVICE_SILENT)
+        continue;
+      p = &p_doors[p_dev->device_id - 1];
+      if (!p->dead) {
+        p_result->false_alarms++;
+        if (verbose)
+          printf("  %u s: door %u called silent but alive (promised %u ms)\n", now / 1000, p_dev->device_id, p_dev->next_ms);
+        continue;
+      }
+      if (p->noticed)
+        continue;
+      p->noticed = 1;
+      p_result->detected++;
+      p_result->delay_sum_ms += now - p->dead_at;
+      if (now - p->dead_at > p_result->delay_max_ms)
+        p_result->delay_max_ms = now - p->dead_at;
+    }
+  }
+
+  free(p_doors);
+}
+
+int main(int argc, char *argv[])
+{
+  sim_result_t fixed, adaptive;
+  uint32_t i, n, limit;
+  double seconds;
+  int opt, failures = 0;
+
+  while ((opt = getopt(argc, argv, "H:c:l:v")) != -1) {
+    switch (opt) {
+      case 'H': sim_hours = atoi(optarg); break;
+      case 'c': move_mean_s = atoi(optarg); break;
+      case 'l': loss_pct = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-H hours] [-c mean seconds between door moves] [-l loss %%] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (sim_hours < 2) {
+    fprintf(stderr, "need at least 2 hours (the last one is for the deaths)\n");
+    return 1;
+  }
+
+  limit = SIM_DETECT_LIMIT_MS;
+  seconds = (sim_hours - 1) * 3600.0;
+
+  printf("hbsim: %u h, a door moves every %u s on average, %u%% loss\n", sim_hours, move_mean_s, loss_pct);
+  printf("senders  policy     frames/s  airtime %%  detect mean s  detect worst s  false alarms\n");
+  for (i = 0; i < sizeof(sim_senders) / sizeof(sim_senders[0]); i++) {
+    n = sim_senders[i];
+    sim_run(n, 0, &fixed);
+    sim_run(n, 1, &adaptive);
+
+    printf("%7u  fixed     %9.2f  %9.4f  %13.1f  %14.1f  %12u\n", n, fixed.frames / seconds,
+           fixed.airtime_us / (seconds * 10000), fixed.detected ? fixed.delay_sum_ms / 1000.0 / fixed.detected : 0,
+           fixed.delay_max_ms / 1000.0, fixed.false_alarms);
+    printf("%7u  adaptive  %9.2f  %9.4f  %13.1f  %14.1f  %12u\n", n, adaptive.frames / seconds,
+           adaptive.airtime_us / (seconds * 10000), adaptive.detected ? adaptive.delay_sum_ms / 1000.0 / adaptive.detected : 0,
+           adaptive.delay_max_ms / 1000.0, adaptive.false_alarms);
+
+    if (adaptive.airtime_us >= fixed.airtime_us) {
+      printf("hbsim: FAIL %u senders: adaptive airtime is not below fixed\n", n);
+      failures++;
+    }
+    if (fixed.detected != n || adaptive.detected != n) {
+      printf("hbsim: FAIL %u senders: only %u (fixed) and %u (adaptive) deaths noticed\n", n, fixed.detected, adaptive.detected);
+      failures++;
+    }
+    if (adaptive.delay_max_ms > limit) {
+      printf("hbsim: FAIL %u senders: a death took %u ms to notice, the promise allows %u\n", n, adaptive.delay_max_ms, limit);
+      failures++;
+    }
+  }
+
+  printf("hbsim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+// host_main.c
+// Linux stand-in for receiver_main.c. There is no WiFi or NVS to set up; we start the
+// same tasks app_main starts and run the real udp_server_task against the loopback
+// interface. A stats task prints packets per second, drop rate (from the sequence gaps
+// the device table sees) and processing time percentiles once a second. The stats query
+// endpoint (stats.h) answers too; try gpstat. So does the door state fan-out
+// (pubsub.h); see pubbench. And the status page (httpd.h) on port 8080; see httpbench.
+//
+// Built as receiver_host the receive and processing sides run as two pinned tasks joined
+// by the pipeline ring (see pipeline.h); receiver_host_single is the one task design.
+//
+//   ./receiver_host [-t seconds] [-v level] [-k key]
+//
+// The receiver id in our ANNOUNCE frames is the process id (there is no MAC to use).
+// -t stops after that many seconds and prints a final summary (default: run forever).
+// -v sets the deferred log level (0 none ... 4 every packet, default CONFIG_DLOG_LEVEL).
+// -k is the frame authentication master key, 32 hex digits (see rxauth.h); without it
+// unsigned reports are accepted. loadgen -K signs with the same key.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "functions.h"
+#include "devices.h"
+#include "dlog.h"
+#include "evlog.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "pubsub.h"
+#include "rxauth.h"
+#include "httpd.h"
+
+const char *TAG = "Receiver";
+
+static uint32_t run_seconds;
+
+// Add up what the device table knows about all senders.
+static void host_totals(uint32_t *p_devices, uint64_t *p_events, uint64_t *p_lost)
+{
+  uint32_t i;
+  device_t *p_dev;
+
+  *p_devices = 0;
+  *p_events = 0;
+  *p_lost = 0;
+  for (i = 0; i < DEVICE_TABLE_SIZE; i++) {
+    if ((p_dev = device_slot(i)) == NULL)
+      continue;
+    (*p_devices)++;
+    *p_events += p_dev->packets;
+    *p_lost += p_dev->lost;
+  }
+}
+
+static void host_report(const char *label, uint32_t packets, uint32_t seconds)
+{
+  uint32_t devices;
+  uint64_t events, lost;
+
+  host_totals(&devices, &events, &lost);
+  printf("%s: %u pkt/s, %u packets, %u bad, %u devices, drop %.3f%%, proc ns p50 %u p99 %u p99.9 %u max %u\n",
+         label, seconds ? packets / seconds : 0, rx_stats.packets, rx_stats.bad, devices,
+         events + lost ? 100.0 * lost / (events + lost) : 0.0,
+         hist_percentile(&rx_stats.proc, 500), hist_percentile(&rx_stats.proc, 990),
+         hist_percentile(&rx_stats.proc, 999), rx_stats.proc.max);
+  fflush(stdout);
+}
+
+static void stats_task(void *pvParameters)
+{
+  uint32_t last = 0, elapsed = 0, active = 0;
+  uint32_t now;
+
+  while (1) {
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    elapsed++;
+    now = rx_stats.packets;
+
+    // Only seconds that saw traffic count towards the summary rate
+    if (now != last)
+      active++;
+
+    host_report("1s", now - last, 1);
+    last = now;
+
+    if (run_seconds && elapsed >= run_seconds) {
+      host_report("total", now, active);
+      evlog_flush();
+      printf("evlog: %u events logged in %u flushes, %u writes, %u bytes, %u erases (%.2f bytes/event)\n",
+             evlog_stats.appended, evlog_stats.flushes, evlog_stats.writes, evlog_stats.bytes,
+             evlog_stats.erases, evlog_stats.appended ? (double)evlog_stats.bytes / evlog_stats.appended : 0.0);
+#ifdef CONFIG_RECEIVER_PIPELINE
+      printf("pipeline: %u queued, %u dropped (ring full), max depth %u of %u, %u consumer sleeps, "
+             "ring wait us p50 %u p99 %u p99.9 %u\n", pipeline_stats.pushed, pipeline_stats.full,
+             pipeline_stats.max_depth, PIPELINE_RING_SIZE, pipeline_stats.sleeps,
+             hist_percentile(&pipeline_stats.wait, 500), hist_percentile(&pipeline_stats.wait, 990),
+             hist_percentile(&pipeline_stats.wait, 999));
+#endif
+      printf("latency ms: e2e p50 %u p99 %u max %u (%u events), sender p50 %u p99 %u, network p50 %u p99 %u, "
+             "%u untimed, %u stats requests\n", hist_percentile(&latency_stats.e2e, 500),
+             hist_percentile(&latency_stats.e2e, 990), latency_stats.e2e.max, latency_stats.e2e.count,
+             hist_percentile(&latency_stats.sender, 500), hist_percentile(&latency_stats.sender, 990),
+             hist_percentile(&latency_stats.network, 500), hist_percentile(&latency_stats.network, 990),
+             latency_stats.untimed, latency_stats.requests);
+      printf("pubsub: %u subscribers, %u subscribes (%u dropped), %u expired, %u refused, %u changes marked, "
+             "%u entries in %u frames over %u ticks, %u datagrams sent, %u failed\n", pubsub_stats.subscribers,
+             pubsub_stats.subscribes, pubsub_stats.dropped, pubsub_stats.expired, pubsub_stats.refused,
+             pubsub_stats.marked,
+             pubsub_stats.entries, pubsub_stats.frames, pubsub_stats.flushes, pubsub_stats.sends,
+             pubsub_stats.failed);
+      printf("auth: %u accepted, %u forged, %u replayed, %u unsigned, %u table full\n", rxauth_stats.accepted,
+             rxauth_stats.forged, rxauth_stats.replayed, rxauth_stats.plain, rxauth_stats.full);
+      printf("httpd: %u connections (%u refused, %u timed out), %u requests, %u queries, %u errors, %u renders "
+             "(%u put off, %u truncated), %u bytes sent\n", httpd_stats.accepted, httpd_stats.refused,
+             httpd_stats.timeouts, httpd_stats.requests, httpd_stats.queries, httpd_stats.errors, httpd_stats.renders, httpd_stats.busy,
+             httpd_stats.truncated, httpd_stats.bytes);
+      exit(0);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  uint8_t level = CONFIG_DLOG_LEVEL;
+  const char *key = "";
+
+  while ((opt = getopt(argc, argv, "t:v:k:")) != -1) {
+    switch (opt) {
+      case 't':
+        run_seconds = atoi(optarg);
+        break;
+      case 'v':
+        level = atoi(optarg);
+        break;
+      case 'k':
+        key = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-t seconds] [-v level] [-k key]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  receiver_id = (uint32_t)getpid();
+  if (rxauth_init(key) != 0)
+    return 1;
+  device_table_init(xTaskGetTickCount() * portTICK_PERIOD_MS);
+  evlog_init(xTaskGetTickCount() * portTICK_PERIOD_MS);
+  hist_init(&rx_stats.proc);
+  dlog_init(level);
+  stats_init();
+  xTaskCreate(dlog_task, "dlog", 3072, NULL, 1, NULL);
+  xTaskCreate(stats_server_task, "stats_server", 3072, NULL, 1, NULL);
+  pubsub_init(rx_clock_ms());
+  xTaskCreate(pubsub_task, "pubsub", 3072, NULL, 1, NULL);
+  httpd_init();
+  xTaskCreate(httpd_task, "httpd", 3072, NULL, 1, NULL);
+  xTaskCreate(stats_task, "stats", 3072, NULL, 1, NULL);
+#ifdef CONFIG_RECEIVER_PIPELINE
+  pipeline_init();
+  xTaskCreatePinnedToCore(pipeline_task, "pipeline", 4096, NULL, 5, NULL, PIPELINE_PROCESS_CORE);
+#endif
+
+  // The receive loop gets a task of its own too, so it has a stack rxhealth can measure
+  xTaskCreate((TaskFunction_t)udp_server_task, "udp_server", 4096, NULL, 5, NULL);
+  while (1)
+    pause();
+  return 0;
+}
@@ -0,0 +1,208 @@
+// host_shim.c
+// The FreeRTOS / ESP-IDF calls the receiver sources make, implemented on Linux. Tasks
+// are detached pthreads (pinned ones get a CPU affinity), notifications are a condition
+// variable and ticks are milliseconds of CLOCK_MONOTONIC. There is no WiFi on the host;
+// wifimgr_esp.c isn't built and host/wifisim.c exercises the connection manager's state
+// machine instead.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_system.h"
+
+// Every task gets a HOST_STACK_SIZE stack: plenty for glibc, and small enough that
+// its high water mark fits a HEALTH frame (see rxhealth.h).
+#define HOST_STACK_SIZE (48 * 1024)
+
+// A task is a pthread plus what it needs for direct to task notifications. It lives
+// for ever (so does its handle), just like the receiver's tasks.
+typedef struct {
+  TaskFunction_t function;
+  void *param;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t notify;
+  const uint32_t *p_stack;    // lowest address of its stack
+  size_t stack_size;
+} host_task_t;
+
+static __thread host_task_t *host_current;
+
+static void *host_task_start(void *arg)
+{
+  pthread_attr_t attr;
+  void *p_stack;
+
+  host_current = arg;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    pthread_attr_getstack(&attr, &p_stack, &host_current->stack_size);
+    host_current->p_stack = p_stack;
+    pthread_attr_destroy(&attr);
+  }
+  host_current->function(host_current->param);
+  return NULL;
+}
+
+static host_task_t *host_task_create(TaskFunction_t function, void *param, pthread_t *p_thread)
+{
+  host_task_t *p_task = calloc(1, sizeof(*p_task));
+  pthread_attr_t attr;
+  int result;
+
+  if (p_task == NULL)
+    return NULL;
+  p_task->function = function;
+  p_task->param = param;
+  pthread_mutex_init(&p_task->lock, NULL);
+  pthread_cond_init(&p_task->cond, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, HOST_STACK_SIZE);
+  result = pthread_create(p_thread, &attr, host_task_start, p_task);
+  pthread_attr_destroy(&attr);
+  if (result != 0) {
+    free(p_task);
+    return NULL;
+  }
+  pthread_detach(*p_thread);
+  return p_task;
+}
+
+// Stack size and priority mean nothing here (see HOST_STACK_SIZE); Linux picks the
+// priority.
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *param,
+                       UBaseType_t priority, TaskHandle_t *p_handle)
+{
+  pthread_t thread;
+  host_task_t *p_task = host_task_create(function, param, &thread);
+
+  if (p_handle)
+    *p_handle = p_task;
+  return p_task ? pdPASS : pdFAIL;
+}
+
+// Pinning maps onto CPU affinity (core modulo the CPUs we have).
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack, void *param,
+                                   UBaseType_t priority, TaskHandle_t *p_handle, BaseType_t core)
+{
+  pthread_t thread;
+  cpu_set_t cpus;
+  host_task_t *p_task = host_task_create(function, param, &thread);
+
+  if (p_task == NULL)
+    return pdFAIL;
+  CPU_ZERO(&cpus);
+  CPU_SET(core % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+  if (p_handle)
+    *p_handle = p_task;
+  return pdPASS;
+}
+
+// NULL for the main thread, which isn't a task of ours
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  return host_current;
+}
+
+// A fresh thread stack is mapped zero pages, and nothing touches its low end until the
+// stack grows that far. So, like FreeRTOS painting its stacks, the words still zero at
+// the bottom are the ones never used.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t handle)
+{
+  host_task_t *p_task = handle;
+  size_t i;
+
+  if (p_task == NULL || p_task->p_stack == NULL)
+    return 0;
+  for (i = 0; i < p_task->stack_size / sizeof(uint32_t) && p_task->p_stack[i] == 0; i++)
+    ;
+  return i * sizeof(uint32_t);
+}
+
+// The heap has no fixed size on Linux; what malloc holds free in its arena will do,
+// and the lowest of that we have seen.
+static uint32_t host_heap_min = 0xffffffff;
+
+uint32_t esp_get_free_heap_size(void)
+{
+  uint32_t free_bytes = (uint32_t)mallinfo2().fordblks;
+
+  if (free_bytes < host_heap_min)
+    host_heap_min = free_bytes;
+  return free_bytes;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+  esp_get_free_heap_size();
+  return host_heap_min;
+}
+
+void xTaskNotifyGive(TaskHandle_t handle)
+{
+  host_task_t *p_task = handle;
+
+  pthread_mutex_lock(&p_task->lock);
+  p_task->notify++;
+  pthread_cond_signal(&p_task->cond);
+  pthread_mutex_unlock(&p_task->lock);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  host_task_t *p_task = host_current;
+  struct timespec until;
+  uint32_t value;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += ticks / 1000;
+  until.tv_nsec += (ticks % 1000) * 1000000;
+  if (until.tv_nsec >= 1000000000) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&p_task->lock);
+  while (p_task->notify == 0) {
+    if (pthread_cond_timedwait(&p_task->cond, &p_task->lock, &until) != 0)
+      break;
+  }
+  value = p_task->notify;
+  if (value)
+    p_task->notify = clear ? 0 : value - 1;
+  pthread_mutex_unlock(&p_task->lock);
+  return value;
+}
+
+void vTaskDelete(TaskHandle_t handle)
+{
+  pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  usleep(ticks * 1000 * portTICK_PERIOD_MS);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+char *inet_ntoa_r(in_addr_t addr, char *buf, int buflen)
+{
+  struct in_addr in = { .s_addr = addr };
+  return (char *)inet_ntop(AF_INET, &in, buf, buflen);
+}
@@ -0,0 +1,387 @@
+// httpbench.c
+// Status page benchmark (see httpd.h in ../main). Polls GET /status on receiver_host
+// from a number of connections at once, each sending its next request the moment the
+// last answer is in:
+//
+//   ./httpbench [-a address] [-p port] [-c clients] [-t seconds] [-1]
+//
+// Keep alive by default; -1 opens a new connection for every request (and says
+// Connection: close), which is what a shell script with curl does. Before that one
+// connection sends two requests in one segment, /status and a path that doesn't
+// exist, and must get a 200 and a 404 back in that order. Afterwards the event log
+// (GET /events) is asked for every door's changes, then for the last ones of the first
+// door in that answer, which must all be that door's, and for a door that isn't a hex
+// number, which must get a 400.
+//
+// Measured: requests and megabytes a second and the request latency, send to last
+// byte of the answer. Every answer is checked: a 200 with a Content-Length that
+// matches the body, and a body that is one JSON object with balanced brackets and a
+// doors list.
+//
+// Exits non-zero if any answer is malformed or missing, a connection fails, or no
+// request got answered at all.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "hist.h"
+
+#define CHECK_NAME "httpbench"
+#include "check.h"
+
+#define RESPONSE_MAX (256 * 1024)
+#define MAX_CLIENTS 1024
+
+static const char request_keep[] = "GET /status HTTP/1.1\r\nHost: receiver\r\n\r\n";
+static const char request_close[] = "GET /status HTTP/1.1\r\nHost: receiver\r\nConnection: close\r\n\r\n";
+
+// One polling client
+typedef struct {
+  int sock;
+  uint64_t start_us;        // request sent
+  char *p_buf;              // the answer so far
+  uint32_t got;
+  uint32_t need;            // whole answer, once the headers are in (0 until then)
+} client_t;
+
+static struct sockaddr_in dest;
+static client_t clients[MAX_CLIENTS];
+static hist_t latency;
+static uint64_t answered, bytes;
+static uint32_t last_doors, last_len;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int open_conn(void)
+{
+  int sock, on = 1;
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  if (connect(sock, (struct sockaddr *)&dest, sizeof(dest)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Where the body starts and how long the whole answer is, or 0 if the headers aren't
+// all in yet. -1 if they are but aren't a 200 with a Content-Length.
+static int parse_header(const char *p_buf, uint32_t got, uint32_t *p_need, const char *p_status)
+{
+  const char *p_end, *p;
+
+  p_end = memmem(p_buf, got, "\r\n\r\n", 4);
+  if (p_end == NULL)
+    return 0;
+  if (strncmp(p_buf, p_status, strlen(p_status)) != 0)
+    return -1;
+  p = memmem(p_buf, p_end - p_buf, "Content-Length:", 15);
+  if (p == NULL)
+    return -1;
+  *p_need = (uint32_t)(p_end + 4 - p_buf) + (uint32_t)strtoul(p + 15, NULL, 10);
+  return (int)(p_end + 4 - p_buf);
+}
+
+// Is this the status document? Returns the number of doors in it, -1 if not.
+static int check_body(const char *p_body, uint32_t len)
+{
+  int depth = 0, string = 0, doors = 0;
+  uint32_t i;
+
+  if (len < 2 || p_body[0] != '{' || memcmp(&p_body[len - 2], "}\n", 2) != 0)
+    return -1;
+  for (i = 0; i < len; i++) {
+    if (string) {
+      if (p_body[i] == '\\')
+        i++;
+      else if (p_body[i] == '"')
+        string = 0;
+      continue;
+    }
+    switch (p_body[i]) {
+      case '"':
+        string = 1;
+        break;
+      case '{':
+      case '[':
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (--depth < 0)
+          return -1;
+        break;
+    }
+    // A door is an object two levels down, in the doors list
+    if (p_body[i] == '{' && depth == 3)
+      doors++;
+  }
+  if (depth != 0 || string || memmem(p_body, len, "\"doors\":[", 9) == NULL)
+    return -1;
+  return doors;
+}
+
+// Two requests in one segment: /status then a 404, answered in order on one connection
+static void check_pipelining(void)
+{
+  static char buf[RESPONSE_MAX];
+  static const char two[] = "GET /status HTTP/1.1\r\nHost: receiver\r\n\r\n"
+                            "GET /nothing-here HTTP/1.1\r\nHost: receiver\r\n\r\n";
+  uint32_t got = 0, need = 0, need2 = 0;
+  int sock, n, body = 0, body2 = 0;
+  struct pollfd pfd;
+  uint64_t deadline = now_us() + 2000000;
+
+  sock = open_conn();
+  CHECK(sock >= 0);
+  if (sock < 0)
+    return;
+  CHECK(send(sock, two, sizeof(two) - 1, 0) == sizeof(two) - 1);
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  while (now_us() < deadline && got < sizeof(buf)) {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    if ((n = recv(sock, &buf[got], sizeof(buf) - got, 0)) <= 0)
+      break;
+    got += n;
+    if (body == 0 && (body = parse_header(buf, got, &need, "HTTP/1.1 200 ")) < 0)
+      break;
+    if (body > 0 && got >= need &&
+        (body2 = parse_header(&buf[need], got - need, &need2, "HTTP/1.1 404 ")) != 0 && got >= need + need2)
+      break;
+  }
+  close(sock);
+
+  CHECK(body > 0);
+  CHECK(body2 > 0);
+  if (body > 0) {
+    CHECK(check_body(&buf[body], need - body) >= 0);
+    CHECK(got == need + need2);
+  }
+}
+
+// One request on a connection of its own. Returns where the body starts in p_buf (the
+// answer ends with a NUL), or -1 if the answer isn't there or doesn't have p_status.
+static int fetch(const char *p_path, char *p_buf, uint32_t size, const char *p_status)
+{
+  char request[256];
+  uint32_t got = 0, need = 0;
+  int sock, n, body = 0;
+  struct pollfd pfd;
+  uint64_t deadline = now_us() + 2000000;
+
+  if ((sock = open_conn()) < 0)
+    return -1;
+  n = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: receiver\r\nConnection: close\r\n\r\n", p_path);
+  if (send(sock, request, n, 0) != n) {
+    close(sock);
+    return -1;
+  }
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  while (now_us() < deadline && got < size - 1) {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    if ((n = recv(sock, &p_buf[got], size - 1 - got, 0)) <= 0)
+      break;
+    got += n;
+    if (body == 0 && (body = parse_header(p_buf, got, &need, p_status)) < 0)
+      break;
+    if (body > 0 && got >= need)
+      break;
+  }
+  close(sock);
+  p_buf[got] = '\0';
+  return body > 0 && got == need ? body : -1;
+}
+
+// The event log: every door, then one door, then a bad query
+static void check_events(void)
+{
+  static char buf[RESPONSE_MAX], door[RESPONSE_MAX];
+  char path[64], *p, *p_id;
+  int body, n = 0;
+
+  body = fetch("/events?from=0", buf, sizeof(buf), "HTTP/1.1 200 ");
+  CHECK(body > 0);
+  if (body <= 0)
+    return;
+  CHECK(strstr(&buf[body], "\"events\":[") != NULL && strstr(&buf[body], "\"now_s\":") != NULL);
+  p_id = strstr(&buf[body], "\"id\":\"");
+  CHECK(p_id != NULL);
+  if (p_id == NULL)
+    return;
+  snprintf(path, sizeof(path), "/events?door=%.8s", p_id + 6);
+
+  body = fetch(path, door, sizeof(door), "HTTP/1.1 200 ");
+  CHECK(body > 0);
+  if (body > 0) {
+    for (p = strstr(&door[body], "\"id\":\""); p != NULL; p = strstr(p + 1, "\"id\":\""), n++)
+      CHECK(memcmp(p + 6, p_id + 6, 8) == 0);
+    CHECK(n > 0);
+  }
+
+  CHECK(fetch("/events?door=garage", buf, sizeof(buf), "HTTP/1.1 400 ") > 0);
+}
+
+static int start(client_t *p_cl, int keep_alive)
+{
+  const char *p_req = keep_alive ? request_keep : request_close;
+  int len = keep_alive ? sizeof(request_keep) - 1 : sizeof(request_close) - 1;
+
+  if (p_cl->sock < 0 && (p_cl->sock = open_conn()) < 0)
+    return -1;
+  p_cl->got = 0;
+  p_cl->need = 0;
+  p_cl->start_us = now_us();
+  return send(p_cl->sock, p_req, len, 0) == len ? 0 : -1;
+}
+
+// Take what the socket has. Returns 1 when the answer is complete, 0 if more is to
+// come, -1 if something went wrong.
+static int receive(client_t *p_cl)
+{
+  int n, body, doors;
+
+  n = recv(p_cl->sock, &p_cl->p_buf[p_cl->got], RESPONSE_MAX - p_cl->got, MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 0;
+  if (n <= 0)
+    return -1;
+  p_cl->got += n;
+  body = parse_header(p_cl->p_buf, p_cl->got, &p_cl->need, "HTTP/1.1 200 ");
+  if (body <= 0)
+    return body;
+  if (p_cl->got < p_cl->need)
+    return p_cl->got < RESPONSE_MAX ? 0 : -1;
+  if (p_cl->got > p_cl->need || (doors = check_body(&p_cl->p_buf[body], p_cl->need - body)) < 0)
+    return -1;
+
+  hist_add(&latency, (uint32_t)(now_us() - p_cl->start_us));
+  answered++;
+  bytes += p_cl->need;
+  last_doors = doors;
+  last_len = p_cl->need;
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  const char *p_addr = "127.0.0.1";
+  int opt, port = 8080, n_clients = 16, seconds = 5, keep_alive = 1, i, result;
+  uint64_t start_us, end_us, failed = 0;
+  struct pollfd pfds[MAX_CLIENTS];
+  double elapsed;
+
+  while ((opt = getopt(argc, argv, "a:p:c:t:1")) != -1) {
+    switch (opt) {
+      case 'a':
+        p_addr = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        n_clients = atoi(optarg);
+        break;
+      case 't':
+        seconds = atoi(optarg);
+        break;
+      case '1':
+        keep_alive = 0;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-a address] [-p port] [-c clients] [-t seconds] [-1]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (n_clients < 1 || n_clients > MAX_CLIENTS) {
+    fprintf(stderr, "httpbench: 1 to %d clients\n", MAX_CLIENTS);
+    return 1;
+  }
+
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port);
+  inet_pton(AF_INET, p_addr, &dest.sin_addr);
+  hist_init(&latency);
+
+  check_pipelining();
+
+  for (i = 0; i < n_clients; i++) {
+    clients[i].sock = -1;
+    clients[i].p_buf = malloc(RESPONSE_MAX);
+    if (start(&clients[i], keep_alive) != 0)
+      failed++;
+  }
+
+  start_us = now_us();
+  end_us = start_us + (uint64_t)seconds * 1000000;
+  while (now_us() < end_us) {
+    for (i = 0; i < n_clients; i++) {
+      pfds[i].fd = clients[i].sock;
+      pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, n_clients, 100) <= 0)
+      continue;
+    for (i = 0; i < n_clients; i++) {
+      if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if ((result = receive(&clients[i])) == 0)
+        continue;
+      if (result < 0)
+        failed++;
+      // Next request, on a new connection unless we keep them alive
+      if (result < 0 || !keep_alive) {
+        close(clients[i].sock);
+        clients[i].sock = -1;
+      }
+      if (start(&clients[i], keep_alive) != 0) {
+        failed++;
+        if (clients[i].sock >= 0)
+          close(clients[i].sock);
+        clients[i].sock = -1;
+      }
+    }
+  }
+  elapsed = (now_us() - start_us) / 1e6;
+
+  for (i = 0; i < n_clients; i++) {
+    if (clients[i].sock >= 0)
+      close(clients[i].sock);
+    free(clients[i].p_buf);
+  }
+
+  printf("httpbench: %s, %d clients: %llu requests, %.0f req/s, %.1f MB/s, latency us p50 %u p99 %u max %u, "
+         "%llu failed, last answer %u doors in %u bytes\n", keep_alive ? "keep alive" : "connection per request",
+         n_clients, (unsigned long long)answered, answered / elapsed, bytes / elapsed / 1e6,
+         hist_percentile(&latency, 500), hist_percentile(&latency, 990), latency.max,
+         (unsigned long long)failed, last_doors, last_len);
+
+  check_events();
+
+  CHECK(failed == 0);
+  CHECK(answered > 0);
+  printf("httpbench: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,362 @@
+// loadgen.c
+// Load generator for the receiver. Pretends to be N senders and sends real report
+// frames (see garage_proto.h) round robin at a fixed total rate. Every sender keeps
+// its own sequence number, so the receiver's device table can work out how many
+// packets were dropped.
+//
+// With -A every frame is a change report asking for an ACK and each simulated sender
+// runs the same retransmission logic as the ESP8266 (reliable.c), one frame in flight
+// at a time. -l drops that percentage of frames in both directions (ours on the way
+// out, the receiver's ACKs on the way in) to see what loss does to delivery latency.
+//
+// With -T the frames carry the latency trace trailer (GP_FLAG_TRACE) like the ESP8266's:
+// we sync our clock with the receiver's first (clksync.h) and every event claims to
+// have been detected SIM_DETECT_MS before it went out, as if it had been debounced.
+// The receiver's latency histograms (stats.h, ask with gpstat) should show that plus
+// the trip over loopback.
+//
+// With -K key (the receiver's master key, see gpauth.h) every simulated sender signs its
+// frames with its own derived key, like an ESP8266 with AUTH_KEY set. The epoch is the
+// wall clock in seconds so a second run against the same receiver counts as a reboot.
+//
+// With -H every simulated sender sends a HEALTH frame (see garage_proto.h) once the load
+// is done, with made up but recognisable figures: sender i says it has 20000 + i bytes
+// of heap at the least and 1000 + i % 1000 bytes of its stack never used.
+//
+//   ./loadgen [-n senders] [-r packets/s] [-t seconds] [-c change %] [-a address] [-p port]
+//             [-A] [-l loss %] [-T] [-K key] [-H]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "reliable.h"
+#include "clksync.h"
+#include "hist.h"
+
+// Pace in slices of this many microseconds
+#define SLICE_US 1000
+
+// How long to keep waiting for outstanding ACKs after the run in -A mode
+#define DRAIN_US 20000000
+
+// -T: detection -> transmit we pretend each event took, and how long to wait for
+// each TIME answer
+#define SIM_DETECT_MS 50
+#define SYNC_WAIT_US 100000
+
+typedef struct {
+  uint32_t seq;
+  uint16_t pins;
+  rel_t rel;
+  uint64_t first_us;            // when the frame in flight was first sent
+  uint8_t frame[GP_REPORT_LEN + GP_TRACE_LEN + GP_AUTH_LEN]; // the frame in flight, for retransmits
+  int len;                      // without the auth trailer
+  gp_auth_t auth;               // -K: our key, epoch and counter
+} sim_sender_t;
+
+static int sock;
+static struct sockaddr_in dest;
+static uint32_t loss;
+static uint64_t sent, failed, lost;
+static int traced;
+static int signing;
+static clk_t rx_clock;
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Our clock for timestamps and the trace trailer, ms
+static uint32_t now_ms(void)
+{
+  return (uint32_t)(now_us() / 1000);
+}
+
+static int lossy(void)
+{
+  return loss && (uint32_t)(rand() % 100) < loss;
+}
+
+// Send a frame of len bytes (without the auth trailer; p_buf has room for it), or
+// pretend the air ate it. Traced frames get stamped for this copy and signed frames
+// signed again, just like the sender's retransmit_function does.
+static void lossy_send(sim_sender_t *p_sim, uint8_t *p_buf, int len)
+{
+  if (traced)
+    gp_stamp(p_buf, len, now_ms(), rx_clock.offset);
+  if (signing)
+    len = gp_auth_sign(&p_sim->auth, p_buf, len, len + GP_AUTH_LEN);
+  if (lossy()) {
+    lost++;
+    return;
+  }
+  if (sendto(sock, p_buf, len, 0, (struct sockaddr *)&dest, sizeof(dest)) == len)
+    sent++;
+  else
+    failed++;
+}
+
+// -H: one HEALTH frame from every sender, the way an ESP8266 sends one now and then
+static void send_health(uint32_t senders, uint64_t start)
+{
+  uint8_t buffer[GP_MAX_FRAME];
+  gp_health_t health;
+  uint32_t i;
+  int len;
+
+  memset(&health, 0, sizeof(health));
+  health.uptime_ms = (uint32_t)((now_us() - start) / 1000);
+  health.vdd_mv = 3300;
+  health.count = 1;
+  memcpy(health.stack[0].name, "sys", 3);
+  for (i = 0; i < senders; i++) {
+    health.device_id = i + 1;
+    health.heap_free = 30000 + i;
+    health.heap_min = 20000 + i;
+    health.callback_us = 100 + i % 50;
+    health.stack[0].unused = 1000 + i % 1000;
+    len = gp_encode_health(&health, buffer, sizeof(buffer));
+    if (sendto(sock, buffer, len, 0, (struct sockaddr *)&dest, sizeof(dest)) == len)
+      sent++;
+    else
+      failed++;
+  }
+}
+
+// Sync our clock with the receiver's the way the ESP8266 does: CLK_BURST TIME
+// exchanges, keeping the one with the smallest round trip. Returns 0 if we got an offset.
+static int clock_sync(void)
+{
+  uint8_t buffer[GP_MAX_FRAME];
+  gp_frame_t frame;
+  uint64_t start;
+  int len, i;
+
+  clk_init(&rx_clock, 0);
+  for (i = 0; i < CLK_BURST * 2 && rx_clock.samples < CLK_BURST; i++) {
+    frame.type = GP_TYPE_TIME_REQ;
+    frame.flags = 0;
+    frame.device_id = 1;
+    frame.seq = clk_request(&rx_clock, now_ms());
+    len = gp_encode(&frame, buffer, sizeof(buffer));
+    sendto(sock, buffer, len, 0, (struct sockaddr *)&dest, sizeof(dest));
+
+    start = now_us();
+    while (now_us() - start < SYNC_WAIT_US) {
+      len = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (len > 0 && gp_decode(buffer, len, &frame) == 0 && frame.type == GP_TYPE_TIME) {
+        clk_sample(&rx_clock, frame.seq, frame.rx_time, frame.tx_time, now_ms());
+        break;
+      }
+      usleep(SLICE_US);
+    }
+  }
+  return rx_clock.offset == GP_OFFSET_UNKNOWN ? -1 : 0;
+}
+
+// Collect whatever ACKs have arrived. Returns the number of frames completed.
+static uint32_t drain_acks(sim_sender_t *p_sim, uint32_t senders, hist_t *p_latency)
+{
+  uint8_t buffer[GP_MAX_FRAME];
+  gp_frame_t ack;
+  uint32_t done = 0;
+  uint64_t now;
+  int len;
+
+  while ((len = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+    if (gp_decode(buffer, len, &ack) != 0 || ack.type != GP_TYPE_ACK)
+      continue;
+    if (ack.device_id == 0 || ack.device_id > senders || lossy())
+      continue;
+    now = now_us();
+    if (rel_ack(&p_sim[ack.device_id - 1].rel, ack.seq, (uint32_t)(now / 1000))) {
+      hist_add(p_latency, (uint32_t)(now - p_sim[ack.device_id - 1].first_us));
+      done++;
+    }
+  }
+  return done;
+}
+
+// Resend whatever is overdue. Returns the number of frames still in flight.
+static uint32_t retransmit(sim_sender_t *p_sim, uint32_t senders)
+{
+  uint32_t i, inflight = 0, now = (uint32_t)(now_us() / 1000);
+
+  for (i = 0; i < senders; i++) {
+    if (!p_sim[i].rel.inflight)
+      continue;
+    if (rel_expired(&p_sim[i].rel, now) == 1)
+      lossy_send(&p_sim[i], p_sim[i].frame, p_sim[i].len);
+    inflight += p_sim[i].rel.inflight;
+  }
+  return inflight;
+}
+
+int main(int argc, char *argv[])
+{
+  uint32_t senders = 100, rate = 10000, seconds = 5, change = 5;
+  const char *address = "127.0.0.1";
+  int port = GP_PORT, acked = 0, health = 0;
+  int opt, len;
+  uint32_t next = 0, i;
+  uint64_t start, due, issued = 0, busy = 0, delivered = 0, gave_up = 0, retransmits = 0;
+  sim_sender_t *p_sim, *p;
+  uint8_t buffer[GP_MAX_FRAME], master[GP_AUTH_KEY_LEN];
+  gp_frame_t frame;
+  hist_t latency;
+
+  while ((opt = getopt(argc, argv, "n:r:t:c:a:p:Al:TK:H")) != -1) {
+    switch (opt) {
+      case 'n': senders = atoi(optarg); break;
+      case 'r': rate = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'c': change = atoi(optarg); break;
+      case 'a': address = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      case 'A': acked = 1; break;
+      case 'l': loss = atoi(optarg); break;
+      case 'T': traced = 1; break;
+      case 'H': health = 1; break;
+      case 'K':
+        if (gp_auth_key(optarg, master) != 0) {
+          fprintf(stderr, "key must be 32 hex digits\n");
+          return 1;
+        }
+        signing = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n senders] [-r packets/s] [-t seconds] [-c change %%] [-a address] [-p port] [-A] [-l loss %%] [-T] [-K key] [-H]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (senders == 0 || rate == 0) {
+    fprintf(stderr, "need at least one sender and a non-zero rate\n");
+    return 1;
+  }
+
+  p_sim = calloc(senders, sizeof(*p_sim));
+  if (p_sim == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  for (i = 0; i < senders; i++) {
+    rel_init(&p_sim[i].rel);
+    if (signing) {
+      gp_auth_derive(master, i + 1, p_sim[i].auth.key);
+      p_sim[i].auth.epoch = (uint32_t)time(NULL);
+    }
+  }
+  hist_init(&latency);
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(port);
+  inet_pton(AF_INET, address, &dest.sin_addr);
+
+  if (traced) {
+    if (clock_sync() != 0) {
+      fprintf(stderr, "no TIME answer from %s\n", address);
+      return 1;
+    }
+    printf("loadgen: receiver clock offset %d ms, rtt %u ms\n", rx_clock.offset, rx_clock.rtt_ms);
+  }
+
+  frame.type = GP_TYPE_REPORT;
+  frame.count = 1;
+
+  start = now_us();
+  while (now_us() - start < (uint64_t)seconds * 1000000) {
+
+    // Catch up to where the clock says we should be, then nap for a slice
+    due = (now_us() - start) * rate / 1000000;
+    while (issued < due) {
+      issued++;
+      p = &p_sim[next];
+      // Device id 0 is reserved, so sender i is i + 1
+      frame.device_id = next + 1;
+      next = (next + 1) % senders;
+
+      // One frame in flight per sender, just like the real thing
+      if (acked && p->rel.inflight) {
+        busy++;
+        continue;
+      }
+
+      frame.seq = p->seq++;
+      if ((uint32_t)(rand() % 100) < change)
+        p->pins ^= 1 << 2;
+      frame.flags = acked ? GP_FLAG_CHANGE | GP_FLAG_ACK_REQ : 0;
+      frame.event[0].pins = p->pins;
+      frame.event[0].timestamp = (uint32_t)((now_us() - start) / 1000);
+      if (traced) {
+        // lossy_send fills in the trailer
+        frame.flags |= GP_FLAG_TRACE;
+        frame.event[0].timestamp = now_ms() - SIM_DETECT_MS;
+      }
+
+      if (acked) {
+        p->len = gp_encode(&frame, p->frame, sizeof(p->frame));
+        p->first_us = now_us();
+        rel_sent(&p->rel, frame.seq, (uint32_t)(p->first_us / 1000));
+        lossy_send(p, p->frame, p->len);
+      } else {
+        len = gp_encode(&frame, buffer, sizeof(buffer));
+        lossy_send(p, buffer, len);
+      }
+    }
+
+    if (acked) {
+      drain_acks(p_sim, senders, &latency);
+      retransmit(p_sim, senders);
+    }
+    usleep(SLICE_US);
+  }
+  if (health)
+    send_health(senders, start);
+
+  printf("loadgen: %u senders, %llu sent, %llu failed, %llu lost, %.0f pkt/s\n", senders,
+         (unsigned long long)sent, (unsigned long long)failed, (unsigned long long)lost,
+         (double)sent * 1000000 / (now_us() - start));
+
+  if (acked) {
+    // Give the frames still in flight a chance to finish (or give up)
+    start = now_us();
+    while (now_us() - start < DRAIN_US) {
+      drain_acks(p_sim, senders, &latency);
+      if (retransmit(p_sim, senders) == 0)
+        break;
+      usleep(SLICE_US);
+    }
+    for (i = 0; i < senders; i++) {
+      delivered += p_sim[i].rel.acked;
+      gave_up += p_sim[i].rel.failed;
+      retransmits += p_sim[i].rel.retransmits;
+    }
+    printf("loadgen: loss %u%%, %llu delivered, %llu gave up, %llu retransmits, %llu busy, "
+           "latency us p50 %u p99 %u max %u\n", loss,
+           (unsigned long long)delivered, (unsigned long long)gave_up,
+           (unsigned long long)retransmits, (unsigned long long)busy,
+           hist_percentile(&latency, 500), hist_percentile(&latency, 990), latency.max);
+  }
+
+  close(sock);
+  return 0;
+}
@@ -0,0 +1,364 @@
+// powersim.c
+// Host-side energy and latency model of the sender's two designs, driven by a door event
+// trace: the always-on soft-AP with its heartbeat timer (user_main.c in sender/) and the
+// deep sleep mode (LOW_POWER, lowpower.c). No radio and no firmware: the same events go
+// through each design's timeline and every state draws a current for as long as it lasts.
+//
+//   ./powersim [-f trace] [-d days] [-c mean seconds between door moves] [-a association ms]
+//              [-s sleep s] [-b battery mAh] [-v]
+//
+// A trace is one event per line, milliseconds since the start and the pins in hex
+// ("#" starts a comment), in time order. Without -f we make one up: -d days (default 7)
+// of a door that opens at random (exponential, mean -c, default 30 minutes) and closes
+// again 10 s to 5 minutes later.
+//
+//   always-on  the radio never goes off. A change goes out when the debounce confirms it
+//              and is acknowledged within a round trip; heartbeats follow heartbeat.c (the
+//              real code) with the sender's defaults.
+//   low power  a change resets the chip out of deep sleep, and so does the heartbeat
+//              deadline (-s, default SLEEP_HEARTBEAT_S). Each wake boots, waits for the
+//              receiver to associate and answer a DISCOVER (-a, default 2500 ms), sends the
+//              batch and waits for its ACK. A change while awake resets the chip again and
+//              the wake starts over with the events so far still queued; more than
+//              GP_BATCH_MAX pending drops the oldest, as lowpower_queue does.
+//
+// The currents are rough ESP8266 datasheet figures; the receiver is always there to
+// associate. Prints, for each design, wakes per day, time awake per event, radio on time
+// per day, charge per day, battery life and delivery latency, then how many events a day
+// low power mode can take before it costs more than always-on. Exits non-zero if a
+// change is neither delivered nor dropped for a full queue, or low power mode doesn't
+// use less charge than always-on for the trace.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "garage_proto.h"
+#include "heartbeat.h"
+
+// The sender's defaults (see user_config.h)
+#define SIM_DEBOUNCE_MS 50
+#define SIM_HB_MIN_MS 5000
+#define SIM_HB_MAX_MS 60000
+#define SIM_HB_JITTER_PCT 20
+#define SIM_SLEEP_S 3600
+
+// Currents (mA) and how long the short states last (ms)
+#define SIM_AP_MA 70.0          // soft-AP up, radio listening (no modem sleep as an AP)
+#define SIM_TX_MA 170.0         // sending a frame
+#define SIM_TX_MS 1.0
+#define SIM_BOOT_MA 20.0        // boot to init_done, radio still off
+#define SIM_BOOT_MS 300.0
+#define SIM_SLEEP_MA 0.02       // deep sleep
+#define SIM_RTT_MS 10.0         // frame out, ACK back
+
+#define SIM_DAY_MS 86400000.0
+
+typedef struct {
+  uint64_t ms;
+  uint16_t pins;
+} sim_event_t;
+
+typedef struct {
+  double wakes;
+  double awake_ms;        // chip running, radio or not
+  double radio_ms;
+  double mas;             // charge, mA ms
+  uint32_t frames;
+  uint32_t delivered;
+  uint32_t dropped;
+  double *p_latency;      // ms, one per delivered event
+} sim_result_t;
+
+static int verbose;
+static uint32_t sim_days = 7;
+static uint32_t move_mean_s = 1800;
+static double assoc_ms = 2500;
+static uint32_t sleep_s = SIM_SLEEP_S;
+static double battery_mah = 2000;
+static uint32_t sim_rand = 12345;
+
+static sim_event_t *p_events;
+static uint32_t event_count;
+static uint64_t trace_ms;
+
+static uint32_t sim_random(void)
+{
+  sim_rand ^= sim_rand << 13;
+  sim_rand ^= sim_rand >> 17;
+  sim_rand ^= sim_rand << 5;
+  return sim_rand;
+}
+
+static void sim_add(uint64_t ms, uint16_t pins)
+{
+  if (event_count % 1024 == 0)
+    p_events = realloc(p_events, (event_count + 1024) * sizeof(sim_event_t));
+  p_events[event_count].ms = ms;
+  p_events[event_count].pins = pins;
+  event_count++;
+}
+
+// -d days of one door opening at random and closing again
+static void sim_generate(void)
+{
+  uint64_t now = 0, end = (uint64_t)sim_days * 86400000;
+  double u;
+
+  for (;;) {
+    u = (sim_random() % 1000000 + 1) / 1000001.0;
+    now += (uint64_t)(-(double)move_mean_s * 1000.0 * log(u)) + 1;
+    if (now >= end)
+      break;
+    sim_add(now, 0x0004);
+    now += 10000 + sim_random() % 290000;
+    if (now >= end)
+      break;
+    sim_add(now, 0x0000);
+  }
+  trace_ms = end;
+}
+
+static int sim_load(const char *p_name)
+{
+  char line[128];
+  unsigned long long ms;
+  unsigned pins;
+  FILE *p_file = fopen(p_name, "r");
+
+  if (p_file == NULL) {
+    perror(p_name);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), p_file)) {
+    if (line[0] == '#' || sscanf(line, "%llu %x", &ms, &pins) != 2)
+      continue;
+    if (event_count && ms < p_events[event_count - 1].ms) {
+      fprintf(stderr, "%s: events out of order at %llu ms\n", p_name, ms);
+      fclose(p_file);
+      return -1;
+    }
+    sim_add(ms, pins);
+  }
+  fclose(p_file);
+  // Round up to whole days so the heartbeats and sleep of the last one count too
+  trace_ms = event_count ? p_events[event_count - 1].ms + 1 : 1;
+  trace_ms = (trace_ms + 86399999) / 86400000 * 86400000;
+  return 0;
+}
+
+static void sim_charge(sim_result_t *p_result, double ma, double ms)
+{
+  p_result->mas += ma * ms;
+}
+
+// The always-on sender: radio on the whole time, one frame (and its ACK) per change and
+// the heartbeats in between.
+static void sim_always_on(sim_result_t *p_result)
+{
+  uint64_t now = 0, next_hb;
+  uint16_t pins = 0xffff;
+  uint32_t i = 0;
+  hb_t hb;
+
+  hb_init(&hb, SIM_HB_MIN_MS, SIM_HB_MAX_MS, SIM_HB_JITTER_PCT, 1);
+  next_hb = hb_wait(&hb);
+  p_result->awake_ms = p_result->radio_ms = trace_ms;
+  sim_charge(p_result, SIM_AP_MA, trace_ms);
+
+  while (now < trace_ms) {
+    if (i < event_count && p_events[i].ms <= next_hb) {
+      now = p_events[i].ms;
+      if (p_events[i++].pins == pins)
+        continue;
+      pins = p_events[i - 1].pins;
+      hb_activity(&hb);
+      p_result->frames++;
+      p_result->p_latency[p_result->delivered++] = SIM_DEBOUNCE_MS + SIM_RTT_MS;
+      next_hb = now + SIM_DEBOUNCE_MS + hb_wait(&hb);
+    } else {
+      now = next_hb;
+      hb_sent(&hb);
+      p_result->frames++;
+      next_hb = now + hb_wait(&hb);
+    }
+  }
+  sim_charge(p_result, SIM_TX_MA - SIM_AP_MA, p_result->frames * SIM_TX_MS);
+}
+
+// The deep sleep sender (see lowpower.c)
+static void sim_low_power(sim_result_t *p_result)
+{
+  uint64_t queued[GP_BATCH_MAX], wake = 0, done, sleep_at;
+  uint32_t i = 0, count = 0, n;
+  uint16_t last_pins = 0xffff;
+  double ms;
+
+  // The first boot has the door's state to tell
+  queued[count++] = 0;
+
+  while (wake < trace_ms) {
+    p_result->wakes++;
+    sim_charge(p_result, SIM_BOOT_MA, SIM_BOOT_MS);
+    if (count == 0) {
+      // A reset bounce or nothing new: back to sleep without touching the radio
+      done = wake + SIM_BOOT_MS;
+      p_result->awake_ms += SIM_BOOT_MS;
+    } else {
+      done = wake + SIM_BOOT_MS + assoc_ms + SIM_RTT_MS;
+      // A door moving before we are done resets us; the wake starts over from there
+      if (i < event_count && p_events[i].ms < done) {
+        ms = p_events[i].ms - wake;
+        p_result->awake_ms += ms;
+        if (ms > SIM_BOOT_MS) {
+          p_result->radio_ms += ms - SIM_BOOT_MS;
+          sim_charge(p_result, SIM_AP_MA, ms - SIM_BOOT_MS);
+        }
+        goto reset;
+      }
+      p_result->awake_ms += done - wake;
+      p_result->radio_ms += assoc_ms + SIM_RTT_MS;
+      sim_charge(p_result, SIM_AP_MA, assoc_ms + SIM_RTT_MS);
+      sim_charge(p_result, SIM_TX_MA - SIM_AP_MA, SIM_TX_MS);
+      p_result->frames++;
+      for (n = 0; n < count; n++)
+        p_result->p_latency[p_result->delivered++] = done - queued[n];
+      count = 0;
+    }
+
+    // Asleep until the heartbeat deadline or the next change, whichever comes first
+    sleep_at = done;
+    if (i < event_count && p_events[i].ms < sleep_at + (uint64_t)sleep_s * 1000) {
+      sim_charge(p_result, SIM_SLEEP_MA, p_events[i].ms - sleep_at);
+      goto reset;
+    }
+    wake = sleep_at + (uint64_t)sleep_s * 1000;
+    sim_charge(p_result, SIM_SLEEP_MA, wake - sleep_at);
+    queued[count++] = wake;
+    continue;
+
+reset:
+    // The reset pulse: the door state as it is now goes in the queue if it changed
+    wake = p_events[i].ms;
+    if (p_events[i].pins != last_pins) {
+      if (count == GP_BATCH_MAX) {
+        memmove(&queued[0], &queued[1], (GP_BATCH_MAX - 1) * sizeof(queued[0]));
+        count--;
+        p_result->dropped++;
+      }
+      queued[count++] = wake;
+      last_pins = p_events[i].pins;
+    }
+    i++;
+  }
+}
+
+static int sim_compare(const void *p_a, const void *p_b)
+{
+  double a = *(const double *)p_a, b = *(const double *)p_b;
+
+  return a < b ? -1 : a > b;
+}
+
+static void sim_print(const char *p_name, sim_result_t *p_result, uint32_t events)
+{
+  double days = trace_ms / SIM_DAY_MS, mah_day = p_result->mas / 3600000.0 / days;
+  uint32_t n = p_result->delivered;
+
+  qsort(p_result->p_latency, n, sizeof(double), sim_compare);
+  printf("%-10s %9.1f %9.2f %10.0f %8.2f %8.0f %8.0f %8.0f %8.0f %7u\n", p_name, p_result->wakes / days,
+         events ? p_result->awake_ms / 1000.0 / events : 0.0, p_result->radio_ms / 1000.0 / days, mah_day,
+         battery_mah / mah_day, n ? p_result->p_latency[n / 2] : 0.0,
+         n ? p_result->p_latency[n * 99 / 100] : 0.0, n ? p_result->p_latency[n - 1] : 0.0,
+         p_result->dropped);
+}
+
+int main(int argc, char **argv)
+{
+  sim_result_t always_on, low_power;
+  const char *p_trace = NULL;
+  double wake_mas, day_mas, hb_wakes, even;
+  uint32_t changes = 0, i;
+  uint16_t pins = 0xffff;
+  int opt, ok = 1;
+
+  while ((opt = getopt(argc, argv, "f:d:c:a:s:b:v")) != -1) {
+    switch (opt) {
+      case 'f': p_trace = optarg; break;
+      case 'd': sim_days = atoi(optarg); break;
+      case 'c': move_mean_s = atoi(optarg); break;
+      case 'a': assoc_ms = atof(optarg); break;
+      case 's': sleep_s = atoi(optarg); break;
+      case 'b': battery_mah = atof(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-f trace] [-d days] [-c mean s] [-a association ms] [-s sleep s] "
+                "[-b battery mAh] [-v]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (sim_days == 0 || move_mean_s == 0 || sleep_s == 0) {
+    fprintf(stderr, "powersim: -d, -c and -s must be more than 0\n");
+    return 2;
+  }
+
+  if (p_trace) {
+    if (sim_load(p_trace) < 0)
+      return 2;
+  } else {
+    sim_generate();
+  }
+  for (i = 0; i < event_count; i++) {
+    if (p_events[i].pins != pins)
+      changes++;
+    pins = p_events[i].pins;
+  }
+
+  memset(&always_on, 0, sizeof(always_on));
+  memset(&low_power, 0, sizeof(low_power));
+  always_on.p_latency = malloc((event_count + 1) * sizeof(double));
+  // Every change, the first boot and every heartbeat wake
+  low_power.p_latency = malloc((event_count + 1 + trace_ms / ((uint64_t)sleep_s * 1000) + 1) * sizeof(double));
+  sim_always_on(&always_on);
+  sim_low_power(&low_power);
+
+  printf("%u events (%u changes) over %.1f days, association %.0f ms, sleep %u s, battery %.0f mAh\n",
+         event_count, changes, trace_ms / SIM_DAY_MS, assoc_ms, sleep_s, battery_mah);
+  printf("design     wakes/day  s/event  radio s/day  mAh/day     days   p50 ms   p99 ms   max ms dropped\n");
+  sim_print("always-on", &always_on, changes);
+  sim_print("low power", &low_power, changes);
+
+  // Charge a day for low power mode is the sleep, the heartbeat wakes and one wake per
+  // event; always-on is the radio all day. Where they meet:
+  wake_mas = SIM_BOOT_MA * SIM_BOOT_MS + SIM_AP_MA * (assoc_ms + SIM_RTT_MS) + (SIM_TX_MA - SIM_AP_MA) * SIM_TX_MS;
+  hb_wakes = SIM_DAY_MS / ((double)sleep_s * 1000);
+  day_mas = SIM_AP_MA * SIM_DAY_MS;
+  even = (day_mas - SIM_SLEEP_MA * SIM_DAY_MS) / wake_mas - hb_wakes;
+  printf("low power costs %.1f mAs a wake and uses less than always-on up to %.0f changes a day\n",
+         wake_mas / 1000, even);
+  if (verbose)
+    printf("frames: always-on %u, low power %u\n", always_on.frames, low_power.frames);
+
+  // Low power mode also delivers a state from the first boot and every heartbeat wake
+  if (always_on.delivered != changes) {
+    fprintf(stderr, "powersim: always-on delivered %u of %u changes\n", always_on.delivered, changes);
+    ok = 0;
+  }
+  if (low_power.delivered + low_power.dropped < changes) {
+    fprintf(stderr, "powersim: low power lost %u of %u changes\n",
+            changes - low_power.delivered - low_power.dropped, changes);
+    ok = 0;
+  }
+  if (low_power.mas >= always_on.mas) {
+    fprintf(stderr, "powersim: low power mode used more charge than always-on\n");
+    ok = 0;
+  }
+
+  printf("powersim: %s\n", ok ? "PASS" : "FAIL");
+  free(always_on.p_latency);
+  free(low_power.p_latency);
+  free(p_events);
+  return ok ? 0 : 1;
+}
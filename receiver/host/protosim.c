@@ -0,0 +1,425 @@
+// protosim.c
+// Host-side test and benchmark of the wire format (garage_proto.c in common/, the code
+// both firmwares run).
+//
+//   ./protosim [-n frames]
+//
+// Checks, exit non-zero on failure:
+//   - every frame type survives encode, decode and encode again byte for byte: reports
+//     and batches of 1 to GP_BATCH_MAX events with and without the liveness and trace
+//     trailers, ACK, DISCOVER, ANNOUNCE, TIME_REQ, TIME, STATS_REQ, STATS, SUBSCRIBE,
+//     NOTIFY, HEALTH, OTA_DATA, OTA_REQ, TUNE and TUNE_ACK, and the fields come back
+//     as they went in
+//   - every truncation of each of them is GP_ERR_SHORT, never a frame
+//   - each of them with junk after it, up to twice GP_MAX_FRAME, decodes the same
+//   - the encoders turn down a buffer one byte too small, and batches, NOTIFY, HEALTH,
+//     OTA_DATA and TUNE frames with more entries than fit
+//   - a bad magic, version or type, or a count over the limit, is turned away
+//   - n random datagrams through gp_decode never read past their end (run it under
+//     valgrind or -fsanitize=address to be sure of that one)
+// and it prints what a report and a full batch cost to encode and decode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "garage_proto.h"
+
+#define CHECK_NAME "protosim"
+#include "check.h"
+
+#define SIM_DEVICE 0x00c0ffee
+#define SIM_ROUNDS 1000000
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// What a frame type's own encoder makes of an encoded frame, for the round trips
+static int sim_reencode(const uint8_t *p_buf, int len, uint8_t *p_out, size_t out_len)
+{
+  gp_health_t health;
+  gp_frame_t frame;
+  gp_tune_t tune;
+  gp_ota_t ota;
+  int n;
+
+  if (gp_decode(p_buf, len, &frame) != 0)
+    return -1;
+  switch (frame.type) {
+    // The encoder only writes the header; the entries are copied in by the receiver
+    case GP_TYPE_NOTIFY:
+      n = gp_encode(&frame, p_out, out_len);
+      if (n > GP_NOTIFY_HEADER_LEN)
+        memcpy(p_out + GP_NOTIFY_HEADER_LEN, p_buf + GP_NOTIFY_HEADER_LEN, n - GP_NOTIFY_HEADER_LEN);
+      return n;
+    case GP_TYPE_HEALTH:
+      return gp_decode_health(p_buf, len, &health) == 0 ? gp_encode_health(&health, p_out, out_len) : -1;
+    case GP_TYPE_OTA_DATA:
+    case GP_TYPE_OTA_REQ:
+      return gp_decode_ota(p_buf, len, &ota) == 0 ? gp_encode_ota(&ota, p_out, out_len) : -1;
+    case GP_TYPE_TUNE:
+    case GP_TYPE_TUNE_ACK:
+      return gp_decode_tune(p_buf, len, &tune) == 0 ? gp_encode_tune(&tune, p_out, out_len) : -1;
+    default:
+      return gp_encode(&frame, p_out, out_len);
+  }
+}
+
+// Round trip, truncation and trailing junk for one encoded frame. whole: every byte up
+// to len is needed (STATS bodies and OTA_DATA deltas are as long as the datagram, so
+// only their headers are).
+static void sim_frame(const char *p_name, const uint8_t *p_buf, int len, int whole)
+{
+  uint8_t junk[2 * GP_OTA_MAX_FRAME], out[2 * GP_OTA_MAX_FRAME];
+  gp_frame_t frame;
+  int i, n, need;
+
+  n = sim_reencode(p_buf, len, out, sizeof(out));
+  if (n != len || memcmp(p_buf, out, len) != 0) {
+    printf("protosim: FAIL %s: %d bytes in, %d back out%s\n", p_name, len, n, n == len ? ", different" : "");
+    failures++;
+  }
+
+  need = whole ? len : GP_HEADER_LEN;
+  for (i = 0; i < need; i++) {
+    if (gp_decode(p_buf, i, &frame) != GP_ERR_SHORT) {
+      printf("protosim: FAIL %s cut to %d of %d bytes decodes\n", p_name, i, len);
+      failures++;
+      break;
+    }
+  }
+
+  // Longer than it says: what follows is somebody else's problem
+  memcpy(junk, p_buf, len);
+  for (i = len; i < (int)sizeof(junk); i++)
+    junk[i] = (uint8_t)(i * 37);
+  if (whole) {
+    n = sim_reencode(junk, 2 * GP_MAX_FRAME, out, sizeof(out));
+    if (n != len || memcmp(p_buf, out, len) != 0) {
+      printf("protosim: FAIL %s with junk after it came back %d bytes\n", p_name, n);
+      failures++;
+    }
+  }
+}
+
+static void sim_report(gp_frame_t *p_frame, uint8_t type, uint8_t flags, int count)
+{
+  int i;
+
+  memset(p_frame, 0, sizeof(*p_frame));
+  p_frame->type = type;
+  p_frame->flags = flags;
+  p_frame->device_id = SIM_DEVICE;
+  p_frame->seq = 0xfedcba98;
+  p_frame->count = count;
+  for (i = 0; i < count; i++) {
+    p_frame->event[i].pins = 0x8001 + i;
+    p_frame->event[i].timestamp = 0xf0000000 + i * 1111;
+  }
+  p_frame->next_ms = 60000;
+  p_frame->tx_time = 0xf0012345;
+  p_frame->offset = -123456;
+}
+
+static void sim_checks(void)
+{
+  static const uint8_t flags[] = {
+    0, GP_FLAG_LIVENESS, GP_FLAG_TRACE, GP_FLAG_LIVENESS | GP_FLAG_TRACE | GP_FLAG_CHANGE
+  };
+  uint8_t buf[GP_OTA_MAX_FRAME], data[GP_OTA_CHUNK];
+  gp_frame_t frame, back;
+  gp_health_t health;
+  gp_tune_t tune;
+  gp_ota_t ota;
+  char name[48];
+  int i, j, len;
+
+  // Reports and batches, every trailer combination
+  for (i = 0; i < (int)sizeof(flags); i++) {
+    sim_report(&frame, GP_TYPE_REPORT, flags[i], 1);
+    len = gp_encode(&frame, buf, sizeof(buf));
+    CHECK(len == GP_REPORT_LEN + (flags[i] & GP_FLAG_LIVENESS ? GP_LIVENESS_LEN : 0) +
+                 (flags[i] & GP_FLAG_TRACE ? GP_TRACE_LEN : 0));
+    CHECK(gp_encode(&frame, buf, len - 1) == 0);
+    CHECK(gp_decode(buf, len, &back) == 0 && back.type == GP_TYPE_REPORT && back.flags == flags[i] &&
+          back.device_id == SIM_DEVICE && back.seq == 0xfedcba98 && back.count == 1 &&
+          back.event[0].pins == 0x8001 && back.event[0].timestamp == 0xf0000000);
+    if (flags[i] & GP_FLAG_LIVENESS)
+      CHECK(back.next_ms == 60000);
+    if (flags[i] & GP_FLAG_TRACE)
+      CHECK(back.tx_time == 0xf0012345 && back.offset == -123456);
+    snprintf(name, sizeof(name), "report flags %02x", flags[i]);
+    sim_frame(name, buf, len, 1);
+
+    for (j = 1; j <= GP_BATCH_MAX; j++) {
+      sim_report(&frame, GP_TYPE_BATCH, flags[i], j);
+      len = gp_encode(&frame, buf, sizeof(buf));
+      CHECK(len > 0 && len <= GP_MAX_FRAME - GP_AUTH_LEN);
+      CHECK(gp_encode(&frame, buf, len - 1) == 0);
+      CHECK(gp_decode(buf, len, &back) == 0 && back.count == j && back.event[j - 1].pins == 0x8001 + j - 1 &&
+            back.event[j - 1].timestamp == 0xf0000000 + (j - 1) * 1111u);
+      snprintf(name, sizeof(name), "batch of %d flags %02x", j, flags[i]);
+      sim_frame(name, buf, len, 1);
+    }
+  }
+  sim_report(&frame, GP_TYPE_BATCH, 0, 0);
+  CHECK(gp_encode(&frame, buf, sizeof(buf)) == 0);
+  frame.count = GP_BATCH_MAX + 1;
+  CHECK(gp_encode(&frame, buf, sizeof(buf)) == 0);
+  sim_report(&frame, GP_TYPE_BATCH, 0, 1);
+  len = gp_encode(&frame, buf, sizeof(buf));
+  buf[12] = GP_BATCH_MAX + 1;
+  CHECK(gp_decode(buf, sizeof(buf), &back) == GP_ERR_TYPE);
+  buf[12] = 0;
+  CHECK(gp_decode(buf, sizeof(buf), &back) == GP_ERR_TYPE);
+
+  // The fixed size ones
+  sim_report(&frame, GP_TYPE_ACK, 0, 0);
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_ACK_LEN);
+  CHECK(gp_encode(&frame, buf, GP_ACK_LEN - 1) == 0);
+  sim_frame("ack", buf, len, 1);
+  sim_report(&frame, GP_TYPE_BATCH, 0, 5);
+  CHECK(gp_encode_ack(&frame, buf, sizeof(buf)) == GP_ACK_LEN && gp_decode(buf, GP_ACK_LEN, &back) == 0 &&
+        back.type == GP_TYPE_ACK && back.seq == 0xfedcba98 + 4);
+  sim_report(&frame, GP_TYPE_DISCOVER, 0, 0);
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_DISCOVER_LEN);
+  sim_frame("discover", buf, len, 1);
+  sim_report(&frame, GP_TYPE_ANNOUNCE, 0, 0);
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_ANNOUNCE_LEN);
+  CHECK(gp_encode(&frame, buf, GP_ANNOUNCE_LEN - 1) == 0);
+  sim_frame("announce", buf, len, 1);
+  sim_report(&frame, GP_TYPE_TIME_REQ, 0, 0);
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_TIME_REQ_LEN);
+  sim_frame("time request", buf, len, 1);
+  sim_report(&frame, GP_TYPE_TIME, 0, 0);
+  frame.rx_time = 0x11223344;
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_TIME_LEN);
+  CHECK(gp_encode(&frame, buf, GP_TIME_LEN - 1) == 0);
+  CHECK(gp_decode(buf, len, &back) == 0 && back.seq == 0xfedcba98 && back.rx_time == 0x11223344 &&
+        back.tx_time == 0xf0012345);
+  sim_frame("time", buf, len, 1);
+  sim_report(&frame, GP_TYPE_STATS_REQ, 0, 0);
+  frame.seq = GP_STATS_SUMMARY;
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_STATS_REQ_LEN);
+  sim_frame("stats request", buf, len, 1);
+  frame.type = GP_TYPE_STATS;
+  frame.seq = 12;
+  frame.device_id = 34;
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_STATS_HEADER_LEN);
+  CHECK(gp_decode(buf, GP_MAX_FRAME, &back) == 0 && back.seq == 12 && back.device_id == 34);
+  sim_frame("stats", buf, len, 0);
+  sim_report(&frame, GP_TYPE_SUBSCRIBE, GP_FLAG_SNAPSHOT, 0);
+  frame.seq = 600;
+  frame.device_id = GP_CONSUMER_ID_MIN + 7;
+  CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_SUBSCRIBE_LEN);
+  CHECK(gp_decode(buf, len, &back) == 0 && back.seq == 600 && back.flags == GP_FLAG_SNAPSHOT &&
+        back.device_id == GP_CONSUMER_ID_MIN + 7);
+  sim_frame("subscribe", buf, len, 1);
+
+  // NOTIFY: the encoder writes the header, the entries are the receiver's
+  for (i = 0; i <= GP_NOTIFY_MAX; i++) {
+    sim_report(&frame, GP_TYPE_NOTIFY, GP_FLAG_SNAPSHOT, i);
+    memset(buf, 0x5a, sizeof(buf));
+    CHECK((len = gp_encode(&frame, buf, sizeof(buf))) == GP_NOTIFY_HEADER_LEN + i * GP_NOTIFY_ENTRY_LEN);
+    CHECK(len <= GP_MAX_FRAME && gp_encode(&frame, buf, len - 1) == 0);
+    snprintf(name, sizeof(name), "notify of %d", i);
+    sim_frame(name, buf, len, 1);
+  }
+  frame.count = GP_NOTIFY_MAX + 1;
+  CHECK(gp_encode(&frame, buf, sizeof(buf)) == 0);
+  buf[16] = GP_NOTIFY_MAX + 1;
+  CHECK(gp_decode(buf, sizeof(buf), &back) == GP_ERR_TYPE);
+
+  // HEALTH
+  memset(&health, 0, sizeof(health));
+  health.device_id = SIM_DEVICE;
+  health.uptime_ms = 0xfffffff0;
+  health.heap_free = 40000;
+  health.heap_min = 30000;
+  health.vdd_mv = 3300;
+  health.callback_us = 65535;
+  for (i = 0; i <= GP_HEALTH_STACKS; i++) {
+    health.count = i;
+    if (i) {
+      memcpy(health.stack[i - 1].name, "tsk", 3);
+      health.stack[i - 1].name[3] = '0' + i;
+      health.stack[i - 1].unused = 1000 - i;
+    }
+    CHECK((len = gp_encode_health(&health, buf, sizeof(buf))) == GP_HEALTH_HEADER_LEN + i * GP_HEALTH_STACK_LEN);
+    CHECK(len <= GP_MAX_FRAME && gp_encode_health(&health, buf, len - 1) == 0);
+    CHECK(gp_decode(buf, len, &back) == 0 && back.event[1].pins == (i ? 1000 - i : 0xffff));
+    snprintf(name, sizeof(name), "health with %d stacks", i);
+    sim_frame(name, buf, len, 1);
+  }
+  health.count = GP_HEALTH_STACKS + 1;
+  CHECK(gp_encode_health(&health, buf, sizeof(buf)) == 0);
+  health.count = 1;
+  len = gp_encode_health(&health, buf, sizeof(buf));
+  buf[24] = GP_HEALTH_STACKS + 1;
+  CHECK(gp_decode(buf, sizeof(buf), &back) == GP_ERR_TYPE);
+
+  // OTA_DATA and OTA_REQ
+  for (i = 0; i < GP_OTA_CHUNK; i++)
+    data[i] = (uint8_t)(i * 7);
+  memset(&ota, 0, sizeof(ota));
+  ota.type = GP_TYPE_OTA_DATA;
+  ota.device_id = SIM_DEVICE;
+  ota.id = 0xdeadbeef;
+  ota.offset = 4096;
+  ota.total = 52000;
+  ota.p_data = data;
+  for (i = 0; i <= GP_OTA_CHUNK; i += GP_OTA_CHUNK / 4) {
+    ota.len = i;
+    CHECK((len = gp_encode_ota(&ota, buf, sizeof(buf))) == GP_OTA_DATA_HEADER_LEN + i);
+    CHECK(gp_encode_ota(&ota, buf, len - 1) == 0);
+    snprintf(name, sizeof(name), "ota data of %d", i);
+    sim_frame(name, buf, len, 0);
+  }
+  ota.len = GP_OTA_CHUNK + 1;
+  CHECK(gp_encode_ota(&ota, buf, sizeof(buf)) == 0);
+  memset(buf + GP_OTA_DATA_HEADER_LEN, 0, GP_OTA_CHUNK);
+  ota.len = GP_OTA_CHUNK;
+  len = gp_encode_ota(&ota, buf, sizeof(buf));
+  CHECK(gp_decode_ota(buf, len + 1, &ota) == GP_ERR_TYPE);
+  ota.type = GP_TYPE_OTA_REQ;
+  ota.status = GP_OTA_CURRENT;
+  CHECK((len = gp_encode_ota(&ota, buf, sizeof(buf))) == GP_OTA_REQ_LEN);
+  CHECK(gp_decode_ota(buf, len, &ota) == 0 && ota.status == GP_OTA_CURRENT && ota.offset == 4096 && ota.len == 0);
+  sim_frame("ota request", buf, len, 1);
+
+  // TUNE and TUNE_ACK
+  memset(&tune, 0, sizeof(tune));
+  tune.device_id = SIM_DEVICE;
+  tune.seq = 0xbeef;
+  for (i = 0; i <= GP_TUNE_MAX; i++) {
+    tune.type = i & 1 ? GP_TYPE_TUNE_ACK : GP_TYPE_TUNE;
+    tune.op = i % 4;
+    tune.count = i;
+    if (i) {
+      tune.entry[i - 1].id = i;
+      tune.entry[i - 1].value = 0x01020304u * i;
+    }
+    CHECK((len = gp_encode_tune(&tune, buf, sizeof(buf))) == GP_TUNE_HEADER_LEN + i * GP_TUNE_ENTRY_LEN);
+    CHECK(gp_encode_tune(&tune, buf, len - 1) == 0);
+    snprintf(name, sizeof(name), "tune of %d", i);
+    sim_frame(name, buf, len, 1);
+  }
+  tune.count = GP_TUNE_MAX + 1;
+  CHECK(gp_encode_tune(&tune, buf, sizeof(buf)) == 0);
+
+  // Not ours at all
+  sim_report(&frame, GP_TYPE_REPORT, 0, 1);
+  len = gp_encode(&frame, buf, sizeof(buf));
+  buf[0] ^= 1;
+  CHECK(gp_decode(buf, len, &back) == GP_ERR_MAGIC);
+  buf[0] ^= 1;
+  buf[1]++;
+  CHECK(gp_decode(buf, len, &back) == GP_ERR_VERSION);
+  buf[1]--;
+  for (i = GP_TYPE_TUNE_ACK + 1; i < 256; i++) {
+    buf[2] = i;
+    if (gp_decode(buf, len, &back) != GP_ERR_TYPE) {
+      CHECK(gp_decode(buf, len, &back) == GP_ERR_TYPE);
+      break;
+    }
+  }
+  buf[2] = 0;
+  CHECK(gp_decode(buf, len, &back) == GP_ERR_TYPE);
+  frame.type = 0;
+  CHECK(gp_encode(&frame, buf, sizeof(buf)) == 0);
+}
+
+// Random datagrams: only the length we say is there may be read. Each one sits at the
+// end of a malloc'd block of exactly that size, so a sanitizer catches a read past it.
+static void sim_random(int frames)
+{
+  gp_health_t health;
+  gp_frame_t frame;
+  gp_tune_t tune;
+  gp_ota_t ota;
+  uint8_t *p_buf;
+  int i, j, len, decoded = 0;
+
+  srand(1);
+  for (i = 0; i < frames; i++) {
+    len = rand() % (GP_MAX_FRAME + 1);
+    p_buf = malloc(len ? len : 1);
+    for (j = 0; j < len; j++)
+      p_buf[j] = rand();
+    if (len > 0)
+      p_buf[0] = GP_MAGIC;
+    if (len > 1)
+      p_buf[1] = GP_VERSION;
+    if (len > 2)
+      p_buf[2] = 1 + rand() % GP_TYPE_TUNE_ACK;
+    if (gp_decode(p_buf, len, &frame) == 0)
+      decoded++;
+    gp_decode_health(p_buf, len, &health);
+    gp_decode_ota(p_buf, len, &ota);
+    gp_decode_tune(p_buf, len, &tune);
+    free(p_buf);
+  }
+  printf("protosim: %d random datagrams, %d of them decoded\n", frames, decoded);
+}
+
+// What the hot paths cost: a traced, liveness carrying report (the sender's usual
+// frame) and a full batch, encoded and decoded SIM_ROUNDS times each
+static void sim_bench(void)
+{
+  uint8_t buf[GP_MAX_FRAME];
+  gp_frame_t frame, back;
+  uint64_t start, encode_ns, decode_ns;
+  uint32_t sum = 0;
+  int i, count, len;
+
+  printf("protosim: frame              bytes  encode ns  decode ns\n");
+  for (count = 1; count <= GP_BATCH_MAX; count += GP_BATCH_MAX - 1) {
+    sim_report(&frame, count == 1 ? GP_TYPE_REPORT : GP_TYPE_BATCH, GP_FLAG_LIVENESS | GP_FLAG_TRACE, count);
+    start = now_ns();
+    for (i = 0; i < SIM_ROUNDS; i++) {
+      frame.seq = i;
+      sum += len = gp_encode(&frame, buf, sizeof(buf));
+    }
+    encode_ns = now_ns() - start;
+    start = now_ns();
+    for (i = 0; i < SIM_ROUNDS; i++) {
+      buf[8] = (uint8_t)i;
+      sum += gp_decode(buf, len, &back) + back.seq;
+    }
+    decode_ns = now_ns() - start;
+    printf("protosim: %-18s %5d  %9.1f  %9.1f\n", count == 1 ? "traced report" : "traced batch of 8", len,
+           (double)encode_ns / SIM_ROUNDS, (double)decode_ns / SIM_ROUNDS);
+  }
+  // Keep the loops from being optimised away
+  if (sum == 0)
+    printf("protosim: (sum %u)\n", sum);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, frames = 1000000;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        frames = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  sim_checks();
+  sim_random(frames);
+  sim_bench();
+  printf("protosim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
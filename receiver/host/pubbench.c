@@ -0,0 +1,365 @@
+// pubbench.c
+// Door state fan-out benchmark (see pubsub.h in ../main). Plays hundreds of local
+// consumers and a building full of doors against receiver_host over loopback:
+//
+//   ./pubbench [-a address] [-s subscribers] [-n doors] [-r events/s] [-t seconds] [-v]
+//
+//   1. Every consumer subscribes from its own socket and must get its snapshot back.
+//      One in ten only takes a LAPSE_S lease and never renews it; the rest renew
+//      within RENEW_S, with jitter (no snapshot, so no answer). That is a third of
+//      their lease, so a renewal dropped on a full request queue is forgiven.
+//   2. The doors change at -r events a second, plus once a second all of them at once
+//      (a burst). Each event is a REPORT from that door's chip id.
+//   3. Everybody unsubscribes, one more door moves, and nobody may hear about it.
+//
+// Measured: notify datagrams and door entries delivered per second, datagrams per
+// event per subscriber (1.0 would be a send per event per subscriber, no batching),
+// and delivery latency: the receiver applying a change (the entry's last change time)
+// to the consumer reading the datagram. The receiver's clock is CLOCK_MONOTONIC too,
+// so that only works with both on the same host.
+//
+// Exits non-zero if a subscription isn't answered, a notify frame goes missing, a
+// consumer ends up with the wrong state for any door, a lapsed lease keeps getting
+// notifications, a frame arrives after unsubscribing, or batching saves nothing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "hist.h"
+#include "pubsub.h"
+
+#define CHECK_NAME "pubbench"
+#include "check.h"
+
+#define DEVICE_BASE 0x70000000u
+#define LEASE_S 6
+#define RENEW_S 2
+#define SUBSCRIBE_TRIES 3
+#define LAPSE_S 2
+#define RCVBUF (256 * 1024)
+#define DOOR_PIN 0x0004
+
+// How long after its lease a lapsed consumer may still hear something: the lease wheel
+// rounds up a tick and pubsub_task looks at it once a PUBSUB_TICK_MS.
+#define LAPSE_SLACK_MS (2 * PUBSUB_TICK_MS + 200)
+
+static int verbose;
+// One consumer
+typedef struct {
+  int sock;
+  uint8_t lapse;            // subscribed once with LAPSE_S, never renews
+  uint8_t synced;           // has had a snapshot
+  uint32_t subscribed_ms;   // last (re)subscribed
+  uint32_t renew_ms;        // renew this long after that
+  uint32_t next_seq;        // notify sequence number we expect
+  uint32_t frames;          // NOTIFY frames, snapshots included
+  uint32_t updates;         // NOTIFY frames that weren't snapshots
+  uint32_t entries;
+  uint32_t gaps;            // notify frames that never came
+  uint32_t late;            // lapsed: frames after the lease (plus slack)
+  uint32_t *p_changes;      // per door: change counter last heard
+  uint16_t *p_pins;         // per door: pins last heard
+} consumer_t;
+
+// One door
+typedef struct {
+  uint32_t seq;
+  uint16_t pins;
+} door_t;
+
+static struct sockaddr_in dest;
+static consumer_t *consumers;
+static door_t *doors;
+static uint32_t n_consumers, n_doors;
+static hist_t latency;
+static uint64_t notify_frames, notify_entries, changes_heard;
+
+static uint32_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void subscribe(consumer_t *p_con, uint16_t lease_s)
+{
+  uint8_t buf[GP_SUBSCRIBE_LEN];
+  gp_frame_t frame;
+
+  frame.type = GP_TYPE_SUBSCRIBE;
+  frame.flags = 0;
+  frame.seq = lease_s;
+  frame.device_id = GP_CONSUMER_ID_MIN + (uint32_t)(p_con - consumers);
+  gp_encode(&frame, buf, sizeof(buf));
+  sendto(p_con->sock, buf, sizeof(buf), 0, (struct sockaddr *)&dest, sizeof(dest));
+}
+
+// Door d moves: flip its pin and report it from a socket of its own (consumer 0's
+// would do, but then consumer 0 would be talking to itself)
+static void door_event(int sock, uint32_t d)
+{
+  uint8_t buf[GP_REPORT_LEN];
+  gp_frame_t frame;
+  door_t *p_door = &doors[d];
+
+  p_door->pins ^= DOOR_PIN;
+  frame.type = GP_TYPE_REPORT;
+  // A rerun against the same receiver starts the sequence numbers over
+  frame.flags = GP_FLAG_CHANGE | (p_door->seq == 0 ? GP_FLAG_BOOT : 0);
+  frame.device_id = DEVICE_BASE + d;
+  frame.seq = p_door->seq++;
+  frame.count = 1;
+  frame.event[0].pins = p_door->pins;
+  frame.event[0].timestamp = now_ms();
+  gp_encode(&frame, buf, sizeof(buf));
+  sendto(sock, buf, sizeof(buf), 0, (struct sockaddr *)&dest, sizeof(dest));
+}
+
+// One datagram for consumer c
+static void notify(consumer_t *p_con, const uint8_t *p_buf, int len, uint32_t now)
+{
+  gp_frame_t frame;
+  const uint8_t *p;
+  uint32_t d, changes;
+  int i;
+
+  if (gp_decode(p_buf, len, &frame) != 0 || frame.type != GP_TYPE_NOTIFY)
+    return;
+
+  p_con->frames++;
+  notify_frames++;
+  // A snapshot can restart the numbering (a rerun) but anything else is a gap
+  if (frame.flags & GP_FLAG_SNAPSHOT) {
+    p_con->synced = 1;
+  } else {
+    p_con->updates++;
+    if (frame.seq != p_con->next_seq)
+      p_con->gaps += frame.seq - p_con->next_seq;
+  }
+  p_con->next_seq = frame.seq + 1;
+
+  if (p_con->lapse && !(frame.flags & GP_FLAG_SNAPSHOT) &&
+      now - p_con->subscribed_ms > LAPSE_S * 1000 + LAPSE_SLACK_MS)
+    p_con->late++;
+
+  for (i = 0; i < frame.count; i++) {
+    p = &p_buf[GP_NOTIFY_HEADER_LEN + i * GP_NOTIFY_ENTRY_LEN];
+    d = gp_get32(&p[0]) - DEVICE_BASE;
+    if (d >= n_doors)
+      continue;
+    p_con->entries++;
+    notify_entries++;
+    changes = gp_get32(&p[7]);
+    // Only news counts towards the latency; a snapshot is a resync, not a delivery
+    if (changes != p_con->p_changes[d] && !(frame.flags & GP_FLAG_SNAPSHOT)) {
+      hist_add(&latency, now - gp_get32(&p[11]));
+      changes_heard++;
+    }
+    p_con->p_changes[d] = changes;
+    p_con->p_pins[d] = gp_get16(&p[4]);
+  }
+}
+
+// Read whatever has arrived, waiting up to wait_ms for the first of it
+static void drain(struct pollfd *p_fds, int wait_ms)
+{
+  uint8_t buf[GP_MAX_FRAME];
+  uint32_t c, now;
+  int len;
+
+  if (poll(p_fds, n_consumers, wait_ms) <= 0)
+    return;
+  now = now_ms();
+  for (c = 0; c < n_consumers; c++) {
+    if (!(p_fds[c].revents & POLLIN))
+      continue;
+    while ((len = recv(consumers[c].sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      notify(&consumers[c], buf, len, now);
+  }
+}
+
+static void drain_for(struct pollfd *p_fds, uint32_t ms)
+{
+  uint32_t until = now_ms() + ms;
+
+  while ((int32_t)(until - now_ms()) > 0)
+    drain(p_fds, 1);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *address = "127.0.0.1";
+  uint32_t rate = 2000, seconds = 5;
+  uint32_t c, d, start, elapsed, renewed, next_renew, bursts, due;
+  uint64_t events = 0, frames_before, updates;
+  uint32_t synced, gaps, late, wrong;
+  struct pollfd *p_fds;
+  struct sockaddr_in local;
+  int rcvbuf = RCVBUF, door_sock, opt, try;
+  double per_event;
+
+  n_consumers = 500;
+  n_doors = 200;
+  while ((opt = getopt(argc, argv, "a:s:n:r:t:v")) != -1) {
+    switch (opt) {
+      case 'a': address = optarg; break;
+      case 's': n_consumers = atoi(optarg); break;
+      case 'n': n_doors = atoi(optarg); break;
+      case 'r': rate = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-a address] [-s subscribers] [-n doors] [-r events/s] [-t seconds] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (n_consumers < 2 || n_consumers > PUBSUB_MAX_SUBSCRIBERS || n_doors == 0) {
+    fprintf(stderr, "pubbench: 2 to %d subscribers and at least one door\n", PUBSUB_MAX_SUBSCRIBERS);
+    return 1;
+  }
+
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(GP_PORT);
+  inet_pton(AF_INET, address, &dest.sin_addr);
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+
+  consumers = calloc(n_consumers, sizeof(*consumers));
+  doors = calloc(n_doors, sizeof(*doors));
+  p_fds = calloc(n_consumers, sizeof(*p_fds));
+  if (consumers == NULL || doors == NULL || p_fds == NULL)
+    return 1;
+  hist_init(&latency);
+
+  for (c = 0; c < n_consumers; c++) {
+    consumers[c].sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (consumers[c].sock < 0 || bind(consumers[c].sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+      perror("pubbench: socket (ulimit -n?)");
+      return 1;
+    }
+    setsockopt(consumers[c].sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    consumers[c].lapse = c % 10 == 9;
+    consumers[c].p_changes = calloc(n_doors, sizeof(uint32_t));
+    consumers[c].p_pins = calloc(n_doors, sizeof(uint16_t));
+    p_fds[c].fd = consumers[c].sock;
+    p_fds[c].events = POLLIN;
+  }
+  door_sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+  // 1. Subscribe everybody and wait for the snapshots. Like any consumer, ask again if
+  // the answer doesn't come (the request queue may have been full).
+  for (try = 0, synced = 0; try < SUBSCRIBE_TRIES && synced < n_consumers; try++) {
+    for (c = 0; c < n_consumers; c++) {
+      if (consumers[c].synced)
+        continue;
+      consumers[c].subscribed_ms = now_ms();
+      consumers[c].renew_ms = RENEW_S * 1000 - rand() % (RENEW_S * 500);
+      subscribe(&consumers[c], consumers[c].lapse ? LAPSE_S : LEASE_S);
+      // The receiver queues only PUBSUB_QUEUE_LEN requests; don't outrun it
+      if (c % PUBSUB_QUEUE_LEN == PUBSUB_QUEUE_LEN - 1)
+        drain_for(p_fds, 2);
+    }
+    drain_for(p_fds, 500);
+    for (c = 0, synced = 0; c < n_consumers; c++)
+      synced += consumers[c].synced;
+  }
+  CHECK(synced == n_consumers);
+  printf("pubbench: %u of %u subscribers answered with a snapshot (%d rounds)\n", synced, n_consumers, try);
+
+  // 2. Load, with a burst of every door once a second
+  frames_before = notify_frames;
+  start = now_ms();
+  next_renew = 0;
+  bursts = 0;
+  while ((elapsed = now_ms() - start) < seconds * 1000) {
+    due = (uint64_t)rate * elapsed / 1000 + (uint64_t)bursts * n_doors;
+    if (elapsed / 1000 >= bursts) {
+      for (d = 0; d < n_doors; d++)
+        door_event(door_sock, d);
+      events += n_doors;
+      bursts++;
+    }
+    for (; events < due; events++)
+      door_event(door_sock, rand() % n_doors);
+
+    // Everybody renews somewhere in the second half of RENEW_S after their last
+    // (re)subscribe. The jitter keeps hundreds of consumers that all started together
+    // from renewing together and overflowing the request queue.
+    for (renewed = 0; renewed < PUBSUB_QUEUE_LEN / 2; renewed++) {
+      c = next_renew++ % n_consumers;
+      if (consumers[c].lapse || now_ms() - consumers[c].subscribed_ms < consumers[c].renew_ms)
+        continue;
+      consumers[c].subscribed_ms = now_ms();
+      consumers[c].renew_ms = RENEW_S * 1000 - rand() % (RENEW_S * 500);
+      subscribe(&consumers[c], LEASE_S);
+    }
+    drain(p_fds, 1);
+  }
+  // Let the last tick go out
+  drain_for(p_fds, 3 * PUBSUB_TICK_MS + 100);
+  elapsed = now_ms() - start;
+
+  gaps = late = wrong = 0;
+  updates = 0;
+  for (c = 0; c < n_consumers; c++) {
+    gaps += consumers[c].gaps;
+    late += consumers[c].late;
+    if (consumers[c].lapse)
+      continue;
+    updates += consumers[c].updates;
+    for (d = 0; d < n_doors; d++) {
+      if (consumers[c].p_pins[d] != doors[d].pins)
+        wrong++;
+    }
+  }
+  // Datagrams per event per subscriber that kept its lease all along
+  per_event = events ? (double)updates / (n_consumers - n_consumers / 10) / events : 0.0;
+  printf("pubbench: %u doors, %llu events in %u ms to %u subscribers (%u lapsed after %u s)\n", n_doors,
+         (unsigned long long)events, elapsed, n_consumers, n_consumers / 10, LAPSE_S);
+  printf("pubbench: %llu notify datagrams (%.0f/s), %llu door entries (%.0f/s), %.3f datagrams per event per "
+         "subscriber\n", (unsigned long long)(notify_frames - frames_before),
+         (notify_frames - frames_before) * 1000.0 / elapsed, (unsigned long long)notify_entries,
+         notify_entries * 1000.0 / elapsed, per_event);
+  printf("pubbench: delivery latency ms p50 %u p99 %u p99.9 %u max %u (%llu changes heard)\n",
+         hist_percentile(&latency, 500), hist_percentile(&latency, 990), hist_percentile(&latency, 999),
+         latency.max, (unsigned long long)changes_heard);
+  printf("pubbench: %u notify frames lost, %u doors in the wrong state, %u frames after a lapsed lease\n",
+         gaps, wrong, late);
+  CHECK(gaps == 0);
+  CHECK(wrong == 0);
+  CHECK(late == 0);
+  CHECK(per_event < 0.5);
+  CHECK(changes_heard > 0);
+
+  // 3. Everybody leaves, one more door moves
+  for (c = 0; c < n_consumers; c++) {
+    subscribe(&consumers[c], 0);
+    if (c % PUBSUB_QUEUE_LEN == PUBSUB_QUEUE_LEN - 1)
+      drain_for(p_fds, 2);
+  }
+  drain_for(p_fds, 3 * PUBSUB_TICK_MS);
+  frames_before = notify_frames;
+  door_event(door_sock, 0);
+  drain_for(p_fds, 3 * PUBSUB_TICK_MS + 100);
+  printf("pubbench: %llu frames after unsubscribing\n", (unsigned long long)(notify_frames - frames_before));
+  CHECK(notify_frames == frames_before);
+
+  if (verbose) {
+    for (c = 0; c < n_consumers; c++)
+      printf("  subscriber %3u%s: %u frames, %u entries, %u lost\n", c, consumers[c].lapse ? " (lapsed)" : "",
+             consumers[c].frames, consumers[c].entries, consumers[c].gaps);
+  }
+
+  printf("pubbench: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
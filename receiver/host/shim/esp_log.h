@@ -0,0 +1,19 @@
+// esp_log.h
+// Host build: ESP_LOGx straight to stderr, in roughly the same shape as the real thing.
+
+#ifndef __HOST_ESP_LOG__H
+
+  #define __HOST_ESP_LOG__H
+
+  #include <stdio.h>
+  #include "freertos/task.h"
+
+  #define HOST_LOG(letter, tag, format, ...) \
+    fprintf(stderr, letter " (%u) %s: " format "\n", (unsigned)xTaskGetTickCount(), tag, ##__VA_ARGS__)
+
+  #define ESP_LOGE(tag, format, ...) HOST_LOG("E", tag, format, ##__VA_ARGS__)
+  #define ESP_LOGW(tag, format, ...) HOST_LOG("W", tag, format, ##__VA_ARGS__)
+  #define ESP_LOGI(tag, format, ...) HOST_LOG("I", tag, format, ##__VA_ARGS__)
+  #define ESP_LOGD(tag, format, ...) do { } while (0)
+
+#endif
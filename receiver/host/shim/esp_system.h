@@ -0,0 +1,13 @@
+// esp_system.h
+// Host build: the heap figures, from malloc's arena. See host_shim.c.
+
+#ifndef __HOST_ESP_SYSTEM__H
+
+  #define __HOST_ESP_SYSTEM__H
+
+  #include <stdint.h>
+
+  uint32_t esp_get_free_heap_size(void);
+  uint32_t esp_get_minimum_free_heap_size(void);
+
+#endif
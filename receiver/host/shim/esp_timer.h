@@ -0,0 +1,18 @@
+// esp_timer.h
+// Host build: esp_timer_get_time is microseconds of CLOCK_MONOTONIC.
+
+#ifndef __HOST_ESP_TIMER__H
+
+  #define __HOST_ESP_TIMER__H
+
+  #include <stdint.h>
+  #include <time.h>
+
+  static inline int64_t esp_timer_get_time(void)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+#endif
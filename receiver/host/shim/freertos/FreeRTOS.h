@@ -0,0 +1,31 @@
+// FreeRTOS.h
+// Just enough FreeRTOS for the receiver sources to build on Linux. Tasks are pthreads
+// and a tick is one millisecond. See host_shim.c.
+
+#ifndef __HOST_FREERTOS__H
+
+  #define __HOST_FREERTOS__H
+
+  #include <stdint.h>
+  #include <stddef.h>
+  #include "sdkconfig.h"
+
+  typedef int BaseType_t;
+  typedef unsigned int UBaseType_t;
+  typedef uint32_t TickType_t;
+  typedef uint32_t EventBits_t;
+  typedef void *TaskHandle_t;
+  typedef void *EventGroupHandle_t;
+
+  #define pdPASS 1
+  #define pdFAIL 0
+  #define pdTRUE 1
+  #define pdFALSE 0
+  #define portMAX_DELAY 0xffffffffu
+  #define portTICK_PERIOD_MS 1
+  #define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+  #define BIT0 0x01
+  #define BIT1 0x02
+
+#endif
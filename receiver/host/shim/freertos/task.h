@@ -0,0 +1,24 @@
+// task.h
+// Host build: FreeRTOS tasks on top of pthreads. See host_shim.c.
+
+#ifndef __HOST_TASK__H
+
+  #define __HOST_TASK__H
+
+  #include "freertos/FreeRTOS.h"
+
+  typedef void (*TaskFunction_t)(void *);
+
+  BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack, void *param,
+                         UBaseType_t priority, TaskHandle_t *p_handle);
+  BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack, void *param,
+                                     UBaseType_t priority, TaskHandle_t *p_handle, BaseType_t core);
+  TaskHandle_t xTaskGetCurrentTaskHandle(void);
+  void xTaskNotifyGive(TaskHandle_t handle);
+  uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+  void vTaskDelete(TaskHandle_t handle);
+  void vTaskDelay(TickType_t ticks);
+  TickType_t xTaskGetTickCount(void);
+  UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t handle);
+
+#endif
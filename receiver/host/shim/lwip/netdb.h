@@ -0,0 +1,4 @@
+// netdb.h
+// Host build: use the system resolver header.
+
+#include <netdb.h>
@@ -0,0 +1,18 @@
+// sockets.h
+// Host build: lwIP's socket API is BSD sockets, so this is mostly the real POSIX headers.
+
+#ifndef __HOST_LWIP_SOCKETS__H
+
+  #define __HOST_LWIP_SOCKETS__H
+
+  #include <sys/socket.h>
+  #include <sys/select.h>
+  #include <netinet/in.h>
+  #include <arpa/inet.h>
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <errno.h>
+
+  char *inet_ntoa_r(in_addr_t addr, char *buf, int buflen);
+
+#endif
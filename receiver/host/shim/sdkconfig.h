@@ -0,0 +1,21 @@
+// sdkconfig.h
+// Host build stand-in for the sdkconfig.h that idf.py menuconfig generates. The table
+// and ring sizes are bigger than the on-device defaults so the load generator can throw
+// thousands of senders at it.
+
+#define CONFIG_ESP_WIFI_SSID "host"
+#define CONFIG_ESP_WIFI_PASSWORD "host"
+#define CONFIG_DEVICE_TABLE_SIZE 16384
+#define CONFIG_DLOG_RING_SIZE 1024
+#define CONFIG_DLOG_LEVEL 2
+#define CONFIG_PUBSUB_MAX_SUBSCRIBERS 1024
+#define CONFIG_HTTPD_PORT 8080
+#define CONFIG_HTTPD_MAX_CLIENTS 64
+#define CONFIG_HTTPD_SNAPSHOT_SIZE 0
+
+// The split receive / process pipeline (see pipeline.h) unless the Makefile builds the
+// single task receiver_host_single to compare against.
+#ifndef HOST_SINGLE_TASK
+  #define CONFIG_RECEIVER_PIPELINE 1
+  #define CONFIG_PIPELINE_RING_SIZE 256
+#endif
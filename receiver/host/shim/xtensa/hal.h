@@ -0,0 +1,19 @@
+// hal.h
+// Host build: the Xtensa cycle counter becomes a nanosecond clock. Wraps every ~4 s,
+// which is fine for timing a single packet.
+
+#ifndef __HOST_XTENSA_HAL__H
+
+  #define __HOST_XTENSA_HAL__H
+
+  #include <stdint.h>
+  #include <time.h>
+
+  static inline uint32_t xthal_get_ccount(void)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec);
+  }
+
+#endif
@@ -0,0 +1,293 @@
+// tunesim.c
+// Host-side test of remote tuning: the TUNE / TUNE_ACK frames (garage_proto.c) and what
+// the sender does with them (gptune.c in common/, the real code sender/tune.c runs).
+//
+//   ./tunesim [-n frames]
+//   ./tunesim -s [-p port] [-k master key] [-t seconds] -i chip id
+//
+// Checks, exit non-zero on failure:
+//   - TUNE frames survive gp_encode_tune / gp_decode_tune; short ones and ones with too
+//     many entries are turned away
+//   - a GET of nothing answers all of them, a GET of some answers those
+//   - a SET changes what it says, flags exactly those as changed, and answers with the
+//     new values
+//   - a SET with one value out of range, an idle heartbeat shorter than the busy one or
+//     an unknown tunable changes nothing at all; an unknown op is GP_TUNE_BAD
+//   - GP_TUNE_DEFAULTS puts back the built in values
+//   - n random frames (random bytes, and valid frames with random entries) through
+//     decode and handle never leave a value set that gp_tune_check refuses
+// and it prints how long a frame takes (making it up included).
+//
+// -s plays the sender for make bench-tune: it takes TUNE frames on loopback like
+// sender/tune.c (signed ones only, each newer than the last, so it needs -k), answers
+// them and prints the values it ends up with after seconds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "gptune.h"
+
+#define CHECK_NAME "tunesim"
+#include "check.h"
+
+#define SIM_DEVICE 0x00c0ffee
+
+// user_config.h's defaults
+static const uint32_t sim_defaults[GP_TUNE_COUNT + 1] = { 0, 5000, 60000, 20, 50, 1000, 300000, 3600, 10000 };
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Encode req, decode it again and hand it to gp_tune_handle, like the sender does
+static int sim_roundtrip(gp_tunables_t *p_tun, const gp_tune_t *p_req, gp_tune_t *p_ack, uint32_t *p_changed)
+{
+  uint8_t buf[GP_MAX_FRAME];
+  gp_tune_t req;
+  int len;
+
+  len = gp_encode_tune(p_req, buf, sizeof(buf));
+  if (len == 0 || gp_decode_tune(buf, len, &req) != 0)
+    return -1;
+  return gp_tune_handle(p_tun, &req, p_ack, p_changed);
+}
+
+static void sim_req(gp_tune_t *p_req, uint8_t op)
+{
+  p_req->type = GP_TYPE_TUNE;
+  p_req->device_id = SIM_DEVICE;
+  p_req->seq = 7;
+  p_req->op = op;
+  p_req->count = 0;
+}
+
+static void sim_entry(gp_tune_t *p_req, uint8_t id, uint32_t value)
+{
+  p_req->entry[p_req->count].id = id;
+  p_req->entry[p_req->count].value = value;
+  p_req->count++;
+}
+
+static void sim_checks(int frames)
+{
+  uint8_t buf[GP_MAX_FRAME];
+  uint32_t changed;
+  gp_tunables_t tun;
+  gp_tune_t req, ack;
+  uint64_t start;
+  int i, j, len;
+
+  gp_tune_init(&tun, sim_defaults);
+  CHECK(gp_tune_check(tun.value) == 0);
+
+  // Framing
+  sim_req(&req, GP_TUNE_SET);
+  sim_entry(&req, GP_TUNE_HB_MIN, 0x12345678);
+  len = gp_encode_tune(&req, buf, sizeof(buf));
+  CHECK(len == GP_TUNE_HEADER_LEN + GP_TUNE_ENTRY_LEN);
+  CHECK(gp_decode_tune(buf, len, &ack) == 0 && ack.type == GP_TYPE_TUNE && ack.device_id == SIM_DEVICE &&
+        ack.seq == 7 && ack.op == GP_TUNE_SET && ack.count == 1 && ack.entry[0].id == GP_TUNE_HB_MIN &&
+        ack.entry[0].value == 0x12345678);
+  CHECK(gp_decode_tune(buf, len - 1, &ack) == GP_ERR_SHORT);
+  CHECK(gp_decode_tune(buf, GP_TUNE_HEADER_LEN - 1, &ack) == GP_ERR_SHORT);
+  buf[11] = GP_TUNE_MAX + 1;
+  CHECK(gp_decode_tune(buf, sizeof(buf), &ack) == GP_ERR_TYPE);
+  CHECK(gp_encode_tune(&req, buf, GP_TUNE_HEADER_LEN) == 0);
+  CHECK(GP_TUNE_HEADER_LEN + GP_TUNE_MAX * GP_TUNE_ENTRY_LEN + GP_AUTH_LEN <= GP_MAX_FRAME);
+
+  // GET
+  sim_req(&req, GP_TUNE_GET);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_OK && changed == 0);
+  CHECK(ack.type == GP_TYPE_TUNE_ACK && ack.seq == 7 && ack.count == GP_TUNE_COUNT);
+  for (i = 0; i < ack.count; i++)
+    CHECK(ack.entry[i].id == i + 1 && ack.entry[i].value == sim_defaults[i + 1]);
+  sim_entry(&req, GP_TUNE_DEBOUNCE, 0);
+  sim_entry(&req, GP_TUNE_SLEEP, 0);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_OK && ack.count == 2);
+  CHECK(ack.entry[0].value == 50 && ack.entry[1].id == GP_TUNE_SLEEP && ack.entry[1].value == 3600);
+  sim_entry(&req, 42, 0);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_UNKNOWN && ack.count == 3 && ack.entry[2].value == 0);
+
+  // SET
+  sim_req(&req, GP_TUNE_SET);
+  sim_entry(&req, GP_TUNE_HB_MIN, 2000);
+  sim_entry(&req, GP_TUNE_HB_MAX, 600000);
+  sim_entry(&req, GP_TUNE_COALESCE, 1000);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_OK);
+  CHECK(changed == ((1u << GP_TUNE_HB_MIN) | (1u << GP_TUNE_HB_MAX)));
+  CHECK(tun.value[GP_TUNE_HB_MIN] == 2000 && tun.value[GP_TUNE_HB_MAX] == 600000 && ack.count == 3 &&
+        ack.entry[1].value == 600000);
+
+  // All or nothing
+  sim_req(&req, GP_TUNE_SAVE);
+  sim_entry(&req, GP_TUNE_DEBOUNCE, 20);
+  sim_entry(&req, GP_TUNE_HB_JITTER, 51);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_RANGE && changed == 0);
+  CHECK(tun.value[GP_TUNE_DEBOUNCE] == 50 && ack.entry[0].value == 50 && ack.entry[1].value == 20);
+  sim_req(&req, GP_TUNE_SET);
+  sim_entry(&req, GP_TUNE_HB_MAX, 1000);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_RANGE && tun.value[GP_TUNE_HB_MAX] == 600000);
+  sim_req(&req, GP_TUNE_SET);
+  sim_entry(&req, GP_TUNE_DEBOUNCE, 3);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_RANGE && tun.value[GP_TUNE_DEBOUNCE] == 50);
+  sim_req(&req, GP_TUNE_SET);
+  sim_entry(&req, GP_TUNE_DEBOUNCE, 20);
+  sim_entry(&req, 0, 1);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_UNKNOWN && changed == 0 &&
+        tun.value[GP_TUNE_DEBOUNCE] == 50);
+  sim_req(&req, 9);
+  sim_entry(&req, GP_TUNE_DEBOUNCE, 20);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_BAD && ack.count == 0 && changed == 0);
+
+  // Back to the defaults
+  sim_req(&req, GP_TUNE_DEFAULTS);
+  CHECK(sim_roundtrip(&tun, &req, &ack, &changed) == GP_TUNE_OK);
+  CHECK(changed == ((1u << GP_TUNE_HB_MIN) | (1u << GP_TUNE_HB_MAX)) && ack.count == GP_TUNE_COUNT);
+  CHECK(memcmp(tun.value, sim_defaults, sizeof(sim_defaults)) == 0);
+
+  // Garbage, and valid frames full of random entries
+  srand(1);
+  start = now_ns();
+  for (i = 0; i < frames; i++) {
+    if (i & 1) {
+      for (j = 0; j < (int)sizeof(buf); j++)
+        buf[j] = rand();
+      buf[0] = GP_MAGIC;
+      buf[1] = GP_VERSION;
+      buf[2] = GP_TYPE_TUNE;
+      len = rand() % sizeof(buf);
+    } else {
+      sim_req(&req, rand() % 4);
+      for (j = rand() % 4; j > 0; j--)
+        sim_entry(&req, rand() % (GP_TUNE_COUNT + 2), rand() % 3 ? (uint32_t)rand() % 100000 : (uint32_t)rand());
+      len = gp_encode_tune(&req, buf, sizeof(buf));
+    }
+    if (gp_decode_tune(buf, len, &req) == 0)
+      gp_tune_handle(&tun, &req, &ack, &changed);
+    if (gp_tune_check(tun.value) != 0) {
+      CHECK(gp_tune_check(tun.value) == 0);
+      break;
+    }
+  }
+  printf("tunesim: %d random frames, %.0f ns each to make up, decode and handle, heartbeat now %u .. %u ms\n",
+         frames, (double)(now_ns() - start) / frames, tun.value[GP_TUNE_HB_MIN], tun.value[GP_TUNE_HB_MAX]);
+}
+
+// Take TUNE frames on loopback like sender/tune.c does
+static int sim_serve(int port, const uint8_t *p_master, uint32_t device_id, int seconds)
+{
+  uint32_t epoch, counter, last_epoch = 0, last_counter = 0, changed;
+  uint8_t key[GP_AUTH_KEY_LEN], buf[GP_MAX_FRAME + 1];
+  struct sockaddr_in addr, from;
+  socklen_t from_len;
+  struct pollfd pfd;
+  gp_tunables_t tun;
+  gp_tune_t req, ack;
+  uint64_t end;
+  int sock, n, i, taken = 0, ignored = 0;
+
+  gp_auth_derive(p_master, device_id, key);
+  gp_tune_init(&tun, sim_defaults);
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  end = now_ns() + (uint64_t)seconds * 1000000000;
+
+  while (now_ns() < end) {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    from_len = sizeof(from);
+    n = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+    if (n <= 0)
+      continue;
+    if ((n = gp_auth_verify(key, buf, n, &epoch, &counter)) < 0 || epoch < last_epoch ||
+        (epoch == last_epoch && counter <= last_counter)) {
+      ignored++;
+      continue;
+    }
+    if (gp_decode_tune(buf, n, &req) != 0 || req.type != GP_TYPE_TUNE || req.device_id != device_id) {
+      ignored++;
+      continue;
+    }
+    last_epoch = epoch;
+    last_counter = counter;
+    gp_tune_handle(&tun, &req, &ack, &changed);
+    taken++;
+    n = gp_encode_tune(&ack, buf, sizeof(buf));
+    sendto(sock, buf, n, 0, (struct sockaddr *)&from, from_len);
+  }
+
+  printf("tunesim: %d TUNE frames taken, %d ignored, ending with", taken, ignored);
+  for (i = 1; i <= GP_TUNE_COUNT; i++)
+    printf(" %u", tun.value[i]);
+  printf("\n");
+  return gp_tune_check(tun.value) == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, frames = 1000000, serve = 0, port = GP_PORT, seconds = 5;
+  uint8_t master[GP_AUTH_KEY_LEN];
+  uint32_t device_id = 0;
+  int signing = 0;
+
+  while ((opt = getopt(argc, argv, "n:sp:k:t:i:")) != -1) {
+    switch (opt) {
+      case 'n':
+        frames = atoi(optarg);
+        break;
+      case 's':
+        serve = 1;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'k':
+        if (gp_auth_key(optarg, master) != 0)
+          return 2;
+        signing = 1;
+        break;
+      case 't':
+        seconds = atoi(optarg);
+        break;
+      case 'i':
+        device_id = strtoul(optarg, NULL, 16);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames]\n       %s -s [-p port] [-k master key] [-t seconds] -i chip id\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+  }
+  if (serve && !signing) {
+    fprintf(stderr, "tunesim: -s needs -k, a sender without a key takes no TUNE frames\n");
+    return 2;
+  }
+  if (serve)
+    return sim_serve(port, master, device_id, seconds);
+
+  sim_checks(frames < 1 ? 1 : frames);
+  printf("tunesim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+// twbench.c
+// Host-side benchmark of the receiver's sender deadlines: the timer wheel (twheel.c)
+// behind device_update and device_expired (devices.c, the real code). No sockets; we
+// call them directly on a simulated clock.
+//
+//   ./twbench [-s simulated seconds] [-v]
+//
+// For 10, 100, 1,000 and 10,000 senders:
+//   rearm    tw_arm on a wheel holding that many timers, moving random timers to random
+//            deadlines up to a few minutes out. This is what every packet pays.
+//   packet   device_update for a heartbeat, rearm included
+//   tick     one device_alerts pass (device_expired until NULL) per TW_TICK_MS, split
+//            into ticks where nothing happened and ticks that expired or cascaded
+//            timers (cost per timer handled)
+//
+// Every sender promises a heartbeat every 5 to 60 s and keeps it. A tenth of them die
+// half way through and every seventh one leaves its door open. Checks, exit non-zero
+// on failure: each death is reported silent exactly once, never before its deadline
+// and at most two ticks after it (one for the wheel, one for our clock step); no live
+// sender is called silent; each open door is reported once, DOOR_OPEN_ALERT_MS after
+// it opened, give or take the same two ticks; and rearm and idle tick costs at 10,000
+// senders stay within 10 times those at 10 (they should be about the same; the slack
+// is for cache misses and a noisy host).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "garage_proto.h"
+#include "devices.h"
+#include "twheel.h"
+
+#define BENCH_STEP_MS TW_TICK_MS
+#define BENCH_REARMS 2000000
+#define BENCH_SLACK_MS (2 * TW_TICK_MS)
+
+static const uint32_t bench_senders[] = { 10, 100, 1000, 10000 };
+
+typedef struct {
+  uint32_t next_ms;       // promise
+  uint32_t send_at;
+  uint32_t last_ms;       // last frame delivered
+  uint32_t dead_at;       // 0 == lives for ever
+  uint32_t open_at;       // 0 == door stays shut
+  uint32_t opened_ms;     // when the receiver got the change
+  uint32_t seq;
+  uint8_t change;         // the next frame is the change, not a heartbeat
+  uint8_t silent;
+  uint8_t alerted;
+} bench_sender_t;
+
+typedef struct {
+  double rearm_ns;
+  double packet_ns;
+  double idle_tick_ns;
+  double busy_timer_ns;   // per timer expired or cascaded, on ticks that had some
+  uint64_t max_tick_ns;
+  uint32_t silent;
+  uint32_t open;
+  uint32_t failures;
+} bench_result_t;
+
+static int verbose;
+static uint32_t bench_seconds = 2400;
+static uint32_t bench_rand = 2463534242u;
+
+static uint32_t bench_random(void)
+{
+  bench_rand ^= bench_rand << 13;
+  bench_rand ^= bench_rand >> 17;
+  bench_rand ^= bench_rand << 5;
+  return bench_rand;
+}
+
+static uint64_t bench_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Raw rearm cost: n armed timers, move random ones to random deadlines
+static double bench_rearm(uint32_t n)
+{
+  static tw_t wheel;
+  tw_timer_t *p_timers = calloc(n, sizeof(*p_timers));
+  uint32_t *p_picks = malloc(BENCH_REARMS * sizeof(*p_picks));
+  uint32_t i;
+  uint64_t start;
+
+  tw_init(&wheel, 0);
+  for (i = 0; i < n; i++)
+    tw_arm(&wheel, &p_timers[i], bench_random() % 200000);
+  // Pick the timers and deadlines up front so we only time the wheel
+  for (i = 0; i < BENCH_REARMS; i++)
+    p_picks[i] = bench_random();
+
+  start = bench_ns();
+  for (i = 0; i < BENCH_REARMS; i++)
+    tw_arm(&wheel, &p_timers[p_picks[i] % n], (p_picks[i] >> 8) % 200000);
+  start = bench_ns() - start;
+
+  free(p_picks);
+  free(p_timers);
+  return (double)start / BENCH_REARMS;
+}
+
+static void bench_run(uint32_t n, bench_result_t *p_result)
+{
+  bench_sender_t *p_senders = calloc(n, sizeof(*p_senders));
+  bench_sender_t *p;
+  gp_frame_t frame;
+  device_t *p_dev;
+  uint32_t now, i, end = bench_seconds * 1000, late;
+  uint32_t before, idle_ticks = 0, busy_timers = 0;
+  uint64_t t, packets = 0, packet_ns = 0, idle_ns = 0, busy_ns = 0;
+  int alert, door;
+
+  memset(p_result, 0, sizeof(*p_result));
+  device_table_init(0);
+
+  for (i = 0; i < n; i++) {
+    p = &p_senders[i];
+    p->next_ms = 5000 + bench_random() % 55001;
+    p->send_at = bench_random() % 1000;
+    if (i % 10 == 3)
+      p->dead_at = end / 2 + bench_random() % (end / 4);
+    if (i % 7 == 5)
+      p->open_at = 1000 + bench_random() % (end / 4);
+  }
+
+  memset(&frame, 0, sizeof(frame));
+  frame.type = GP_TYPE_REPORT;
+  frame.count = 1;
+
+  for (now = 0; now < end; now += BENCH_STEP_MS) {
+    for (i = 0; i < n; i++) {
+      p = &p_senders[i];
+      if (p->dead_at && now >= p->dead_at)
+        continue;
+
+      // The door opens and the change goes straight out
+      if (p->open_at && now >= p->open_at && !p->opened_ms && !p->change) {
+        p->change = 1;
+        p->seq++;
+        p->send_at = now;
+      }
+      if (now < p->send_at)
+        continue;
+
+      frame.device_id = i + 1;
+      frame.seq = p->seq;
+      frame.flags = GP_FLAG_LIVENESS | (p->change ? GP_FLAG_CHANGE : GP_FLAG_HEARTBEAT);
+      frame.next_ms = p->next_ms;
+      frame.event[0].pins = p->open_at && now >= p->open_at ? device_door_pin(0) : 0;
+      t = bench_ns();
+      device_update(&frame, i + 1, now, NULL);
+      packet_ns += bench_ns() - t;
+      packets++;
+      p->last_ms = now;
+      if (p->change) {
+        p->change = 0;
+        p->opened_ms = now;
+      }
+      // Jitter only ever makes it early (see heartbeat.h)
+      p->send_at = now + p->next_ms - bench_random() % (p->next_ms / 5);
+      if (p->silent) {
+        printf("twbench: FAIL %u senders: sender %u silent but alive\n", n, i + 1);
+        p_result->failures++;
+      }
+    }
+
+    // One device_alerts pass
+    before = device_wheel()->fired + device_wheel()->cascaded;
+    t = bench_ns();
+    while ((p_dev = device_expired(now, &alert, &door)) != NULL) {
+      p = &p_senders[p_dev->device_id - 1];
+      if (alert == DEVICE_SILENT) {
+        p_result->silent++;
+        late = now - (p->last_ms + 3 * p->next_ms + LIVENESS_GRACE_MS);
+        if (p->silent || !p->dead_at || now < p->dead_at || (int32_t)late < 0 || late > BENCH_SLACK_MS) {
+          printf("twbench: FAIL %u senders: sender %u called silent at %u ms, deadline %u ms%s\n", n,
+                 p_dev->device_id, now, p->last_ms + 3 * p->next_ms + LIVENESS_GRACE_MS, p->dead_at ? "" : " (alive)");
+          p_result->failures++;
+        }
+        p->silent = 1;
+      } else {
+        p_result->open++;
+        late = now - (p->opened_ms + DOOR_OPEN_ALERT_MS);
+        if (p->alerted || !p->opened_ms || (int32_t)late < 0 || late > BENCH_SLACK_MS) {
+          printf("twbench: FAIL %u senders: door %u open too long at %u ms, opened %u ms\n", n,
+                 p_dev->device_id, now, p->opened_ms);
+          p_result->failures++;
+        }
+        p->alerted = 1;
+      }
+      if (verbose)
+        printf("  %7u ms: %u %s\n", now, p_dev->device_id, alert == DEVICE_SILENT ? "silent" : "open too long");
+    }
+    t = bench_ns() - t;
+    before = device_wheel()->fired + device_wheel()->cascaded - before;
+    if (before == 0) {
+      idle_ticks++;
+      idle_ns += t;
+    } else {
+      busy_timers += before;
+      busy_ns += t;
+    }
+    if (t > p_result->max_tick_ns)
+      p_result->max_tick_ns = t;
+  }
+
+  // Everybody that died or left the door open long enough must have been reported
+  for (i = 0; i < n; i++) {
+    p = &p_senders[i];
+    if (p->dead_at && !p->silent) {
+      printf("twbench: FAIL %u senders: sender %u died at %u ms and was never called silent\n", n, i + 1, p->dead_at);
+      p_result->failures++;
+    }
+    // A dead sender's door stays open as far as the receiver knows
+    if (p->opened_ms && p->opened_ms + DOOR_OPEN_ALERT_MS + BENCH_SLACK_MS < end && !p->alerted) {
+      printf("twbench: FAIL %u senders: door %u opened at %u ms and was never reported\n", n, i + 1, p->opened_ms);
+      p_result->failures++;
+    }
+  }
+
+  p_result->packet_ns = packets ? (double)packet_ns / packets : 0;
+  p_result->idle_tick_ns = idle_ticks ? (double)idle_ns / idle_ticks : 0;
+  p_result->busy_timer_ns = busy_timers ? (double)busy_ns / busy_timers : 0;
+  free(p_senders);
+}
+
+int main(int argc, char *argv[])
+{
+  bench_result_t results[sizeof(bench_senders) / sizeof(bench_senders[0])];
+  bench_result_t *p_first = &results[0], *p_last;
+  uint32_t i, count = sizeof(bench_senders) / sizeof(bench_senders[0]);
+  int opt, failures = 0;
+
+  while ((opt = getopt(argc, argv, "s:v")) != -1) {
+    switch (opt) {
+      case 's': bench_seconds = atoi(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-s simulated seconds] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (bench_seconds * 1000 < 4 * DOOR_OPEN_ALERT_MS / 3) {
+    fprintf(stderr, "need at least %u simulated seconds for the open door alerts\n", 4 * DOOR_OPEN_ALERT_MS / 3000);
+    return 1;
+  }
+
+  printf("twbench: %u simulated seconds, tick %u ms, %u wheel levels of %u slots\n", bench_seconds,
+         TW_TICK_MS, TW_LEVELS, TW_SLOTS);
+  printf("senders  rearm ns  packet ns  idle tick ns  ns/timer handled  worst tick us  silent  open\n");
+  for (i = 0; i < count; i++) {
+    bench_run(bench_senders[i], &results[i]);
+    results[i].rearm_ns = bench_rearm(bench_senders[i]);
+    printf("%7u  %8.1f  %9.1f  %12.1f  %16.1f  %13.1f  %6u  %4u\n", bench_senders[i], results[i].rearm_ns,
+           results[i].packet_ns, results[i].idle_tick_ns, results[i].busy_timer_ns,
+           results[i].max_tick_ns / 1000.0, results[i].silent, results[i].open);
+    failures += results[i].failures;
+  }
+
+  p_last = &results[count - 1];
+  if (p_last->rearm_ns > 10 * p_first->rearm_ns) {
+    printf("twbench: FAIL rearm cost grew from %.1f to %.1f ns\n", p_first->rearm_ns, p_last->rearm_ns);
+    failures++;
+  }
+  if (p_last->idle_tick_ns > 10 * p_first->idle_tick_ns) {
+    printf("twbench: FAIL idle tick cost grew from %.1f to %.1f ns\n", p_first->idle_tick_ns, p_last->idle_tick_ns);
+    failures++;
+  }
+
+  printf("twbench: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
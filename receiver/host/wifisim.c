@@ -0,0 +1,193 @@
+// wifisim.c
+// Host-side test of the receiver's WiFi connection manager (see wifimgr.h). No radio:
+// we play the WiFi driver ourselves, feed the state machine events on a simulated
+// clock and check what it asks for.
+//
+//   ./wifisim [-v]
+//
+// Scenarios:
+//   1. Cold boot, nothing cached: full scan, the AP gets cached, boot to IP measured.
+//   2. Link drops: immediate fast path reconnect, outage measured.
+//   3. The AP moved to another channel: the fast path fails WM_FAST_MAX_FAILS times,
+//      the cache is dropped, a scan finds it and the new channel is cached.
+//   4. The AP is gone for an hour: waits grow to WM_BACKOFF_MAX_MS and no further,
+//      stay within the jitter window, never stop, and we recover when it is back.
+//   5. Two receivers with different seeds don't retry in lock step.
+//
+// Prints the metrics and exits non-zero on the first check that fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wifimgr.h"
+
+#define CHECK_NAME "wifisim"
+#include "check.h"
+
+#define SIM_ASSOC_MS 40       // driver: connect -> associated, fast path
+#define SIM_SCAN_MS 1500      // driver: connect -> associated, full scan
+#define SIM_DHCP_MS 300       // associated -> got IP
+#define SIM_FAIL_MS 3000      // driver: connect -> disconnected when there is no AP
+
+static int verbose;
+static const uint8_t ap_bssid[6] = { 0x5c, 0xcf, 0x7f, 0x01, 0x02, 0x03 };
+
+// Our fake driver: an AP on some channel, possibly switched off.
+typedef struct {
+  uint8_t up;
+  uint8_t channel;
+} sim_ap_t;
+
+// Run one connect action against the AP. Returns the time it took and feeds the
+// resulting events to the state machine.
+static uint32_t sim_connect(wm_t *p_wm, const sim_ap_t *p_ap, int action, uint32_t now)
+{
+  uint32_t took;
+
+  if ((action & WM_CONNECT_FAST) && p_ap->up && p_wm->ap.channel == p_ap->channel) {
+    took = SIM_ASSOC_MS;
+  } else if ((action & WM_CONNECT_SCAN) && p_ap->up) {
+    took = SIM_SCAN_MS;
+  } else {
+    // Wrong channel or no AP: the driver gives up on this attempt
+    wm_disconnected(p_wm, now + SIM_FAIL_MS);
+    if (verbose)
+      printf("  %8u ms: %s attempt failed\n", now + SIM_FAIL_MS, action & WM_CONNECT_FAST ? "fast" : "scan");
+    return SIM_FAIL_MS;
+  }
+
+  wm_associated(p_wm, ap_bssid, p_ap->channel, now + took);
+  wm_got_ip(p_wm, now + took + SIM_DHCP_MS);
+  if (verbose)
+    printf("  %8u ms: online via %s\n", now + took + SIM_DHCP_MS, action & WM_CONNECT_FAST ? "fast path" : "scan");
+  return took + SIM_DHCP_MS;
+}
+
+// Keep retrying (as the esp_timer would) until online or until limit_ms. Returns the
+// time we got there.
+static uint32_t sim_until_online(wm_t *p_wm, const sim_ap_t *p_ap, uint32_t now, uint32_t limit_ms)
+{
+  int action;
+
+  while (p_wm->state != WM_ONLINE && now < limit_ms) {
+    now += wm_wait(p_wm, now);
+    action = wm_retry(p_wm, now);
+    if (action == 0)
+      break;
+    now += sim_connect(p_wm, p_ap, action, now);
+  }
+  return now;
+}
+
+int main(int argc, char *argv[])
+{
+  wm_t wm, other;
+  wm_ap_t cache;
+  sim_ap_t ap = { 1, 6 };
+  uint32_t now, wait, expect, i, lockstep;
+  int action, opt;
+
+  while ((opt = getopt(argc, argv, "v")) != -1) {
+    switch (opt) {
+      case 'v': verbose = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  // 1. Cold boot
+  wm_init(&wm, NULL, 1234);
+  action = wm_start(&wm, 0);
+  CHECK(action == WM_CONNECT_SCAN);
+  now = 100;
+  CHECK(wm_associated(&wm, ap_bssid, ap.channel, now + SIM_SCAN_MS) == WM_SAVE_CACHE);
+  wm_got_ip(&wm, now + SIM_SCAN_MS + SIM_DHCP_MS);
+  now += SIM_SCAN_MS + SIM_DHCP_MS;
+  CHECK(wm.state == WM_ONLINE);
+  CHECK(wm.ap.valid && wm.ap.channel == 6);
+  CHECK(wm.boot_to_ip_ms == now);
+  printf("wifisim: cold boot, boot to IP %u ms\n", wm.boot_to_ip_ms);
+
+  // A warm boot from that cache goes straight to the fast path
+  cache = wm.ap;
+  wm_init(&other, &cache, 99);
+  CHECK(wm_start(&other, 0) == WM_CONNECT_FAST);
+
+  // 2. Link drop: immediate fast path
+  now += 60000;
+  CHECK(wm_disconnected(&wm, now) == 0);
+  CHECK(wm.state == WM_BACKOFF && wm.disconnects == 1);
+  CHECK(wm_wait(&wm, now) == 0);
+  // The driver reporting the same disconnect twice changes nothing
+  CHECK(wm_disconnected(&wm, now) == 0 && wm.disconnects == 1);
+  now = sim_until_online(&wm, &ap, now, now + 60000);
+  CHECK(wm.state == WM_ONLINE);
+  CHECK(wm.fast_hits == 1);
+  CHECK(wm.recover_ms == SIM_ASSOC_MS + SIM_DHCP_MS);
+  printf("wifisim: link drop, recovered in %u ms via the fast path\n", wm.recover_ms);
+
+  // 3. AP moves to channel 11
+  ap.channel = 11;
+  now += 60000;
+  wm_disconnected(&wm, now);
+  now = sim_until_online(&wm, &ap, now, now + 600000);
+  CHECK(wm.state == WM_ONLINE);
+  CHECK(wm.fast_misses == WM_FAST_MAX_FAILS);
+  CHECK(wm.ap.valid && wm.ap.channel == 11);
+  printf("wifisim: AP moved channel, recovered in %u ms (%u fast path misses, then scan)\n",
+         wm.recover_ms, wm.fast_misses);
+
+  // 4. AP gone for an hour. Every wait must be inside [d/2, d] for the doubling d, and
+  // d must stop at WM_BACKOFF_MAX_MS.
+  ap.up = 0;
+  now += 60000;
+  wm_disconnected(&wm, now);
+  expect = 0;
+  for (i = 0; now < 3600000 * 2; i++) {
+    wait = wm_wait(&wm, now);
+    if (i == 0) {
+      CHECK(wait == 0);
+    } else {
+      expect = expect ? (expect * 2 > WM_BACKOFF_MAX_MS ? WM_BACKOFF_MAX_MS : expect * 2) : WM_BACKOFF_MIN_MS;
+      CHECK(wait >= expect / 2 && wait <= expect);
+    }
+    now += wait;
+    action = wm_retry(&wm, now);
+    CHECK(action != 0);
+    if (i == 3600 / 30)
+      ap.up = 1;
+    now += sim_connect(&wm, &ap, action, now);
+    if (wm.state == WM_ONLINE)
+      break;
+  }
+  CHECK(wm.state == WM_ONLINE);
+  CHECK(expect == WM_BACKOFF_MAX_MS);
+  printf("wifisim: AP gone, %u attempts, back online after %u ms, worst outage %u ms\n",
+         i + 1, wm.recover_ms, wm.recover_max_ms);
+
+  // 5. Same outage, two receivers with different seeds
+  wm_init(&wm, &cache, 1);
+  wm_init(&other, &cache, 2);
+  wm_start(&wm, 0);
+  wm_start(&other, 0);
+  wm_got_ip(&wm, 0);
+  wm_got_ip(&other, 0);
+  wm_disconnected(&wm, 1000);
+  wm_disconnected(&other, 1000);
+  lockstep = 0;
+  for (i = 0; i < 10; i++) {
+    wm_retry(&wm, wm.retry_at_ms);
+    wm_retry(&other, other.retry_at_ms);
+    wm_disconnected(&wm, wm.retry_at_ms);
+    wm_disconnected(&other, other.retry_at_ms);
+    lockstep += wm.retry_at_ms == other.retry_at_ms;
+  }
+  CHECK(lockstep < 3);
+  printf("wifisim: two receivers retried at the same time %u out of 10 times\n", lockstep);
+
+  printf("wifisim: %s\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
@@ -6,3 +6,7 @@
 # in the build directory. This behaviour is entirely configurable,
 # please read the ESP-IDF documents if you need to do this.
 #
+
+# The wire protocol code is shared with the sender and lives in ../../common.
+COMPONENT_SRCDIRS := . ../../common
+COMPONENT_ADD_INCLUDEDIRS := . ../../common
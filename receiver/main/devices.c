@@ -0,0 +1,333 @@
+// devices.c
+// Per-sender state table (see devices.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// Linear probing over a power of two sized array. Slots are never freed ... a sender
+// that goes away keeps its slot (and its history) until the receiver reboots. Device
+// id 0 is reserved to mark an empty slot. New senders are turned away once
+// DEVICE_LOAD_MAX slots are taken: probe runs grow quickly as a linear probed table
+// fills, and a quarter of it empty keeps a lookup to a couple of slots on average.
+//
+// The liveness and open door deadlines live in a timer wheel (see twheel.h) so keeping
+// them costs the same however many senders there are. Whoever calls device_update
+// owns the wheel and must also be the one calling device_expired.
+
+#include <string.h>
+#include "devices.h"
+
+#if (DEVICE_TABLE_SIZE & (DEVICE_TABLE_SIZE - 1)) != 0
+  #error "DEVICE_TABLE_SIZE must be a power of two"
+#endif
+
+#if DEVICE_DOORS == 0 || (DOOR_OPEN_MASK) > 0xffff
+  #error "DOOR_OPEN_MASK must have between 1 and 16 of the 16 pin bits set"
+#endif
+
+// Longest promise we take at face value (a day); keeps the deadline arithmetic sane
+#define LIVENESS_MAX_MS 86400000
+
+static device_t device_table[DEVICE_TABLE_SIZE];
+static uint32_t device_used;
+static uint32_t device_quiet;
+static tw_t device_timers;
+
+// Fibonacci hashing ... chip ids are far from random in the low bits so mix them first.
+static inline uint32_t device_hash(uint32_t device_id)
+{
+  return ((device_id * 0x9E3779B1u) >> 16) & (DEVICE_TABLE_SIZE - 1);
+}
+
+// Find the slot for device_id, or the empty slot where it would go. Returns NULL only
+// if the table is full and device_id isn't in it.
+static device_t *device_find(uint32_t device_id)
+{
+  uint32_t i, index = device_hash(device_id);
+
+  for (i = 0; i < DEVICE_TABLE_SIZE; i++) {
+    device_t *p_dev = &device_table[(index + i) & (DEVICE_TABLE_SIZE - 1)];
+    if (p_dev->device_id == device_id || p_dev->device_id == 0)
+      return p_dev;
+  }
+  return NULL;
+}
+
+// now_ms is the clock device_update and device_expired will be given
+void device_table_init(uint32_t now_ms)
+{
+  memset(device_table, 0, sizeof(device_table));
+  device_used = 0;
+  device_quiet = 0;
+  tw_init(&device_timers, now_ms);
+}
+
+// The pin of door n: the nth lowest bit of DOOR_OPEN_MASK
+uint16_t device_door_pin(int door)
+{
+  uint16_t mask = DOOR_OPEN_MASK;
+
+  while (door--)
+    mask &= mask - 1;
+  return mask & -mask;
+}
+
+// When event i of a frame happened, on the clock device_update is given: now_ms less
+// how long ago the sender saw it, by the frame's clock offset. A batch that waited on
+// the sender for a receiver holds events from well before it got here. Without an
+// offset (an untraced frame, or a sender still waiting for its first TIME answer) all
+// we know is now_ms.
+static uint32_t device_event_ms(const gp_frame_t *p_frame, int i, uint32_t now_ms)
+{
+  int32_t age;
+
+  if (!(p_frame->flags & GP_FLAG_TRACE) || p_frame->offset == GP_OFFSET_UNKNOWN)
+    return now_ms;
+  age = (int32_t)(p_frame->rx_time - (p_frame->event[i].timestamp + p_frame->offset));
+  return age > 0 ? now_ms - age : now_ms;
+}
+
+// Start each door's open clock when its pin says open and stop it when it says closed,
+// and keep the door's analytics, as of event_ms. Returns 1 if a door just closed after
+// an unusually long opening (unusual_door says which). An opening we didn't see start
+// (the door was already open the first time we heard from the sender) isn't timed.
+// Events are never taken as older than the one before: the offset moves between
+// frames, and neither the open clocks nor doorstats' hours run backwards.
+static int device_door(device_t *p_dev, uint32_t event_ms)
+{
+  uint16_t open = p_dev->pins & DOOR_OPEN_MASK, moved = open ^ p_dev->open, pin;
+  device_door_t *p_door;
+  int door, unusual = 0;
+
+  if ((int32_t)(event_ms - p_dev->door_ms) < 0)
+    event_ms = p_dev->door_ms;
+  p_dev->door_ms = event_ms;
+
+  for (door = 0; moved && door < DEVICE_DOORS; door++) {
+    pin = device_door_pin(door);
+    if (!(moved & pin))
+      continue;
+    moved &= ~pin;
+    p_door = &p_dev->door[door];
+    if (open & pin) {
+      p_door->open_since = event_ms;
+      if (DOOR_OPEN_ALERT_MS)
+        tw_arm(&device_timers, &p_door->open_timer, event_ms + DOOR_OPEN_ALERT_MS);
+      doorstats_open(&p_door->doorstats, event_ms, p_dev->changes != 0);
+    } else {
+      tw_cancel(&device_timers, &p_door->open_timer);
+      if (doorstats_close(&p_door->doorstats, p_door->open_since, event_ms)) {
+        p_dev->unusual_door = door;
+        unusual = 1;
+      }
+    }
+  }
+  p_dev->open = open;
+  return unusual;
+}
+
+device_t *device_lookup(uint32_t device_id)
+{
+  device_t *p_dev;
+
+  if (device_id == 0)
+    return NULL;
+  p_dev = device_find(device_id);
+  return (p_dev && p_dev->device_id == device_id) ? p_dev : NULL;
+}
+
+// Apply a decoded frame to its sender's slot. Returns a mask of DEVICE_NEW,
+// DEVICE_CHANGED, DEVICE_ALIVE, DEVICE_UNUSUAL and the DEVICE_FRESH_SHIFT bits, or
+// DEVICE_FULL if there is no room for a new sender (DEVICE_LOAD_MAX). Events with a sequence number we
+// have already seen are counted as dups and otherwise ignored (this is what suppresses
+// retransmissions); a jump forward in the sequence is counted as lost packets, until
+// one of them turns up late and is counted as reordered instead.
+int device_update(const gp_frame_t *p_frame, uint32_t addr, uint32_t now_ms, device_t **pp_dev)
+{
+  device_t *p_dev;
+  int i, result = 0;
+  uint32_t seq, age, gap;
+
+  if (p_frame->device_id == 0)
+    return DEVICE_FULL;
+
+  p_dev = device_find(p_frame->device_id);
+  if (p_dev == NULL)
+    return DEVICE_FULL;
+
+  if (p_dev->device_id == 0) {
+    if (device_used >= DEVICE_LOAD_MAX)
+      return DEVICE_FULL;
+    memset(p_dev, 0, sizeof(*p_dev));
+    p_dev->device_id = p_frame->device_id;
+    p_dev->pins = p_frame->event[0].pins;
+    p_dev->last_seq = p_frame->seq - 1;
+    // Anything from before we met it is none of our business
+    p_dev->window = 0xffffffff;
+    for (i = 0; i < DEVICE_DOORS; i++)
+      doorstats_init(&p_dev->door[i].doorstats, now_ms);
+    p_dev->door_ms = now_ms;
+    device_used++;
+    result |= DEVICE_NEW;
+  }
+
+  p_dev->addr = addr;
+  p_dev->last_seen = now_ms;
+
+  // The sender's heartbeat promise (see heartbeat.h in common/). Its interval at most
+  // doubles per heartbeat, so waiting three intervals forgives one lost heartbeat.
+  if (p_frame->flags & GP_FLAG_LIVENESS) {
+    p_dev->next_ms = p_frame->next_ms > LIVENESS_MAX_MS ? LIVENESS_MAX_MS : p_frame->next_ms;
+    tw_arm(&device_timers, &p_dev->live_timer, now_ms + 3 * p_dev->next_ms + LIVENESS_GRACE_MS);
+  }
+  if (p_dev->silent) {
+    p_dev->silent = 0;
+    device_quiet--;
+    result |= DEVICE_ALIVE;
+  }
+
+  // Heartbeats don't carry a new sequence number. Just take the state; it only differs
+  // from ours if we somehow missed a change. A new sender took its pins from this frame
+  // already, but its doors still have to hear them: after a receiver restart a
+  // heartbeat is usually the first frame we get.
+  if (p_frame->flags & GP_FLAG_HEARTBEAT) {
+    p_dev->heartbeats++;
+    if (p_frame->count && p_frame->event[0].pins != p_dev->pins) {
+      p_dev->pins = p_frame->event[0].pins;
+      p_dev->changes++;
+      result |= DEVICE_CHANGED;
+      if (device_door(p_dev, now_ms))
+        result |= DEVICE_UNUSUAL;
+    } else if (result & DEVICE_NEW)
+      device_door(p_dev, now_ms);
+    if (pp_dev)
+      *pp_dev = p_dev;
+    return result;
+  }
+
+  // The sender rebooted and its sequence numbers started over, from wherever: behind us,
+  // or ahead (a low power sender keeps counting in RTC memory until that is lost). A
+  // retransmitted boot frame we already have is just a dup, so a BOOT frame whose first
+  // sequence number is marked in the window changes nothing. That is why senders start
+  // each boot from a random sequence number (see GP_FLAG_BOOT): one that started from 0
+  // again after a few changes would look like that retransmit.
+  age = p_dev->last_seq - p_frame->seq;
+  if ((p_frame->flags & GP_FLAG_BOOT) && !(result & DEVICE_NEW) &&
+      !((int32_t)age >= 0 && age < 32 && (p_dev->window & (1u << age)))) {
+    p_dev->last_seq = p_frame->seq - 1;
+    p_dev->window = 0xffffffff;
+    p_dev->boots++;
+  }
+
+  for (i = 0; i < p_frame->count; i++) {
+    seq = p_frame->seq + i;
+
+    // Signed difference so the comparison survives the sequence number wrapping.
+    age = p_dev->last_seq - seq;
+    if ((int32_t)age >= 0) {
+      // Behind us. If it is inside the window and we never had it, we counted it as
+      // lost when we jumped past it: it was only late. Its pins are older than what
+      // we have, so they don't count as a change.
+      if (age < 32 && !(p_dev->window & (1u << age))) {
+        p_dev->window |= 1u << age;
+        p_dev->lost--;
+        p_dev->reordered++;
+        p_dev->packets++;
+        result |= 1 << (DEVICE_FRESH_SHIFT + i);
+      } else {
+        p_dev->dups++;
+      }
+      continue;
+    }
+
+    gap = seq - p_dev->last_seq;
+    p_dev->window = gap < 32 ? (p_dev->window << gap) | 1 : 1;
+    p_dev->lost += gap - 1;
+    p_dev->last_seq = seq;
+    p_dev->packets++;
+    result |= 1 << (DEVICE_FRESH_SHIFT + i);
+
+    if (p_frame->event[i].pins != p_dev->pins) {
+      p_dev->pins = p_frame->event[i].pins;
+      p_dev->changes++;
+      result |= DEVICE_CHANGED;
+    }
+    // Each event in turn, when it happened, so a batch that opened and closed a door
+    // times that opening rather than losing it
+    if (device_door(p_dev, device_event_ms(p_frame, i, now_ms)))
+      result |= DEVICE_UNUSUAL;
+  }
+
+  if (pp_dev)
+    *pp_dev = p_dev;
+  return result;
+}
+
+// Iterate the table: returns the device in slot index, or NULL if the slot is empty.
+device_t *device_slot(uint32_t index)
+{
+  if (index >= DEVICE_TABLE_SIZE || device_table[index].device_id == 0)
+    return NULL;
+  return &device_table[index];
+}
+
+// The other way round: which slot p_dev is in
+uint32_t device_index(const device_t *p_dev)
+{
+  return p_dev - device_table;
+}
+
+// The next sender whose deadline passed by now_ms, or NULL. *p_alert says which one:
+// DEVICE_SILENT (it broke its heartbeat promise, now marked silent until it speaks) or
+// DEVICE_OPEN_TOO_LONG (once per opening, *p_door says which door). Call it in a loop
+// at least every TW_TICK_MS or so; each call only costs what has expired since the
+// last one.
+device_t *device_expired(uint32_t now_ms, int *p_alert, int *p_door)
+{
+  tw_timer_t *p_timer = tw_expire(&device_timers, now_ms);
+  device_t *p_dev;
+
+  if (p_timer == NULL)
+    return NULL;
+
+  // Every timer lives in a device_table slot; which one and which of its timers
+  p_dev = &device_table[((char *)p_timer - (char *)device_table) / sizeof(device_t)];
+  if (p_timer != &p_dev->live_timer) {
+    *p_door = ((char *)p_timer - (char *)&p_dev->door[0].open_timer) / sizeof(device_door_t);
+    p_dev->door[*p_door].open_alerts++;
+    *p_alert = DEVICE_OPEN_TOO_LONG;
+    return p_dev;
+  }
+
+  p_dev->silent = 1;
+  p_dev->silences++;
+  device_quiet++;
+  *p_alert = DEVICE_SILENT;
+  return p_dev;
+}
+
+// Would device_update take a frame from this sender: it has a slot, or there is room
+// for one. The receive side asks before it ACKs a frame that another task will apply
+// (rawrx.c, the pipeline). That is a read of a table the other task writes, like the
+// status page's. It can only be wrong in a race with the last free slots being taken:
+// a frame from a new sender caught in that gap is ACKed, then dropped as DEVICE_FULL
+// (DLOG_TABLE_FULL) without the sender ever knowing.
+int device_room(uint32_t device_id)
+{
+  return device_used < DEVICE_LOAD_MAX || device_lookup(device_id) != NULL;
+}
+
+uint32_t device_count(void)
+{
+  return device_used;
+}
+
+// Senders silent right now
+uint32_t device_silent(void)
+{
+  return device_quiet;
+}
+
+// The deadline wheel, for its counters
+const tw_t *device_wheel(void)
+{
+  return &device_timers;
+}
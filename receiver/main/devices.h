@@ -0,0 +1,126 @@
+// devices.h
+// Per-sender state table. One receiver can track a whole building full of doors; each
+// sender gets a slot keyed by its device id (the ESP8266 chip id). The table is a fixed
+// size, open addressed hash table so there is no heap allocation per packet and a
+// lookup is O(1) on average. Size it with idf.py menuconfig (DEVICE_TABLE_SIZE); it
+// takes senders until it is three quarters full.
+//
+// A sender can watch several doors, one per pin in DOOR_OPEN_MASK. Each door has its
+// own open clock, open too long timer and analytics (device_door_t); door n is the nth
+// lowest bit of the mask.
+
+#ifndef __DEVICES__H
+
+  #define __DEVICES__H
+
+  #include <stdint.h>
+  #include "garage_proto.h"
+  #include "twheel.h"
+  #include "doorstats.h"
+
+  #include "sdkconfig.h"
+
+  #ifdef CONFIG_DEVICE_TABLE_SIZE
+    #define DEVICE_TABLE_SIZE CONFIG_DEVICE_TABLE_SIZE
+  #else
+    #define DEVICE_TABLE_SIZE 64
+  #endif
+
+  // Most senders we take, three quarters of the slots
+  #define DEVICE_LOAD_MAX (DEVICE_TABLE_SIZE / 4 * 3)
+
+  // How late a sender may be on top of its promise (GP_FLAG_LIVENESS, see heartbeat.h in
+  // common/) before we call it silent.
+  #ifdef CONFIG_LIVENESS_GRACE_MS
+    #define LIVENESS_GRACE_MS CONFIG_LIVENESS_GRACE_MS
+  #else
+    #define LIVENESS_GRACE_MS 2000
+  #endif
+
+  // The pins that are doors, one door per bit, open while it is set, and how long a
+  // door may stay open before we say so (0 == never).
+  #ifdef CONFIG_DOOR_OPEN_MASK
+    #define DOOR_OPEN_MASK CONFIG_DOOR_OPEN_MASK
+  #else
+    #define DOOR_OPEN_MASK 0x0004
+  #endif
+
+  // Doors per sender: the bits in DOOR_OPEN_MASK
+  #define DEVICE_DOORS (((DOOR_OPEN_MASK) & 1) + ((DOOR_OPEN_MASK) >> 1 & 1) + ((DOOR_OPEN_MASK) >> 2 & 1) + \
+                        ((DOOR_OPEN_MASK) >> 3 & 1) + ((DOOR_OPEN_MASK) >> 4 & 1) + ((DOOR_OPEN_MASK) >> 5 & 1) + \
+                        ((DOOR_OPEN_MASK) >> 6 & 1) + ((DOOR_OPEN_MASK) >> 7 & 1) + ((DOOR_OPEN_MASK) >> 8 & 1) + \
+                        ((DOOR_OPEN_MASK) >> 9 & 1) + ((DOOR_OPEN_MASK) >> 10 & 1) + ((DOOR_OPEN_MASK) >> 11 & 1) + \
+                        ((DOOR_OPEN_MASK) >> 12 & 1) + ((DOOR_OPEN_MASK) >> 13 & 1) + ((DOOR_OPEN_MASK) >> 14 & 1) + \
+                        ((DOOR_OPEN_MASK) >> 15 & 1))
+  #ifdef CONFIG_DOOR_OPEN_ALERT_S
+    #define DOOR_OPEN_ALERT_MS (CONFIG_DOOR_OPEN_ALERT_S * 1000)
+  #else
+    #define DOOR_OPEN_ALERT_MS 900000
+  #endif
+
+  // device_update result bits. Bit DEVICE_FRESH_SHIFT + i is set if event i of the
+  // frame was one we hadn't seen (not a dup).
+  #define DEVICE_NEW 0x01
+  #define DEVICE_CHANGED 0x02
+  #define DEVICE_ALIVE 0x04     // a sender we had called silent spoke again
+  #define DEVICE_UNUSUAL 0x08   // a door closed after an unusually long opening (doorstats.h)
+  #define DEVICE_FRESH_SHIFT 8
+  #define DEVICE_FULL -1
+
+  // device_expired alerts
+  #define DEVICE_SILENT 1       // nothing heard by the deadline it promised
+  #define DEVICE_OPEN_TOO_LONG 2
+
+  // One of a sender's doors
+  typedef struct {
+    tw_timer_t open_timer;  // fires if the door stays open DOOR_OPEN_ALERT_MS
+    uint32_t open_since;  // receiver time (ms) the sender saw the door open
+    uint32_t open_alerts; // times the door was left open too long
+    doorstats_t doorstats;  // how long and how often it opens (doorstats.h)
+  } device_door_t;
+
+  typedef struct {
+    uint32_t device_id;   // 0 means the slot is empty
+    uint32_t addr;        // sender's IPv4 address (network byte order)
+    uint16_t pins;        // last reported pin bitmask
+    uint32_t last_seq;    // highest sequence number seen
+    uint32_t window;      // bit n: we have last_seq - n (tells a late arrival from a dup)
+    uint32_t last_seen;   // receiver time (ms) of the last packet
+    uint32_t changed_ms;  // receiver clock (rx_clock_ms) of the frame with the last change
+    uint32_t next_ms;     // the sender's promised interval, 0 if it never gave one
+    tw_timer_t live_timer;  // fires if nothing arrives in time (only if next_ms)
+    uint16_t open;        // the DOOR_OPEN_MASK pins of the doors that are open
+    uint32_t door_ms;     // receiver time (ms) of the last event the doors were given
+    uint8_t silent;       // it missed its deadline and hasn't spoken since
+    uint8_t unusual_door; // the door behind the last DEVICE_UNUSUAL
+    uint32_t silences;    // times it went silent
+    uint32_t packets;     // events received
+    uint32_t changes;     // events where the pins changed
+    uint32_t lost;        // sequence numbers we never saw
+    uint32_t dups;        // old or repeated sequence numbers (retransmits we already had)
+    uint32_t reordered;   // events that turned up after a later one (not lost after all)
+    uint32_t heartbeats;  // heartbeat frames
+    uint32_t boots;       // times the sender restarted its sequence numbers
+    uint32_t latency_ms;  // detection on the sender -> received here, last traced event
+    uint32_t latency_max_ms;
+    uint32_t health_ms;   // receiver time (ms) of its last HEALTH frame, 0 if none yet
+    uint32_t heap_min;    // ... the lowest free heap it has had
+    uint16_t stack_unused; // ... the fewest bytes of its stack never used
+    uint16_t vdd_mv;      // ... its supply voltage, 0 if it doesn't measure it
+    uint16_t callback_us; // ... its longest timer callback since the one before
+    device_door_t door[DEVICE_DOORS];
+  } device_t;
+
+  void device_table_init(uint32_t now_ms);
+  device_t *device_lookup(uint32_t device_id);
+  int device_update(const gp_frame_t *p_frame, uint32_t addr, uint32_t now_ms, device_t **pp_dev);
+  device_t *device_slot(uint32_t index);
+  uint32_t device_index(const device_t *p_dev);
+  device_t *device_expired(uint32_t now_ms, int *p_alert, int *p_door);
+  uint16_t device_door_pin(int door);
+  int device_room(uint32_t device_id);
+  uint32_t device_count(void);
+  uint32_t device_silent(void);
+  const tw_t *device_wheel(void);
+
+#endif
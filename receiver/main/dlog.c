@@ -0,0 +1,194 @@
+// dlog.c
+// Deferred logging (see dlog.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// The ring is a bounded multi producer / single consumer queue (Dmitry Vyukov's). Records
+// come from udp_server_task or raw_rx_task, the lwIP tcpip thread (rawrx.c) and
+// pipeline_task, on either core. Every slot carries a sequence number that says whose
+// turn it is: a producer claims a slot by moving head on with a compare and swap, fills
+// it in and then publishes it by bumping the slot's sequence; dlog_task (the only
+// consumer, so tail needs no atomics) takes a record once its sequence says it is
+// published and hands the slot back a lap later. No locks and no blocking, just
+// acquire/release ordering so the reader sees the record before it sees the sequence.
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "dlog.h"
+#include "rxhealth.h"
+
+#if (DLOG_RING_SIZE & (DLOG_RING_SIZE - 1)) != 0
+  #error "DLOG_RING_SIZE must be a power of two"
+#endif
+
+// How long dlog_task sleeps when the ring is empty
+#define DLOG_IDLE_MS 20
+
+extern const char *TAG;
+
+volatile uint8_t dlog_level = DLOG_INFO;
+dlog_stats_t dlog_stats;
+
+typedef struct {
+  uint32_t seq;       // pos: free for the producer at pos, pos + 1: record for the consumer
+  dlog_rec_t rec;
+} dlog_slot_t;
+
+static dlog_slot_t dlog_ring[DLOG_RING_SIZE];
+static uint32_t dlog_head;   // next slot a producer claims (compare and swap)
+static uint32_t dlog_tail;   // next slot the consumer reads, written by it only
+
+void dlog_init(uint8_t level)
+{
+  uint32_t i;
+
+  dlog_level = level;
+  for (i = 0; i < DLOG_RING_SIZE; i++)
+    dlog_ring[i].seq = i;
+  dlog_head = 0;
+  dlog_tail = 0;
+  dlog_stats.written = 0;
+  dlog_stats.dropped = 0;
+  dlog_stats.filtered = 0;
+}
+
+void dlog_set_level(uint8_t level)
+{
+  dlog_level = level;
+}
+
+// Producer side, any task or the tcpip thread. Never blocks; if the consumer has fallen
+// behind we count a drop. A producer that loses the race for a slot just tries the next.
+void dlog_write(uint8_t level, dlog_type_t type, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+  uint32_t head = __atomic_load_n(&dlog_head, __ATOMIC_RELAXED), seq;
+  dlog_slot_t *p_slot;
+
+  while (1) {
+    p_slot = &dlog_ring[head & (DLOG_RING_SIZE - 1)];
+    seq = __atomic_load_n(&p_slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == head) {
+      // Free and ours if nobody beat us to it; a failed swap reloads head
+      if (__atomic_compare_exchange_n(&dlog_head, &head, head + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if ((int32_t)(seq - head) < 0) {
+      // Still holds the record from a lap ago: the ring is full
+      __atomic_fetch_add(&dlog_stats.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      // Another producer took it; catch up
+      head = __atomic_load_n(&dlog_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  p_slot->rec.time_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+  p_slot->rec.level = level;
+  p_slot->rec.type = type;
+  p_slot->rec.a = a;
+  p_slot->rec.b = b;
+  p_slot->rec.c = c;
+  p_slot->rec.d = d;
+
+  __atomic_store_n(&p_slot->seq, head + 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&dlog_stats.written, 1, __ATOMIC_RELAXED);
+}
+
+// Consumer side, dlog_task only. Returns 1 and fills in p_rec if there was a record,
+// otherwise 0. A slot that was claimed but isn't filled in yet counts as empty; the
+// record comes out on the next call.
+int dlog_read(dlog_rec_t *p_rec)
+{
+  dlog_slot_t *p_slot = &dlog_ring[dlog_tail & (DLOG_RING_SIZE - 1)];
+
+  if (__atomic_load_n(&p_slot->seq, __ATOMIC_ACQUIRE) != dlog_tail + 1)
+    return 0;
+
+  *p_rec = p_slot->rec;
+  __atomic_store_n(&p_slot->seq, dlog_tail + DLOG_RING_SIZE, __ATOMIC_RELEASE);
+  dlog_tail++;
+  return 1;
+}
+
+// Addresses are kept in network byte order, so the first octet is the low byte.
+#define IP_ARGS(addr) (addr) & 0xff, ((addr) >> 8) & 0xff, ((addr) >> 16) & 0xff, (addr) >> 24
+
+// Turn one record back into the text we used to print straight from the UDP task.
+static void dlog_format(const dlog_rec_t *p_rec)
+{
+  char line[96];
+
+  switch (p_rec->type) {
+    case DLOG_RX:
+      snprintf(line, sizeof(line), "Received %u bytes from %u.%u.%u.%u", p_rec->a, IP_ARGS(p_rec->b));
+      break;
+    case DLOG_BAD_FRAME:
+      snprintf(line, sizeof(line), "Bad frame from %u.%u.%u.%u: error %d", IP_ARGS(p_rec->b), (int)p_rec->a);
+      break;
+    case DLOG_EVENT:
+      snprintf(line, sizeof(line), "Device %08x seq %u pins 0x%04x time %u", p_rec->a, p_rec->b, p_rec->c, p_rec->d);
+      break;
+    case DLOG_CHANGE:
+      snprintf(line, sizeof(line), "Device %08x is now 0x%04x (%u changes, %u lost)", p_rec->a, p_rec->b, p_rec->c, p_rec->d);
+      break;
+    case DLOG_TABLE_FULL:
+      snprintf(line, sizeof(line), "Device table full, ignoring %08x", p_rec->a);
+      break;
+    case DLOG_DISCOVER:
+      snprintf(line, sizeof(line), "Device %08x at %u.%u.%u.%u is looking for receivers", p_rec->a, IP_ARGS(p_rec->b));
+      break;
+    case DLOG_SILENT:
+      snprintf(line, sizeof(line), "Device %08x silent for %u ms, promised a frame every %u ms", p_rec->a, p_rec->b, p_rec->c);
+      break;
+    case DLOG_ALIVE:
+      snprintf(line, sizeof(line), "Device %08x is back (silent %u times)", p_rec->a, p_rec->b);
+      break;
+    case DLOG_OPEN_TOO_LONG:
+      snprintf(line, sizeof(line), "Device %08x door %04x open for %u s (pins %04x)", p_rec->a, p_rec->d,
+               p_rec->b / 1000, p_rec->c);
+      break;
+    case DLOG_HEALTH:
+      snprintf(line, sizeof(line), "Device %08x heap low %u bytes, stack %u bytes unused, %u mV", p_rec->a, p_rec->b,
+               p_rec->c, p_rec->d);
+      break;
+    case DLOG_UNUSUAL:
+      snprintf(line, sizeof(line), "Device %08x door %04x was open %u s, it's usually %u s", p_rec->a, p_rec->d,
+               p_rec->b / 1000, p_rec->c / 1000);
+      break;
+    default:
+      snprintf(line, sizeof(line), "Unknown log record %d", p_rec->type);
+      break;
+  }
+
+  if (p_rec->level <= DLOG_ERROR)
+    ESP_LOGE(TAG, "[%u] %s", p_rec->time_ms, line);
+  else if (p_rec->level == DLOG_WARN)
+    ESP_LOGW(TAG, "[%u] %s", p_rec->time_ms, line);
+  else
+    ESP_LOGI(TAG, "[%u] %s", p_rec->time_ms, line);
+}
+
+// This is the deferred logging task. Run it at a low priority; it drains the ring
+// whenever the UDP task leaves it some CPU. Like every FreeRTOS task function it must
+// never return. See receiver_main.c for task creation.
+void dlog_task(void *pvParameters)
+{
+  dlog_rec_t rec;
+  uint32_t dropped = 0;
+
+  rxhealth_watch("dlog");
+
+  while (1) {
+    while (dlog_read(&rec))
+      dlog_format(&rec);
+
+    // Tell somebody if we had to throw records away
+    if (dlog_stats.dropped != dropped) {
+      ESP_LOGW(TAG, "dlog dropped %u records", dlog_stats.dropped - dropped);
+      dropped = dlog_stats.dropped;
+    }
+
+    vTaskDelay(DLOG_IDLE_MS / portTICK_PERIOD_MS);
+  }
+}
@@ -0,0 +1,82 @@
+// dlog.h
+// Deferred logging. ESP_LOGI on the packet path means formatting a string and pushing
+// it out of the UART before we can look at the next datagram ... the console becomes
+// the throughput limit long before the WiFi does. Instead, the hot path drops a small
+// binary record into a lock-free ring buffer and the low priority dlog task formats and
+// prints the records when nothing better is going on. Any number of tasks (and the lwIP
+// tcpip thread, see rawrx.c) may log at once, on either core; dlog_task is the only
+// reader.
+//
+// If the ring is full the record is dropped and counted; we never block the producer.
+// The verbosity can be changed at runtime with dlog_set_level; records above the current
+// level cost one compare.
+
+#ifndef __DLOG__H
+
+  #define __DLOG__H
+
+  #include <stdint.h>
+
+  #include "sdkconfig.h"
+
+  #ifdef CONFIG_DLOG_RING_SIZE
+    #define DLOG_RING_SIZE CONFIG_DLOG_RING_SIZE
+  #else
+    #define DLOG_RING_SIZE 64
+  #endif
+
+  // Levels, same order as esp_log_level_t
+  #define DLOG_ERROR 1
+  #define DLOG_WARN 2
+  #define DLOG_INFO 3
+  #define DLOG_DEBUG 4
+
+  // Record types. Each one has a format string in dlog.c; keep the two in step.
+  typedef enum {
+    DLOG_RX,            // a = length, b = source address
+    DLOG_BAD_FRAME,     // a = gp_decode error, b = source address
+    DLOG_EVENT,         // a = device id, b = sequence, c = pins, d = sender timestamp
+    DLOG_CHANGE,        // a = device id, b = pins, c = changes, d = lost
+    DLOG_TABLE_FULL,    // a = device id
+    DLOG_DISCOVER,      // a = device id, b = source address
+    DLOG_SILENT,        // a = device id, b = ms since we heard it, c = promised interval (ms)
+    DLOG_ALIVE,         // a = device id, b = times it went silent
+    DLOG_OPEN_TOO_LONG, // a = device id, b = ms open, c = pins, d = the door's pin
+    DLOG_HEALTH,        // a = device id, b = lowest free heap, c = least unused stack, d = mV
+    DLOG_UNUSUAL,       // a = device id, b = ms open, c = usual ms open (doorstats.h), d = the door's pin
+    DLOG_RECORD_TYPES
+  } dlog_type_t;
+
+  typedef struct {
+    uint32_t time_ms;
+    uint8_t level;
+    uint8_t type;
+    uint32_t a, b, c, d;
+  } dlog_rec_t;
+
+  typedef struct {
+    uint32_t written;   // records queued
+    uint32_t dropped;   // records lost because the ring was full
+    uint32_t filtered;  // records skipped because of the level
+  } dlog_stats_t;
+
+  extern volatile uint8_t dlog_level;
+
+  // Log from the hot path. Cheap level check first, then the ring.
+  #define DLOG(level, type, a, b, c, d) \
+    do { \
+      if ((level) <= dlog_level) \
+        dlog_write(level, type, a, b, c, d); \
+      else \
+        __atomic_fetch_add(&dlog_stats.filtered, 1, __ATOMIC_RELAXED); \
+    } while (0)
+
+  extern dlog_stats_t dlog_stats;
+
+  void dlog_init(uint8_t level);
+  void dlog_set_level(uint8_t level);
+  void dlog_write(uint8_t level, dlog_type_t type, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+  int dlog_read(dlog_rec_t *p_rec);
+  void dlog_task(void *pvParameters);
+
+#endif
@@ -0,0 +1,152 @@
+// doorstats.c
+// Per-door analytics (see doorstats.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// The hour buckets are a ring: hour is the newest, the one after it the oldest. Times
+// are kept relative to hour_ms, like the timer wheel keeps them relative to its tick,
+// so nothing here cares when the millisecond clock wraps. The work per event is bounded
+// by DOORSTATS_HOURS whatever the gap since the last one.
+
+#include <string.h>
+#include "doorstats.h"
+
+void doorstats_init(doorstats_t *p_stats, uint32_t now_ms)
+{
+  memset(p_stats, 0, sizeof(*p_stats));
+  p_stats->hour_ms = now_ms;
+}
+
+// Move the newest bucket up to now_ms, clearing the hours that fell out of the window
+static void doorstats_roll(doorstats_t *p_stats, uint32_t now_ms)
+{
+  uint32_t hours = (now_ms - p_stats->hour_ms) / DOORSTATS_HOUR_MS;
+
+  if (hours == 0)
+    return;
+  p_stats->hour_ms += hours * DOORSTATS_HOUR_MS;
+  if (hours >= DOORSTATS_HOURS) {
+    memset(p_stats->open_ms, 0, sizeof(p_stats->open_ms));
+    memset(p_stats->cycles, 0, sizeof(p_stats->cycles));
+    p_stats->open_ms_sum = 0;
+    p_stats->cycles_sum = 0;
+    return;
+  }
+  while (hours--) {
+    p_stats->hour = (p_stats->hour + 1) % DOORSTATS_HOURS;
+    p_stats->open_ms_sum -= p_stats->open_ms[p_stats->hour];
+    p_stats->cycles_sum -= p_stats->cycles[p_stats->hour];
+    p_stats->open_ms[p_stats->hour] = 0;
+    p_stats->cycles[p_stats->hour] = 0;
+  }
+}
+
+// The door opened at now_ms. timed: we saw it closed before, so the opening can be
+// timed and counted.
+void doorstats_open(doorstats_t *p_stats, uint32_t now_ms, int timed)
+{
+  doorstats_roll(p_stats, now_ms);
+  p_stats->timed = timed != 0;
+  if (!timed)
+    return;
+  p_stats->opens++;
+  if (p_stats->cycles[p_stats->hour] < 0xffff) {
+    p_stats->cycles[p_stats->hour]++;
+    p_stats->cycles_sum++;
+  }
+}
+
+// Longer than this (ms) is unusual for the door, or 0 while there isn't a baseline yet:
+// DOORSTATS_ANOMALY_K mean deviations over the average, and at least twice the average.
+uint32_t doorstats_threshold(const doorstats_t *p_stats)
+{
+  uint64_t threshold;
+
+  if (p_stats->samples < DOORSTATS_WARMUP)
+    return 0;
+  threshold = p_stats->ewma_ms + (uint64_t)DOORSTATS_ANOMALY_K * p_stats->dev_ms;
+  if (threshold < 2 * (uint64_t)p_stats->ewma_ms)
+    threshold = 2 * (uint64_t)p_stats->ewma_ms;
+  if (threshold > 0xffffffff)
+    threshold = 0xffffffff;
+  return threshold ? threshold : 1;
+}
+
+// The door that opened at open_since closed at now_ms. Returns 1 if that was an
+// unusual opening for it.
+int doorstats_close(doorstats_t *p_stats, uint32_t open_since, uint32_t now_ms)
+{
+  uint32_t open_ms = now_ms - open_since, left, piece, span, threshold;
+  int i, bucket, unusual = 0;
+  int64_t error;
+
+  doorstats_roll(p_stats, now_ms);
+
+  // Spread the time it was open over the hours it covered, newest first. span is how
+  // much of the bucket lies before now_ms; whatever is older than the window is gone.
+  span = now_ms - p_stats->hour_ms;
+  for (i = 0, bucket = p_stats->hour, left = open_ms; i < DOORSTATS_HOURS && left; i++) {
+    piece = left < span ? left : span;
+    p_stats->open_ms[bucket] += piece;
+    p_stats->open_ms_sum += piece;
+    left -= piece;
+    span = DOORSTATS_HOUR_MS;
+    bucket = bucket ? bucket - 1 : DOORSTATS_HOURS - 1;
+  }
+
+  if (!p_stats->timed)
+    return 0;
+  p_stats->timed = 0;
+  p_stats->last_ms = open_ms;
+
+  // Judge it by the baseline from before it, then let it in no further than the line
+  threshold = doorstats_threshold(p_stats);
+  if (threshold && open_ms > threshold) {
+    unusual = 1;
+    p_stats->anomalies++;
+    open_ms = threshold;
+  }
+  p_stats->anomaly = unusual;
+
+  if (p_stats->samples == 0) {
+    p_stats->ewma_ms = open_ms;
+    p_stats->dev_ms = open_ms / 2;
+  } else {
+    error = (int64_t)open_ms - p_stats->ewma_ms;
+    p_stats->ewma_ms += error / (1 << DOORSTATS_EWMA_SHIFT);
+    error = error < 0 ? -error : error;
+    p_stats->dev_ms += (error - (int64_t)p_stats->dev_ms) / (1 << DOORSTATS_DEV_SHIFT);
+  }
+  p_stats->samples++;
+  return unusual;
+}
+
+// The last DOORSTATS_HOURS hours as of now_ms, without changing anything: the hours
+// that have fallen out of the window since the last event are left out rather than
+// cleared, and an opening still going on (open, since open_since) is counted up to now.
+void doorstats_day(const doorstats_t *p_stats, int open, uint32_t open_since, uint32_t now_ms,
+                   doorstats_day_t *p_day)
+{
+  uint32_t age = now_ms - p_stats->hour_ms, hours = age / DOORSTATS_HOUR_MS, window, i;
+  int bucket;
+
+  p_day->cycles = 0;
+  p_day->open_ms = 0;
+  if (hours < DOORSTATS_HOURS) {
+    p_day->cycles = p_stats->cycles_sum;
+    p_day->open_ms = p_stats->open_ms_sum;
+    for (i = 0, bucket = p_stats->hour; i < hours; i++) {
+      bucket = (bucket + 1) % DOORSTATS_HOURS;
+      p_day->cycles -= p_stats->cycles[bucket];
+      p_day->open_ms -= p_stats->open_ms[bucket];
+    }
+  }
+
+  p_day->threshold_ms = doorstats_threshold(p_stats);
+  p_day->unusual = p_stats->anomaly;
+  if (open) {
+    window = age % DOORSTATS_HOUR_MS + (DOORSTATS_HOURS - 1) * DOORSTATS_HOUR_MS;
+    p_day->open_ms += now_ms - open_since < window ? now_ms - open_since : window;
+    if (p_stats->timed && p_day->threshold_ms && now_ms - open_since > p_day->threshold_ms)
+      p_day->unusual = 1;
+  }
+}
@@ -0,0 +1,85 @@
+// doorstats.h
+// Per-door analytics, kept as the events come in: how often a door opens, how long it
+// stays open, what's usual for it and when an opening isn't. Everything is a running
+// aggregate in the door's device_t slot (devices.h), so there is no event history to
+// store or scan, and an open or a close costs the same whatever the door's past:
+//
+//   - the last DOORSTATS_HOURS hours, one bucket per hour, each with the openings that
+//     started in it and the milliseconds the door was open in it, plus the sums over
+//     all of them. The buckets roll forward on each event; the bucket that falls out of
+//     the window leaves the sums as it is cleared.
+//   - a baseline of how long an opening lasts: an exponentially weighted moving
+//     average (weight 1 / 2^DOORSTATS_EWMA_SHIFT) and its mean deviation (weight
+//     1 / 2^DOORSTATS_DEV_SHIFT), the way TCP keeps its round trip time.
+//   - an anomaly flag: once DOORSTATS_WARMUP openings have been timed, one that lasts
+//     longer than DOORSTATS_ANOMALY_K deviations over the average (and at least twice
+//     the average) is unusual. It is judged against the baseline from before it, and
+//     moves the baseline no further than the threshold, so one afternoon with the door
+//     propped open doesn't teach us that's normal.
+//
+// An opening is timed from the frame that said open to the one that said closed, on the
+// receiver's clock like open_since. One that was already open when we first heard
+// from the sender has no start we know of: it counts towards the open time but not
+// the baseline.
+//
+// Not thread safe: whoever calls device_update owns these. doorstats_day only reads, so
+// the status page (httpd.c) can call it on the fly; at worst it sees a door one event
+// behind.
+//
+// Like devices.c this file and doorstats.c make no ESP-IDF calls; host/doorbench.c
+// drives them on Linux.
+
+#ifndef __DOORSTATS__H
+
+  #define __DOORSTATS__H
+
+  #include <stdint.h>
+
+  #include "sdkconfig.h"
+
+  #define DOORSTATS_HOURS 24
+  #define DOORSTATS_HOUR_MS 3600000
+  #define DOORSTATS_EWMA_SHIFT 3
+  #define DOORSTATS_DEV_SHIFT 2
+  #define DOORSTATS_WARMUP 8
+
+  // How many mean deviations over the average an opening may last before it's unusual
+  #ifdef CONFIG_DOORSTATS_ANOMALY_K
+    #define DOORSTATS_ANOMALY_K CONFIG_DOORSTATS_ANOMALY_K
+  #else
+    #define DOORSTATS_ANOMALY_K 4
+  #endif
+
+  typedef struct {
+    uint32_t hour_ms;         // receiver time the newest bucket started
+    uint32_t open_ms[DOORSTATS_HOURS];  // time spent open, per hour
+    uint16_t cycles[DOORSTATS_HOURS];   // openings that started, per hour
+    uint32_t open_ms_sum;     // ... over the whole window
+    uint32_t cycles_sum;
+    uint8_t hour;             // bucket of the newest hour
+    uint8_t timed;            // the door is open and we saw it open
+    uint8_t anomaly;          // the last opening we timed was unusual
+    uint32_t opens;           // openings, ever
+    uint32_t samples;         // openings timed into the baseline
+    uint32_t ewma_ms;         // baseline open time
+    uint32_t dev_ms;          // ... and its mean deviation
+    uint32_t last_ms;         // how long the last timed opening lasted
+    uint32_t anomalies;       // unusual openings, ever
+  } doorstats_t;
+
+  // What the status page shows, as of some moment
+  typedef struct {
+    uint32_t cycles;          // openings in the last DOORSTATS_HOURS hours
+    uint32_t open_ms;         // time open in them, the current opening included
+    uint32_t threshold_ms;    // longer than this is unusual, 0 while warming up
+    uint8_t unusual;          // the last opening was unusual, or this one already is
+  } doorstats_day_t;
+
+  void doorstats_init(doorstats_t *p_stats, uint32_t now_ms);
+  void doorstats_open(doorstats_t *p_stats, uint32_t now_ms, int timed);
+  int doorstats_close(doorstats_t *p_stats, uint32_t open_since, uint32_t now_ms);
+  uint32_t doorstats_threshold(const doorstats_t *p_stats);
+  void doorstats_day(const doorstats_t *p_stats, int open, uint32_t open_since, uint32_t now_ms,
+                     doorstats_day_t *p_day);
+
+#endif
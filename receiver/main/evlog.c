@@ -0,0 +1,343 @@
+// evlog.c
+// Append-only door event log (see evlog.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// Slots are numbered from the start of the partition (sector * EVLOG_RECS_PER_SECTOR +
+// record). evlog_next is the slot the next record goes into; it only moves forward and
+// wraps at the end of the partition. Everything queued in evlog_batch has consecutive
+// slots starting at evlog_batch_slot and isn't in flash yet, so reads check the batch
+// first. The public calls take evlog_lock; the static ones expect it taken.
+
+#include <string.h>
+#include "devices.h"
+#include "evlog.h"
+
+// The per-door index uses the same size as the device table; it never needs more.
+#define EVLOG_INDEX_SIZE DEVICE_TABLE_SIZE
+
+typedef struct {
+  uint32_t first_seq;   // seq of the first record, 0xffffffff if the sector is empty
+  uint32_t min_time;
+  uint32_t max_time;
+  uint16_t count;
+} evlog_sector_t;
+
+typedef struct {
+  uint32_t device_id;   // 0 means empty
+  uint32_t seq;         // seq of the door's latest record
+  uint16_t slot;        // and where it is
+} evlog_index_t;
+
+evlog_stats_t evlog_stats;
+
+static uint32_t evlog_sectors;
+static uint32_t evlog_slots;
+static uint32_t evlog_next;
+static uint32_t evlog_seq;
+static evlog_sector_t evlog_summary[EVLOG_MAX_SECTORS];
+static evlog_index_t evlog_index[EVLOG_INDEX_SIZE];
+static evlog_rec_t evlog_batch[EVLOG_BATCH];
+static uint32_t evlog_batch_slot;
+static int evlog_batched;
+static uint32_t evlog_batch_ms;
+static uint32_t evlog_clock_s;      // log clock ...
+static uint32_t evlog_clock_ms;     // ... as of this now_ms
+
+static evlog_index_t *evlog_find(uint32_t device_id)
+{
+  uint32_t i, index = ((device_id * 0x9E3779B1u) >> 16) & (EVLOG_INDEX_SIZE - 1);
+
+  for (i = 0; i < EVLOG_INDEX_SIZE; i++) {
+    evlog_index_t *p_idx = &evlog_index[(index + i) & (EVLOG_INDEX_SIZE - 1)];
+    if (p_idx->device_id == device_id || p_idx->device_id == 0)
+      return p_idx;
+  }
+  return NULL;
+}
+
+// Remember that slot holds device_id's record with sequence number seq, if it is
+// newer than what we have.
+static void evlog_index_put(uint32_t device_id, uint32_t seq, uint32_t slot)
+{
+  evlog_index_t *p_idx = evlog_find(device_id);
+
+  if (p_idx == NULL)
+    return;
+  if (p_idx->device_id == 0 || (int32_t)(seq - p_idx->seq) > 0) {
+    p_idx->device_id = device_id;
+    p_idx->seq = seq;
+    p_idx->slot = slot;
+  }
+}
+
+static void evlog_summary_add(const evlog_rec_t *p_rec, uint32_t slot)
+{
+  evlog_sector_t *p_sec = &evlog_summary[slot / EVLOG_RECS_PER_SECTOR];
+
+  if (p_sec->count == 0) {
+    p_sec->first_seq = p_rec->seq;
+    p_sec->min_time = p_rec->time;
+    p_sec->max_time = p_rec->time;
+  }
+  if (p_rec->time < p_sec->min_time)
+    p_sec->min_time = p_rec->time;
+  if (p_rec->time > p_sec->max_time)
+    p_sec->max_time = p_rec->time;
+  p_sec->count++;
+}
+
+// Read a slot, from the batch if it hasn't been written yet. Returns 0 if the slot
+// holds a record.
+static int evlog_read_slot(uint32_t slot, evlog_rec_t *p_rec)
+{
+  uint32_t offset = (slot + evlog_slots - evlog_batch_slot) % evlog_slots;
+
+  if (evlog_batched && offset < (uint32_t)evlog_batched) {
+    *p_rec = evlog_batch[offset];
+    return 0;
+  }
+  if (evlog_flash_read(slot * sizeof(evlog_rec_t), p_rec, sizeof(evlog_rec_t)) != 0)
+    return -1;
+  return p_rec->seq == 0xffffffff ? -1 : 0;
+}
+
+// The log clock in seconds. Whole seconds of now_ms are carried over one at a time, so
+// it runs on when now_ms wraps; evlog_tick calls this often enough for that.
+static uint32_t evlog_now(uint32_t now_ms)
+{
+  uint32_t seconds = (now_ms - evlog_clock_ms) / 1000;
+
+  evlog_clock_s += seconds;
+  evlog_clock_ms += seconds * 1000;
+  return evlog_clock_s;
+}
+
+// Open the partition and rebuild the RAM state. This is the only time we read the whole
+// log. The log clock starts a second after the newest record. Returns 0 on success.
+int evlog_init(uint32_t now_ms)
+{
+  uint32_t size, slot, newest = 0;
+  evlog_rec_t rec;
+  int found = 0;
+
+  memset(evlog_summary, 0, sizeof(evlog_summary));
+  memset(evlog_index, 0, sizeof(evlog_index));
+  memset(&evlog_stats, 0, sizeof(evlog_stats));
+  evlog_batched = 0;
+  evlog_slots = 0;
+  evlog_clock_s = 0;
+  evlog_clock_ms = now_ms;
+
+  if (evlog_flash_open(&size) != 0)
+    return -1;
+
+  evlog_sectors = size / EVLOG_SECTOR_SIZE;
+  if (evlog_sectors > EVLOG_MAX_SECTORS)
+    evlog_sectors = EVLOG_MAX_SECTORS;
+  // prev pointers are 16 bits
+  if (evlog_sectors * EVLOG_RECS_PER_SECTOR > EVLOG_NONE)
+    evlog_sectors = EVLOG_NONE / EVLOG_RECS_PER_SECTOR;
+  if (evlog_sectors < 2)
+    return -1;
+  evlog_slots = evlog_sectors * EVLOG_RECS_PER_SECTOR;
+
+  for (slot = 0; slot < evlog_slots; slot++) {
+    if (evlog_read_slot(slot, &rec) != 0)
+      continue;
+    evlog_summary_add(&rec, slot);
+    evlog_index_put(rec.device_id, rec.seq, slot);
+    if (!found || (int32_t)(rec.seq - evlog_seq) > 0) {
+      evlog_seq = rec.seq;
+      newest = slot;
+      found = 1;
+    }
+  }
+
+  if (found) {
+    evlog_next = (newest + 1) % evlog_slots;
+    evlog_seq++;
+    if (evlog_read_slot(newest, &rec) == 0)
+      evlog_clock_s = rec.time + 1;
+  } else {
+    evlog_next = 0;
+    evlog_seq = 0;
+  }
+  evlog_batch_slot = evlog_next;
+
+  return 0;
+}
+
+// Write the batch out. A batch can run past the end of a sector (and of the partition),
+// so write it in per-sector pieces and erase each new sector as we enter it.
+static void evlog_write_batch(void)
+{
+  uint32_t slot = evlog_batch_slot;
+  int done = 0, n;
+
+  while (done < evlog_batched) {
+    if (slot % EVLOG_RECS_PER_SECTOR == 0) {
+      evlog_flash_erase((slot / EVLOG_RECS_PER_SECTOR) * EVLOG_SECTOR_SIZE, EVLOG_SECTOR_SIZE);
+      evlog_stats.erases++;
+    }
+    n = EVLOG_RECS_PER_SECTOR - slot % EVLOG_RECS_PER_SECTOR;
+    if (n > evlog_batched - done)
+      n = evlog_batched - done;
+    evlog_flash_write(slot * sizeof(evlog_rec_t), &evlog_batch[done], n * sizeof(evlog_rec_t));
+    evlog_stats.writes++;
+    evlog_stats.bytes += n * sizeof(evlog_rec_t);
+    done += n;
+    slot = (slot + n) % evlog_slots;
+  }
+
+  if (evlog_batched)
+    evlog_stats.flushes++;
+  evlog_batched = 0;
+  evlog_batch_slot = evlog_next;
+}
+
+void evlog_flush(void)
+{
+  evlog_lock();
+  evlog_write_batch();
+  evlog_unlock();
+}
+
+// Log a state change at now_ms on the caller's millisecond clock (the one it ticks us
+// with). The record gets the log clock's time for it.
+void evlog_append(uint32_t device_id, uint16_t pins, uint32_t now_ms)
+{
+  evlog_index_t *p_idx;
+  evlog_rec_t *p_rec;
+  evlog_sector_t *p_sec;
+
+  if (evlog_slots == 0)
+    return;
+  evlog_lock();
+
+  // Starting a new sector throws away the oldest one (evlog_flush erases it); forget
+  // its summary now so queries don't go looking in it.
+  if (evlog_next % EVLOG_RECS_PER_SECTOR == 0) {
+    p_sec = &evlog_summary[evlog_next / EVLOG_RECS_PER_SECTOR];
+    memset(p_sec, 0, sizeof(*p_sec));
+  }
+
+  if (evlog_batched == 0)
+    evlog_batch_ms = now_ms;
+
+  p_rec = &evlog_batch[evlog_batched++];
+  p_rec->seq = evlog_seq++;
+  p_rec->time = evlog_now(now_ms);
+  p_rec->device_id = device_id;
+  p_rec->pins = pins;
+  p_idx = evlog_find(device_id);
+  p_rec->prev = (p_idx && p_idx->device_id == device_id) ? p_idx->slot : EVLOG_NONE;
+
+  evlog_summary_add(p_rec, evlog_next);
+  evlog_index_put(device_id, p_rec->seq, evlog_next);
+  evlog_next = (evlog_next + 1) % evlog_slots;
+  evlog_stats.appended++;
+
+  if (evlog_batched == EVLOG_BATCH || now_ms - evlog_batch_ms >= EVLOG_FLUSH_MS)
+    evlog_write_batch();
+  evlog_unlock();
+}
+
+// Timer side, from whoever appends (see device_alerts): a batch that has waited
+// EVLOG_FLUSH_MS goes out even if nothing else gets logged, and the log clock keeps up.
+void evlog_tick(uint32_t now_ms)
+{
+  evlog_lock();
+  evlog_now(now_ms);
+  if (evlog_batched && now_ms - evlog_batch_ms >= EVLOG_FLUSH_MS)
+    evlog_write_batch();
+  evlog_unlock();
+}
+
+// The log clock now, for whoever wants to tell a record's age
+uint32_t evlog_time(uint32_t now_ms)
+{
+  uint32_t seconds;
+
+  evlog_lock();
+  seconds = evlog_now(now_ms);
+  evlog_unlock();
+  return seconds;
+}
+
+// The last (up to) max events for one door, newest first. Follows the prev chain so it
+// costs one read per record returned. The chain ends where the log has wrapped: a prev
+// slot that now holds somebody else's (or a newer) record.
+int evlog_last(uint32_t device_id, evlog_rec_t *p_out, int max)
+{
+  evlog_index_t *p_idx;
+  uint32_t slot, seq;
+  int n = 0;
+
+  evlog_lock();
+  p_idx = evlog_find(device_id);
+  if (p_idx == NULL || p_idx->device_id != device_id) {
+    evlog_unlock();
+    return 0;
+  }
+
+  slot = p_idx->slot;
+  seq = p_idx->seq + 1;
+  while (n < max && slot != EVLOG_NONE) {
+    if (evlog_read_slot(slot, &p_out[n]) != 0)
+      break;
+    if (p_out[n].device_id != device_id || (int32_t)(p_out[n].seq - seq) >= 0)
+      break;
+    seq = p_out[n].seq;
+    slot = p_out[n].prev;
+    n++;
+  }
+  evlog_unlock();
+  return n;
+}
+
+// All events (up to max) with from <= time <= to, oldest first. Sectors whose time
+// range doesn't overlap are skipped without reading them.
+int evlog_range(uint32_t from, uint32_t to, evlog_rec_t *p_out, int max)
+{
+  uint32_t i, sector, slot, last, current;
+  evlog_sector_t *p_sec;
+  evlog_rec_t rec;
+  int n = 0;
+
+  if (evlog_slots == 0)
+    return 0;
+  evlog_lock();
+
+  // Oldest sector first: the one after the sector holding the newest record.
+  last = (evlog_next + evlog_slots - 1) % evlog_slots;
+  current = last / EVLOG_RECS_PER_SECTOR;
+  for (i = 1; i <= evlog_sectors && n < max; i++) {
+    sector = (current + i) % evlog_sectors;
+    p_sec = &evlog_summary[sector];
+    if (p_sec->count == 0 || p_sec->max_time < from || p_sec->min_time > to)
+      continue;
+    for (slot = sector * EVLOG_RECS_PER_SECTOR; slot < (sector + 1) * EVLOG_RECS_PER_SECTOR && n < max; slot++) {
+      // Anything past the newest record in its sector is left over from the previous lap
+      if (sector == current && slot > last)
+        break;
+      if (evlog_read_slot(slot, &rec) != 0)
+        continue;
+      if (rec.time >= from && rec.time <= to)
+        p_out[n++] = rec;
+    }
+  }
+  evlog_unlock();
+  return n;
+}
+
+// Records we know about (in flash or waiting in the batch)
+uint32_t evlog_count(void)
+{
+  uint32_t i, n = 0;
+
+  evlog_lock();
+  for (i = 0; i < evlog_sectors; i++)
+    n += evlog_summary[i].count;
+  evlog_unlock();
+  return n;
+}
@@ -0,0 +1,78 @@
+// evlog.h
+// Door event log. Every state change the receiver sees is appended to a dedicated flash
+// partition ("evlog", see partitions.csv) so door history survives a reboot.
+//
+//   - Records are a fixed 16 bytes and are only ever appended.
+//   - The partition is used as a ring of 4 KB sectors. When the log wraps we erase the
+//     oldest sector and carry on, so every sector gets erased equally often (that's the
+//     wear levelling).
+//   - Records are collected in RAM and written EVLOG_BATCH at a time (or when the oldest
+//     one is EVLOG_FLUSH_MS old, checked by evlog_tick from the same timer that runs the
+//     sender deadlines) to keep the number of flash writes down.
+//   - Each record points back at the previous record for the same door and a small RAM
+//     index holds each door's latest record, so "last N events for door X" is N reads.
+//     A per-sector summary (first sequence number, time range) lets time range queries
+//     skip sectors that can't match. GET /events on the status page server asks both
+//     (see httpd.h).
+//   - Times are seconds on the log's own clock, not the wall clock: the receiver's only
+//     network is the sender's soft-AP, so there is no SNTP server to set one from. The
+//     log clock is receiver uptime that carries on from the newest record after a
+//     reboot, so it never goes backwards, but the time the receiver was off is missing
+//     from it.
+//
+// The processing side appends and ticks while httpd_task queries, so every call takes
+// evlog_lock. The flash and the lock are behind evlog_flash_* and evlog_lock/unlock
+// (evlog_esp.c on the ESP32, a RAM array and a pthread mutex in the host build) so the
+// log logic is the same everywhere.
+
+#ifndef __EVLOG__H
+
+  #define __EVLOG__H
+
+  #include <stdint.h>
+
+  #define EVLOG_SECTOR_SIZE 4096
+  #define EVLOG_RECS_PER_SECTOR (EVLOG_SECTOR_SIZE / sizeof(evlog_rec_t))
+  #define EVLOG_MAX_SECTORS 256
+  #define EVLOG_BATCH 16
+  #define EVLOG_FLUSH_MS 2000
+  #define EVLOG_NONE 0xffff
+
+  // One log record. Erased flash reads as all ones, so seq 0xffffffff is an empty slot.
+  typedef struct {
+    uint32_t seq;         // log sequence number, increases forever
+    uint32_t time;        // log clock (seconds, see above) when we logged it
+    uint32_t device_id;
+    uint16_t pins;
+    uint16_t prev;        // slot of this door's previous record, or EVLOG_NONE
+  } evlog_rec_t;
+
+  typedef struct {
+    uint32_t appended;    // records logged
+    uint32_t flushes;     // batched writes
+    uint32_t writes;      // evlog_flash_write calls
+    uint32_t bytes;       // bytes written to flash
+    uint32_t erases;      // sectors erased
+  } evlog_stats_t;
+
+  extern evlog_stats_t evlog_stats;
+
+  int evlog_init(uint32_t now_ms);
+  void evlog_append(uint32_t device_id, uint16_t pins, uint32_t now_ms);
+  void evlog_tick(uint32_t now_ms);
+  void evlog_flush(void);
+  uint32_t evlog_time(uint32_t now_ms);
+  int evlog_last(uint32_t device_id, evlog_rec_t *p_out, int max);
+  int evlog_range(uint32_t from, uint32_t to, evlog_rec_t *p_out, int max);
+  uint32_t evlog_count(void);
+
+  // Flash access and the lock, provided by evlog_esp.c (or the host build). Offsets are
+  // bytes from the start of the log partition. All return 0 on success.
+  void evlog_lock(void);
+  void evlog_unlock(void);
+  int evlog_flash_open(uint32_t *p_size);
+  int evlog_flash_read(uint32_t offset, void *p_buf, uint32_t len);
+  int evlog_flash_write(uint32_t offset, const void *p_buf, uint32_t len);
+  int evlog_flash_erase(uint32_t offset, uint32_t len);
+
+#endif
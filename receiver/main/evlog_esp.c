@@ -0,0 +1,57 @@
+// evlog_esp.c
+// Flash access for the event log (see evlog.h) on the ESP32. Please remember to add this
+// module to the CMakeLists.txt file or it won't get compiled and linked!
+//
+// The log lives in its own data partition named "evlog" (subtype 0x40, see
+// partitions.csv) so it can never collide with NVS or the application. The lock is a
+// FreeRTOS mutex, so a query from httpd_task that holds it lends the processing side's
+// priority while it does.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "evlog.h"
+
+#define EVLOG_PARTITION_SUBTYPE 0x40
+
+static const esp_partition_t *p_evlog_partition;
+static SemaphoreHandle_t evlog_mutex;
+
+void evlog_lock(void)
+{
+  if (evlog_mutex != NULL)
+    xSemaphoreTake(evlog_mutex, portMAX_DELAY);
+}
+
+void evlog_unlock(void)
+{
+  if (evlog_mutex != NULL)
+    xSemaphoreGive(evlog_mutex);
+}
+
+// evlog_init calls this before any task that logs is started
+int evlog_flash_open(uint32_t *p_size)
+{
+  if (evlog_mutex == NULL)
+    evlog_mutex = xSemaphoreCreateMutex();
+  p_evlog_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, EVLOG_PARTITION_SUBTYPE, "evlog");
+  if (p_evlog_partition == NULL)
+    return -1;
+  *p_size = p_evlog_partition->size;
+  return 0;
+}
+
+int evlog_flash_read(uint32_t offset, void *p_buf, uint32_t len)
+{
+  return esp_partition_read(p_evlog_partition, offset, p_buf, len) == ESP_OK ? 0 : -1;
+}
+
+int evlog_flash_write(uint32_t offset, const void *p_buf, uint32_t len)
+{
+  return esp_partition_write(p_evlog_partition, offset, p_buf, len) == ESP_OK ? 0 : -1;
+}
+
+int evlog_flash_erase(uint32_t offset, uint32_t len)
+{
+  return esp_partition_erase_range(p_evlog_partition, offset, len) == ESP_OK ? 0 : -1;
+}
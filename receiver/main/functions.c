@@ -5,58 +5,167 @@
 //
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/event_groups.h"
-#include "esp_event.h"
-#include "esp_wifi.h"
+#include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "lwip/sockets.h"
+#include <time.h>
 #include <lwip/netdb.h>
+#include "xtensa/hal.h"
 
-// These are defined via the menuconfig. Use idf.py menuconfig
-#define EXAMPLE_ESP_MAXIMUM_RETRY CONFIG_ESP_MAXIMUM_RETRY
+#include "garage_proto.h"
+#include "devices.h"
+#include "twheel.h"
+#include "dlog.h"
+#include "evlog.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "pubsub.h"
+#include "httpd.h"
+#include "rxauth.h"
+#include "rxhealth.h"
+#include "functions.h"
 
-#define PORT 8266
-
-// These macros are defined in setup.c. Redefine here for event_handler.
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+#define PORT GP_PORT
 
 extern const char *TAG;
-extern EventGroupHandle_t s_wifi_event_group;
-
-// This is our event handler function. We are going to use this function
-// to catch various events (both WIFI_EVENT and IP_EVENT) and respond
-// accordingly. If a WIFI_EVENT_STA_START event is posted to the default event
-// loop then that means the WiFi driver has started and we should go ahead and
-// start the WiFi connection (esp_wifi_connect). If we receive a WIFI_EVENT_STA_DISCONNECTED
-// event then that means we disconnected and we will try to reconnect (up to the max attempts).
-// And finally, if we receive an IP_EVENT_STA_GOT_IP then we know we have a successful 
-// client connection; so we'll update our event group and set the bit for WIFI_CONNECTED_BIT!
-// See setup.c for use of event_handler.
-void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+
+// Receive path counters. proc is the time from recvfrom returning to the packet being
+// fully processed, in CPU cycles (xthal_get_ccount) ... nanoseconds on the host build.
+rx_stats_t rx_stats;
+
+// Who we are when a sender goes looking for receivers (see discovery.h in common/). Set
+// from the station MAC by app_main before the receive task starts.
+uint32_t receiver_id;
+
+// Build our answer to a sender's DISCOVER broadcast. Returns its length.
+int announce_encode(uint8_t *p_buf, size_t len)
 {
+  gp_frame_t announce;
 
-  int s_retry_num = 0;
-
-  if (event_base == WIFI_EVENT)
-      ESP_LOGI(TAG, "WiFi Event: %d", event_id);
-  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-      esp_wifi_connect();
-  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-      if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
-          esp_wifi_connect();
-          s_retry_num++;
-          ESP_LOGI(TAG, "Retrying the connection to the AP");
-      } else {
-          xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-      }
-      ESP_LOGI(TAG,"Connect to the AP failed!");
-  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-      ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-      ESP_LOGI(TAG, "Got IP: %s", ip4addr_ntoa(&event->ip_info.ip));
-      s_retry_num = 0;
-      xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+  announce.type = GP_TYPE_ANNOUNCE;
+  announce.flags = 0;
+  announce.device_id = receiver_id;
+  announce.count = 0;
+  return gp_encode(&announce, p_buf, len);
+}
+
+// Our clock for latency tracing and TIME answers: milliseconds since reset. esp_timer
+// rather than the tick count, which only moves every 10 ms.
+uint32_t rx_clock_ms(void)
+{
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+// Answer a sender's TIME_REQ (see clksync.h in common/): its t0 back, t1 when the
+// request arrived (the receive path stamped it in rx_time) and t2 now. Returns the
+// length.
+int time_encode(const gp_frame_t *p_req, uint8_t *p_buf, size_t len)
+{
+  gp_frame_t answer;
+
+  answer.type = GP_TYPE_TIME;
+  answer.flags = 0;
+  answer.device_id = p_req->device_id;
+  answer.seq = p_req->seq;
+  answer.count = 0;
+  answer.rx_time = p_req->rx_time;
+  answer.tx_time = rx_clock_ms();
+  return gp_encode(&answer, p_buf, len);
+}
+
+// Process one decoded frame, whichever receive backend it came from (the socket loop
+// below or the lwIP raw callback in rawrx.c). addr is the sender's IPv4 address in
+// network byte order and p_frame->rx_time is when it arrived (see rx_clock_ms).
+// Returns -1 if the frame's events were dropped because the device table has no room
+// for its sender (don't ACK it), 0 otherwise.
+int process_frame(const gp_frame_t *p_frame, uint32_t addr)
+{
+  int result, i;
+  device_t *p_dev;
+
+  // A sender telling us how it is doing (see GP_TYPE_HEALTH). Those aren't signed, so
+  // only a sender that already has a slot gets to fill it in.
+  if (p_frame->type == GP_TYPE_HEALTH) {
+    if ((p_dev = device_lookup(p_frame->device_id)) == NULL)
+      return 0;
+    p_dev->health_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    p_dev->heap_min = p_frame->next_ms;
+    p_dev->stack_unused = p_frame->event[1].pins;
+    p_dev->vdd_mv = p_frame->event[0].pins;
+    p_dev->callback_us = (uint16_t)p_frame->event[0].timestamp;
+    DLOG(DLOG_INFO, DLOG_HEALTH, p_dev->device_id, p_dev->heap_min, p_dev->stack_unused, p_dev->vdd_mv);
+    return 0;
+  }
+
+  // Only reports and batches carry door events
+  if (p_frame->type != GP_TYPE_REPORT && p_frame->type != GP_TYPE_BATCH)
+    return 0;
+
+  // A report carries one event, a batch up to GP_BATCH_MAX. Event i has sequence seq + i.
+  for (i = 0; i < p_frame->count; i++) {
+    DLOG(DLOG_DEBUG, DLOG_EVENT, p_frame->device_id, p_frame->seq + i, p_frame->event[i].pins, p_frame->event[i].timestamp);
   }
+
+  // Remember what this sender told us (see devices.c).
+  result = device_update(p_frame, addr, xTaskGetTickCount() * portTICK_PERIOD_MS, &p_dev);
+  if (result == DEVICE_FULL) {
+    DLOG(DLOG_WARN, DLOG_TABLE_FULL, p_frame->device_id, 0, 0, 0);
+    return -1;
+  }
+
+  // Latency histograms (see stats.h)
+  stats_trace(p_frame, result, p_dev);
+
+  if (result & DEVICE_ALIVE)
+    DLOG(DLOG_INFO, DLOG_ALIVE, p_dev->device_id, p_dev->silences, 0, 0);
+
+  // Tell the subscribers, next pubsub tick (see pubsub.h), and the status page (httpd.h)
+  if (result & (DEVICE_NEW | DEVICE_CHANGED))
+    p_dev->changed_ms = p_frame->rx_time;
+  if (result & (DEVICE_NEW | DEVICE_CHANGED | DEVICE_ALIVE)) {
+    pubsub_mark(p_dev);
+    httpd_mark();
+  }
+
+  if (result & (DEVICE_NEW | DEVICE_CHANGED)) {
+    DLOG(DLOG_INFO, DLOG_CHANGE, p_dev->device_id, p_dev->pins, p_dev->changes, p_dev->lost);
+    // And keep it in the flash event log (see evlog.c)
+    evlog_append(p_dev->device_id, p_dev->pins, p_dev->last_seen);
+  }
+
+  // A door just closed after an opening much longer than its baseline (doorstats.h)
+  if (result & DEVICE_UNUSUAL)
+    DLOG(DLOG_WARN, DLOG_UNUSUAL, p_dev->device_id, p_dev->door[p_dev->unusual_door].doorstats.last_ms,
+         p_dev->door[p_dev->unusual_door].doorstats.ewma_ms, device_door_pin(p_dev->unusual_door));
+  return 0;
+}
+
+// Sender deadlines (see devices.h): report the senders that went quiet for longer than
+// they promised and the doors left open too long. Whoever calls process_frame calls
+// this too, after every frame and at least every TW_TICK_MS when there are none; it
+// only costs what expired since the last call.
+void device_alerts(void)
+{
+  uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+  int64_t start = esp_timer_get_time();
+  device_t *p_dev;
+  int alert, door;
+
+  while ((p_dev = device_expired(now, &alert, &door)) != NULL) {
+    if (alert == DEVICE_SILENT)
+      DLOG(DLOG_WARN, DLOG_SILENT, p_dev->device_id, now - p_dev->last_seen, p_dev->next_ms, 0);
+    else
+      DLOG(DLOG_WARN, DLOG_OPEN_TOO_LONG, p_dev->device_id, now - p_dev->door[door].open_since, p_dev->pins,
+           device_door_pin(door));
+    pubsub_mark(p_dev);
+    httpd_mark();
+  }
+  // A batch of door events that has waited long enough goes to flash (see evlog.h)
+  evlog_tick(now);
+
+  // These are our timer callbacks; how long the worst pass took (see rxhealth.h)
+  rxhealth_callback((uint32_t)(esp_timer_get_time() - start));
 }
 
 // This is our UDP server function. It is executed as a FreeRTOS task in an infinite loop. Do not
@@ -64,15 +173,23 @@ void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, voi
 // continually reboot! See receiver_main.c for task creation code.
 void udp_server_task ()
 {
-  char rx_buffer[128];
-  char addr_str[128];
+  uint8_t rx_buffer[GP_MAX_FRAME];
+  uint8_t tx_buffer[GP_TIME_LEN];   // our biggest answer
   int ip_protocol = 0;
+  int on = 1;
   struct sockaddr_in dest_addr;
   int sock = -1;
-  int result, len; 
+  int result, len, taken;
+  uint32_t start;
+  gp_frame_t frame;
   struct sockaddr_in source_addr;
   socklen_t socklen;
+#ifndef CONFIG_RECEIVER_PIPELINE
+  struct timeval timeout = { 0, TW_TICK_MS * 1000 };
+#endif
  
+  rxhealth_watch("udp");
+
   // Just loop forever ... or until something goes wrong ... remember ... we don't want
   // to exit or return from this function. We'll call this loop "Setup and Create"
   while (1) {
@@ -93,6 +210,14 @@ void udp_server_task ()
 
     ESP_LOGI(TAG, "Socket created");
 
+    // Senders look for us with a broadcast DISCOVER; make sure lwIP lets those through
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+#ifndef CONFIG_RECEIVER_PIPELINE
+    // Wake up every tick even when nobody is talking, to run the sender deadlines (see
+    // device_alerts). With the pipeline, pipeline_task does that and we can block.
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+
     // And bind the socket to the IP and port
     result = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
 
@@ -105,9 +230,16 @@ void udp_server_task ()
     // Obtain and process the incoming datagrams. We'll call this loop "Process the Data".
     while (1) {
 
-      ESP_LOGI(TAG, "Waiting for data ...");
+      // Nothing in this loop talks to the console directly; the DLOG records are formatted
+      // later by dlog_task (see dlog.c) so the console can't slow down the receive path.
       socklen = sizeof(source_addr);
-      len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
+      len = recvfrom(sock, rx_buffer, sizeof(rx_buffer), 0, (struct sockaddr *)&source_addr, &socklen);
+
+      // Nothing this tick
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        device_alerts();
+        continue;
+      }
 
       // Error occurred during receiving
       if (len < 0) {
@@ -117,12 +249,80 @@ void udp_server_task ()
 
       // You got data!
       else {
-        // Get the sender's ip address as string
-        inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-        // Null-terminate whatever we received and treat like a string.
-        rx_buffer[len] = 0;
-        ESP_LOGI(TAG, "Received %d bytes from %s:", len, addr_str);
-        ESP_LOGI(TAG, "%s", rx_buffer);
+        // With the pipeline the frame is finished on the other core, whose cycle counter
+        // isn't ours, so it is timed on esp_timer instead (see pipeline.h)
+#ifdef CONFIG_RECEIVER_PIPELINE
+        start = (uint32_t)esp_timer_get_time();
+#else
+        start = xthal_get_ccount();
+#endif
+        rx_stats.packets++;
+        // Forged and replayed reports go before anything else, logging included, looks
+        // at them (see rxauth.h). What's left is the frame without its auth trailer.
+        len = rxauth_check(rx_buffer, len);
+        if (len < 0)
+          continue;
+        DLOG(DLOG_DEBUG, DLOG_RX, len, source_addr.sin_addr.s_addr, 0, 0);
+        // Decode the binary frame (see garage_proto.h). Anything that isn't ours gets dropped.
+        result = gp_decode(rx_buffer, len, &frame);
+        if (result != 0) {
+          rx_stats.bad++;
+          DLOG(DLOG_WARN, DLOG_BAD_FRAME, result, source_addr.sin_addr.s_addr, 0, 0);
+          continue;
+        }
+        frame.rx_time = rx_clock_ms();
+        // A sender looking for receivers. Tell it who we are.
+        if (frame.type == GP_TYPE_DISCOVER) {
+          len = announce_encode(tx_buffer, sizeof(tx_buffer));
+          sendto(sock, tx_buffer, len, 0, (struct sockaddr *)&source_addr, socklen);
+          DLOG(DLOG_INFO, DLOG_DISCOVER, frame.device_id, source_addr.sin_addr.s_addr, 0, 0);
+          continue;
+        }
+        // A sender syncing its idea of our clock. Answer right away; every bit of delay
+        // between here and sendto is error in its offset.
+        if (frame.type == GP_TYPE_TIME_REQ) {
+          len = time_encode(&frame, tx_buffer, sizeof(tx_buffer));
+          sendto(sock, tx_buffer, len, 0, (struct sockaddr *)&source_addr, socklen);
+          continue;
+        }
+        // Somebody wants our numbers. stats_server_task answers (see stats.h).
+        if (frame.type == GP_TYPE_STATS_REQ) {
+          stats_request(source_addr.sin_addr.s_addr, ntohs(source_addr.sin_port), frame.seq);
+          continue;
+        }
+        // A consumer (re)subscribing to door changes. pubsub_task answers (see pubsub.h).
+        if (frame.type == GP_TYPE_SUBSCRIBE) {
+          pubsub_request(source_addr.sin_addr.s_addr, ntohs(source_addr.sin_port), &frame);
+          continue;
+        }
+#ifdef CONFIG_RECEIVER_PIPELINE
+        // Hand the frame to the processing core (see pipeline.c). If the ring is full we
+        // drop it without an ACK and the sender tries again. Same if the device table has
+        // no room for the sender: the processing core would only drop it (device_room).
+        if (!device_room(frame.device_id)) {
+          DLOG(DLOG_WARN, DLOG_TABLE_FULL, frame.device_id, 0, 0, 0);
+          continue;
+        }
+        if (pipeline_push(&frame, source_addr.sin_addr.s_addr, start) != 0) {
+          rx_stats.overrun++;
+          continue;
+        }
+        taken = 1;
+#else
+        taken = process_frame(&frame, source_addr.sin_addr.s_addr) == 0;
+#endif
+        // The sender wants to know we got it (see reliable.h). ACKs are cumulative and
+        // sent even for dups ... the first ACK may have been the thing that got lost. A
+        // frame the device table had no room for gets none, so the sender keeps its
+        // events and tries again.
+        if (taken && (frame.flags & GP_FLAG_ACK_REQ)) {
+          len = gp_encode_ack(&frame, tx_buffer, sizeof(tx_buffer));
+          sendto(sock, tx_buffer, len, 0, (struct sockaddr *)&source_addr, socklen);
+        }
+#ifndef CONFIG_RECEIVER_PIPELINE
+        hist_add(&rx_stats.proc, xthal_get_ccount() - start);
+        device_alerts();
+#endif
 
       }
 
@@ -1,4 +1,20 @@
-#include "esp_event.h"
+#include "hist.h"
+#include "garage_proto.h"
 
-void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+typedef struct {
+  uint32_t packets;   // datagrams received
+  uint32_t bad;       // datagrams gp_decode rejected
+  uint32_t overrun;   // decoded frames dropped because the raw backend's queue (or the pipeline ring) was full
+  hist_t proc;        // per packet processing time (cycles)
+} rx_stats_t;
+
+extern rx_stats_t rx_stats;
+extern uint32_t receiver_id;
+
+int announce_encode(uint8_t *p_buf, size_t len);
+int time_encode(const gp_frame_t *p_req, uint8_t *p_buf, size_t len);
+uint32_t rx_clock_ms(void);
+int process_frame(const gp_frame_t *p_frame, uint32_t addr);
+void device_alerts(void);
 void udp_server_task ();
+void raw_rx_task(void *pvParameters);
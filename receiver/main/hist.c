@@ -0,0 +1,65 @@
+// hist.c
+// Log bucketed histogram (see hist.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// Values 0..3 get a bucket each. Above that, a value with its top bit at position msb
+// goes into bucket 4 * (msb - 1) + (the two bits just below the top bit).
+
+#include <string.h>
+#include "hist.h"
+
+static inline uint32_t hist_index(uint32_t value)
+{
+  uint32_t msb;
+
+  if (value < 4)
+    return value;
+  msb = 31 - __builtin_clz(value);
+  return 4 * (msb - 1) + ((value >> (msb - 2)) & 3);
+}
+
+// Largest value that lands in bucket index ... what we report for a percentile.
+static uint32_t hist_upper(uint32_t index)
+{
+  uint32_t msb, lower;
+
+  if (index < 4)
+    return index;
+  msb = index / 4 + 1;
+  lower = (4 + (index & 3)) << (msb - 2);
+  return lower + ((1u << (msb - 2)) - 1);
+}
+
+void hist_init(hist_t *p_hist)
+{
+  memset(p_hist, 0, sizeof(*p_hist));
+}
+
+void hist_add(hist_t *p_hist, uint32_t value)
+{
+  p_hist->bucket[hist_index(value)]++;
+  p_hist->count++;
+  if (value > p_hist->max)
+    p_hist->max = value;
+}
+
+// Percentile in tenths of a percent (500 = p50, 999 = p99.9). Returns the upper edge
+// of the bucket holding that sample, or 0 for an empty histogram.
+uint32_t hist_percentile(const hist_t *p_hist, uint32_t per_mille)
+{
+  uint32_t i, seen = 0, target;
+
+  if (p_hist->count == 0)
+    return 0;
+
+  target = (uint32_t)(((uint64_t)p_hist->count * per_mille + 999) / 1000);
+  if (target == 0)
+    target = 1;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += p_hist->bucket[i];
+    if (seen >= target)
+      return hist_upper(i) < p_hist->max ? hist_upper(i) : p_hist->max;
+  }
+  return p_hist->max;
+}
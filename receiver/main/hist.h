@@ -0,0 +1,25 @@
+// hist.h
+// Fixed memory, log bucketed histogram. Every power of two is split into 4 linear
+// sub-buckets, so any value up to 2^32 lands in one of HIST_BUCKETS buckets with at
+// most 25% error. Adding a sample is a count-leading-zeros and an increment; no floats,
+// no heap. Good enough for "what is p99 of the packet processing time".
+
+#ifndef __HIST__H
+
+  #define __HIST__H
+
+  #include <stdint.h>
+
+  #define HIST_BUCKETS 124
+
+  typedef struct {
+    uint32_t count;
+    uint32_t max;
+    uint32_t bucket[HIST_BUCKETS];
+  } hist_t;
+
+  void hist_init(hist_t *p_hist);
+  void hist_add(hist_t *p_hist, uint32_t value);
+  uint32_t hist_percentile(const hist_t *p_hist, uint32_t per_mille);
+
+#endif
@@ -0,0 +1,618 @@
+// httpd.c
+// Door state over HTTP from a prerendered snapshot (see httpd.h). Please remember to
+// add this module to the CMakeLists.txt file or it won't get compiled and linked!
+//
+// httpd_task owns everything in here except httpd_generation, which the processing
+// side bumps with an atomic add. The snapshots are only ever written by httpd_render,
+// into the buffer no connection is sending from.
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "devices.h"
+#include "functions.h"
+#include "rxauth.h"
+#include "evlog.h"
+#include "httpd.h"
+#include "rxhealth.h"
+
+#if HTTPD_SNAPSHOT_SIZE < HTTPD_SNAPSHOT_NEED
+  #error "HTTPD_SNAPSHOT_SIZE can't hold a full device table; leave it at 0 to have it worked out"
+#endif
+
+// Content-Length is written right aligned into this many columns once the body is
+// done; the spaces in front of it are allowed whitespace
+#define HTTPD_LENGTH_DIGITS 10
+
+extern const char *TAG;
+
+httpd_stats_t httpd_stats;
+
+// A rendered response, headers and all
+typedef struct {
+  char *buf;
+  uint32_t size;              // of buf
+  uint32_t len;
+  uint32_t refs;              // connections sending from it right now
+} httpd_snap_t;
+
+// One client connection
+typedef struct {
+  int sock;                   // -1 == free
+  uint32_t last_ms;           // last time it sent or took anything
+  char request[HTTPD_REQUEST_MAX];
+  uint32_t req_len;           // bytes in request
+  uint32_t consumed;          // ... of which the request being answered
+  const char *p_out;          // response being sent, NULL while we wait for a request
+  uint32_t out_len;
+  uint32_t sent;
+  int snap;                   // snapshot p_out points into, -1 for the canned ones
+  uint8_t close;              // close once the response is out
+} httpd_conn_t;
+
+// 0 and 1 are the status snapshots, HTTPD_QUERY the /events answer being sent
+#define HTTPD_QUERY 2
+
+static httpd_snap_t httpd_snaps[3];
+static char httpd_status_bufs[2][HTTPD_SNAPSHOT_SIZE];
+static char httpd_query_buf[HTTPD_QUERY_SIZE];
+static uint32_t httpd_front;              // the one new requests get
+static uint32_t httpd_generation;         // bumped by httpd_mark
+static uint32_t httpd_rendered;           // generation of the front snapshot
+static uint32_t httpd_rendered_ms;
+static uint32_t httpd_rendered_packets;
+static httpd_conn_t httpd_conns[HTTPD_MAX_CLIENTS];
+
+static const char httpd_header[] = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                   "Cache-Control: no-cache\r\nContent-Length: ";
+static const char httpd_400[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\nConnection: close\r\n\r\nbad request\n";
+static const char httpd_404[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 10\r\n\r\nnot found\n";
+static const char httpd_405[] = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 19\r\n"
+                                "Connection: close\r\n\r\nmethod not allowed\n";
+static const char httpd_503[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 5\r\n\r\nbusy\n";
+
+// Append to a snapshot. Everything stops at the end of the buffer; httpd_render sees
+// that from len and rolls back to the last complete door.
+static void httpd_put(httpd_snap_t *p_snap, const char *p_str)
+{
+  while (*p_str && p_snap->len < p_snap->size)
+    p_snap->buf[p_snap->len++] = *p_str++;
+}
+
+static void httpd_put_u32(httpd_snap_t *p_snap, uint32_t value)
+{
+  char digits[11];
+  int i = sizeof(digits) - 1;
+
+  digits[i] = '\0';
+  do {
+    digits[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  httpd_put(p_snap, &digits[i]);
+}
+
+static void httpd_put_hex32(httpd_snap_t *p_snap, uint32_t value)
+{
+  static const char hex[] = "0123456789abcdef";
+  char digits[9];
+  int i;
+
+  for (i = 0; i < 8; i++)
+    digits[i] = hex[(value >> (28 - 4 * i)) & 0xf];
+  digits[8] = '\0';
+  httpd_put(p_snap, digits);
+}
+
+static void httpd_put_bool(httpd_snap_t *p_snap, int value)
+{
+  httpd_put(p_snap, value ? "true" : "false");
+}
+
+// One of a sender's doors, with its analytics (doorstats.h), the current opening
+// included. open_since and the alert run on the tick clock, like device_update.
+static void httpd_door_stats(httpd_snap_t *p_snap, const device_t *p_dev, int door, uint32_t now)
+{
+  const device_door_t *p_door = &p_dev->door[door];
+  int open = (p_dev->open & device_door_pin(door)) != 0;
+  doorstats_day_t day;
+
+  doorstats_day(&p_door->doorstats, open, p_door->open_since, now, &day);
+  httpd_put(p_snap, "{\"pin\":");
+  httpd_put_u32(p_snap, device_door_pin(door));
+  httpd_put(p_snap, ",\"open\":");
+  httpd_put_bool(p_snap, open);
+  httpd_put(p_snap, ",\"open_too_long\":");
+  httpd_put_bool(p_snap, open && DOOR_OPEN_ALERT_MS && now - p_door->open_since >= DOOR_OPEN_ALERT_MS);
+  httpd_put(p_snap, ",\"opens\":");
+  httpd_put_u32(p_snap, p_door->doorstats.opens);
+  httpd_put(p_snap, ",\"opens_day\":");
+  httpd_put_u32(p_snap, day.cycles);
+  httpd_put(p_snap, ",\"open_s_day\":");
+  httpd_put_u32(p_snap, day.open_ms / 1000);
+  httpd_put(p_snap, ",\"open_usual_s\":");
+  httpd_put_u32(p_snap, p_door->doorstats.ewma_ms / 1000);
+  httpd_put(p_snap, ",\"open_last_s\":");
+  httpd_put_u32(p_snap, p_door->doorstats.last_ms / 1000);
+  httpd_put(p_snap, ",\"unusual\":");
+  httpd_put_bool(p_snap, day.unusual);
+  httpd_put(p_snap, "}");
+}
+
+// One sender. The fields are read while the processing side may be updating them; at
+// worst the entry is a change behind, and the change's httpd_mark brings a new render.
+static void httpd_door(httpd_snap_t *p_snap, const device_t *p_dev, uint32_t now)
+{
+  int door;
+
+  httpd_put(p_snap, "{\"id\":\"");
+  httpd_put_hex32(p_snap, p_dev->device_id);
+  httpd_put(p_snap, "\",\"pins\":");
+  httpd_put_u32(p_snap, p_dev->pins);
+  httpd_put(p_snap, ",\"open\":");
+  httpd_put_bool(p_snap, p_dev->open);
+  httpd_put(p_snap, ",\"silent\":");
+  httpd_put_bool(p_snap, p_dev->silent);
+  httpd_put(p_snap, ",\"changes\":");
+  httpd_put_u32(p_snap, p_dev->changes);
+  httpd_put(p_snap, ",\"changed_ms\":");
+  httpd_put_u32(p_snap, p_dev->changed_ms);
+  httpd_put(p_snap, ",\"last_seen_ms\":");
+  httpd_put_u32(p_snap, p_dev->last_seen);
+  httpd_put(p_snap, ",\"packets\":");
+  httpd_put_u32(p_snap, p_dev->packets);
+  httpd_put(p_snap, ",\"lost\":");
+  httpd_put_u32(p_snap, p_dev->lost);
+  httpd_put(p_snap, ",\"boots\":");
+  httpd_put_u32(p_snap, p_dev->boots);
+  httpd_put(p_snap, ",\"door\":[");
+  for (door = 0; door < DEVICE_DOORS; door++) {
+    if (door)
+      httpd_put(p_snap, ",");
+    httpd_door_stats(p_snap, p_dev, door, now);
+  }
+  httpd_put(p_snap, "]}");
+}
+
+// Headers with room for Content-Length. Returns where the body starts.
+static uint32_t httpd_begin(httpd_snap_t *p_snap)
+{
+  int i;
+
+  p_snap->len = 0;
+  httpd_put(p_snap, httpd_header);
+  for (i = 0; i < HTTPD_LENGTH_DIGITS; i++)
+    httpd_put(p_snap, " ");
+  httpd_put(p_snap, "\r\n\r\n");
+  return p_snap->len;
+}
+
+// Now we know how long the body that starts at body is
+static void httpd_end(httpd_snap_t *p_snap, uint32_t body)
+{
+  uint32_t length = sizeof(httpd_header) - 1 + HTTPD_LENGTH_DIGITS - 1, left = p_snap->len - body;
+  int i;
+
+  for (i = HTTPD_LENGTH_DIGITS - 1; i >= 0; i--) {
+    p_snap->buf[length--] = '0' + left % 10;
+    left /= 10;
+    if (left == 0)
+      break;
+  }
+}
+
+// The whole response into p_snap
+static void httpd_render(httpd_snap_t *p_snap)
+{
+  uint32_t slot, mark, body, doors = 0, now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+  device_t *p_dev;
+  int truncated = 0;
+
+  body = httpd_begin(p_snap);
+
+  httpd_put(p_snap, "{\"receiver\":\"");
+  httpd_put_hex32(p_snap, receiver_id);
+  httpd_put(p_snap, "\",\"uptime_ms\":");
+  httpd_put_u32(p_snap, rx_clock_ms());
+  httpd_put(p_snap, ",\"packets\":");
+  httpd_put_u32(p_snap, rx_stats.packets);
+  httpd_put(p_snap, ",\"bad\":");
+  httpd_put_u32(p_snap, rx_stats.bad);
+  httpd_put(p_snap, ",\"rejected\":");
+  httpd_put_u32(p_snap, rxauth_rejected());
+  httpd_put(p_snap, ",\"devices\":");
+  httpd_put_u32(p_snap, device_count());
+  httpd_put(p_snap, ",\"doors\":[");
+
+  for (slot = 0; slot < DEVICE_TABLE_SIZE; slot++) {
+    if ((p_dev = device_slot(slot)) == NULL)
+      continue;
+    mark = p_snap->len;
+    if (doors)
+      httpd_put(p_snap, ",");
+    httpd_door(p_snap, p_dev, now);
+    if (p_snap->len > p_snap->size - HTTPD_TAIL_LEN) {
+      p_snap->len = mark;
+      truncated = 1;
+      break;
+    }
+    doors++;
+  }
+
+  httpd_put(p_snap, "],\"truncated\":");
+  httpd_put_bool(p_snap, truncated);
+  httpd_put(p_snap, "}\n");
+  httpd_end(p_snap, body);
+
+  httpd_stats.renders++;
+  if (truncated)
+    httpd_stats.truncated++;
+}
+
+// The number after name= in the query string (which ends at a space), in base 10 or 16.
+// Returns 1 if it is there.
+static int httpd_param(const char *p_query, const char *p_name, int base, uint32_t *p_value)
+{
+  uint32_t len = strlen(p_name), value = 0, digit, digits = 0;
+  const char *p = p_query;
+
+  while (*p && *p != ' ') {
+    if ((p == p_query || p[-1] == '&') && strncmp(p, p_name, len) == 0 && p[len] == '=') {
+      for (p += len + 1; *p && *p != ' ' && *p != '&'; p++, digits++) {
+        if (*p >= '0' && *p <= '9')
+          digit = *p - '0';
+        else if (base == 16 && (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+          digit = (*p | 0x20) - 'a' + 10;
+        else
+          return 0;
+        value = value * base + digit;
+      }
+      *p_value = value;
+      return digits > 0;
+    }
+    p++;
+  }
+  return 0;
+}
+
+// GET /events?door=<id> (that door's last HTTPD_EVENTS_MAX, newest first) or
+// GET /events?from=<s>&to=<s> (every door, oldest first) from the flash event log (see
+// evlog.h), into the query buffer. Returns 0, or -1 if the query makes no sense.
+static int httpd_events(httpd_snap_t *p_snap, const char *p_query)
+{
+  evlog_rec_t recs[HTTPD_EVENTS_MAX];
+  uint32_t door, from = 0, to = 0xffffffff, body;
+  int i, n;
+
+  if (httpd_param(p_query, "door", 16, &door))
+    n = evlog_last(door, recs, HTTPD_EVENTS_MAX);
+  else if (httpd_param(p_query, "from", 10, &from) | httpd_param(p_query, "to", 10, &to))
+    n = evlog_range(from, to, recs, HTTPD_EVENTS_MAX);
+  else
+    return -1;
+
+  body = httpd_begin(p_snap);
+  httpd_put(p_snap, "{\"now_s\":");
+  httpd_put_u32(p_snap, evlog_time(xTaskGetTickCount() * portTICK_PERIOD_MS));
+  httpd_put(p_snap, ",\"events\":[");
+  for (i = 0; i < n; i++) {
+    httpd_put(p_snap, i ? ",{\"seq\":" : "{\"seq\":");
+    httpd_put_u32(p_snap, recs[i].seq);
+    httpd_put(p_snap, ",\"time_s\":");
+    httpd_put_u32(p_snap, recs[i].time);
+    httpd_put(p_snap, ",\"id\":\"");
+    httpd_put_hex32(p_snap, recs[i].device_id);
+    httpd_put(p_snap, "\",\"pins\":");
+    httpd_put_u32(p_snap, recs[i].pins);
+    httpd_put(p_snap, "}");
+  }
+  httpd_put(p_snap, "],\"more\":");
+  httpd_put_bool(p_snap, n == HTTPD_EVENTS_MAX);
+  httpd_put(p_snap, "}\n");
+  httpd_end(p_snap, body);
+  return 0;
+}
+
+// Render a new snapshot if a door changed (or the counters moved and the last one is
+// getting old), but no more than once a tick, and never over a buffer in use.
+static void httpd_refresh(uint32_t now)
+{
+  uint32_t generation = __atomic_load_n(&httpd_generation, __ATOMIC_ACQUIRE);
+  uint32_t back = httpd_front ^ 1;
+
+  if (now - httpd_rendered_ms < HTTPD_TICK_MS)
+    return;
+  if (generation == httpd_rendered &&
+      (rx_stats.packets == httpd_rendered_packets || now - httpd_rendered_ms < HTTPD_REFRESH_MS))
+    return;
+  if (httpd_snaps[back].refs) {
+    httpd_stats.busy++;
+    return;
+  }
+
+  httpd_render(&httpd_snaps[back]);
+  httpd_front = back;
+  httpd_rendered = generation;
+  httpd_rendered_ms = now;
+  httpd_rendered_packets = rx_stats.packets;
+}
+
+static void httpd_close(httpd_conn_t *p_conn)
+{
+  if (p_conn->p_out != NULL && p_conn->snap >= 0)
+    httpd_snaps[p_conn->snap].refs--;
+  close(p_conn->sock);
+  p_conn->sock = -1;
+  p_conn->p_out = NULL;
+}
+
+// Start answering the request at the front of p_conn->request, if it is all there.
+// Returns 1 if there is a response to send, 0 if we need more bytes.
+static int httpd_parse(httpd_conn_t *p_conn)
+{
+  char *p_end, *p_path, *p;
+  uint32_t i;
+
+  // The end of the headers
+  p_end = NULL;
+  for (i = 3; i < p_conn->req_len; i++) {
+    if (memcmp(&p_conn->request[i - 3], "\r\n\r\n", 4) == 0) {
+      p_end = &p_conn->request[i + 1];
+      break;
+    }
+  }
+  if (p_end == NULL) {
+    if (p_conn->req_len < HTTPD_REQUEST_MAX)
+      return 0;
+    // Headers too big to be anything we serve
+    p_conn->consumed = p_conn->req_len;
+    p_conn->p_out = httpd_400;
+    p_conn->out_len = sizeof(httpd_400) - 1;
+  } else {
+    p_conn->consumed = p_end - p_conn->request;
+    p_end[-1] = '\0';
+    p_path = &p_conn->request[4];
+    if (memcmp(p_conn->request, "GET ", 4) != 0) {
+      p_conn->p_out = httpd_405;
+      p_conn->out_len = sizeof(httpd_405) - 1;
+    } else if ((p_path[0] == '/' && (p_path[1] == ' ' || p_path[1] == '?')) ||
+               (memcmp(p_path, "/status", 7) == 0 && (p_path[7] == ' ' || p_path[7] == '?'))) {
+      p_conn->snap = httpd_front;
+      httpd_snaps[p_conn->snap].refs++;
+      p_conn->p_out = httpd_snaps[p_conn->snap].buf;
+      p_conn->out_len = httpd_snaps[p_conn->snap].len;
+      httpd_stats.requests++;
+    } else if (memcmp(p_path, "/events?", 8) == 0) {
+      // Rendered now, into the one query buffer; if somebody is still being sent the
+      // last answer this one has to wait
+      if (httpd_snaps[HTTPD_QUERY].refs) {
+        p_conn->p_out = httpd_503;
+        p_conn->out_len = sizeof(httpd_503) - 1;
+      } else if (httpd_events(&httpd_snaps[HTTPD_QUERY], &p_path[8]) != 0) {
+        p_conn->p_out = httpd_400;
+        p_conn->out_len = sizeof(httpd_400) - 1;
+      } else {
+        p_conn->snap = HTTPD_QUERY;
+        httpd_snaps[p_conn->snap].refs++;
+        p_conn->p_out = httpd_snaps[p_conn->snap].buf;
+        p_conn->out_len = httpd_snaps[p_conn->snap].len;
+        httpd_stats.queries++;
+      }
+    } else {
+      p_conn->p_out = httpd_404;
+      p_conn->out_len = sizeof(httpd_404) - 1;
+    }
+
+    // HTTP/1.0, or a client that says so, wants the connection closed afterwards
+    p = strstr(p_conn->request, "\r\n");
+    if (p != NULL && p - p_conn->request >= 8 && memcmp(p - 8, "HTTP/1.0", 8) == 0)
+      p_conn->close = 1;
+    if (strstr(p_conn->request, "\r\nConnection: close") != NULL ||
+        strstr(p_conn->request, "\r\nconnection: close") != NULL)
+      p_conn->close = 1;
+  }
+
+  if (p_conn->p_out == httpd_400 || p_conn->p_out == httpd_405)
+    p_conn->close = 1;
+  if (p_conn->p_out != httpd_snaps[0].buf && p_conn->p_out != httpd_snaps[1].buf &&
+      p_conn->p_out != httpd_snaps[HTTPD_QUERY].buf) {
+    p_conn->snap = -1;
+    httpd_stats.errors++;
+  }
+  p_conn->sent = 0;
+  return 1;
+}
+
+// Send what the socket takes of the response. Returns 1 when it is all out and the
+// connection stays open, 0 if the socket is full, -1 if the connection is gone.
+static int httpd_write(httpd_conn_t *p_conn, uint32_t now)
+{
+  int n;
+
+  n = send(p_conn->sock, p_conn->p_out + p_conn->sent, p_conn->out_len - p_conn->sent, MSG_DONTWAIT);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    httpd_close(p_conn);
+    return -1;
+  }
+  p_conn->sent += n;
+  p_conn->last_ms = now;
+  httpd_stats.bytes += n;
+  if (p_conn->sent < p_conn->out_len)
+    return 0;
+
+  // Done with this one. Anything pipelined behind it moves to the front.
+  if (p_conn->snap >= 0)
+    httpd_snaps[p_conn->snap].refs--;
+  p_conn->p_out = NULL;
+  if (p_conn->close) {
+    httpd_close(p_conn);
+    return -1;
+  }
+  p_conn->req_len -= p_conn->consumed;
+  memmove(p_conn->request, &p_conn->request[p_conn->consumed], p_conn->req_len);
+  return 1;
+}
+
+// Answer every complete request the connection has, as far as the socket lets us
+static void httpd_serve(httpd_conn_t *p_conn, uint32_t now)
+{
+  while (p_conn->sock >= 0) {
+    if (p_conn->p_out == NULL && !httpd_parse(p_conn))
+      return;
+    if (httpd_write(p_conn, now) <= 0)
+      return;
+  }
+}
+
+static void httpd_read(httpd_conn_t *p_conn, uint32_t now)
+{
+  int n;
+
+  n = recv(p_conn->sock, &p_conn->request[p_conn->req_len], HTTPD_REQUEST_MAX - p_conn->req_len, MSG_DONTWAIT);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    httpd_close(p_conn);
+    return;
+  }
+  if (n < 0)
+    return;
+  p_conn->req_len += n;
+  p_conn->last_ms = now;
+  httpd_serve(p_conn, now);
+}
+
+static void httpd_accept(int listener, uint32_t now)
+{
+  httpd_conn_t *p_conn = NULL;
+  int sock, i;
+
+  sock = accept(listener, NULL, NULL);
+  if (sock < 0)
+    return;
+  for (i = 0; i < HTTPD_MAX_CLIENTS; i++) {
+    if (httpd_conns[i].sock < 0) {
+      p_conn = &httpd_conns[i];
+      break;
+    }
+  }
+  if (p_conn == NULL) {
+    httpd_stats.refused++;
+    close(sock);
+    return;
+  }
+
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  memset(p_conn, 0, sizeof(*p_conn));
+  p_conn->sock = sock;
+  p_conn->snap = -1;
+  p_conn->last_ms = now;
+  httpd_stats.accepted++;
+}
+
+void httpd_init(void)
+{
+  int i;
+
+  memset(&httpd_stats, 0, sizeof(httpd_stats));
+  for (i = 0; i < HTTPD_MAX_CLIENTS; i++)
+    httpd_conns[i].sock = -1;
+  for (i = 0; i < 2; i++) {
+    httpd_snaps[i].buf = httpd_status_bufs[i];
+    httpd_snaps[i].size = sizeof(httpd_status_bufs[i]);
+    httpd_snaps[i].refs = 0;
+  }
+  httpd_snaps[HTTPD_QUERY].buf = httpd_query_buf;
+  httpd_snaps[HTTPD_QUERY].size = sizeof(httpd_query_buf);
+  httpd_snaps[HTTPD_QUERY].refs = 0;
+  httpd_front = 0;
+  httpd_render(&httpd_snaps[0]);
+  httpd_rendered = __atomic_load_n(&httpd_generation, __ATOMIC_ACQUIRE);
+  httpd_rendered_ms = rx_clock_ms();
+  httpd_rendered_packets = rx_stats.packets;
+}
+
+// Processing side: something a status page shows changed. An atomic add.
+void httpd_mark(void)
+{
+  __atomic_fetch_add(&httpd_generation, 1, __ATOMIC_RELEASE);
+}
+
+// The HTTP server. This is a FreeRTOS task function and must never return. See
+// receiver_main.c for task creation; it runs at priority 1 next to the stats server.
+void httpd_task(void *pvParameters)
+{
+  struct sockaddr_in addr;
+  struct timeval timeout;
+  fd_set readable, writable;
+  uint32_t now;
+  int listener, top, on = 1, i;
+  httpd_conn_t *p_conn;
+
+  rxhealth_watch("http");
+
+  listener = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+  if (listener < 0) {
+    ESP_LOGE(TAG, "Httpd: unable to create socket: errno %d", errno);
+    vTaskDelete(NULL);
+  }
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(HTTPD_PORT);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, HTTPD_MAX_CLIENTS) < 0) {
+    ESP_LOGE(TAG, "Httpd: unable to listen on port %d: errno %d", HTTPD_PORT, errno);
+    close(listener);
+    vTaskDelete(NULL);
+  }
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL, 0) | O_NONBLOCK);
+  ESP_LOGI(TAG, "Httpd: listening, port %d", HTTPD_PORT);
+
+  while (1) {
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    FD_SET(listener, &readable);
+    top = listener;
+    for (i = 0; i < HTTPD_MAX_CLIENTS; i++) {
+      p_conn = &httpd_conns[i];
+      if (p_conn->sock < 0)
+        continue;
+      FD_SET(p_conn->sock, p_conn->p_out != NULL ? &writable : &readable);
+      if (p_conn->sock > top)
+        top = p_conn->sock;
+    }
+
+    // Wake up at least every tick for new renders and idle connections
+    timeout.tv_sec = 0;
+    timeout.tv_usec = HTTPD_TICK_MS * 1000;
+    if (select(top + 1, &readable, &writable, NULL, &timeout) < 0) {
+      FD_ZERO(&readable);
+      FD_ZERO(&writable);
+    }
+
+    now = rx_clock_ms();
+    httpd_refresh(now);
+
+    for (i = 0; i < HTTPD_MAX_CLIENTS; i++) {
+      p_conn = &httpd_conns[i];
+      if (p_conn->sock < 0)
+        continue;
+      if (FD_ISSET(p_conn->sock, &readable))
+        httpd_read(p_conn, now);
+      else if (FD_ISSET(p_conn->sock, &writable))
+        httpd_serve(p_conn, now);
+      if (p_conn->sock >= 0 && now - p_conn->last_ms >= HTTPD_TIMEOUT_MS) {
+        httpd_stats.timeouts++;
+        httpd_close(p_conn);
+      }
+    }
+
+    // New connections last, so none of them is mistaken for one select looked at
+    if (FD_ISSET(listener, &readable))
+      httpd_accept(listener, now);
+  }
+}
@@ -0,0 +1,123 @@
+// httpd.h
+// Door state over HTTP: GET /status on port HTTPD_PORT answers with a JSON document of
+// every sender we know, its doors, when they last changed and its counters, so a
+// browser or curl can see what the serial console used to be needed for. GET / is the
+// same.
+//
+//   {"receiver":"a1b2c3d4","uptime_ms":123456,"packets":1000,"bad":0,"rejected":0,
+//    "devices":2,"doors":[{"id":"00c0ffee","pins":4,"open":true,"silent":false,
+//    "changes":12,"changed_ms":120000,"last_seen_ms":123000,"packets":500,"lost":0,
+//    "boots":1,"door":[{"pin":4,"open":true,"open_too_long":false,"opens":40,
+//    "opens_day":6,"open_s_day":310,"open_usual_s":45,"open_last_s":38,
+//    "unusual":false}]}, ...],"truncated":false}
+//
+// Each entry in doors is a sender; open says any of its doors is open and door has one
+// entry per pin in DOOR_OPEN_MASK (see devices.h). All times are milliseconds on the
+// receiver's clock, like uptime_ms, so the age of a change is uptime_ms - changed_ms.
+// The door analytics (see doorstats.h) are in seconds: opens_day and open_s_day cover
+// the last DOORSTATS_HOURS hours, open_usual_s is the baseline an opening is judged by
+// and unusual says the last one (or the one going on) was far longer.
+// HTTPD_SNAPSHOT_SIZE is worked out from the most senders the device table takes and
+// the doors each has, every number at its longest, so the whole table always fits; a
+// smaller size of your own stops the build. truncated is there in case that sum ever
+// falls behind the JSON, and says the doors list stops early.
+//
+// GET /events?door=00c0ffee is that door's last HTTPD_EVENTS_MAX changes from the flash
+// event log (see evlog.h), newest first; GET /events?from=1000&to=2000 is every door's
+// changes in that time range, oldest first (either end can be left out). Times are on
+// the log clock, seconds, and now_s says what it reads now:
+//
+//   {"now_s":5120,"events":[{"seq":812,"time_s":5003,"id":"00c0ffee","pins":4}, ...],
+//    "more":false}
+//
+// more says there may be further events past the last one. These are read from flash
+// when they are asked for, into a third, smaller buffer; a request that comes while another
+// client is still being sent the last answer gets a 503 and should try again.
+//
+// Requests never build anything. The whole response, headers included, is rendered
+// ahead of time into one of two snapshot buffers and a request is a send() straight
+// out of the current one. httpd_task renders a new one into the other buffer when a
+// door changed (the processing side calls httpd_mark next to pubsub_mark, an atomic
+// add), at most every HTTPD_TICK_MS, and at least every HTTPD_REFRESH_MS while packets
+// come in so the counters don't go stale. Then the two swap. A client still being sent
+// the old one keeps it; we don't render over a buffer somebody is reading, we wait for
+// the next tick.
+//
+// One task, no heap: up to HTTPD_MAX_CLIENTS connections in a static table, all non
+// blocking behind one select(), so a slow client never holds up the others. Keep alive
+// (HTTP/1.1) and pipelined requests work; a connection idle for HTTPD_TIMEOUT_MS is
+// closed, and one that doesn't fit in the table is closed straight away. It runs at
+// priority 1 with its own socket and reads the device table on the fly, like the
+// stats endpoint, so polling never holds up the UDP receive path.
+
+#ifndef __HTTPD__H
+
+  #define __HTTPD__H
+
+  #include <stdint.h>
+
+  #include "devices.h"
+
+  #include "sdkconfig.h"
+
+  #ifdef CONFIG_HTTPD_PORT
+    #define HTTPD_PORT CONFIG_HTTPD_PORT
+  #else
+    #define HTTPD_PORT 80
+  #endif
+
+  #ifdef CONFIG_HTTPD_MAX_CLIENTS
+    #define HTTPD_MAX_CLIENTS CONFIG_HTTPD_MAX_CLIENTS
+  #else
+    #define HTTPD_MAX_CLIENTS 4
+  #endif
+
+  #define HTTPD_TICK_MS 100
+  #define HTTPD_REFRESH_MS 1000
+  #define HTTPD_TIMEOUT_MS 10000
+  #define HTTPD_REQUEST_MAX 512
+  #define HTTPD_EVENTS_MAX 32
+
+  // The longest the JSON gets, in bytes, with every number at its longest: a sender
+  // without its doors (comma included), one door, one event, and the headers plus what
+  // goes around the list (HTTPD_TAIL_LEN is kept free for what follows the last one).
+  // Keep these in step with httpd.c.
+  #define HTTPD_SENDER_LEN 198
+  #define HTTPD_DOOR_LEN 182
+  #define HTTPD_EVENT_LEN 68
+  #define HTTPD_HEAD_LEN 240
+  #define HTTPD_EVENTS_HEAD_LEN 150
+  #define HTTPD_TAIL_LEN 32
+
+  // A full device table, and HTTPD_EVENTS_MAX events
+  #define HTTPD_SNAPSHOT_NEED (HTTPD_HEAD_LEN + HTTPD_TAIL_LEN + \
+                               DEVICE_LOAD_MAX * (HTTPD_SENDER_LEN + DEVICE_DOORS * HTTPD_DOOR_LEN))
+  #define HTTPD_QUERY_SIZE (HTTPD_EVENTS_HEAD_LEN + HTTPD_EVENTS_MAX * HTTPD_EVENT_LEN)
+
+  // 0 (the default) is HTTPD_SNAPSHOT_NEED
+  #if defined(CONFIG_HTTPD_SNAPSHOT_SIZE) && CONFIG_HTTPD_SNAPSHOT_SIZE
+    #define HTTPD_SNAPSHOT_SIZE CONFIG_HTTPD_SNAPSHOT_SIZE
+  #else
+    #define HTTPD_SNAPSHOT_SIZE HTTPD_SNAPSHOT_NEED
+  #endif
+
+  typedef struct {
+    uint32_t accepted;    // connections
+    uint32_t refused;     // connections closed straight away, table full
+    uint32_t requests;    // GET /status (or /)
+    uint32_t queries;     // GET /events
+    uint32_t errors;      // anything else: 400, 404, 405, 503
+    uint32_t timeouts;    // connections closed for being idle
+    uint32_t renders;     // snapshots rendered
+    uint32_t busy;        // renders put off because a client still had the other buffer
+    uint32_t truncated;   // renders that ran out of room
+    uint32_t bytes;       // sent, all responses
+  } httpd_stats_t;
+
+  extern httpd_stats_t httpd_stats;
+
+  void httpd_init(void);
+  void httpd_mark(void);
+  void httpd_task(void *pvParameters);
+
+#endif
@@ -0,0 +1,123 @@
+// pipeline.c
+// Receive / process split (see pipeline.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// Same ring discipline as dlog.c: the ingress task only ever writes head, pipeline_task
+// only ever writes tail. When the ring is empty pipeline_task sets waiting and blocks on
+// a task notification; the producer only pays for xTaskNotifyGive when it sees waiting
+// set. Both sides use sequentially consistent accesses for head and waiting so a push
+// can't slip in between the consumer's last look and its sleep.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "functions.h"
+#include "pipeline.h"
+#include "rxhealth.h"
+#include "twheel.h"
+
+#if (PIPELINE_RING_SIZE & (PIPELINE_RING_SIZE - 1)) != 0
+  #error "PIPELINE_RING_SIZE must be a power of two"
+#endif
+
+// Longest pipeline_task sleeps without a notification: one timer wheel tick, so the
+// sender deadlines (device_alerts) run on time while the ring is empty.
+#define PIPELINE_IDLE_MS TW_TICK_MS
+
+extern const char *TAG;
+
+pipeline_stats_t pipeline_stats;
+
+static pipeline_item_t pipeline_ring[PIPELINE_RING_SIZE];
+static uint32_t pipeline_head;      // written by the producer only
+static uint32_t pipeline_tail;      // written by the consumer only
+static uint32_t pipeline_waiting;   // the consumer is (about to be) asleep
+static TaskHandle_t pipeline_consumer;
+
+int pipeline_init(void)
+{
+  pipeline_head = 0;
+  pipeline_tail = 0;
+  pipeline_waiting = 0;
+  pipeline_stats.pushed = 0;
+  pipeline_stats.full = 0;
+  pipeline_stats.max_depth = 0;
+  pipeline_stats.sleeps = 0;
+  hist_init(&pipeline_stats.wait);
+  return 0;
+}
+
+// Frames in the ring right now. Either side may ask.
+uint32_t pipeline_depth(void)
+{
+  return __atomic_load_n(&pipeline_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&pipeline_tail, __ATOMIC_ACQUIRE);
+}
+
+// Producer side (the ingress task). Never blocks. Returns 0 if the frame was queued or
+// -1 if the ring was full and it was dropped.
+int pipeline_push(const gp_frame_t *p_frame, uint32_t addr, uint32_t start_us)
+{
+  uint32_t head = pipeline_head;
+  uint32_t depth = head - __atomic_load_n(&pipeline_tail, __ATOMIC_ACQUIRE);
+  pipeline_item_t *p_item;
+
+  if (depth >= PIPELINE_RING_SIZE) {
+    pipeline_stats.full++;
+    return -1;
+  }
+
+  p_item = &pipeline_ring[head & (PIPELINE_RING_SIZE - 1)];
+  p_item->frame = *p_frame;
+  p_item->addr = addr;
+  p_item->start_us = start_us;
+
+  __atomic_store_n(&pipeline_head, head + 1, __ATOMIC_SEQ_CST);
+  pipeline_stats.pushed++;
+  if (depth + 1 > pipeline_stats.max_depth)
+    pipeline_stats.max_depth = depth + 1;
+
+  if (__atomic_load_n(&pipeline_waiting, __ATOMIC_SEQ_CST) && pipeline_consumer != NULL)
+    xTaskNotifyGive(pipeline_consumer);
+  return 0;
+}
+
+// Consumer side. This is a FreeRTOS task function and must never return. See
+// receiver_main.c for task creation; it is pinned to PIPELINE_PROCESS_CORE.
+void pipeline_task(void *pvParameters)
+{
+  pipeline_item_t *p_item;
+  uint32_t tail, now;
+
+  pipeline_consumer = xTaskGetCurrentTaskHandle();
+  rxhealth_watch("proc");
+
+  while (1) {
+    tail = pipeline_tail;
+
+    if (tail == __atomic_load_n(&pipeline_head, __ATOMIC_SEQ_CST)) {
+      // Empty. Say we are going to sleep, then look once more before we do.
+      __atomic_store_n(&pipeline_waiting, 1, __ATOMIC_SEQ_CST);
+      if (tail == __atomic_load_n(&pipeline_head, __ATOMIC_SEQ_CST)) {
+        pipeline_stats.sleeps++;
+        ulTaskNotifyTake(pdTRUE, PIPELINE_IDLE_MS / portTICK_PERIOD_MS);
+      }
+      __atomic_store_n(&pipeline_waiting, 0, __ATOMIC_SEQ_CST);
+      device_alerts();
+      continue;
+    }
+
+    // Work on the frame in place and only then hand the slot back
+    p_item = &pipeline_ring[tail & (PIPELINE_RING_SIZE - 1)];
+    now = (uint32_t)esp_timer_get_time();
+    hist_add(&pipeline_stats.wait, now - p_item->start_us);
+    process_frame(&p_item->frame, p_item->addr);
+    // recvfrom returned -> processed, like the single task loop measures it, but on
+    // esp_timer: start_us was taken on the other core
+    hist_add(&rx_stats.proc, ((uint32_t)esp_timer_get_time() - p_item->start_us) * PIPELINE_CYCLES_PER_US);
+
+    __atomic_store_n(&pipeline_tail, tail + 1, __ATOMIC_RELEASE);
+    device_alerts();
+  }
+}
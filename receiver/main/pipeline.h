@@ -0,0 +1,69 @@
+// pipeline.h
+// The receiver split over the ESP32's two cores. The network ingress task (the socket
+// loop in udp_server_task) runs on the protocol core next to the WiFi driver and lwIP:
+// it receives, decodes, answers DISCOVER and ACKs, and pushes the decoded frame into a
+// lock free single producer / single consumer ring. pipeline_task runs on the other
+// core, pops frames and does the real work (process_frame: device table, deferred log,
+// event log). A slow flash write on the processing core no longer holds up recvfrom.
+//
+// Instrumentation: queue depth (high water mark), frames dropped because the ring was
+// full (the producer never blocks; the sender retransmits anything we didn't ACK), the
+// number of times the consumer had to sleep and the time frames spend in the ring.
+// A frame is stamped on one core and finished on the other, and the two cores' cycle
+// counters aren't the same clock, so those times come from esp_timer (microseconds).
+// Select it with idf.py menuconfig (Receiver Configuration -> Split receive and
+// processing over both cores). It is off by default: on a single CPU host it is slower
+// than the one task loop, and it hasn't been measured on the ESP32 yet.
+
+#ifndef __PIPELINE__H
+
+  #define __PIPELINE__H
+
+  #include <stdint.h>
+  #include "sdkconfig.h"
+  #include "hist.h"
+  #include "garage_proto.h"
+
+  #ifdef CONFIG_PIPELINE_RING_SIZE
+    #define PIPELINE_RING_SIZE CONFIG_PIPELINE_RING_SIZE
+  #else
+    #define PIPELINE_RING_SIZE 32
+  #endif
+
+  // Cores. The WiFi driver and lwIP live on core 0 (PRO_CPU).
+  #define PIPELINE_INGRESS_CORE 0
+  #define PIPELINE_PROCESS_CORE 1
+
+  // rx_stats.proc is in cycles (see functions.c); this turns the pipeline's microseconds
+  // into those. The host build's "cycles" are nanoseconds.
+  #if defined(CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ)
+    #define PIPELINE_CYCLES_PER_US CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+  #elif defined(CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ)
+    #define PIPELINE_CYCLES_PER_US CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+  #else
+    #define PIPELINE_CYCLES_PER_US 1000
+  #endif
+
+  // One decoded frame on its way to the processing core
+  typedef struct {
+    gp_frame_t frame;
+    uint32_t addr;        // sender address, network byte order
+    uint32_t start_us;    // esp_timer_get_time() when recvfrom returned
+  } pipeline_item_t;
+
+  typedef struct {
+    uint32_t pushed;      // frames queued
+    uint32_t full;        // frames dropped because the ring was full
+    uint32_t max_depth;   // deepest the ring has been
+    uint32_t sleeps;      // times pipeline_task found the ring empty and blocked
+    hist_t wait;          // recvfrom returned -> picked up by pipeline_task, microseconds
+  } pipeline_stats_t;
+
+  extern pipeline_stats_t pipeline_stats;
+
+  int pipeline_init(void);
+  int pipeline_push(const gp_frame_t *p_frame, uint32_t addr, uint32_t start_us);
+  uint32_t pipeline_depth(void);
+  void pipeline_task(void *pvParameters);
+
+#endif
@@ -0,0 +1,342 @@
+// pubsub.c
+// Door state fan-out to local consumers (see pubsub.h). Please remember to add this
+// module to the CMakeLists.txt file or it won't get compiled and linked!
+//
+// Two ways in from the other tasks, neither of which ever blocks:
+//
+//   - the request queue has the same discipline as stats.c: the receive path only ever
+//     writes head, pubsub_task only ever writes tail, and the producer notifies on
+//     every request it queues so the snapshot goes out straight away.
+//   - the dirty mask has a bit per device table slot. The processing side sets bits
+//     with an atomic or, pubsub_task takes a whole word at a time with an atomic
+//     exchange, so a change is either in this flush or the next one, never lost. No
+//     notification; pubsub_task comes round every PUBSUB_TICK_MS anyway.
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "garage_proto.h"
+#include "devices.h"
+#include "twheel.h"
+#include "functions.h"
+#include "pubsub.h"
+#include "rxhealth.h"
+
+#define PUBSUB_DIRTY_WORDS ((DEVICE_TABLE_SIZE + 31) / 32)
+
+extern const char *TAG;
+
+pubsub_stats_t pubsub_stats;
+
+// Who asked, and for how long
+typedef struct {
+  uint32_t addr;        // network byte order
+  uint16_t port;        // host byte order
+  uint16_t lease_s;     // capped at PUBSUB_LEASE_MAX_S
+  uint8_t snapshot;     // GP_FLAG_SNAPSHOT was set
+} pubsub_req_t;
+
+static pubsub_req_t pubsub_queue[PUBSUB_QUEUE_LEN];
+static uint32_t pubsub_head;      // written by the receive path only
+static uint32_t pubsub_tail;      // written by pubsub_task only
+static TaskHandle_t pubsub_server;
+
+static uint32_t pubsub_dirty[PUBSUB_DIRTY_WORDS];
+static subscriber_t pubsub_table[PUBSUB_MAX_SUBSCRIBERS];
+static tw_t pubsub_leases;
+
+// A NOTIFY frame being filled. One for the changes and one for snapshots, so a
+// SUBSCRIBE can be answered in the middle of a flush.
+typedef struct {
+  uint8_t buf[GP_MAX_FRAME];
+  uint8_t count;
+} pubsub_frame_t;
+
+static pubsub_frame_t pubsub_changes;
+static pubsub_frame_t pubsub_snap;
+
+// now_ms is the receiver clock (rx_clock_ms)
+void pubsub_init(uint32_t now_ms)
+{
+  memset(&pubsub_stats, 0, sizeof(pubsub_stats));
+  memset(pubsub_table, 0, sizeof(pubsub_table));
+  memset(pubsub_dirty, 0, sizeof(pubsub_dirty));
+  pubsub_head = 0;
+  pubsub_tail = 0;
+  pubsub_changes.count = 0;
+  tw_init(&pubsub_leases, now_ms);
+}
+
+// Processing side: p_dev changed (pins, silent, alive, open too long). Costs an atomic
+// or, whether anybody is subscribed or not.
+void pubsub_mark(const device_t *p_dev)
+{
+  uint32_t slot = device_index(p_dev);
+
+  __atomic_fetch_or(&pubsub_dirty[slot / 32], 1u << (slot % 32), __ATOMIC_RELEASE);
+  pubsub_stats.marked++;
+}
+
+// Receive path: queue a decoded SUBSCRIBE for pubsub_task. Never blocks. Returns 0, or -1 if
+// the queue was full and the request was dropped. With a key rxauth_check has already
+// made sure it is signed (see rxauth.h).
+int pubsub_request(uint32_t addr, uint16_t port, const gp_frame_t *p_frame)
+{
+  uint32_t head = pubsub_head;
+  pubsub_req_t *p_req;
+
+  if (head - __atomic_load_n(&pubsub_tail, __ATOMIC_ACQUIRE) >= PUBSUB_QUEUE_LEN) {
+    pubsub_stats.dropped++;
+    return -1;
+  }
+
+  p_req = &pubsub_queue[head % PUBSUB_QUEUE_LEN];
+  p_req->addr = addr;
+  p_req->port = port;
+  // The lease is 16 bits on the wire, but seq isn't: cap it here, not by truncating
+  p_req->lease_s = p_frame->seq > PUBSUB_LEASE_MAX_S ? PUBSUB_LEASE_MAX_S : p_frame->seq;
+  p_req->snapshot = (p_frame->flags & GP_FLAG_SNAPSHOT) != 0;
+  __atomic_store_n(&pubsub_head, head + 1, __ATOMIC_RELEASE);
+
+  if (pubsub_server != NULL)
+    xTaskNotifyGive(pubsub_server);
+  return 0;
+}
+
+// Add p_dev to the frame being filled. The fields are read while the processing side
+// may be updating them; at worst an entry is a change behind, and the change's dirty
+// bit brings the rest next tick.
+static void pubsub_entry(pubsub_frame_t *p_frame, const device_t *p_dev)
+{
+  uint8_t *p = &p_frame->buf[GP_NOTIFY_HEADER_LEN + p_frame->count * GP_NOTIFY_ENTRY_LEN];
+  uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+  uint8_t state = 0;
+  int door;
+
+  // Any door open, any door open too long; the pins say which. open_since and the alert
+  // run on the tick clock, like device_update.
+  if (p_dev->open)
+    state |= GP_STATE_OPEN;
+  for (door = 0; door < DEVICE_DOORS; door++) {
+    if ((p_dev->open & device_door_pin(door)) && DOOR_OPEN_ALERT_MS &&
+        now - p_dev->door[door].open_since >= DOOR_OPEN_ALERT_MS)
+      state |= GP_STATE_OPEN_TOO_LONG;
+  }
+  if (p_dev->silent)
+    state |= GP_STATE_SILENT;
+
+  gp_put32(&p[0], p_dev->device_id);
+  gp_put16(&p[4], p_dev->pins);
+  p[6] = state;
+  gp_put32(&p[7], p_dev->changes);
+  gp_put32(&p[11], p_dev->changed_ms);
+  p_frame->count++;
+}
+
+// Send p_frame to one subscriber
+static void pubsub_send(int sock, subscriber_t *p_sub, pubsub_frame_t *p_frame, uint8_t flags)
+{
+  struct sockaddr_in dest_addr;
+  gp_frame_t header;
+  int len;
+
+  header.type = GP_TYPE_NOTIFY;
+  header.flags = flags;
+  header.device_id = receiver_id;
+  header.seq = p_sub->seq++;
+  header.tx_time = rx_clock_ms();
+  header.count = p_frame->count;
+  len = gp_encode(&header, p_frame->buf, sizeof(p_frame->buf));
+
+  dest_addr.sin_family = AF_INET;
+  dest_addr.sin_addr.s_addr = p_sub->addr;
+  dest_addr.sin_port = htons(p_sub->port);
+  pubsub_stats.sends++;
+  if (sendto(sock, p_frame->buf, len, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) == len) {
+    p_sub->sent++;
+  } else {
+    p_sub->failed++;
+    pubsub_stats.failed++;
+  }
+}
+
+// The changes frame goes to everybody. Only the header differs per subscriber.
+static void pubsub_publish(int sock)
+{
+  uint32_t i;
+
+  pubsub_stats.frames++;
+  pubsub_stats.entries += pubsub_changes.count;
+  for (i = 0; i < PUBSUB_MAX_SUBSCRIBERS; i++) {
+    if (pubsub_table[i].addr != 0)
+      pubsub_send(sock, &pubsub_table[i], &pubsub_changes, 0);
+  }
+  pubsub_changes.count = 0;
+}
+
+// The whole device table to one subscriber, at least one frame even if it is empty.
+static void pubsub_snapshot(int sock, subscriber_t *p_sub)
+{
+  uint32_t slot;
+  device_t *p_dev;
+  int sent = 0;
+
+  pubsub_snap.count = 0;
+  for (slot = 0; slot < DEVICE_TABLE_SIZE; slot++) {
+    if ((p_dev = device_slot(slot)) == NULL)
+      continue;
+    pubsub_entry(&pubsub_snap, p_dev);
+    if (pubsub_snap.count == GP_NOTIFY_MAX) {
+      pubsub_send(sock, p_sub, &pubsub_snap, GP_FLAG_SNAPSHOT);
+      pubsub_snap.count = 0;
+      sent = 1;
+    }
+  }
+  if (pubsub_snap.count || !sent)
+    pubsub_send(sock, p_sub, &pubsub_snap, GP_FLAG_SNAPSHOT);
+}
+
+static void pubsub_remove(subscriber_t *p_sub)
+{
+  tw_cancel(&pubsub_leases, &p_sub->lease);
+  p_sub->addr = 0;
+  pubsub_stats.subscribers--;
+}
+
+// A SUBSCRIBE: new subscriber, renewal or (lease 0) goodbye.
+static void pubsub_subscribe(int sock, const pubsub_req_t *p_req, uint32_t now)
+{
+  subscriber_t *p_sub = NULL, *p_free = NULL;
+  uint32_t i;
+  int snapshot = p_req->snapshot;
+
+  for (i = 0; i < PUBSUB_MAX_SUBSCRIBERS; i++) {
+    if (pubsub_table[i].addr == p_req->addr && pubsub_table[i].port == p_req->port) {
+      p_sub = &pubsub_table[i];
+      break;
+    }
+    if (pubsub_table[i].addr == 0 && p_free == NULL)
+      p_free = &pubsub_table[i];
+  }
+
+  if (p_req->lease_s == 0) {
+    if (p_sub != NULL)
+      pubsub_remove(p_sub);
+    return;
+  }
+
+  if (p_sub == NULL) {
+    if (p_free == NULL) {
+      pubsub_stats.refused++;
+      ESP_LOGW(TAG, "Pubsub: no room for another subscriber (%d)", PUBSUB_MAX_SUBSCRIBERS);
+      return;
+    }
+    p_sub = p_free;
+    memset(p_sub, 0, sizeof(*p_sub));
+    p_sub->addr = p_req->addr;
+    p_sub->port = p_req->port;
+    p_sub->since_ms = now;
+    pubsub_stats.subscribers++;
+    snapshot = 1;
+    ESP_LOGD(TAG, "Pubsub: new subscriber %08x:%u", ntohl(p_req->addr), p_req->port);
+  }
+
+  pubsub_stats.subscribes++;
+  tw_arm(&pubsub_leases, &p_sub->lease, now + p_req->lease_s * 1000);
+  if (snapshot)
+    pubsub_snapshot(sock, p_sub);
+}
+
+// Everything in the request queue
+static void pubsub_requests(int sock)
+{
+  uint32_t tail, now = rx_clock_ms();
+
+  for (tail = pubsub_tail; tail != __atomic_load_n(&pubsub_head, __ATOMIC_ACQUIRE); tail++) {
+    pubsub_subscribe(sock, &pubsub_queue[tail % PUBSUB_QUEUE_LEN], now);
+    __atomic_store_n(&pubsub_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Once a tick: everything marked since the last flush, GP_NOTIFY_MAX doors a frame.
+static void pubsub_flush(int sock)
+{
+  uint32_t word, bits, slot;
+  device_t *p_dev;
+  int any = 0;
+
+  for (word = 0; word < PUBSUB_DIRTY_WORDS; word++) {
+    // Plain read first; most words are empty and the exchange costs a bus lock
+    if (pubsub_dirty[word] == 0)
+      continue;
+    bits = __atomic_exchange_n(&pubsub_dirty[word], 0, __ATOMIC_ACQUIRE);
+    // Nobody to tell ... the marks are still taken, a new subscriber gets a snapshot
+    if (pubsub_stats.subscribers == 0)
+      continue;
+    while (bits) {
+      slot = word * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      if ((p_dev = device_slot(slot)) == NULL)
+        continue;
+      pubsub_entry(&pubsub_changes, p_dev);
+      any = 1;
+      if (pubsub_changes.count == GP_NOTIFY_MAX) {
+        pubsub_publish(sock);
+        // With hundreds of subscribers a flush takes a while; keep the queue moving
+        pubsub_requests(sock);
+      }
+    }
+  }
+  if (pubsub_changes.count)
+    pubsub_publish(sock);
+  if (any)
+    pubsub_stats.flushes++;
+}
+
+// Sends the NOTIFY frames. This is a FreeRTOS task function and must never return. See
+// receiver_main.c for task creation; it runs at priority 1 next to the stats server so
+// the consumers never hold up a door event.
+void pubsub_task(void *pvParameters)
+{
+  uint32_t now, next;
+  tw_timer_t *p_timer;
+  int sock;
+
+  // Any port will do, like the stats server
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Pubsub: unable to create socket: errno %d", errno);
+    vTaskDelete(NULL);
+  }
+  pubsub_server = xTaskGetCurrentTaskHandle();
+  rxhealth_watch("pubs");
+  next = rx_clock_ms() + PUBSUB_TICK_MS;
+
+  while (1) {
+    // Sleep until the next tick, or until a SUBSCRIBE comes in
+    now = rx_clock_ms();
+    if ((int32_t)(next - now) > 0)
+      ulTaskNotifyTake(pdTRUE, (next - now + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+    pubsub_requests(sock);
+
+    now = rx_clock_ms();
+    if ((int32_t)(next - now) > 0)
+      continue;
+
+    // Every lease timer is the lease member of a pubsub_table slot
+    while ((p_timer = tw_expire(&pubsub_leases, now)) != NULL) {
+      pubsub_remove(&pubsub_table[((char *)p_timer - (char *)pubsub_table) / sizeof(subscriber_t)]);
+      pubsub_stats.expired++;
+    }
+
+    pubsub_flush(sock);
+
+    // A late wakeup doesn't earn a burst of catch up ticks
+    next += PUBSUB_TICK_MS;
+    if ((int32_t)(next - now) <= 0)
+      next = now + PUBSUB_TICK_MS;
+  }
+}
@@ -0,0 +1,83 @@
+// pubsub.h
+// Door state fan-out to local consumers: a home automation bridge, a wall display, a
+// logger. They register with a GP_TYPE_SUBSCRIBE to port 8266 and get GP_TYPE_NOTIFY
+// frames when doors change (see garage_proto.h for both).
+//
+// Subscribers live in a fixed table of PUBSUB_MAX_SUBSCRIBERS slots, keyed by address
+// and port. Each has a lease (capped at PUBSUB_LEASE_MAX_S); a consumer that doesn't
+// renew in time is dropped. The leases are timers in a wheel of their own (twheel.h).
+// A subscriber that doesn't fit is refused: it gets no snapshot back, and can try
+// again later.
+//
+// Delivery is coalesced and batched. The processing side (process_frame, device_alerts)
+// only sets the device's bit in a dirty mask; that is all a door event costs it.
+// pubsub_task wakes every PUBSUB_TICK_MS, takes the whole mask, builds NOTIFY frames
+// of up to GP_NOTIFY_MAX doors each from the current device state and sends every
+// frame to every subscriber. A burst of E events from D doors to M subscribers is then
+// ceil(D / GP_NOTIFY_MAX) * M datagrams, not E * M. A door that moved twice in one tick
+// goes out once, with its change counter showing both moves. The price is up to one
+// tick of extra delay.
+//
+// SUBSCRIBE requests go through a small queue from the receive path, like stats
+// requests (see stats.h). pubsub_task answers new subscribers, and renewals that ask
+// for it, with a snapshot of the whole table. pubsub_task owns the subscriber table
+// and the lease wheel; it reads the device table on the fly, like the stats endpoint.
+
+#ifndef __PUBSUB__H
+
+  #define __PUBSUB__H
+
+  #include <stdint.h>
+  #include "garage_proto.h"
+  #include "devices.h"
+  #include "twheel.h"
+
+  #include "sdkconfig.h"
+
+  #ifdef CONFIG_PUBSUB_MAX_SUBSCRIBERS
+    #define PUBSUB_MAX_SUBSCRIBERS CONFIG_PUBSUB_MAX_SUBSCRIBERS
+  #else
+    #define PUBSUB_MAX_SUBSCRIBERS 8
+  #endif
+
+  #ifdef CONFIG_PUBSUB_TICK_MS
+    #define PUBSUB_TICK_MS CONFIG_PUBSUB_TICK_MS
+  #else
+    #define PUBSUB_TICK_MS 50
+  #endif
+
+  #define PUBSUB_LEASE_MAX_S 3600     // fits the uint16_t lease in a request
+  #define PUBSUB_QUEUE_LEN 16
+
+  typedef struct {
+    uint32_t addr;        // network byte order, 0 means the slot is free
+    uint16_t port;        // host byte order
+    uint32_t seq;         // next notify sequence number
+    tw_timer_t lease;     // fires when the lease runs out
+    uint32_t since_ms;    // first subscribed (receiver clock)
+    uint32_t sent;        // NOTIFY frames sent
+    uint32_t failed;      // NOTIFY frames sendto wouldn't take
+  } subscriber_t;
+
+  typedef struct {
+    uint32_t subscribers; // right now
+    uint32_t subscribes;  // SUBSCRIBEs handled, renewals included
+    uint32_t expired;     // leases that ran out
+    uint32_t refused;     // table full
+    uint32_t dropped;     // requests dropped, queue full
+    uint32_t marked;      // device changes handed to us
+    uint32_t entries;     // door entries built (each one goes to every subscriber)
+    uint32_t frames;      // NOTIFY frames built, snapshots not included
+    uint32_t sends;       // NOTIFY datagrams sent, snapshots included
+    uint32_t failed;      // NOTIFY datagrams sendto wouldn't take
+    uint32_t flushes;     // ticks that had something to send
+  } pubsub_stats_t;
+
+  extern pubsub_stats_t pubsub_stats;
+
+  void pubsub_init(uint32_t now_ms);
+  void pubsub_mark(const device_t *p_dev);
+  int pubsub_request(uint32_t addr, uint16_t port, const gp_frame_t *p_frame);
+  void pubsub_task(void *pvParameters);
+
+#endif
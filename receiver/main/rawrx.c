@@ -0,0 +1,210 @@
+// rawrx.c
+// Alternative receive backend built on lwIP's raw UDP API. Please remember to add this
+// module to the CMakeLists.txt file or it won't get compiled and linked! Select it with
+// idf.py menuconfig (Receiver Configuration -> Receive backend).
+//
+// The socket backend (udp_server_task in functions.c) pays for every packet three
+// times: lwIP copies the pbuf into our rx_buffer, the packet hops through a mailbox
+// from the tcpip thread to our task and we take a context switch to get it. Here lwIP
+// calls raw_recv directly from the tcpip thread with the pbuf. We decode the frame
+// straight out of the pbuf payload (no copy unless lwIP chained it), free the pbuf
+// right away and only pass the small decoded frame to raw_rx_task through a queue.
+//
+// raw_recv runs in the tcpip thread so it must stay short and must never block: if the
+// queue is full we count an overrun and drop the frame.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "lwip/udp.h"
+#include "lwip/tcpip.h"
+#include "xtensa/hal.h"
+
+#include "garage_proto.h"
+#include "functions.h"
+#include "devices.h"
+#include "stats.h"
+#include "pubsub.h"
+#include "rxauth.h"
+#include "rxhealth.h"
+#include "dlog.h"
+#include "twheel.h"
+
+#ifdef CONFIG_RAW_RX_QUEUE_LEN
+  #define RAW_RX_QUEUE_LEN CONFIG_RAW_RX_QUEUE_LEN
+#else
+  #define RAW_RX_QUEUE_LEN 16
+#endif
+
+extern const char *TAG;
+
+// What raw_recv hands to raw_rx_task. cycles is what the tcpip thread spent on it so
+// the processing histogram stays comparable with the socket backend.
+typedef struct {
+  gp_frame_t frame;
+  uint32_t addr;
+  uint32_t cycles;
+} raw_rx_item_t;
+
+static QueueHandle_t raw_rx_queue;
+
+// Send the ACK for a frame (see reliable.h). Runs in the tcpip thread.
+static void raw_ack(struct udp_pcb *pcb, const gp_frame_t *p_frame, const ip_addr_t *addr, u16_t port)
+{
+  struct pbuf *p_ack = pbuf_alloc(PBUF_TRANSPORT, GP_ACK_LEN, PBUF_RAM);
+
+  if (p_ack == NULL)
+    return;
+  gp_encode_ack(p_frame, p_ack->payload, GP_ACK_LEN);
+  udp_sendto(pcb, p_ack, addr, port);
+  pbuf_free(p_ack);
+}
+
+// Answer a sender's DISCOVER (see discovery.h in common/). Runs in the tcpip thread.
+static void raw_announce(struct udp_pcb *pcb, const ip_addr_t *addr, u16_t port)
+{
+  struct pbuf *p_announce = pbuf_alloc(PBUF_TRANSPORT, GP_ANNOUNCE_LEN, PBUF_RAM);
+
+  if (p_announce == NULL)
+    return;
+  announce_encode(p_announce->payload, GP_ANNOUNCE_LEN);
+  udp_sendto(pcb, p_announce, addr, port);
+  pbuf_free(p_announce);
+}
+
+// Answer a sender's TIME_REQ (see clksync.h in common/). Runs in the tcpip thread.
+static void raw_time(struct udp_pcb *pcb, const gp_frame_t *p_frame, const ip_addr_t *addr, u16_t port)
+{
+  struct pbuf *p_time = pbuf_alloc(PBUF_TRANSPORT, GP_TIME_LEN, PBUF_RAM);
+
+  if (p_time == NULL)
+    return;
+  time_encode(p_frame, p_time->payload, GP_TIME_LEN);
+  udp_sendto(pcb, p_time, addr, port);
+  pbuf_free(p_time);
+}
+
+// lwIP receive callback ... runs in the tcpip thread. We own the pbuf and must free it.
+static void raw_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+  uint32_t start = xthal_get_ccount();
+  uint8_t copy[GP_MAX_FRAME];
+  const uint8_t *p_data;
+  raw_rx_item_t item;
+  int result, len;
+
+  rx_stats.packets++;
+
+  // Usually the whole datagram sits in the first pbuf and we can parse it in place.
+  // If lwIP chained it, fall back to copying it into a small buffer.
+  if (p->len == p->tot_len) {
+    p_data = p->payload;
+  } else {
+    pbuf_copy_partial(p, copy, sizeof(copy), 0);
+    p_data = copy;
+  }
+
+  // Forged and replayed reports are dropped before anything else looks at them (see
+  // rxauth.h); the rest is decoded without its auth trailer
+  item.addr = ip_2_ip4(addr)->addr;
+  len = rxauth_check(p_data, p->tot_len < sizeof(copy) ? p->tot_len : sizeof(copy));
+  result = len < 0 ? len : gp_decode(p_data, len, &item.frame);
+  pbuf_free(p);
+
+  if (len < 0)
+    return;
+  if (result != 0) {
+    rx_stats.bad++;
+    DLOG(DLOG_WARN, DLOG_BAD_FRAME, result, item.addr, 0, 0);
+    return;
+  }
+
+  item.frame.rx_time = rx_clock_ms();
+
+  // Discovery, clock sync, stats and subscribe requests never go near the application side
+  if (item.frame.type == GP_TYPE_DISCOVER) {
+    raw_announce(pcb, addr, port);
+    DLOG(DLOG_INFO, DLOG_DISCOVER, item.frame.device_id, item.addr, 0, 0);
+    return;
+  }
+  if (item.frame.type == GP_TYPE_TIME_REQ) {
+    raw_time(pcb, &item.frame, addr, port);
+    return;
+  }
+  if (item.frame.type == GP_TYPE_STATS_REQ) {
+    stats_request(item.addr, port, item.frame.seq);
+    return;
+  }
+  if (item.frame.type == GP_TYPE_SUBSCRIBE) {
+    pubsub_request(item.addr, port, &item.frame);
+    return;
+  }
+
+  // A sender the device table has no room for would only be dropped on the other side,
+  // so it gets no ACK and keeps its events (see device_room)
+  if (!device_room(item.frame.device_id)) {
+    DLOG(DLOG_WARN, DLOG_TABLE_FULL, item.frame.device_id, 0, 0, 0);
+    return;
+  }
+
+  item.cycles = xthal_get_ccount() - start;
+  if (xQueueSend(raw_rx_queue, &item, 0) != pdTRUE) {
+    rx_stats.overrun++;
+    return;
+  }
+
+  // Queued means delivered as far as the sender is concerned. We are already in the
+  // tcpip thread so we can answer with udp_sendto right here. A frame we had to drop
+  // gets no ACK and the sender will try again.
+  if (item.frame.flags & GP_FLAG_ACK_REQ)
+    raw_ack(pcb, &item.frame, addr, port);
+}
+
+// Set up the pcb. lwIP's raw API isn't thread safe so this runs in the tcpip thread
+// via tcpip_callback.
+static void raw_rx_setup(void *ctx)
+{
+  struct udp_pcb *pcb = udp_new();
+
+  if (pcb == NULL) {
+    ESP_LOGE(TAG, "Unable to create raw UDP pcb");
+    return;
+  }
+  if (udp_bind(pcb, IP_ADDR_ANY, GP_PORT) != ERR_OK) {
+    ESP_LOGE(TAG, "Raw UDP pcb unable to bind");
+    udp_remove(pcb);
+    return;
+  }
+  // Let the broadcast DISCOVER frames in
+  ip_set_option(pcb, SOF_BROADCAST);
+  udp_recv(pcb, raw_recv, NULL);
+  ESP_LOGI(TAG, "Raw UDP pcb bound, port %d", GP_PORT);
+}
+
+// Application side of the raw backend. Just like udp_server_task, this is a FreeRTOS
+// task function and must never return. See receiver_main.c for task creation.
+void raw_rx_task(void *pvParameters)
+{
+  raw_rx_item_t item;
+  uint32_t start;
+
+  rxhealth_watch("raw");
+  raw_rx_queue = xQueueCreate(RAW_RX_QUEUE_LEN, sizeof(raw_rx_item_t));
+  if (raw_rx_queue == NULL) {
+    ESP_LOGE(TAG, "Unable to create raw receive queue");
+    vTaskDelete(NULL);
+  }
+
+  tcpip_callback(raw_rx_setup, NULL);
+
+  // Wake up at least every timer wheel tick for the sender deadlines (device_alerts)
+  while (1) {
+    if (xQueueReceive(raw_rx_queue, &item, TW_TICK_MS / portTICK_PERIOD_MS) == pdTRUE) {
+      start = xthal_get_ccount();
+      process_frame(&item.frame, item.addr);
+      hist_add(&rx_stats.proc, item.cycles + (xthal_get_ccount() - start));
+    }
+    device_alerts();
+  }
+}
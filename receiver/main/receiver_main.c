@@ -17,9 +17,19 @@
 #include "esp_system.h"
 #include "esp_log.h"
 #include "nvs_flash.h"
+#include "esp_wifi.h"
 
 #include "setup.h"
+#include "garage_proto.h"
 #include "functions.h"
+#include "devices.h"
+#include "dlog.h"
+#include "evlog.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "pubsub.h"
+#include "httpd.h"
+#include "rxauth.h"
 
 // Define a character string for our log messsages
 const char *TAG = "Receiver";
@@ -28,6 +38,7 @@ void app_main()
 {
   esp_err_t ret;
   BaseType_t xTaskReturn;
+  uint8_t mac[6];
 
   // Initialize NVS. We use NVS to store our WiFi configuration. That way the configuration
   // can be preserved across system boots. We also do some error checking to ensure that
@@ -47,13 +58,89 @@ void app_main()
   // Configure and start the WiFi ... includes registering the event handler. See setup.c.
   wifi_init_sta();
 
+  // Our receiver id is the tail of the station MAC, the same thing the sender's soft-AP
+  // sees when we join or leave. Senders learn it from our ANNOUNCE frames.
+  esp_wifi_get_mac(WIFI_IF_STA, mac);
+  receiver_id = gp_mac_id(mac);
+  ESP_LOGI(TAG, "Receiver id %08x", receiver_id);
+
+  // Only senders with the key get to report (see rxauth.h). A bad key shuts them all
+  // out rather than letting everyone in.
+  rxauth_init(CONFIG_GP_AUTH_KEY);
+
+  // Start with an empty table of senders. See devices.c. Its deadlines run on the tick
+  // clock, like process_frame.
+  device_table_init(xTaskGetTickCount() * portTICK_PERIOD_MS);
+
+  // Open the door event log in its flash partition and rebuild the RAM index. See evlog.c.
+  // It is appended to and ticked on the tick clock, like the device table.
+  if (evlog_init(xTaskGetTickCount() * portTICK_PERIOD_MS) == 0) {
+    ESP_LOGI(TAG, "Event log ready, %u events", evlog_count());
+  } else {
+    ESP_LOGE(TAG, "No evlog partition, door events won't be kept");
+  }
+
+  // Start the deferred logging task. It runs at priority 1 so it only gets the CPU when
+  // the UDP server has nothing to do. Change the verbosity at runtime with dlog_set_level.
+  dlog_init(CONFIG_DLOG_LEVEL);
+  xTaskReturn = xTaskCreate(dlog_task,"dlog",3072,NULL,1,NULL);
+
+  if(xTaskReturn == pdPASS)
+  {
+    ESP_LOGI(TAG,"Deferred log task started\n");
+  }
+
+  // Latency histograms and the stats query endpoint (see stats.h). The answers go out
+  // from their own priority 1 task so asking never slows down the receive path.
+  stats_init();
+  xTaskReturn = xTaskCreate(stats_server_task,"stats",3072,NULL,1,NULL);
+
+  if(xTaskReturn == pdPASS)
+  {
+    ESP_LOGI(TAG,"Stats task started\n");
+  }
+
+  // Door state fan-out to local consumers (see pubsub.h), also at priority 1. The
+  // subscribers get their notifications a tick late, never a door event.
+  pubsub_init(rx_clock_ms());
+  xTaskReturn = xTaskCreate(pubsub_task,"pubsub",3072,NULL,1,NULL);
+
+  if(xTaskReturn == pdPASS)
+  {
+    ESP_LOGI(TAG,"Pubsub task started\n");
+  }
+
+  // Door state over HTTP (see httpd.h), priority 1 as well: a browser polling the
+  // status page gets a prerendered snapshot and never touches the receive path.
+  httpd_init();
+  xTaskReturn = xTaskCreate(httpd_task,"httpd",3072,NULL,1,NULL);
+
+  if(xTaskReturn == pdPASS)
+  {
+    ESP_LOGI(TAG,"Httpd task started\n");
+  }
+
   // Create a new FreeRTOS task and add to the task list. The associated function
-  // is udp_server_task (see above)) and we'll use 4096 words (NOT BYTES) for the 
-  // task stack.  Let's use priority 5 for this task. Remember, tasks are infinite
-  // loops; don't try to exit and don't try to return (but it is OK to delete the task).
+  // is udp_server_task (see above)) and we'll use 4096 bytes for the task stack
+  // (ESP-IDF counts stack depth in bytes, not words; gpstat -H shows how much of it
+  // every task has never touched, see rxhealth.h). Let's use priority 5 for this task.
+  // Remember, tasks are infinite loops; don't try to exit and don't try to return (but
+  // it is OK to delete the task).
   // See your above udp_server_task function for more details. Note that udp_server_task is 
   // located in functions.c. See functions.c for details on implementation of the UDP server.
+  // With the lwIP raw backend selected (see rawrx.c) we start raw_rx_task instead.
+  // With the pipeline (see pipeline.h) the socket loop only receives and the processing
+  // runs in pipeline_task on the other core. The network side gets the higher priority.
+#ifdef CONFIG_RECEIVER_BACKEND_RAW
+  xTaskReturn = xTaskCreate(raw_rx_task,"raw_rx",4096,NULL,5,NULL);
+#elif defined(CONFIG_RECEIVER_PIPELINE)
+  pipeline_init();
+  xTaskReturn = xTaskCreatePinnedToCore(pipeline_task,"pipeline",4096,NULL,5,NULL,PIPELINE_PROCESS_CORE);
+  if (xTaskReturn == pdPASS)
+    xTaskReturn = xTaskCreatePinnedToCore(udp_server_task,"udp_server",4096,NULL,6,NULL,PIPELINE_INGRESS_CORE);
+#else
   xTaskReturn = xTaskCreate(udp_server_task,"udp_server",4096,NULL,5,NULL);
+#endif
 
   if(xTaskReturn == pdPASS)
   {
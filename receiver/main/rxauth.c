@@ -0,0 +1,143 @@
+// rxauth.c
+// Frame authentication on the receive path (see rxauth.h). Please remember to add this
+// module to the CMakeLists.txt file or it won't get compiled and linked!
+
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "rxauth.h"
+
+#if (RXAUTH_TABLE_SIZE & (RXAUTH_TABLE_SIZE - 1)) != 0
+  #error "RXAUTH_TABLE_SIZE must be a power of two"
+#endif
+
+extern const char *TAG;
+
+// One sender we have had a good frame from
+typedef struct {
+  uint32_t device_id;             // 0 == free (device id 0 is reserved)
+  uint8_t key[GP_AUTH_KEY_LEN];   // derived from the master key (gp_auth_derive)
+  gp_replay_t replay;
+} rxauth_entry_t;
+
+rxauth_stats_t rxauth_stats;
+
+static uint8_t rxauth_master[GP_AUTH_KEY_LEN];
+static rxauth_entry_t rxauth_table[RXAUTH_TABLE_SIZE];
+
+// Same mixing as the device table (see devices.c)
+static inline uint32_t rxauth_hash(uint32_t device_id)
+{
+  return ((device_id * 0x9E3779B1u) >> 16) & (RXAUTH_TABLE_SIZE - 1);
+}
+
+// The slot for device_id, or the free slot it would go in, or NULL if the table is
+// full and it isn't there.
+static rxauth_entry_t *rxauth_find(uint32_t device_id)
+{
+  uint32_t i, index = rxauth_hash(device_id);
+  rxauth_entry_t *p_entry;
+
+  for (i = 0; i < RXAUTH_TABLE_SIZE; i++) {
+    p_entry = &rxauth_table[(index + i) & (RXAUTH_TABLE_SIZE - 1)];
+    if (p_entry->device_id == device_id || p_entry->device_id == 0)
+      return p_entry;
+  }
+  return NULL;
+}
+
+// Set the master key, 32 hex digits. An empty (or NULL) key turns checking off. A key
+// that doesn't parse turns it on with nothing able to pass, rather than quietly off.
+// Returns 0, or -1 for a bad key.
+int rxauth_init(const char *p_hex)
+{
+  memset(rxauth_table, 0, sizeof(rxauth_table));
+  memset(&rxauth_stats, 0, sizeof(rxauth_stats));
+
+  if (p_hex == NULL || p_hex[0] == '\0') {
+    rxauth_stats.mode = RXAUTH_OFF;
+    ESP_LOGW(TAG, "No frame authentication key, accepting unsigned reports");
+    return 0;
+  }
+  if (gp_auth_key(p_hex, rxauth_master) != 0) {
+    rxauth_stats.mode = RXAUTH_BROKEN;
+    ESP_LOGE(TAG, "Frame authentication key is not 32 hex digits, rejecting all reports");
+    return -1;
+  }
+  rxauth_stats.mode = RXAUTH_ON;
+  ESP_LOGI(TAG, "Frame authentication on");
+  return 0;
+}
+
+// Check a received datagram of len bytes before anything else looks at it. Returns the
+// length to decode (the auth trailer stripped), or GP_ERR_AUTH / GP_ERR_REPLAY to drop
+// it without another word. Only reports, batches and SUBSCRIBEs are checked; anything
+// else, and anything that isn't even ours, goes through as is for gp_decode to sort out.
+int rxauth_check(const uint8_t *p_buf, int len)
+{
+  rxauth_entry_t *p_entry;
+  uint8_t key[GP_AUTH_KEY_LEN];
+  uint32_t device_id, epoch, counter;
+  int n, at = 4;
+
+  if (rxauth_stats.mode == RXAUTH_OFF)
+    return len;
+  if (len < GP_HEADER_LEN || p_buf[0] != GP_MAGIC ||
+      (p_buf[2] != GP_TYPE_REPORT && p_buf[2] != GP_TYPE_BATCH && p_buf[2] != GP_TYPE_SUBSCRIBE))
+    return len;
+
+  if (rxauth_stats.mode == RXAUTH_BROKEN || !(p_buf[3] & GP_FLAG_AUTH)) {
+    rxauth_stats.plain++;
+    return GP_ERR_AUTH;
+  }
+  // A SUBSCRIBE has the consumer id after the lease, and it must not be a chip id: a
+  // sender's key doesn't get to move subscriptions (see garage_proto.h)
+  if (p_buf[2] == GP_TYPE_SUBSCRIBE)
+    at = 6;
+  // Id plus trailer at the very least, and id 0 is reserved
+  device_id = len >= at + 4 ? gp_get32(&p_buf[at]) : 0;
+  if (len < at + 4 + GP_AUTH_LEN || device_id == 0 || (at == 6 && device_id < GP_CONSUMER_ID_MIN)) {
+    rxauth_stats.forged++;
+    return GP_ERR_AUTH;
+  }
+
+  // Known senders have their key ready. For anyone else work it out, but only take a
+  // slot once the tag is good.
+  p_entry = rxauth_find(device_id);
+  if (p_entry != NULL && p_entry->device_id == device_id)
+    memcpy(key, p_entry->key, sizeof(key));
+  else
+    gp_auth_derive(rxauth_master, device_id, key);
+
+  n = gp_auth_verify(key, p_buf, len, &epoch, &counter);
+  if (n < 0) {
+    rxauth_stats.forged++;
+    return n;
+  }
+
+  if (p_entry == NULL) {
+    rxauth_stats.full++;
+    return GP_ERR_REPLAY;
+  }
+  if (p_entry->device_id != device_id) {
+    p_entry->device_id = device_id;
+    memcpy(p_entry->key, key, sizeof(key));
+    memset(&p_entry->replay, 0, sizeof(p_entry->replay));
+  }
+  if (gp_replay_check(&p_entry->replay, epoch, counter) != 0) {
+    rxauth_stats.replayed++;
+    return GP_ERR_REPLAY;
+  }
+
+  rxauth_stats.accepted++;
+  return n;
+}
+
+// Everything rxauth_check turned away, for the stats summary
+uint32_t rxauth_rejected(void)
+{
+  return rxauth_stats.forged + rxauth_stats.replayed + rxauth_stats.plain + rxauth_stats.full;
+}
@@ -0,0 +1,52 @@
+// rxauth.h
+// Receive side of frame authentication (see gpauth.h in common/). With a master key
+// configured (idf.py menuconfig, Receiver Configuration -> Frame authentication key)
+// every report and batch must carry a good tag from the sender it claims to be from,
+// and must not be a replay. So must every SUBSCRIBE (unsubscribing included), from the
+// consumer id in it, or anyone on the soft-AP could cut a consumer off or point
+// NOTIFY floods at somebody. Without a key everything gets in, like before.
+//
+// rxauth_check runs first thing on the receive path, before the frame is logged or
+// decoded, so a flood of forgeries costs one SipHash each (three for a device id we
+// haven't met) and a counter, never a DLOG record or a device table slot. What it
+// rejects only shows up in rxauth_stats and the stats summary page.
+//
+// Per sender (or consumer) we keep its derived key (so it is worked out once) and its
+// replay window, in an open addressed table of RXAUTH_TABLE_SIZE slots like the device
+// table. A slot
+// is only taken for a frame whose tag checked out, so forgeries with made up ids can't
+// fill it. When it is full, new senders are rejected: without a window we couldn't
+// tell a replay.
+//
+// The receive path (either backend, only one runs) is the only user, so no locking.
+
+#ifndef __RXAUTH__H
+
+  #define __RXAUTH__H
+
+  #include <stdint.h>
+  #include "gpauth.h"
+  #include "devices.h"
+
+  #define RXAUTH_TABLE_SIZE DEVICE_TABLE_SIZE
+
+  #define RXAUTH_OFF 0        // no key configured, nothing is checked
+  #define RXAUTH_ON 1
+  #define RXAUTH_BROKEN 2     // the configured key doesn't parse: reject, don't guess
+
+  typedef struct {
+    uint32_t mode;        // RXAUTH_*
+    uint32_t accepted;    // frames with a good tag
+    uint32_t forged;      // bad tag, or too short to have one
+    uint32_t replayed;    // good tag, seen it before (or too old to tell)
+    uint32_t plain;       // reports, batches and SUBSCRIBEs without GP_FLAG_AUTH
+    uint32_t full;        // good tag, but no room for another sender
+  } rxauth_stats_t;
+
+  extern rxauth_stats_t rxauth_stats;
+
+  int rxauth_init(const char *p_hex);
+  int rxauth_check(const uint8_t *p_buf, int len);
+  uint32_t rxauth_rejected(void);
+
+#endif
@@ -0,0 +1,69 @@
+// rxhealth.c
+// The receiver's own memory and stack figures (see rxhealth.h). Please remember to add
+// this module to the CMakeLists.txt file or it won't get compiled and linked!
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+
+#include "garage_proto.h"
+#include "functions.h"
+#include "rxhealth.h"
+
+// The tasks that called rxhealth_watch. Slots are claimed with an atomic add and the
+// handle goes in last, so a reader skips a slot that isn't filled in yet.
+typedef struct {
+  char name[4];
+  TaskHandle_t handle;
+} rxhealth_task_t;
+
+static rxhealth_task_t rxhealth_tasks[GP_HEALTH_STACKS];
+static uint32_t rxhealth_count;
+static uint32_t rxhealth_callback_us;
+
+// Called by a task function before its loop. More than GP_HEALTH_STACKS tasks and the
+// rest don't show up.
+void rxhealth_watch(const char *p_name)
+{
+  uint32_t slot = __atomic_fetch_add(&rxhealth_count, 1, __ATOMIC_RELAXED);
+
+  if (slot >= GP_HEALTH_STACKS)
+    return;
+  strncpy(rxhealth_tasks[slot].name, p_name, sizeof(rxhealth_tasks[slot].name));
+  __atomic_store_n(&rxhealth_tasks[slot].handle, xTaskGetCurrentTaskHandle(), __ATOMIC_RELEASE);
+}
+
+// How long a device_alerts pass took. Only the processing side calls this.
+void rxhealth_callback(uint32_t us)
+{
+  if (us > rxhealth_callback_us)
+    rxhealth_callback_us = us;
+}
+
+// Our HEALTH frame. Returns its length, or 0 if p_buf is too small.
+int rxhealth_encode(uint8_t *p_buf, size_t len)
+{
+  gp_health_t health;
+  TaskHandle_t handle;
+  uint32_t slot, unused;
+
+  health.device_id = receiver_id;
+  health.uptime_ms = rx_clock_ms();
+  health.heap_free = esp_get_free_heap_size();
+  health.heap_min = esp_get_minimum_free_heap_size();
+  health.vdd_mv = 0;
+  health.callback_us = rxhealth_callback_us > 0xffff ? 0xffff : rxhealth_callback_us;
+  rxhealth_callback_us = 0;
+
+  health.count = 0;
+  for (slot = 0; slot < GP_HEALTH_STACKS; slot++) {
+    if ((handle = __atomic_load_n(&rxhealth_tasks[slot].handle, __ATOMIC_ACQUIRE)) == NULL)
+      continue;
+    unused = uxTaskGetStackHighWaterMark(handle);
+    memcpy(health.stack[health.count].name, rxhealth_tasks[slot].name, sizeof(health.stack[0].name));
+    health.stack[health.count].unused = unused > 0xffff ? 0xffff : unused;
+    health.count++;
+  }
+  return gp_encode_health(&health, p_buf, len);
+}
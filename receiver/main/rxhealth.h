@@ -0,0 +1,26 @@
+// rxhealth.h
+// How close the receiver runs to the edge, so stacks and buffers can be sized from
+// data instead of guesses: free heap and the least there ever was
+// (esp_get_minimum_free_heap_size), every task's stack high water mark
+// (uxTaskGetStackHighWaterMark, bytes in ESP-IDF) and the longest device_alerts pass,
+// which is where our timer wheel callbacks run.
+//
+// Each task function calls rxhealth_watch with a short name as the first thing it does;
+// that is all it takes to show up. stats page GP_STATS_HEALTH answers with a HEALTH
+// frame (see garage_proto.h) built by rxhealth_encode, so gpstat -H shows it next to
+// what the senders report about themselves (gpstat -d). The longest callback is the
+// longest since the last time somebody asked.
+
+#ifndef __RXHEALTH__H
+
+  #define __RXHEALTH__H
+
+  #include <stdint.h>
+  #include <stddef.h>
+  #include "garage_proto.h"
+
+  void rxhealth_watch(const char *p_name);
+  void rxhealth_callback(uint32_t us);
+  int rxhealth_encode(uint8_t *p_buf, size_t len);
+
+#endif
@@ -11,7 +11,8 @@
 #include "esp_event.h"
 #include "esp_log.h"
 
-#include "functions.h"
+#include "setup.h"
+#include "wifimgr.h"
 
 // These are defined via the menuconfig. Use idf.py menuconfig
 #define EXAMPLE_ESP_WIFI_SSID CONFIG_ESP_WIFI_SSID
@@ -20,11 +21,12 @@
 // FreeRTOS event group to signal when we are connected
 EventGroupHandle_t s_wifi_event_group;
 
-// The event group allows multiple bits for each event, but we only care about two events:
-//   - We are connected to the AP with an IP
-//   - We failed to connect after the maximum amount of retries
+// The event group allows multiple bits for each event, but we only care about one: we
+// are connected to the AP with an IP. The connection manager (see wifimgr.h) never
+// gives up, so there is no "failed" bit any more; we just stop waiting for it after
+// WIFI_BOOT_WAIT_MS and let it carry on in the background.
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+#define WIFI_BOOT_WAIT_MS 10000
 
 extern const char *TAG;
 
@@ -60,10 +62,15 @@ void wifi_init_sta()
   wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
   ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
+  // Load the cached AP from NVS and get the connection manager ready before any events
+  // can arrive. See wifimgr_esp.c.
+  wifi_mgr_start();
+
   // Now let's register our event handler callback functions. Our event handler function is aptly named
-  // event_handler (see above static function). We are interested in the following events:
+  // event_handler (see wifimgr_esp.c). We are interested in the following events:
   //   - ESP_EVENT_ANY_ID: This is a "catch all" for alerting us to ANY of the various WIFI_EVENT events
   //   - IP_EVENT_STA_GOT_IP: The DHCP client on the ESP32 has received a valid IP address 
+  // They stay registered for good: the connection manager handles every disconnect.
   ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL));
 
@@ -87,26 +94,17 @@ void wifi_init_sta()
   ESP_ERROR_CHECK(esp_wifi_start() );
   ESP_LOGI(TAG, "Success wifi_init_sta finished!");
 
-  // Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-  // number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see functions.c)
+  // Wait (a while) for the first connection. The bit is set by event_handler() (see
+  // wifimgr_esp.c).
   EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-          WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+          WIFI_CONNECTED_BIT,
           pdFALSE,
           pdFALSE,
-          portMAX_DELAY);
+          WIFI_BOOT_WAIT_MS / portTICK_PERIOD_MS);
 
-  /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-   * happened. */
   if (bits & WIFI_CONNECTED_BIT) {
-      ESP_LOGI(TAG, "Connected to SSID:%s password:%s", EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
-  } else if (bits & WIFI_FAIL_BIT) {
-      ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s", EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
+      ESP_LOGI(TAG, "Connected to SSID:%s in %u ms", EXAMPLE_ESP_WIFI_SSID, wifi_mgr.boot_to_ip_ms);
   } else {
-      ESP_LOGE(TAG, "UNEXPECTED EVENT");
+      ESP_LOGW(TAG, "Not connected to SSID:%s yet, still trying", EXAMPLE_ESP_WIFI_SSID);
   }
-
-  // Clean up ... unregister the events and delete the event group
-  ESP_ERROR_CHECK(esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler));
-  ESP_ERROR_CHECK(esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler));
-  vEventGroupDelete(s_wifi_event_group);
 }
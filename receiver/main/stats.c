@@ -0,0 +1,225 @@
+// stats.c
+// Latency histograms and the stats query endpoint (see stats.h). Please remember to add
+// this module to the CMakeLists.txt file or it won't get compiled and linked!
+//
+// The request queue has the same discipline as dlog.c and pipeline.c: the receive path
+// (whichever backend) only ever writes head, stats_server_task only ever writes tail.
+// Requests are rare, so the producer simply notifies on every one it queues.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+#include "garage_proto.h"
+#include "devices.h"
+#include "functions.h"
+#include "rxauth.h"
+#include "rxhealth.h"
+#include "stats.h"
+
+// Longest stats_server_task sleeps without a notification. Only a safety net.
+#define STATS_IDLE_MS 1000
+
+extern const char *TAG;
+
+latency_stats_t latency_stats;
+
+// Who asked, and for which page
+typedef struct {
+  uint32_t addr;        // network byte order
+  uint16_t port;        // host byte order
+  uint16_t page;
+} stats_req_t;
+
+static stats_req_t stats_queue[STATS_QUEUE_LEN];
+static uint32_t stats_head;       // written by the receive path only
+static uint32_t stats_tail;       // written by stats_server_task only
+static TaskHandle_t stats_server;
+
+void stats_init(void)
+{
+  hist_init(&latency_stats.e2e);
+  hist_init(&latency_stats.sender);
+  hist_init(&latency_stats.network);
+  latency_stats.untimed = 0;
+  latency_stats.requests = 0;
+  latency_stats.dropped = 0;
+  stats_head = 0;
+  stats_tail = 0;
+}
+
+// later - earlier in ms. The two ends can come from clocks that only agree to within
+// the offset's error, so a small negative difference is just zero.
+static uint32_t stats_elapsed(uint32_t later, uint32_t earlier)
+{
+  int32_t elapsed = (int32_t)(later - earlier);
+
+  return elapsed < 0 ? 0 : (uint32_t)elapsed;
+}
+
+// A frame process_frame has applied to p_dev; result is what device_update returned
+// (it says which events were fresh). Runs on the processing side.
+void stats_trace(const gp_frame_t *p_frame, int result, device_t *p_dev)
+{
+  uint32_t e2e;
+  int known, i;
+
+  if (!(p_frame->flags & GP_FLAG_TRACE))
+    return;
+
+  // Receiver clock = sender clock + offset
+  known = p_frame->offset != GP_OFFSET_UNKNOWN;
+  if (known)
+    hist_add(&latency_stats.network, stats_elapsed(p_frame->rx_time, p_frame->tx_time + p_frame->offset));
+
+  // A heartbeat's timestamp is just when it was sent
+  if (p_frame->flags & GP_FLAG_HEARTBEAT)
+    return;
+
+  for (i = 0; i < p_frame->count; i++) {
+    if (!(result & (1 << (DEVICE_FRESH_SHIFT + i))))
+      continue;
+    hist_add(&latency_stats.sender, stats_elapsed(p_frame->tx_time, p_frame->event[i].timestamp));
+    if (!known) {
+      latency_stats.untimed++;
+      continue;
+    }
+    e2e = stats_elapsed(p_frame->rx_time, p_frame->event[i].timestamp + p_frame->offset);
+    hist_add(&latency_stats.e2e, e2e);
+    p_dev->latency_ms = e2e;
+    if (e2e > p_dev->latency_max_ms)
+      p_dev->latency_max_ms = e2e;
+  }
+}
+
+// Receive path: queue a request for stats_server_task. Never blocks. Returns 0, or -1
+// if the queue was full and the request was dropped.
+int stats_request(uint32_t addr, uint16_t port, uint16_t page)
+{
+  uint32_t head = stats_head;
+  stats_req_t *p_req;
+
+  if (head - __atomic_load_n(&stats_tail, __ATOMIC_ACQUIRE) >= STATS_QUEUE_LEN) {
+    latency_stats.dropped++;
+    return -1;
+  }
+
+  p_req = &stats_queue[head % STATS_QUEUE_LEN];
+  p_req->addr = addr;
+  p_req->port = port;
+  p_req->page = page;
+  __atomic_store_n(&stats_head, head + 1, __ATOMIC_RELEASE);
+
+  if (stats_server != NULL)
+    xTaskNotifyGive(stats_server);
+  return 0;
+}
+
+static void stats_put_hist(uint8_t *p, const hist_t *p_hist, int count)
+{
+  if (count) {
+    gp_put32(p, p_hist->count);
+    p += 4;
+  }
+  gp_put32(&p[0], hist_percentile(p_hist, 500));
+  gp_put32(&p[4], hist_percentile(p_hist, 990));
+  gp_put32(&p[8], p_hist->max);
+}
+
+// Build the answer for page. Returns its length, or 0 if p_buf is too small. The
+// counters are read on the fly without stopping anybody, so they can be a packet or
+// two out of step with each other.
+int stats_encode(uint16_t page, uint8_t *p_buf, size_t len)
+{
+  gp_frame_t header;
+  device_t *p_dev;
+  uint32_t slot;
+  int n = GP_STATS_HEADER_LEN;
+
+  if (len < GP_MAX_FRAME)
+    return 0;
+
+  if (page == GP_STATS_SUMMARY) {
+    gp_put32(&p_buf[8], receiver_id);
+    gp_put32(&p_buf[12], rx_clock_ms());
+    gp_put32(&p_buf[16], rx_stats.packets);
+    gp_put32(&p_buf[20], rx_stats.bad);
+    gp_put32(&p_buf[24], rx_stats.overrun);
+    gp_put32(&p_buf[28], device_count());
+    gp_put32(&p_buf[32], latency_stats.untimed);
+    stats_put_hist(&p_buf[STATS_OFF_E2E], &latency_stats.e2e, 1);
+    stats_put_hist(&p_buf[STATS_OFF_SENDER], &latency_stats.sender, 1);
+    stats_put_hist(&p_buf[STATS_OFF_NETWORK], &latency_stats.network, 1);
+    stats_put_hist(&p_buf[STATS_OFF_PROC], &rx_stats.proc, 0);
+    gp_put32(&p_buf[STATS_OFF_DROPPED], latency_stats.dropped);
+    gp_put32(&p_buf[STATS_OFF_SILENT], device_silent());
+    gp_put32(&p_buf[STATS_OFF_REJECTED], rxauth_rejected());
+    n = STATS_SUMMARY_LEN;
+    slot = GP_STATS_END;
+  } else if (page == GP_STATS_HEALTH) {
+    n += rxhealth_encode(&p_buf[n], len - n);
+    slot = GP_STATS_END;
+  } else {
+    // The next STATS_DEVICES_PER_PAGE devices from slot page on
+    for (slot = page; slot < DEVICE_TABLE_SIZE && n + STATS_DEVICE_LEN <= GP_MAX_FRAME; slot++) {
+      if ((p_dev = device_slot(slot)) == NULL)
+        continue;
+      gp_put32(&p_buf[n], p_dev->device_id);
+      gp_put32(&p_buf[n + 4], p_dev->packets);
+      gp_put32(&p_buf[n + 8], p_dev->lost);
+      gp_put32(&p_buf[n + 12], p_dev->dups);
+      gp_put32(&p_buf[n + 16], p_dev->reordered);
+      gp_put32(&p_buf[n + 20], p_dev->latency_max_ms);
+      gp_put32(&p_buf[n + 24], p_dev->heap_min);
+      gp_put16(&p_buf[n + 28], p_dev->stack_unused);
+      gp_put16(&p_buf[n + 30], p_dev->vdd_mv);
+      gp_put16(&p_buf[n + 32], p_dev->callback_us);
+      n += STATS_DEVICE_LEN;
+    }
+    if (slot >= DEVICE_TABLE_SIZE)
+      slot = GP_STATS_END;
+  }
+
+  header.type = GP_TYPE_STATS;
+  header.flags = 0;
+  header.seq = page;
+  header.device_id = slot;
+  gp_encode(&header, p_buf, len);
+  return n;
+}
+
+// Answers stats requests. This is a FreeRTOS task function and must never return. See
+// receiver_main.c for task creation; it runs at the same (lowest) priority as dlog_task.
+void stats_server_task(void *pvParameters)
+{
+  uint8_t tx_buffer[GP_MAX_FRAME];
+  struct sockaddr_in dest_addr;
+  stats_req_t *p_req;
+  uint32_t tail;
+  int sock, len;
+
+  // Not bound to GP_PORT (the receive path has that), any port will do for answers
+  sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Stats: unable to create socket: errno %d", errno);
+    vTaskDelete(NULL);
+  }
+  stats_server = xTaskGetCurrentTaskHandle();
+  rxhealth_watch("stat");
+
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, STATS_IDLE_MS / portTICK_PERIOD_MS);
+
+    for (tail = stats_tail; tail != __atomic_load_n(&stats_head, __ATOMIC_ACQUIRE); tail++) {
+      p_req = &stats_queue[tail % STATS_QUEUE_LEN];
+      len = stats_encode(p_req->page, tx_buffer, sizeof(tx_buffer));
+      dest_addr.sin_family = AF_INET;
+      dest_addr.sin_addr.s_addr = p_req->addr;
+      dest_addr.sin_port = htons(p_req->port);
+      __atomic_store_n(&stats_tail, tail + 1, __ATOMIC_RELEASE);
+      if (sendto(sock, tx_buffer, len, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) == len)
+        latency_stats.requests++;
+    }
+  }
+}
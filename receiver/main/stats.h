@@ -0,0 +1,84 @@
+// stats.h
+// Latency tracing and the stats query endpoint.
+//
+// Latency: senders timestamp every event when they first see the edge and stamp every
+// report and batch with its transmit time and their estimate of our clock (see
+// GP_FLAG_TRACE in garage_proto.h). process_frame hands each traced frame to
+// stats_trace, which fills three histograms, in milliseconds:
+//
+//   e2e      detection on the sender -> received here (needs the clock offset)
+//   sender   detection -> transmit: debounce, queueing while no receiver was around,
+//            retransmissions. Both ends on the sender's clock, so always available.
+//   network  transmit -> received here (needs the clock offset), heartbeats included
+//
+// Events from a sender that doesn't have an offset yet only make it into sender and
+// are counted in untimed. Dups never count; the first copy already did.
+//
+// Endpoint: a GP_TYPE_STATS_REQ to port 8266 gets a GP_TYPE_STATS answer (see
+// garage_proto.h). The receive path only drops the request into a small queue; the
+// answer is built and sent by stats_server_task at the lowest priority, from its own
+// socket, so a client polling us never holds up a door event. Requests that find the
+// queue full are dropped (UDP ... ask again).
+//
+// Summary page (GP_STATS_SUMMARY), offsets into the frame, all 32 bit:
+//
+//    8  receiver id          32  untimed events
+//   12  uptime (ms)          36  e2e latency: count, p50, p99, max (ms)
+//   16  packets              52  sender latency: count, p50, p99, max (ms)
+//   20  bad frames           68  network latency: count, p50, p99, max (ms)
+//   24  overruns             84  processing time: p50, p99, max (cycles, ns on the host)
+//   28  devices              96  stats requests dropped
+//                           100  devices silent right now (see devices.h)
+//                           104  frames rejected: forged, replayed, unsigned (rxauth.h)
+//
+// Device pages: up to STATS_DEVICES_PER_PAGE entries of STATS_DEVICE_LEN bytes from
+// offset 8, each device id, events, lost, dups, reordered and worst e2e latency (ms),
+// all 32 bit, then what its last HEALTH frame said: lowest free heap (32 bit), fewest
+// unused stack bytes, mV and longest timer callback (us), 16 bit each, all 0 if it
+// never sent one. The page number is the device table slot to start at; the answer's
+// next page is where to carry on.
+//
+// Health page (GP_STATS_HEALTH): the body is the receiver's own HEALTH frame, whole
+// (see rxhealth.h).
+
+#ifndef __STATS__H
+
+  #define __STATS__H
+
+  #include <stdint.h>
+  #include "hist.h"
+  #include "garage_proto.h"
+  #include "devices.h"
+
+  #define STATS_QUEUE_LEN 4
+
+  #define STATS_SUMMARY_LEN 108
+  #define STATS_OFF_E2E 36
+  #define STATS_OFF_SENDER 52
+  #define STATS_OFF_NETWORK 68
+  #define STATS_OFF_PROC 84
+  #define STATS_OFF_DROPPED 96
+  #define STATS_OFF_SILENT 100
+  #define STATS_OFF_REJECTED 104
+
+  #define STATS_DEVICE_LEN 34
+  #define STATS_DEVICES_PER_PAGE ((GP_MAX_FRAME - GP_STATS_HEADER_LEN) / STATS_DEVICE_LEN)
+
+  typedef struct {
+    hist_t e2e;
+    hist_t sender;
+    hist_t network;
+    uint32_t untimed;     // fresh events that came without a clock offset
+    uint32_t requests;    // stats requests answered
+    uint32_t dropped;     // stats requests dropped, queue full
+  } latency_stats_t;
+
+  extern latency_stats_t latency_stats;
+
+  void stats_init(void);
+  void stats_trace(const gp_frame_t *p_frame, int result, device_t *p_dev);
+  int stats_request(uint32_t addr, uint16_t port, uint16_t page);
+  int stats_encode(uint16_t page, uint8_t *p_buf, size_t len);
+  void stats_server_task(void *pvParameters);
+
+#endif
@@ -0,0 +1,131 @@
+// twheel.c
+// Hierarchical timer wheel (see twheel.h). Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked!
+//
+// The slots are singly linked lists with a back pointer to whatever points at each
+// timer (the slot head or the previous timer's next), so unlinking from anywhere is
+// O(1) without a doubly linked head per slot. Times are kept relative to tick_ms so
+// the wheel doesn't care when the millisecond clock wraps.
+
+#include <string.h>
+#include "twheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+
+static void tw_link(tw_timer_t **pp_head, tw_timer_t *p_timer)
+{
+  p_timer->next = *pp_head;
+  if (*pp_head != NULL)
+    (*pp_head)->pprev = &p_timer->next;
+  *pp_head = p_timer;
+  p_timer->pprev = pp_head;
+}
+
+static void tw_unlink(tw_timer_t *p_timer)
+{
+  *p_timer->pprev = p_timer->next;
+  if (p_timer->next != NULL)
+    p_timer->next->pprev = p_timer->pprev;
+  p_timer->next = NULL;
+  p_timer->pprev = NULL;
+}
+
+// Put a timer in its slot: the lowest level whose reach covers its expiry tick.
+// Anything already due goes into the slot that runs next.
+static void tw_place(tw_t *p_wheel, tw_timer_t *p_timer)
+{
+  uint32_t delta = p_timer->expires - p_wheel->tick;
+  uint32_t level;
+
+  if ((int32_t)delta < 0) {
+    p_timer->expires = p_wheel->tick;
+    delta = 0;
+  }
+  for (level = 0; level < TW_LEVELS - 1; level++) {
+    if (delta < (1u << (TW_SLOT_BITS * (level + 1))))
+      break;
+  }
+  tw_link(&p_wheel->slot[level][(p_timer->expires >> (TW_SLOT_BITS * level)) & TW_MASK], p_timer);
+}
+
+// Spread one slot of a higher level over the levels below it. Returns the slot index
+// so the caller knows whether this level wrapped too.
+static uint32_t tw_cascade(tw_t *p_wheel, uint32_t level)
+{
+  uint32_t index = (p_wheel->tick >> (TW_SLOT_BITS * level)) & TW_MASK;
+  tw_timer_t *p_timer, *p_list = p_wheel->slot[level][index];
+
+  p_wheel->slot[level][index] = NULL;
+  while ((p_timer = p_list) != NULL) {
+    p_list = p_timer->next;
+    p_timer->pprev = NULL;
+    tw_place(p_wheel, p_timer);
+    p_wheel->cascaded++;
+  }
+  return index;
+}
+
+// Run one tick: cascade where a level wrapped, then everything in the level 0 slot has
+// expired and moves to the expired list.
+static void tw_tick(tw_t *p_wheel)
+{
+  uint32_t level, index = p_wheel->tick & TW_MASK;
+  tw_timer_t *p_timer;
+
+  for (level = 1; index == 0 && level < TW_LEVELS; level++)
+    index = tw_cascade(p_wheel, level);
+
+  index = p_wheel->tick & TW_MASK;
+  while ((p_timer = p_wheel->slot[0][index]) != NULL) {
+    tw_unlink(p_timer);
+    tw_link(&p_wheel->expired, p_timer);
+  }
+  p_wheel->tick++;
+  p_wheel->tick_ms += TW_TICK_MS;
+}
+
+void tw_init(tw_t *p_wheel, uint32_t now_ms)
+{
+  memset(p_wheel, 0, sizeof(*p_wheel));
+  p_wheel->tick_ms = now_ms;
+}
+
+// Arm (or re-arm) a timer to fire at expires_ms. An armed timer is moved. O(1).
+void tw_arm(tw_t *p_wheel, tw_timer_t *p_timer, uint32_t expires_ms)
+{
+  int32_t delta = (int32_t)(expires_ms - p_wheel->tick_ms);
+  uint32_t ticks = delta > 0 ? ((uint32_t)delta + TW_TICK_MS - 1) / TW_TICK_MS : 0;
+
+  if (tw_armed(p_timer))
+    tw_unlink(p_timer);
+  else
+    p_wheel->pending++;
+  p_timer->expires = p_wheel->tick + (ticks > TW_MAX_TICKS ? TW_MAX_TICKS : ticks);
+  tw_place(p_wheel, p_timer);
+}
+
+void tw_cancel(tw_t *p_wheel, tw_timer_t *p_timer)
+{
+  if (!tw_armed(p_timer))
+    return;
+  tw_unlink(p_timer);
+  p_wheel->pending--;
+}
+
+// Bring the wheel up to now_ms and hand out one expired timer (no longer armed), or
+// NULL when there are none left. Call it in a loop; the timers may be re-armed or left
+// alone as the caller likes.
+tw_timer_t *tw_expire(tw_t *p_wheel, uint32_t now_ms)
+{
+  tw_timer_t *p_timer;
+
+  while ((int32_t)(now_ms - p_wheel->tick_ms) >= 0)
+    tw_tick(p_wheel);
+
+  if ((p_timer = p_wheel->expired) == NULL)
+    return NULL;
+  tw_unlink(p_timer);
+  p_wheel->pending--;
+  p_wheel->fired++;
+  return p_timer;
+}
@@ -0,0 +1,62 @@
+// twheel.h
+// Hierarchical timer wheel. The receiver keeps a couple of deadlines per sender (it
+// went silent, its door has been open too long) and re-arms one on nearly every packet,
+// so arming, cancelling and expiring all have to cost the same with 10 senders or
+// 10,000: no sorted list, no heap, no walk over the device table.
+//
+// Time moves in TW_TICK_MS ticks. TW_LEVELS wheels of TW_SLOTS slots each: level 0 has
+// a slot per tick, level 1 a slot per TW_SLOTS ticks and so on. A timer goes into the
+// slot for its expiry tick on the lowest level that reaches that far (O(1)). Each tick
+// the wheel empties the current level 0 slot; when level 0 wraps, the next slot of
+// level 1 is spread over level 0 (a cascade), and so on up. A timer is moved at most
+// once per level over its life, so the cost per tick is constant plus the timers that
+// expire. Timers fire at most one tick late and never early.
+//
+// The timers are embedded in the caller's own structs (intrusive lists), so there is no
+// allocation either. Not thread safe: one task owns a wheel.
+//
+// Like wifimgr.c this file and twheel.c make no ESP-IDF calls; host/twbench.c drives
+// them on Linux.
+
+#ifndef __TWHEEL__H
+
+  #define __TWHEEL__H
+
+  #include <stdint.h>
+
+  #define TW_TICK_MS 100
+  #define TW_SLOT_BITS 6
+  #define TW_SLOTS (1 << TW_SLOT_BITS)
+  #define TW_LEVELS 4
+
+  // Furthest a timer can be set, in ticks (about 19 days). Anything longer is clamped
+  // and fires early, so keep deadlines shorter.
+  #define TW_MAX_TICKS ((1u << (TW_SLOT_BITS * TW_LEVELS)) - 1)
+
+  typedef struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer **pprev;  // whatever points at us, NULL if not armed
+    uint32_t expires;         // tick
+  } tw_timer_t;
+
+  typedef struct {
+    uint32_t tick;            // next tick to run
+    uint32_t tick_ms;         // the time tick stands for
+    tw_timer_t *slot[TW_LEVELS][TW_SLOTS];
+    tw_timer_t *expired;      // fired, waiting for tw_expire to hand them out
+    uint32_t pending;         // timers armed
+    uint32_t fired;           // timers that expired
+    uint32_t cascaded;        // timers moved down a level
+  } tw_t;
+
+  void tw_init(tw_t *p_wheel, uint32_t now_ms);
+  void tw_arm(tw_t *p_wheel, tw_timer_t *p_timer, uint32_t expires_ms);
+  void tw_cancel(tw_t *p_wheel, tw_timer_t *p_timer);
+  tw_timer_t *tw_expire(tw_t *p_wheel, uint32_t now_ms);
+
+  static inline int tw_armed(const tw_timer_t *p_timer)
+  {
+    return p_timer->pprev != NULL;
+  }
+
+#endif
@@ -0,0 +1,157 @@
+// wifimgr.c
+// WiFi connection manager state machine. Please remember to add this module to the
+// CMakeLists.txt file or it won't get compiled and linked! See wifimgr.h.
+
+#include <string.h>
+
+#include "wifimgr.h"
+
+// xorshift32. Good enough to spread retries, and repeatable from a seed for the tests.
+static uint32_t wm_random(wm_t *p_wm)
+{
+  uint32_t x = p_wm->rand;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  p_wm->rand = x;
+  return x;
+}
+
+// How long to wait before attempt number p_wm->attempt. The first one (attempt 0) goes
+// straight away, then WM_BACKOFF_MIN_MS doubling up to WM_BACKOFF_MAX_MS. Half of that
+// is fixed and half is random.
+static uint32_t wm_backoff(wm_t *p_wm)
+{
+  uint32_t delay = WM_BACKOFF_MIN_MS;
+  uint32_t i;
+
+  if (p_wm->attempt == 0)
+    return 0;
+  for (i = 1; i < p_wm->attempt && delay < WM_BACKOFF_MAX_MS; i++)
+    delay *= 2;
+  if (delay > WM_BACKOFF_MAX_MS)
+    delay = WM_BACKOFF_MAX_MS;
+  return delay / 2 + wm_random(p_wm) % (delay / 2 + 1);
+}
+
+// Start an attempt: fast path if we have a cached AP that hasn't let us down too often.
+static int wm_connect(wm_t *p_wm)
+{
+  p_wm->state = WM_CONNECTING;
+  p_wm->attempts++;
+  p_wm->fast = p_wm->ap.valid && p_wm->fast_fails < WM_FAST_MAX_FAILS;
+  return p_wm->fast ? WM_CONNECT_FAST : WM_CONNECT_SCAN;
+}
+
+// p_cache is what NVS had (or NULL). seed only has to differ between receivers.
+void wm_init(wm_t *p_wm, const wm_ap_t *p_cache, uint32_t seed)
+{
+  memset(p_wm, 0, sizeof(*p_wm));
+  if (p_cache != NULL && p_cache->valid)
+    p_wm->ap = *p_cache;
+  p_wm->rand = seed ? seed : 1;
+}
+
+// The driver is up. Returns the first connect action.
+int wm_start(wm_t *p_wm, uint32_t now_ms)
+{
+  p_wm->start_ms = now_ms;
+  return wm_connect(p_wm);
+}
+
+// We associated with bssid on channel. Returns WM_SAVE_CACHE if that's news.
+int wm_associated(wm_t *p_wm, const uint8_t *p_bssid, uint8_t channel, uint32_t now_ms)
+{
+  int action = 0;
+
+  p_wm->state = WM_ASSOCIATED;
+  if (p_wm->fast)
+    p_wm->fast_hits++;
+  p_wm->fast_fails = 0;
+
+  if (!p_wm->ap.valid || p_wm->ap.channel != channel || memcmp(p_wm->ap.bssid, p_bssid, 6) != 0) {
+    p_wm->ap.valid = 1;
+    p_wm->ap.channel = channel;
+    memcpy(p_wm->ap.bssid, p_bssid, 6);
+    action = WM_SAVE_CACHE;
+  }
+  return action;
+}
+
+// DHCP gave us an address. Work out how long it took.
+int wm_got_ip(wm_t *p_wm, uint32_t now_ms)
+{
+  uint32_t took;
+
+  p_wm->state = WM_ONLINE;
+  p_wm->attempt = 0;
+
+  if (p_wm->boot_to_ip_ms == 0)
+    p_wm->boot_to_ip_ms = (now_ms - p_wm->start_ms) ? now_ms - p_wm->start_ms : 1;
+
+  if (p_wm->down_ms) {
+    took = now_ms - p_wm->down_ms;
+    p_wm->recover_ms = took;
+    if (took > p_wm->recover_max_ms)
+      p_wm->recover_max_ms = took;
+    p_wm->down_ms = 0;
+  }
+  return 0;
+}
+
+// The driver says we are disconnected. That is either a working link going away or an
+// attempt failing; either way we back off (see wm_wait) and try again. Returns
+// WM_CLEAR_CACHE if the fast path has failed once too often.
+int wm_disconnected(wm_t *p_wm, uint32_t now_ms)
+{
+  int action = 0;
+
+  switch (p_wm->state) {
+
+    case WM_ONLINE:
+      // Lost a working link. The first retry is immediate and uses the fast path.
+      p_wm->disconnects++;
+      p_wm->down_ms = now_ms ? now_ms : 1;
+      p_wm->attempt = 0;
+      break;
+
+    case WM_CONNECTING:
+    case WM_ASSOCIATED:
+      // An attempt failed (or DHCP never came)
+      p_wm->attempt++;
+      if (p_wm->fast && p_wm->state == WM_CONNECTING) {
+        p_wm->fast_misses++;
+        if (++p_wm->fast_fails >= WM_FAST_MAX_FAILS && p_wm->ap.valid) {
+          p_wm->ap.valid = 0;
+          action = WM_CLEAR_CACHE;
+        }
+      }
+      break;
+
+    default:
+      // Already backing off (the driver can report twice) or not started
+      return 0;
+  }
+
+  p_wm->state = WM_BACKOFF;
+  p_wm->retry_at_ms = now_ms + wm_backoff(p_wm);
+  return action;
+}
+
+// Milliseconds until wm_retry has something to do (0 == now). Only meaningful in
+// WM_BACKOFF.
+uint32_t wm_wait(const wm_t *p_wm, uint32_t now_ms)
+{
+  if (p_wm->state != WM_BACKOFF || (int32_t)(p_wm->retry_at_ms - now_ms) <= 0)
+    return 0;
+  return p_wm->retry_at_ms - now_ms;
+}
+
+// The backoff timer fired. Returns the connect action, or 0 if it isn't time yet.
+int wm_retry(wm_t *p_wm, uint32_t now_ms)
+{
+  if (p_wm->state != WM_BACKOFF || wm_wait(p_wm, now_ms) != 0)
+    return 0;
+  return wm_connect(p_wm);
+}
@@ -0,0 +1,92 @@
+// wifimgr.h
+// WiFi connection manager for the receiver. It keeps the station connected for as long
+// as the receiver runs:
+//
+//   - Fast path: the channel and BSSID of the last AP we got an IP from are cached in
+//     NVS. The first attempt after boot or after losing the link goes straight to that
+//     AP on that channel instead of scanning every channel. If the fast path fails
+//     WM_FAST_MAX_FAILS times in a row the cache is dropped and we scan.
+//   - Backoff: the first reconnect after losing the link is immediate. Every failed
+//     attempt after that doubles the wait, from WM_BACKOFF_MIN_MS up to
+//     WM_BACKOFF_MAX_MS, with jitter (half fixed, half random) so a room full of
+//     receivers doesn't hammer the AP in lock step after it reboots. There is no retry
+//     limit.
+//   - Metrics: boot to first IP, and disconnect to IP again for every outage.
+//
+// This file and wifimgr.c are only the state machine: events in, actions out, no
+// ESP-IDF calls, so the host build can drive it through scenarios (see host/wifisim.c).
+// wifimgr_esp.c wires it to the WiFi driver, NVS and a timer.
+
+#ifndef __WIFIMGR__H
+
+  #define __WIFIMGR__H
+
+  #include <stdint.h>
+  #include "sdkconfig.h"
+
+  #ifdef CONFIG_WIFI_BACKOFF_MIN_MS
+    #define WM_BACKOFF_MIN_MS CONFIG_WIFI_BACKOFF_MIN_MS
+  #else
+    #define WM_BACKOFF_MIN_MS 250
+  #endif
+
+  #ifdef CONFIG_WIFI_BACKOFF_MAX_MS
+    #define WM_BACKOFF_MAX_MS CONFIG_WIFI_BACKOFF_MAX_MS
+  #else
+    #define WM_BACKOFF_MAX_MS 30000
+  #endif
+
+  #define WM_FAST_MAX_FAILS 2
+
+  // States
+  #define WM_IDLE 0           // not started
+  #define WM_CONNECTING 1     // esp_wifi_connect called, waiting to associate
+  #define WM_ASSOCIATED 2     // associated, waiting for DHCP
+  #define WM_ONLINE 3         // we have an IP
+  #define WM_BACKOFF 4        // waiting for the next attempt (see wm_wait)
+
+  // Actions, returned as a bit mask by the wm_* event functions
+  #define WM_CONNECT_FAST 0x01  // connect to the cached BSSID on the cached channel
+  #define WM_CONNECT_SCAN 0x02  // connect to the SSID, full scan
+  #define WM_SAVE_CACHE 0x04    // store p_wm->ap in NVS
+  #define WM_CLEAR_CACHE 0x08   // forget the stored AP
+
+  // What we cache about the AP
+  typedef struct {
+    uint8_t valid;
+    uint8_t channel;
+    uint8_t bssid[6];
+  } wm_ap_t;
+
+  typedef struct {
+    uint8_t state;
+    uint8_t fast;               // the current attempt uses the cached AP
+    uint8_t fast_fails;         // fast path attempts that failed in a row
+    wm_ap_t ap;                 // cached AP
+    uint32_t attempt;           // failed attempts since we were last online
+    uint32_t retry_at_ms;       // end of the backoff
+    uint32_t rand;              // jitter PRNG state
+    uint32_t down_ms;           // when we lost the link (0 == never had it)
+    uint32_t boot_to_ip_ms;     // wm_start -> first IP, 0 until then
+    uint32_t recover_ms;        // disconnect -> IP, last outage
+    uint32_t recover_max_ms;    // worst outage
+    uint32_t start_ms;
+    uint32_t disconnects;       // times we lost a working link
+    uint32_t attempts;          // connection attempts
+    uint32_t fast_hits;         // attempts that got in via the fast path
+    uint32_t fast_misses;       // fast path attempts that failed
+  } wm_t;
+
+  void wm_init(wm_t *p_wm, const wm_ap_t *p_cache, uint32_t seed);
+  int wm_start(wm_t *p_wm, uint32_t now_ms);
+  int wm_associated(wm_t *p_wm, const uint8_t *p_bssid, uint8_t channel, uint32_t now_ms);
+  int wm_got_ip(wm_t *p_wm, uint32_t now_ms);
+  int wm_disconnected(wm_t *p_wm, uint32_t now_ms);
+  uint32_t wm_wait(const wm_t *p_wm, uint32_t now_ms);
+  int wm_retry(wm_t *p_wm, uint32_t now_ms);
+
+  // wifimgr_esp.c
+  extern wm_t wifi_mgr;
+  void wifi_mgr_start(void);
+
+#endif
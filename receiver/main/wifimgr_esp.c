@@ -0,0 +1,165 @@
+// wifimgr_esp.c
+// ESP-IDF side of the WiFi connection manager (see wifimgr.h). Please remember to add
+// this module to the CMakeLists.txt file or it won't get compiled and linked!
+//
+// event_handler feeds WiFi and IP events to the state machine and carries out what it
+// asks for: connect (fast path or full scan), store or forget the cached AP in NVS. A
+// one shot esp_timer runs the backoff. The handlers stay registered for the life of the
+// receiver so every disconnect is handled, not just the ones during wifi_init_sta.
+//
+// The event loop task and the esp_timer task both drive the state machine, so every
+// call into it holds wm_lock.
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "wifimgr.h"
+
+// NVS namespace and key of the cached AP
+#define WM_NVS_NAMESPACE "wifimgr"
+#define WM_NVS_KEY "ap"
+
+// These macros are defined in setup.c. Redefine here for event_handler.
+#define WIFI_CONNECTED_BIT BIT0
+
+extern const char *TAG;
+extern EventGroupHandle_t s_wifi_event_group;
+
+wm_t wifi_mgr;
+
+static SemaphoreHandle_t wm_lock;
+static esp_timer_handle_t wm_timer;
+
+// Milliseconds since reset
+static uint32_t wm_now(void)
+{
+  return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+// Read the cached AP. Anything odd (first boot, old layout) just means no cache.
+static void wm_cache_load(wm_ap_t *p_ap)
+{
+  nvs_handle_t handle;
+  size_t len = sizeof(*p_ap);
+
+  memset(p_ap, 0, sizeof(*p_ap));
+  if (nvs_open(WM_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    return;
+  if (nvs_get_blob(handle, WM_NVS_KEY, p_ap, &len) != ESP_OK || len != sizeof(*p_ap))
+    p_ap->valid = 0;
+  nvs_close(handle);
+}
+
+static void wm_cache_store(const wm_ap_t *p_ap)
+{
+  nvs_handle_t handle;
+
+  if (nvs_open(WM_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    return;
+  if (nvs_set_blob(handle, WM_NVS_KEY, p_ap, sizeof(*p_ap)) == ESP_OK)
+    nvs_commit(handle);
+  nvs_close(handle);
+}
+
+// Do what the state machine asked for. Called with wm_lock held.
+static void wm_act(int action)
+{
+  wifi_config_t config;
+
+  if (action & (WM_SAVE_CACHE | WM_CLEAR_CACHE))
+    wm_cache_store(&wifi_mgr.ap);
+
+  if (action & (WM_CONNECT_FAST | WM_CONNECT_SCAN)) {
+    esp_wifi_get_config(ESP_IF_WIFI_STA, &config);
+    if (action & WM_CONNECT_FAST) {
+      // Straight to the AP we know, on its channel ... no scan of the other 12
+      config.sta.bssid_set = true;
+      memcpy(config.sta.bssid, wifi_mgr.ap.bssid, 6);
+      config.sta.channel = wifi_mgr.ap.channel;
+      config.sta.scan_method = WIFI_FAST_SCAN;
+    } else {
+      config.sta.bssid_set = false;
+      config.sta.channel = 0;
+      config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    }
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &config);
+    esp_wifi_connect();
+  }
+}
+
+// Backoff timer ... runs in the esp_timer task.
+static void wm_timer_callback(void *arg)
+{
+  xSemaphoreTake(wm_lock, portMAX_DELAY);
+  wm_act(wm_retry(&wifi_mgr, wm_now()));
+  xSemaphoreGive(wm_lock);
+}
+
+// This is our event handler function. We use it to catch WiFi and IP events on the
+// default event loop and hand them to the connection manager. See setup.c for where
+// it is registered.
+void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  wifi_event_sta_connected_t *p_connected;
+  ip_event_got_ip_t *p_got_ip;
+  uint32_t now = wm_now();
+  uint32_t wait;
+
+  xSemaphoreTake(wm_lock, portMAX_DELAY);
+
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+    // Boot to IP is measured from reset, not from here
+    wm_act(wm_start(&wifi_mgr, 0));
+    ESP_LOGI(TAG, "Connecting (%s)", wifi_mgr.fast ? "cached AP" : "scan");
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+    p_connected = (wifi_event_sta_connected_t *)event_data;
+    wm_act(wm_associated(&wifi_mgr, p_connected->bssid, p_connected->channel, now));
+    ESP_LOGI(TAG, "Associated, channel %d", p_connected->channel);
+  } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    wm_act(wm_disconnected(&wifi_mgr, now));
+    wait = wm_wait(&wifi_mgr, now);
+    // esp_timer won't take a zero timeout ... 1 ms is as good as immediate
+    esp_timer_stop(wm_timer);
+    esp_timer_start_once(wm_timer, (uint64_t)(wait ? wait : 1) * 1000);
+    ESP_LOGI(TAG, "Disconnected (reason %d), attempt %u in %u ms",
+             ((wifi_event_sta_disconnected_t *)event_data)->reason, wifi_mgr.attempt, wait);
+  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+    p_got_ip = (ip_event_got_ip_t *)event_data;
+    wm_got_ip(&wifi_mgr, now);
+    ESP_LOGI(TAG, "Got IP: %s, boot to IP %u ms, last outage %u ms (worst %u ms), %u disconnects",
+             ip4addr_ntoa(&p_got_ip->ip_info.ip), wifi_mgr.boot_to_ip_ms, wifi_mgr.recover_ms,
+             wifi_mgr.recover_max_ms, wifi_mgr.disconnects);
+    xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+  }
+
+  xSemaphoreGive(wm_lock);
+}
+
+// Load the cached AP and get the state machine, its lock and its timer ready. Call
+// before the event handlers are registered (see wifi_init_sta).
+void wifi_mgr_start(void)
+{
+  wm_ap_t cache;
+  const esp_timer_create_args_t timer_args = {
+    .callback = wm_timer_callback,
+    .name = "wifimgr"
+  };
+
+  wm_cache_load(&cache);
+  wm_init(&wifi_mgr, &cache, esp_random());
+  wm_lock = xSemaphoreCreateMutex();
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &wm_timer));
+
+  if (cache.valid)
+    ESP_LOGI(TAG, "Cached AP %02x:%02x:%02x:%02x:%02x:%02x channel %d", cache.bssid[0], cache.bssid[1],
+             cache.bssid[2], cache.bssid[3], cache.bssid[4], cache.bssid[5], cache.channel);
+}
@@ -1,39 +1,110 @@
 #include "c_types.h"
+#include "ets_sys.h"
 #include "eagle_soc.h"
 #include "gpio.h"
 #include "osapi.h"
 #include "ip_addr.h"
 #include "espconn.h"
+#include "user_interface.h"
 #include "user_config.h"
+#include "garage_proto.h"
+#include "reliable.h"
+#include "evqueue.h"
+#include "discovery.h"
+#include "clksync.h"
+#include "heartbeat.h"
+#include "gpauth.h"
 #include "debug.h"
 
-// Create UDP function. This is where we finalize our UDP connection block
-// with the desination IP and port. Then we create the client UDP connection.
+// Debounce state for the door pin. Edges come in from gpio_intr_handler; see user_main.c
+// for the timer that confirms them.
+debounce_t door_debounce;
+
+// Changes waiting to be delivered (see evqueue.h) and reliable delivery of the frame
+// in flight (see reliable.h). We keep a copy of that frame so the retransmit timer can
+// send it again byte for byte.
+evq_t report_queue;
+rel_t report_rel;
+LOCAL os_timer_t retransmit_timer;
+LOCAL struct espconn *p_report_espconn;
+LOCAL uint8_t inflight_buffer[GP_MAX_FRAME];
+LOCAL int inflight_len;
+
+// The receivers we know about (see discovery.h). DISCOVER broadcasts go out from
+// discover_timer while we don't know one, and for a few rounds after a station joins.
+disc_t receivers;
+LOCAL os_timer_t discover_timer;
+LOCAL uint8 discover_left;
+
+// Our estimate of the current receiver's clock (see clksync.h). Every report and batch
+// carries it in its trace trailer so the receiver can measure end to end latency.
+clk_t receiver_clock;
+
+// Heartbeat policy (see heartbeat.h). user_main.c owns the timer; every frame we send
+// carries the interval so the receiver knows when to expect the next one.
+hb_t heartbeat;
+
+// Our signing key, epoch and counter (see gpauth.h and setup_auth), and what the last
+// signature cost in CPU cycles. Nothing is signed unless AUTH_KEY is defined.
+gp_auth_t report_auth;
+LOCAL uint32 auth_cycles;
+LOCAL uint32 auth_cycles_max;
+
+// Set on every change frame until the receiver has acknowledged one, so it knows our
+// sequence numbers started over.
+LOCAL uint8 boot_flag = GP_FLAG_BOOT;
+
+// Our millisecond clock (see clock_ms)
+LOCAL uint32 clock_last_us;
+LOCAL uint32 clock_us;
+LOCAL uint32 clock_total_ms;
+
+// Milliseconds since boot. system_get_time() counts microseconds in 32 bits, so
+// system_get_time() / 1000 jumps back to 0 after 4294967 ms (71 minutes) and every
+// "now - then" across that goes wrong. Instead we add up the microseconds since the last
+// call and carry the whole milliseconds over, so this one wraps at 2^32 ms like the
+// receiver's clock and unsigned subtraction works across it. It has to be called at least
+// once every 71 minutes to see every wrap of system_get_time(); each heartbeat calls it,
+// and gptune can't stretch those past an hour. The GPIO interrupt calls it too, hence IRAM
+// and the interrupts off while we update.
+uint32 clock_ms(void)
+{
+  uint32 now, ms;
+
+  ETS_INTR_LOCK();
+  now = system_get_time();
+  clock_us += now - clock_last_us;
+  clock_last_us = now;
+  clock_total_ms += clock_us / 1000;
+  clock_us %= 1000;
+  ms = clock_total_ms;
+  ETS_INTR_UNLOCK();
+  return ms;
+}
+
+// Create UDP function. This is where we finalize our UDP connection block and create
+// the client UDP connection. There is no fixed destination: we find receivers with a
+// DISCOVER broadcast (see discover_function) and point the connection at the current
+// one right before each send (see receiver_target).
 void ICACHE_FLASH_ATTR create_udp(struct espconn *p_espconn)
 {
   sint16 result = 0;
 
-  const char udp_remoteip[4] = {192,168,4,2};
-  os_memcpy(p_espconn->proto.udp->remote_ip, udp_remoteip, 4);
-  p_espconn->proto.udp->remote_port = 8266;
+  const char udp_broadcast[4] = {255,255,255,255};
+  os_memcpy(p_espconn->proto.udp->remote_ip, udp_broadcast, 4);
+  p_espconn->proto.udp->remote_port = GP_PORT;
+  p_report_espconn = p_espconn;
+
+  // Boot to first delivered report is measured from 0, i.e. from reset
+  disc_init(&receivers, 0);
+  clk_init(&receiver_clock, 0);
 
   // Create the UDP connection
   result = espconn_create(p_espconn);
 
   #ifdef DEBUG_ON
     os_printf("espconn create status: %d\n", result);
-  #endif
-
-  // Let's create a pointer to our esp_udp structure so we can more succinctly
-  // parse the individual elements of our remote IP array.
-
-  esp_udp *p_udp;
-  p_udp = p_espconn->proto.udp;
-
-  // Now use our new pointer to write the debug information
-  #ifdef DEBUG_ON
-    os_printf("Remote IP: %d.%d.%d.%d\n", p_udp->remote_ip[0],p_udp->remote_ip[1],p_udp->remote_ip[2],p_udp->remote_ip[3]);
-    os_printf("Remote port: %d\n", p_udp->remote_port);
+    os_printf("Looking for receivers on port %d\n", p_espconn->proto.udp->remote_port);
   #endif
 
   // Register our callbacks
@@ -48,37 +119,360 @@ void ICACHE_FLASH_ATTR create_udp(struct espconn *p_espconn)
 
 }
 
-// Poll function ... read the status of GPIO2 and send the status via UDP.
-// Note that counter is static to preserve the variable over multiple function
-// calls.
-void ICACHE_FLASH_ATTR poll_function (struct espconn *p_espconn) {
-  sint16 result = 0;
-  uint8 level;
-  static uint32 counter = 0;
-  char buffer[2048];
+// GPIO interrupt handler. Keep this short ... acknowledge the interrupt, note the edge
+// (any door, the debouncer sorts out which) and post to the door task (see
+// user_main.c) which does the real work outside of interrupt context. No
+// ICACHE_FLASH_ATTR here; interrupt handlers belong in IRAM.
+void gpio_intr_handler(void *arg)
+{
+  uint32 gpio_status;
 
-  os_memset(buffer, 0, sizeof(buffer));
+  gpio_status = GPIO_REG_READ(GPIO_STATUS_ADDRESS);
+  GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, gpio_status);
 
-  level = GPIO_INPUT_GET(GPIO_ID_PIN(2));
+  if (gpio_status & DOOR_PINS) {
+    debounce_edge(&door_debounce, clock_ms());
+    system_os_post(DOOR_TASK_PRIO, 0, 0);
+  }
+}
+
+// Point the connection at the current receiver. Returns 0 if we don't know one yet.
+// A clock offset only holds for the receiver it was measured against, so a new one
+// starts from scratch.
+int ICACHE_FLASH_ATTR receiver_target(struct espconn *p_espconn)
+{
+  const disc_entry_t *p_rx = disc_current(&receivers);
+
+  if (p_rx == NULL)
+    return 0;
+  os_memcpy(p_espconn->proto.udp->remote_ip, p_rx->ip, 4);
+  p_espconn->proto.udp->remote_port = GP_PORT;
+  if (p_rx->id != receiver_clock.receiver)
+    clk_init(&receiver_clock, p_rx->id);
+  return 1;
+}
+
+// Ask the current receiver for its clock if clk_due says so (see clksync.h). The
+// answer comes back in receive_callback.
+LOCAL void ICACHE_FLASH_ATTR clock_sync(struct espconn *p_espconn)
+{
+  uint8_t buffer[GP_TIME_REQ_LEN];
+  uint32 now = clock_ms();
+  gp_frame_t frame;
+  int len;
+
+  if (!receiver_target(p_espconn) || !clk_due(&receiver_clock, now))
+    return;
+
+  frame.type = GP_TYPE_TIME_REQ;
+  frame.flags = 0;
+  frame.device_id = system_get_chip_id();
+  frame.seq = clk_request(&receiver_clock, now);
+  len = gp_encode(&frame, buffer, sizeof(buffer));
+  espconn_sendto(p_espconn, buffer, len);
+}
+
+// Broadcast a DISCOVER on the soft-AP subnet. Every receiver that hears it answers
+// with an ANNOUNCE (see receive_callback).
+void ICACHE_FLASH_ATTR discover_send(struct espconn *p_espconn)
+{
+  const char udp_broadcast[4] = {255,255,255,255};
+  uint8_t buffer[GP_DISCOVER_LEN];
+  gp_frame_t frame;
+  sint16 result;
+  int len;
+
+  frame.type = GP_TYPE_DISCOVER;
+  frame.flags = 0;
+  frame.device_id = system_get_chip_id();
+  len = gp_encode(&frame, buffer, sizeof(buffer));
+
+  os_memcpy(p_espconn->proto.udp->remote_ip, udp_broadcast, 4);
+  p_espconn->proto.udp->remote_port = GP_PORT;
+  result = espconn_sendto(p_espconn, buffer, len);
   #ifdef DEBUG_ON
-    os_printf("GPIO2 %d: %d\n", counter, level);
+    os_printf("DISCOVER sent status: %d\n", result);
   #endif
+}
+
+// Discover timer function. Probe while we don't know a receiver (and someone is
+// associated to answer), backing off from DISC_PROBE_MIN_MS to DISC_PROBE_MAX_MS.
+// discover_left forces a few extra rounds after a station joins so a second receiver
+// gets into the list even though we already have one.
+LOCAL void ICACHE_FLASH_ATTR discover_function(void)
+{
+  if (wifi_softap_get_station_num() == 0)
+    return;
+  if (discover_left == 0 && disc_current(&receivers) != NULL)
+    return;
+
+  discover_send(p_report_espconn);
+  if (discover_left)
+    discover_left--;
+  os_timer_arm(&discover_timer, disc_probe(&receivers), 0);
+}
 
-  os_sprintf(buffer, "GPIO2 %d: %d\n", counter, level);
+// (Re)start probing, fast. A station that just joined may still be waiting for its DHCP
+// lease, hence the rounds.
+LOCAL void ICACHE_FLASH_ATTR discover_start(uint8 rounds)
+{
+  discover_left = rounds;
+  disc_probe_reset(&receivers);
+  os_timer_disarm(&discover_timer);
+  os_timer_setfn(&discover_timer, health_timed, (void *)discover_function);
+  os_timer_arm(&discover_timer, 1, 0);
+}
 
-  result = espconn_sendto(p_espconn, buffer, sizeof(buffer));
+// Retransmit timer function. Resend the frame in flight if its ACK is overdue. After
+// REL_MAX_RETRIES we stop; the events stay queued (with their sequence numbers) and go
+// out again to the next receiver on the list, or on the next flush once we find one.
+LOCAL void ICACHE_FLASH_ATTR retransmit_function(void)
+{
+  uint32 now = clock_ms();
+  uint32 wait;
+  sint16 result;
+
+  switch (rel_expired(&report_rel, now)) {
+    case 1:
+      // The current receiver may have changed since the first send (it left the soft-AP),
+      // so the trace trailer is stamped again for this copy
+      receiver_target(p_report_espconn);
+      gp_stamp(inflight_buffer, inflight_len, now, receiver_clock.offset);
+      result = report_send(p_report_espconn, inflight_buffer, inflight_len);
+      #ifdef DEBUG_ON
+        os_printf("Retransmit seq %d try %d status: %d\n", report_rel.seq, report_rel.retries, result);
+      #endif
+      break;
+    case -1:
+      #ifdef DEBUG_ON
+        os_printf("Gave up on seq %d, %d events queued\n", report_rel.seq, report_queue.count);
+      #endif
+      // Blame the receiver and try the next one right away, or go looking for one
+      if (disc_failed(&receivers))
+        report_flush();
+      else
+        discover_start(0);
+      return;
+    default:
+      if (!report_rel.inflight)
+        return;
+      break;
+  }
+
+  wait = rel_wait(&report_rel, now);
+  os_timer_arm(&retransmit_timer, wait ? wait : 1, 0);
+}
+
+// Send an encoded report or batch of len bytes, signed first if we have a key (see
+// gpauth.h). p_buf needs GP_AUTH_LEN bytes of room after the frame. The frame itself is
+// left as it was, so a retransmit can stamp it and send it through here again; every
+// transmission gets a counter value of its own.
+sint16 ICACHE_FLASH_ATTR report_send(struct espconn *p_espconn, uint8_t *p_buf, int len)
+{
+  #ifdef AUTH_KEY
+    uint32 start = ccount();
+
+    len = gp_auth_sign(&report_auth, p_buf, len, len + GP_AUTH_LEN);
+    auth_cycles = ccount() - start;
+    if (auth_cycles > auth_cycles_max)
+      auth_cycles_max = auth_cycles;
+    #ifdef DEBUG_ON
+      os_printf("Signed %d bytes, epoch %d counter %d, %d cycles (max %d)\n", len, report_auth.epoch,
+                report_auth.counter - 1, auth_cycles, auth_cycles_max);
+    #endif
+  #endif
+  return espconn_sendto(p_espconn, p_buf, len);
+}
+
+// Send the front of the event queue if we can: we need to know a receiver, it has to
+// be associated with our soft-AP and nothing may be in flight. Up to GP_BATCH_MAX events go out in one
+// frame, so a backlog built up while the receiver was away drains in a few bursts.
+void ICACHE_FLASH_ATTR report_flush(void)
+{
+  sint16 result;
+  gp_frame_t frame;
+
+  if (p_report_espconn == NULL || report_rel.inflight || report_queue.count == 0)
+    return;
+  if (wifi_softap_get_station_num() == 0 || !receiver_target(p_report_espconn))
+    return;
+
+  evq_take(&report_queue, &frame);
+  frame.flags = GP_FLAG_CHANGE | GP_FLAG_ACK_REQ | GP_FLAG_TRACE | GP_FLAG_LIVENESS | boot_flag;
+  frame.device_id = system_get_chip_id();
+  frame.next_ms = heartbeat.interval_ms;
+  frame.tx_time = clock_ms();
+  frame.offset = receiver_clock.offset;
+
+  inflight_len = gp_encode(&frame, inflight_buffer, sizeof(inflight_buffer));
+  result = report_send(p_report_espconn, inflight_buffer, inflight_len);
   #ifdef DEBUG_ON
-    os_printf("espconn sent status %d: %d\n", counter, result);
+    os_printf("Sent %d events from seq %d status: %d (%d bytes)\n", frame.count, frame.seq, result, inflight_len);
   #endif
 
-  counter++;
+  rel_sent(&report_rel, frame.seq + frame.count - 1, frame.tx_time);
+  os_timer_disarm(&retransmit_timer);
+  os_timer_setfn(&retransmit_timer, health_timed, (void *)retransmit_function);
+  os_timer_arm(&retransmit_timer, report_rel.rto_ms, 0);
+}
+
+// Report the (debounced) door state. Changes (GP_FLAG_CHANGE) are queued and flushed
+// (see report_flush); they ask for an ACK and are retransmitted until they get one.
+// A change is timestamped with the first edge of the burst, not the end of the
+// debounce, so the receiver's latency figures start when the door actually moved.
+// Heartbeats are sent straight away, fire and forget, and repeat the next sequence
+// number without using it up. A change pulls the heartbeat interval back to its
+// minimum; every heartbeat that goes out stretches it (see heartbeat.h).
+void ICACHE_FLASH_ATTR send_report(struct espconn *p_espconn, uint8 flags)
+{
+  sint16 result = 0;
+  uint8_t buffer[GP_MAX_FRAME];
+  uint32 now = clock_ms();
+  gp_frame_t frame;
+  int len;
+
+  if (flags & GP_FLAG_CHANGE) {
+    hb_activity(&heartbeat);
+    evq_push(&report_queue, door_debounce.stable, now - door_debounce.latency_ms);
+    report_flush();
+    return;
+  }
+
+  // Nobody to tell yet. discover_function is on it.
+  if (!receiver_target(p_espconn))
+    return;
+
+  // Idle since the last one ... the next heartbeat can wait longer, and we say so
+  hb_sent(&heartbeat);
 
-  os_delay_us(100);
+  frame.type = GP_TYPE_REPORT;
+  frame.flags = flags | GP_FLAG_HEARTBEAT | GP_FLAG_TRACE | GP_FLAG_LIVENESS;
+  frame.device_id = system_get_chip_id();
+  frame.seq = report_queue.next_seq;
+  frame.count = 1;
+  frame.event[0].pins = door_debounce.stable;
+  frame.event[0].timestamp = now;
+  frame.tx_time = now;
+  frame.offset = receiver_clock.offset;
+  frame.next_ms = heartbeat.interval_ms;
+
+  len = gp_encode(&frame, buffer, sizeof(buffer));
+
+  result = report_send(p_espconn, buffer, len);
+  #ifdef DEBUG_ON
+    os_printf("Pins %04x %d: flags %d\n", door_debounce.stable, frame.seq, frame.flags);
+    os_printf("espconn sent status %d: %d (%d bytes)\n", frame.seq, result, len);
+  #endif
+
+  // Anything stuck in the queue (we gave up, or the receiver was away) gets another go
+  report_flush();
+
+  // And keep our idea of the receiver's clock fresh
+  clock_sync(p_espconn);
+
+  // Every so often, how we are doing for memory (see health.c)
+  health_send(p_espconn);
+}
+
+// WiFi event callback. A station joining may be a receiver: look for it, and flush the
+// backlog in case it is one we already know. A station leaving may be our current
+// receiver; if so move on to the next one (the frame in flight follows, see
+// retransmit_function) or start looking again.
+void ICACHE_FLASH_ATTR wifi_event_callback(System_Event_t *p_event)
+{
+  uint32 id;
+
+  if (p_event->event == EVENT_SOFTAPMODE_STACONNECTED) {
+    #ifdef DEBUG_ON
+      os_printf("Station joined, %d events queued (%d overflowed)\n", report_queue.count, report_queue.overflow);
+    #endif
+    discover_start(DISCOVER_JOIN_ROUNDS);
+    report_flush();
+  } else if (p_event->event == EVENT_SOFTAPMODE_STADISCONNECTED) {
+    id = gp_mac_id(p_event->event_info.sta_disconnected.mac);
+    #ifdef DEBUG_ON
+      os_printf("Station %08x left\n", id);
+    #endif
+    if (disc_forget(&receivers, id) < 0)
+      discover_start(0);
+  }
 }
 
-// Receive callback function for our UDP connection. Nothing to do here (yet).
+// Poll function ... the heartbeat. Changes are reported as soon as the debounce
+// confirms them; this just re-sends the current state when the heartbeat timer says so
+// (see timer_function in user_main.c).
+void ICACHE_FLASH_ATTR poll_function (struct espconn *p_espconn) {
+  send_report(p_espconn, 0);
+}
+
+// Receive callback function for our UDP connection. Receivers answer our DISCOVER
+// broadcasts with ANNOUNCEs (see discovery.h) and our change frames with ACKs (see
+// reliable.h), and gptune sends TUNE frames (see tune.c); anything else is ignored.
 void ICACHE_FLASH_ATTR receive_callback(void *arg, char *p_data, unsigned short len) 
 {
+  struct espconn *p_espconn = (struct espconn *)arg;
+  remot_info *p_remote = NULL;
+  gp_frame_t frame;
+  uint32 now = clock_ms();
+
+  // Checked for a signature before anything is decoded. Without AUTH_KEY nobody can
+  // prove they are allowed to tune us, so nobody does.
+  if (len > 2 && p_data[2] == GP_TYPE_TUNE) {
+    #ifdef AUTH_KEY
+      tune_receive(p_espconn, (uint8_t *)p_data, len);
+    #endif
+    return;
+  }
+
+  if (gp_decode((uint8_t *)p_data, len, &frame) != 0)
+    return;
+
+  // A receiver. Where it lives comes from the datagram itself.
+  if (frame.type == GP_TYPE_ANNOUNCE) {
+    if (espconn_get_connection_info(p_espconn, &p_remote, 0) != ESPCONN_OK)
+      return;
+    #ifdef DEBUG_ON
+      os_printf("Receiver %08x at %d.%d.%d.%d\n", frame.device_id, p_remote->remote_ip[0],
+                p_remote->remote_ip[1], p_remote->remote_ip[2], p_remote->remote_ip[3]);
+    #endif
+    // Our first receiver ... anything queued can go now, and we want its clock
+    if (disc_heard(&receivers, frame.device_id, p_remote->remote_ip, now)) {
+      report_flush();
+      clock_sync(p_espconn);
+    }
+    return;
+  }
+
+  // The receiver's answer to clock_sync
+  if (frame.type == GP_TYPE_TIME && frame.device_id == system_get_chip_id()) {
+    if (clk_sample(&receiver_clock, frame.seq, frame.rx_time, frame.tx_time, now) > 0) {
+      #ifdef DEBUG_ON
+        os_printf("Receiver clock offset %d ms (rtt %d ms)\n", receiver_clock.offset, receiver_clock.rtt_ms);
+      #endif
+    }
+    return;
+  }
+
+  if (frame.type != GP_TYPE_ACK || frame.device_id != system_get_chip_id())
+    return;
+
+  evq_ack(&report_queue, frame.seq);
+  if (rel_ack(&report_rel, frame.seq, now)) {
+    os_timer_disarm(&retransmit_timer);
+    boot_flag = 0;
+    #ifdef DEBUG_ON
+      os_printf("ACK seq %d, srtt %d ms, rto %d ms\n", frame.seq, report_rel.srtt_ms, report_rel.rto_ms);
+      if (receivers.first_ms == 0)
+        os_printf("First report delivered %d ms after boot (target %d ms)\n", now, DISC_TARGET_MS);
+    #endif
+    disc_delivered(&receivers, now);
+    // A freshly updated image works (see ota.c)
+    #ifdef OTA
+      ota_confirm();
+    #endif
+    // Next burst, if there is a backlog
+    report_flush();
+  }
 }
 
 // Sent callback function for our UDP connection. Nothing to do here (yet).
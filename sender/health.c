@@ -0,0 +1,134 @@
+// health.c
+// How close the sender runs to the edge (see GP_TYPE_HEALTH in garage_proto.h), so the
+// buffers and the work done in timer callbacks can be sized from data:
+//   - Free heap, and the least we have seen. The non-OS SDK has no low water mark of
+//     its own, so we sample system_get_free_heap_size after every timer callback, which
+//     is when the stack (lwIP, WiFi) has just had its go at the heap too.
+//   - Stack. There is one stack for everything and nothing tells us how deep it got, so
+//     user_init paints HEALTH_STACK_PAINT bytes below where it runs with a pattern
+//     (health_paint), stopping at the end of the stack, and we count how much of it is
+//     still untouched. Interrupts and the SDK run on the same stack, so that is the
+//     real worst case, not just ours.
+//   - The longest timer callback since the last report. Timers that do our work are set
+//     up with health_timed as their function and the real one as the argument; a long
+//     callback holds up the WiFi stack as much as the next door change.
+//   - Supply voltage, when the ADC is set up to read it (see init_done_callback).
+// A HEALTH frame goes out with the first heartbeat and then every HEALTH_INTERVAL_MS (or
+// what gptune set, see tune.c), fire and forget and never signed; it is for a person to
+// look at (gpstat -d).
+
+#include "c_types.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "user_config.h"
+#include "garage_proto.h"
+#include "debug.h"
+
+#define HEALTH_PATTERN 0xa5a5a5a5
+// Left alone below the stack pointer when we paint, for health_paint's own calls and
+// any interrupt that comes in meanwhile
+#define HEALTH_PAINT_GAP 256
+
+// The end of the stack, from the linker script. Not every SDK's eagle.app.v6.common.ld
+// defines it, so it is weak and HEALTH_STACK_END stands in when it isn't there.
+extern uint32 _stack_sentry __attribute__((weak));
+
+LOCAL uint32 *p_paint;              // lowest painted word
+LOCAL uint32 paint_words;           // painted, from p_paint up
+LOCAL uint32 heap_min = 0xffffffff;
+LOCAL uint32 callback_cycles_max;   // since the last report
+LOCAL uint16 vdd_mv;
+LOCAL uint32 health_last_ms;
+LOCAL uint8 health_sent;
+
+// Paint the stack below us. Call it first thing in user_init, where the stack is as
+// shallow as it is ever going to be. The stack grows down, and we never paint past its
+// end: with less than HEALTH_STACK_PAINT left we paint what there is.
+void ICACHE_FLASH_ATTR health_paint(void)
+{
+  volatile uint32 here = 0;
+  uint32 *p_end = &_stack_sentry != NULL ? &_stack_sentry : (uint32 *)HEALTH_STACK_END;
+  uint32 *p_top = (uint32 *)&here - HEALTH_PAINT_GAP / 4;
+  uint32 *p;
+
+  p_paint = p_top - HEALTH_STACK_PAINT / 4;
+  if (p_paint < p_end)
+    p_paint = p_end < p_top ? p_end : p_top;
+  paint_words = p_top - p_paint;
+  for (p = p_paint; p < p_top; p++)
+    *p = HEALTH_PATTERN;
+}
+
+// Bytes of the painted area nobody has written to yet, counted up from the bottom
+LOCAL uint16 ICACHE_FLASH_ATTR health_stack_unused(void)
+{
+  uint32 i;
+
+  if (p_paint == NULL)
+    return 0;
+  for (i = 0; i < paint_words && p_paint[i] == HEALTH_PATTERN; i++);
+  return i * 4;
+}
+
+// Timer function wrapper. arg is the real timer function.
+void ICACHE_FLASH_ATTR health_timed(void *arg)
+{
+  uint32 start = ccount();
+  uint32 cycles, heap;
+
+  ((os_timer_func_t *)arg)(NULL);
+
+  cycles = ccount() - start;
+  if (cycles > callback_cycles_max)
+    callback_cycles_max = cycles;
+  heap = system_get_free_heap_size();
+  if (heap < heap_min)
+    heap_min = heap;
+}
+
+// The supply voltage as system_get_vdd33 gives it (1/1024 V)
+void ICACHE_FLASH_ATTR health_vdd(uint16 raw)
+{
+  vdd_mv = (uint32)raw * 1000 / 1024;
+}
+
+// Send a HEALTH frame to the current receiver if one is due. The caller has already
+// pointed p_espconn at the receiver (receiver_target).
+void ICACHE_FLASH_ATTR health_send(struct espconn *p_espconn)
+{
+  uint8_t buffer[GP_HEALTH_HEADER_LEN + GP_HEALTH_STACK_LEN];
+  uint32 now = clock_ms();
+  gp_health_t health;
+  sint16 result;
+  uint32 us;
+  int len;
+
+  if (health_sent && now - health_last_ms < tunables.value[GP_TUNE_HEALTH])
+    return;
+  health_sent = 1;
+  health_last_ms = now;
+
+  health.device_id = system_get_chip_id();
+  health.uptime_ms = now;
+  health.heap_free = system_get_free_heap_size();
+  if (health.heap_free < heap_min)
+    heap_min = health.heap_free;
+  health.heap_min = heap_min;
+  health.vdd_mv = vdd_mv;
+  us = callback_cycles_max / system_get_cpu_freq();
+  health.callback_us = us > 0xffff ? 0xffff : us;
+  callback_cycles_max = 0;
+  health.count = 1;
+  os_memcpy(health.stack[0].name, "sys", 4);
+  health.stack[0].unused = health_stack_unused();
+
+  len = gp_encode_health(&health, buffer, sizeof(buffer));
+  result = espconn_sendto(p_espconn, buffer, len);
+
+  #ifdef DEBUG_ON
+    os_printf("Health: heap %d (low %d), stack %d unused, longest callback %d us, %d mV, status: %d\n",
+              health.heap_free, health.heap_min, health.stack[0].unused, health.callback_us,
+              health.vdd_mv, result);
+  #endif
+}
@@ -0,0 +1,243 @@
+// lowpower.c
+// Deep sleep duty cycled mode for battery installs. Define LOW_POWER in user_config.h
+// to use it instead of the always-on soft-AP + heartbeat timer.
+//
+// How it works: the ESP8266 spends almost all of its life in deep sleep. It wakes
+// up for one of two reasons:
+//   - A door changed. Deep sleep can only be left through a reset, so wire the tilt
+//     switch edges to RST (each through a small capacitor so a held switch doesn't
+//     hold the chip in reset, and a diode per door if there are several). This shows
+//     up as REASON_EXT_SYS_RST.
+//   - The heartbeat deadline expired (GPIO16 wired to RST). This shows up as
+//     REASON_DEEP_SLEEP_AWAKE.
+// Everything that has to survive the sleep (sequence number, our idea of the time,
+// the last pins we reported and any events we haven't delivered yet) lives in RTC
+// user memory. When there is something to say we bring up the soft-AP, wait for the
+// receiver to associate and answer a DISCOVER, send all pending events as one batch
+// frame (see garage_proto.h), wait for its ACK (see reliable.h) and go straight back to
+// sleep. The events are only let go of once the receiver has acknowledged them.
+//
+// Our clock carries on across sleeps: the RTC timer keeps counting through deep sleep,
+// so on every wake we add what it counted since we went down, whether we slept the
+// whole SLEEP_HEARTBEAT_S or a door cut it short. host/powersim.c in the receiver
+// directory models what this mode costs against the always-on one.
+//
+// Note that the sender is the access point so the receiver has to re-associate on
+// every wake. That's why we wait for a station before sending and why events are kept
+// in RTC memory if nobody shows up before AWAKE_TIMEOUT_MS. The two times are tunables
+// (see tune.c): a TUNE that arrives while we are awake takes effect from the next sleep.
+
+#include "c_types.h"
+#include "osapi.h"
+#include "gpio.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "user_config.h"
+#include "garage_proto.h"
+#include "debug.h"
+
+// RTC user memory starts at block 64 (each block is 4 bytes). The struct must be a
+// multiple of 4 bytes.
+#define RTC_BLOCK 64
+#define RTC_MAGIC 0x47445233
+
+typedef struct {
+  uint32 magic;
+  uint32 seq;           // sequence number of the next event
+  uint32 clock_ms;      // milliseconds since first boot when we went to sleep
+  uint32 rtc_ticks;     // system_get_rtc_time() then ...
+  uint32 rtc_cali;      // ... and how long a tick was (system_rtc_clock_cali_proc)
+  uint16 last_pins;     // last pins we queued
+  uint8 count;          // number of pending events
+  uint8 flags;          // GP_FLAG_BOOT until the first batch is delivered
+  uint32 auth_epoch;    // frame signatures (see gpauth.h): one epoch per power up,
+  uint32 auth_counter;  // the counter carries on across sleeps
+  gp_event_t event[GP_BATCH_MAX];
+} rtc_state_t;
+
+LOCAL rtc_state_t rtc_state;
+LOCAL os_timer_t wait_timer;
+LOCAL struct espconn *p_lp_espconn;
+LOCAL uint32 wait_ms;
+LOCAL uint32 base_ms;           // lowpower_now() - clock_ms()
+LOCAL uint8 sent;               // the batch in frame_buffer is out, waiting for its ACK
+LOCAL uint8_t frame_buffer[GP_MAX_FRAME];
+LOCAL int frame_len;
+
+// Milliseconds since first boot
+LOCAL uint32 ICACHE_FLASH_ATTR lowpower_now(void)
+{
+  return base_ms + clock_ms();
+}
+
+// Queue an event in RTC memory. If the queue is full we drop the oldest event; the
+// newest one is the state the receiver really needs.
+LOCAL void ICACHE_FLASH_ATTR lowpower_queue(uint16 pins, uint32 now_ms)
+{
+  if (rtc_state.count == GP_BATCH_MAX) {
+    os_memmove(&rtc_state.event[0], &rtc_state.event[1], (GP_BATCH_MAX - 1) * sizeof(gp_event_t));
+    rtc_state.count--;
+    rtc_state.seq++;
+  }
+  rtc_state.event[rtc_state.count].pins = pins;
+  rtc_state.event[rtc_state.count].timestamp = now_ms;
+  rtc_state.count++;
+  rtc_state.last_pins = pins;
+}
+
+// Save the RTC state and go back to sleep until the next heartbeat (or door reset).
+// The time now and the RTC timer go with it, so the next wake can tell how long we were
+// really out (see lowpower_start).
+LOCAL void ICACHE_FLASH_ATTR lowpower_sleep(void)
+{
+  rtc_state.clock_ms = lowpower_now();
+  rtc_state.rtc_ticks = system_get_rtc_time();
+  rtc_state.rtc_cali = system_rtc_clock_cali_proc();
+  rtc_state.auth_counter = report_auth.counter;
+  system_rtc_mem_write(RTC_BLOCK, &rtc_state, sizeof(rtc_state));
+
+  #ifdef DEBUG_ON
+    os_printf("Sleeping, %d events pending, awake %d ms\n", rtc_state.count, clock_ms());
+  #endif
+
+  // Option 2: no RF calibration on wake ... keeps the wake up short.
+  system_deep_sleep_set_option(2);
+  system_deep_sleep((uint64_t)tunables.value[GP_TUNE_SLEEP] * 1000000);
+}
+
+// Send everything pending as one batch frame. It asks for an ACK; the events stay
+// queued until it comes (see wait_function).
+LOCAL void ICACHE_FLASH_ATTR lowpower_send(void)
+{
+  gp_frame_t frame;
+  sint16 result;
+
+  frame.type = GP_TYPE_BATCH;
+  frame.flags = GP_FLAG_CHANGE | GP_FLAG_ACK_REQ | GP_FLAG_LIVENESS | rtc_state.flags;
+  frame.device_id = system_get_chip_id();
+  frame.seq = rtc_state.seq;
+  frame.count = rtc_state.count;
+  // The timer wakes us at the latest SLEEP_HEARTBEAT_S from now, then we may need all of
+  // AWAKE_TIMEOUT_MS to find the receiver again (see heartbeat.h). Both can be tuned.
+  frame.next_ms = tunables.value[GP_TUNE_SLEEP] * 1000 + tunables.value[GP_TUNE_AWAKE];
+  os_memcpy(frame.event, rtc_state.event, rtc_state.count * sizeof(gp_event_t));
+
+  frame_len = gp_encode(&frame, frame_buffer, sizeof(frame_buffer));
+  result = report_send(p_lp_espconn, frame_buffer, frame_len);
+  rel_sent(&report_rel, frame.seq + frame.count - 1, clock_ms());
+  sent = 1;
+
+  #ifdef DEBUG_ON
+    os_printf("Batch of %d sent status: %d (%d bytes)\n", rtc_state.count, result, frame_len);
+  #endif
+}
+
+// Wait timer function. Poll (every LOW_POWER_POLL_MS) for the receiver to associate
+// with our soft-AP and answer a DISCOVER (see discovery.h), then send. receive_callback
+// (see functions.c) takes the ACK; once it has, the events are delivered and we go to
+// sleep. Until then the batch goes out again as reliable.h says. Give up after
+// AWAKE_TIMEOUT_MS, or when reliable.h does, and keep the events for next time.
+LOCAL void ICACHE_FLASH_ATTR wait_function(void)
+{
+  if (sent) {
+    switch (rel_expired(&report_rel, clock_ms())) {
+      case 1:
+        report_send(p_lp_espconn, frame_buffer, frame_len);
+        break;
+      case -1:
+        os_timer_disarm(&wait_timer);
+        lowpower_sleep();
+        return;
+    }
+    if (!report_rel.inflight) {
+      os_timer_disarm(&wait_timer);
+      rtc_state.seq += rtc_state.count;
+      rtc_state.count = 0;
+      rtc_state.flags = 0;
+      // Every wake is a fresh boot as far as health.c knows, so this always goes
+      health_send(p_lp_espconn);
+      lowpower_sleep();
+      return;
+    }
+  } else if (wifi_softap_get_station_num() > 0) {
+    if (receiver_target(p_lp_espconn)) {
+      lowpower_send();
+      return;
+    }
+    // Someone is there but hasn't told us who they are. The ANNOUNCE is picked up by
+    // receive_callback (see functions.c).
+    discover_send(p_lp_espconn);
+  }
+
+  wait_ms += LOW_POWER_POLL_MS;
+  if (wait_ms >= tunables.value[GP_TUNE_AWAKE]) {
+    os_timer_disarm(&wait_timer);
+    lowpower_sleep();
+  }
+}
+
+// Low power entry point. Called from init_done_callback instead of the always-on
+// setup when LOW_POWER is defined.
+void ICACHE_FLASH_ATTR lowpower_start(struct espconn *p_espconn)
+{
+  struct rst_info *p_rst = system_get_rst_info();
+  uint16 pins;
+  uint32 ticks;
+
+  // All the doors in one read. No debounce: the reset pulse has long finished bouncing
+  // by the time we get here.
+  gpio_init();
+  setup_door_pins();
+  pins = GPIO_REG_READ(GPIO_IN_ADDRESS) & DOOR_PINS;
+
+  // First boot (or the RTC memory is junk) ... start from scratch. That is the only
+  // time the signature epoch goes to flash; a wake from deep sleep just carries on.
+  system_rtc_mem_read(RTC_BLOCK, &rtc_state, sizeof(rtc_state));
+  if (rtc_state.magic != RTC_MAGIC || rtc_state.count > GP_BATCH_MAX) {
+    os_memset(&rtc_state, 0, sizeof(rtc_state));
+    rtc_state.magic = RTC_MAGIC;
+    rtc_state.last_pins = 0xffff;
+    rtc_state.flags = GP_FLAG_BOOT;
+    rtc_state.seq = os_random();
+    rtc_state.auth_epoch = setup_auth_epoch();
+  }
+  setup_auth(rtc_state.auth_epoch, rtc_state.auth_counter);
+
+  // How long we were out, from the RTC timer (a tick is rtc_cali / 4096 us). It counts
+  // through deep sleep; if a reset started it over we only know the time since then. The
+  // boot so far is in both the ticks and clock_ms(), so it comes off once.
+  base_ms = rtc_state.clock_ms - clock_ms();
+  if (rtc_state.rtc_ticks) {
+    ticks = system_get_rtc_time();
+    if ((sint32)(ticks - rtc_state.rtc_ticks) > 0)
+      ticks -= rtc_state.rtc_ticks;
+    base_ms += (uint32)((uint64_t)ticks * rtc_state.rtc_cali / 4096 / 1000);
+  }
+  rel_init(&report_rel);
+  sent = 0;
+
+  // Queue a change if a door moved, and always queue the current state on a heartbeat
+  // wake so the receiver knows we are still alive.
+  if (pins != rtc_state.last_pins || p_rst->reason == REASON_DEEP_SLEEP_AWAKE)
+    lowpower_queue(pins, lowpower_now());
+
+  #ifdef DEBUG_ON
+    os_printf("Low power wake, reason %d, pins %04x, %d events pending\n", p_rst->reason, pins, rtc_state.count);
+  #endif
+
+  // A reset bounce with nothing new to say ... back to sleep without touching the radio.
+  if (rtc_state.count == 0) {
+    lowpower_sleep();
+    return;
+  }
+
+  setup_wifi();
+  setup_udp(p_espconn);
+  create_udp(p_espconn);
+  p_lp_espconn = p_espconn;
+
+  wait_ms = 0;
+  os_timer_disarm(&wait_timer);
+  os_timer_setfn(&wait_timer, health_timed, (void *)wait_function);
+  os_timer_arm(&wait_timer, LOW_POWER_POLL_MS, 1);
+}
@@ -0,0 +1,365 @@
+// ota.c
+// Over the air firmware updates. gpota (receiver/host) sends a delta against the image
+// we are running (see gpdelta.h) to GP_OTA_PORT in OTA_DATA frames (see garage_proto.h),
+// and we write the new image into the flash slot we are not running from, as it comes:
+// one gpd_t (a 256 byte block and a few counters) is all the RAM it takes.
+//
+// This needs the OTA flash layout: the SDK's second stage boot loader at 0 and two
+// image slots, user1 at OTA_SLOT_BASE and user2 OTA_SLOT_SIZE after it (make ota and
+// make flash-ota in the Makefile). system_upgrade_userbin_check says which one runs.
+//
+// How a transfer goes:
+//   - Offset 0 carries the delta header. If we already run the new image we say so
+//     (GP_OTA_CURRENT). If the delta has a base and the CRC-32 of what we run doesn't
+//     match it, we refuse (GP_OTA_BASE) and gpota can send the whole image instead.
+//   - Every chunk that is the one we asked for goes through gpd_feed, and we ask for
+//     the next offset. Anything else (lost, duplicated, out of order) gets the same
+//     request again. We ask again every OTA_RETRY_MS and give up after OTA_RETRIES.
+//   - When gpd_feed is done (the image CRC checked out) we read the slot back and check
+//     the CRC again, so a bad flash write can't get through. Then GP_OTA_DONE, and we
+//     reboot into the new slot.
+//
+// Rollback. Before we reboot we leave a note in RTC memory: the new image is on trial.
+// Every boot with the note counts (ota_boot). The first change the new image gets
+// acknowledged by a receiver ends the trial (ota_confirm). An image that resets
+// OTA_TRIAL_BOOTS times without getting there (a crash loop, a watchdog) is rolled
+// back: we switch back to the other slot, which still holds the old image. A power cut
+// during the trial wipes the note and the new image stays, trial or not.
+//
+// Versions. Only built with OTA defined (make ota), and only with AUTH_KEY: every
+// OTA_DATA frame must carry our signature, and the epoch in its trailer is the image
+// version (gpota send -V). A transfer has to be newer than the version we last took,
+// which is kept in flash at OTA_VERSION_SECTOR and written before we reboot into the
+// new image, so a recorded transfer of an older build can't be played back to us,
+// not even after a power cycle. Every frame of a transfer carries the same version.
+//
+// Not in LOW_POWER mode: the radio is only up for a moment at a time there.
+
+#include "c_types.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "user_config.h"
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "gpdelta.h"
+#include "debug.h"
+
+#ifdef OTA
+
+#ifndef AUTH_KEY
+  #error "OTA needs AUTH_KEY: without it anyone on the soft-AP could flash us"
+#endif
+
+#define OTA_RTC_MAGIC 0x4f544131
+
+// The RTC memory note, see above
+typedef struct {
+  uint32 magic;
+  uint32 boots;
+} ota_rtc_t;
+
+LOCAL struct espconn ota_espconn;
+LOCAL esp_udp ota_udp;
+LOCAL os_timer_t ota_timer;
+LOCAL gpd_t ota_delta;
+LOCAL uint8 ota_active;           // a transfer is going on
+LOCAL uint8 ota_trial;            // we are a new image that hasn't proved itself yet
+LOCAL uint8 ota_retries;
+LOCAL uint32 ota_id;              // transfer id: CRC-32 of the new image
+LOCAL uint32 ota_total;           // delta length
+LOCAL uint32 ota_next;            // delta offset we want next
+LOCAL uint32 ota_slot;            // flash address of the slot we are writing
+LOCAL uint32 ota_start_ms;
+LOCAL uint32 ota_version;         // of the last image we took, from OTA_VERSION_SECTOR
+LOCAL uint32 ota_new_version;     // of the transfer going on
+
+// Where an image slot starts in flash
+LOCAL uint32 ICACHE_FLASH_ATTR ota_slot_addr(uint8 bin)
+{
+  return bin == UPGRADE_FW_BIN1 ? OTA_SLOT_BASE : OTA_SLOT_BASE + OTA_SLOT_SIZE;
+}
+
+// spi_flash_read wants word aligned addresses and buffers; gpd_feed asks for any
+// bytes anywhere. Go through a small aligned buffer.
+LOCAL int ICACHE_FLASH_ATTR ota_flash_read(uint32 addr, uint8_t *p_buf, uint32 len)
+{
+  uint32 bounce[16];
+  uint32 skip, n;
+
+  while (len) {
+    skip = addr & 3;
+    n = sizeof(bounce) - skip;
+    if (n > len)
+      n = len;
+    if (spi_flash_read(addr - skip, bounce, (skip + n + 3) & ~3) != SPI_FLASH_RESULT_OK)
+      return -1;
+    os_memcpy(p_buf, (uint8_t *)bounce + skip, n);
+    addr += n;
+    p_buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// CRC-32 of len bytes of flash. Big images take a while, so keep the watchdog fed. A
+// read error gives back something that won't match.
+LOCAL uint32 ICACHE_FLASH_ATTR ota_flash_crc(uint32 addr, uint32 len)
+{
+  uint32 block[GPD_BLOCK / 4];
+  uint32 crc = 0, n;
+
+  while (len) {
+    n = len < GPD_BLOCK ? len : GPD_BLOCK;
+    if (ota_flash_read(addr, (uint8_t *)block, n) != 0)
+      return ~crc;
+    crc = gpd_crc32(crc, (uint8_t *)block, n);
+    addr += n;
+    len -= n;
+    system_soft_wdt_feed();
+  }
+  return crc;
+}
+
+// gpd_feed's view of the flash: the base is the slot we run from, the image the one we
+// write. Blocks never straddle a sector, and each sector is erased when its first
+// block comes in.
+LOCAL int ICACHE_FLASH_ATTR ota_read_base(void *p_ctx, uint32_t offset, uint8_t *p_buf, uint32_t len)
+{
+  return ota_flash_read(ota_slot_addr(system_upgrade_userbin_check()) + offset, p_buf, len);
+}
+
+LOCAL int ICACHE_FLASH_ATTR ota_read_image(void *p_ctx, uint32_t offset, uint8_t *p_buf, uint32_t len)
+{
+  return ota_flash_read(ota_slot + offset, p_buf, len);
+}
+
+LOCAL int ICACHE_FLASH_ATTR ota_write(void *p_ctx, uint32_t offset, const uint8_t *p_buf, uint32_t len)
+{
+  if (offset % SPI_FLASH_SEC_SIZE == 0 &&
+      spi_flash_erase_sector((ota_slot + offset) / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK)
+    return -1;
+  return spi_flash_write(ota_slot + offset, (uint32 *)p_buf, (len + 3) & ~3) == SPI_FLASH_RESULT_OK ? 0 : -1;
+}
+
+LOCAL const gpd_io_t ota_io = { ota_read_base, ota_read_image, ota_write };
+
+// Tell gpota where we are: the next offset we want, or how it ended
+LOCAL void ICACHE_FLASH_ATTR ota_request(uint8 status)
+{
+  uint8_t buffer[GP_OTA_REQ_LEN];
+  gp_ota_t req;
+  int len;
+
+  req.type = GP_TYPE_OTA_REQ;
+  req.device_id = system_get_chip_id();
+  req.id = ota_id;
+  req.offset = ota_next;
+  req.status = status;
+  len = gp_encode_ota(&req, buffer, sizeof(buffer));
+  espconn_sendto(&ota_espconn, buffer, len);
+
+  os_timer_disarm(&ota_timer);
+  if (status == GP_OTA_MORE)
+    os_timer_arm(&ota_timer, OTA_RETRY_MS, 0);
+}
+
+// The transfer is over, one way or another
+LOCAL void ICACHE_FLASH_ATTR ota_end(uint8 status)
+{
+  ota_request(status);
+  ota_active = 0;
+  system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+  #ifdef DEBUG_ON
+    os_printf("OTA %08x ended at %d of %d bytes, status %d\n", ota_id, ota_next, ota_total, status);
+  #endif
+}
+
+LOCAL void ICACHE_FLASH_ATTR ota_reboot(void)
+{
+  system_upgrade_reboot();
+}
+
+// Retry timer function. Our last request (or the answer to it) got lost.
+LOCAL void ICACHE_FLASH_ATTR ota_retry(void)
+{
+  if (!ota_active)
+    return;
+  if (++ota_retries > OTA_RETRIES) {
+    #ifdef DEBUG_ON
+      os_printf("OTA %08x: nothing for %d tries, giving up\n", ota_id, OTA_RETRIES);
+    #endif
+    ota_active = 0;
+    system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+    return;
+  }
+  ota_request(GP_OTA_MORE);
+}
+
+// A new transfer of image version. Returns GP_OTA_MORE if we take it, or why not.
+LOCAL uint8 ICACHE_FLASH_ATTR ota_begin(const gp_ota_t *p_ota, uint32 version)
+{
+  uint32 running = ota_slot_addr(system_upgrade_userbin_check());
+  gpd_header_t header;
+
+  ota_id = p_ota->id;
+  ota_next = 0;
+  if (version <= ota_version)
+    return GP_OTA_OLD;
+  if (gpd_header(p_ota->p_data, p_ota->len, &header) != 0 || header.crc != p_ota->id)
+    return GP_OTA_BAD;
+  if (header.len > OTA_SLOT_SIZE || header.base_len > OTA_SLOT_SIZE)
+    return GP_OTA_FIT;
+  if (ota_flash_crc(running, header.len) == header.crc)
+    return GP_OTA_CURRENT;
+  if (header.base_len && ota_flash_crc(running, header.base_len) != header.base_crc)
+    return GP_OTA_BASE;
+
+  ota_slot = ota_slot_addr(system_upgrade_userbin_check() == UPGRADE_FW_BIN1 ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1);
+  ota_total = p_ota->total;
+  ota_retries = 0;
+  ota_start_ms = clock_ms();
+  ota_new_version = version;
+  gpd_init(&ota_delta, &ota_io, NULL);
+  system_upgrade_flag_set(UPGRADE_FLAG_START);
+  ota_active = 1;
+  #ifdef DEBUG_ON
+    os_printf("OTA %08x: version %d, %d byte delta to a %d byte image at %x\n", ota_id, version, ota_total,
+              header.len, ota_slot);
+  #endif
+  return GP_OTA_MORE;
+}
+
+// The whole image is in. Check what is in flash, keep its version, put the trial note
+// in RTC memory and reboot into it once the GP_OTA_DONE has had a moment to go out. A
+// version we couldn't keep would let this transfer be played back, so that fails it.
+LOCAL void ICACHE_FLASH_ATTR ota_finish(void)
+{
+  ota_rtc_t rtc;
+
+  if (ota_flash_crc(ota_slot, ota_delta.header.len) != ota_delta.header.crc ||
+      !system_param_save_with_protect(OTA_VERSION_SECTOR, &ota_new_version, sizeof(ota_new_version))) {
+    ota_end(GP_OTA_BAD);
+    return;
+  }
+  ota_version = ota_new_version;
+  #ifdef DEBUG_ON
+    os_printf("OTA %08x: image written and checked in %d ms, rebooting\n", ota_id,
+              clock_ms() - ota_start_ms);
+  #endif
+  ota_end(GP_OTA_DONE);
+
+  rtc.magic = OTA_RTC_MAGIC;
+  rtc.boots = 0;
+  system_rtc_mem_write(OTA_RTC_BLOCK, &rtc, sizeof(rtc));
+  system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+  os_timer_disarm(&ota_timer);
+  os_timer_setfn(&ota_timer, (os_timer_func_t *)ota_reboot, NULL);
+  os_timer_arm(&ota_timer, 200, 0);
+}
+
+// Receive callback for GP_OTA_PORT
+LOCAL void ICACHE_FLASH_ATTR ota_receive(void *arg, char *p_data, unsigned short len)
+{
+  remot_info *p_remote = NULL;
+  uint32 epoch, counter;
+  gp_ota_t ota;
+  int n, result;
+  uint8 status;
+
+  // Only from somebody who has our key (see gpauth.h); the epoch is the image version
+  if ((n = gp_auth_verify(report_auth.key, (uint8_t *)p_data, len, &epoch, &counter)) < 0)
+    return;
+  if (gp_decode_ota((uint8_t *)p_data, n, &ota) != 0 || ota.type != GP_TYPE_OTA_DATA ||
+      ota.device_id != system_get_chip_id())
+    return;
+
+  // Answers go back where this came from
+  if (espconn_get_connection_info(&ota_espconn, &p_remote, 0) != ESPCONN_OK)
+    return;
+  os_memcpy(ota_udp.remote_ip, p_remote->remote_ip, 4);
+  ota_udp.remote_port = p_remote->remote_port;
+
+  // Offset 0 of something new starts over
+  if (ota.offset == 0 && (!ota_active || ota.id != ota_id)) {
+    if ((status = ota_begin(&ota, epoch)) != GP_OTA_MORE) {
+      ota_end(status);
+      return;
+    }
+  }
+  if (!ota_active || ota.id != ota_id || epoch != ota_new_version)
+    return;
+
+  if (ota.offset != ota_next || ota.len == 0) {
+    ota_request(GP_OTA_MORE);
+    return;
+  }
+  ota_retries = 0;
+  result = gpd_feed(&ota_delta, ota.p_data, ota.len);
+  ota_next += ota.len;
+  if (result == GPD_DONE)
+    ota_finish();
+  else if (result < 0 || ota_next >= ota_total)
+    ota_end(GP_OTA_BAD);
+  else
+    ota_request(GP_OTA_MORE);
+}
+
+// Listen on GP_OTA_PORT. Called from init_done_callback.
+void ICACHE_FLASH_ATTR ota_listen(void)
+{
+  // A flash that never had a version in it takes any
+  if (!system_param_load(OTA_VERSION_SECTOR, 0, &ota_version, sizeof(ota_version)) || ota_version == 0xffffffff)
+    ota_version = 0;
+  ota_espconn.type = ESPCONN_UDP;
+  ota_espconn.proto.udp = &ota_udp;
+  ota_udp.local_port = GP_OTA_PORT;
+  espconn_create(&ota_espconn);
+  espconn_regist_recvcb(&ota_espconn, ota_receive);
+  os_timer_disarm(&ota_timer);
+  os_timer_setfn(&ota_timer, health_timed, (void *)ota_retry);
+}
+
+// Boot check, first thing in init_done_callback. A new image on trial that has been
+// through OTA_TRIAL_BOOTS boots without ota_confirm goes back to the old one.
+void ICACHE_FLASH_ATTR ota_boot(void)
+{
+  ota_rtc_t rtc;
+
+  system_rtc_mem_read(OTA_RTC_BLOCK, &rtc, sizeof(rtc));
+  if (rtc.magic != OTA_RTC_MAGIC)
+    return;
+  if (++rtc.boots > OTA_TRIAL_BOOTS) {
+    rtc.magic = 0;
+    system_rtc_mem_write(OTA_RTC_BLOCK, &rtc, sizeof(rtc));
+    #ifdef DEBUG_ON
+      os_printf("New image failed its trial, rolling back\n");
+    #endif
+    system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+    system_upgrade_reboot();
+    return;
+  }
+  system_rtc_mem_write(OTA_RTC_BLOCK, &rtc, sizeof(rtc));
+  ota_trial = 1;
+  #ifdef DEBUG_ON
+    os_printf("New image on trial, boot %d of %d\n", rtc.boots, OTA_TRIAL_BOOTS);
+  #endif
+}
+
+// A receiver acknowledged one of our changes: a new image has proved itself
+void ICACHE_FLASH_ATTR ota_confirm(void)
+{
+  ota_rtc_t rtc;
+
+  if (!ota_trial)
+    return;
+  ota_trial = 0;
+  rtc.magic = 0;
+  rtc.boots = 0;
+  system_rtc_mem_write(OTA_RTC_BLOCK, &rtc, sizeof(rtc));
+  #ifdef DEBUG_ON
+    os_printf("New image confirmed\n");
+  #endif
+}
+
+#endif
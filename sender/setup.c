@@ -1,26 +1,115 @@
 #include "credentials.h"
+#include "ets_sys.h"
 #include "osapi.h"
 #include "user_interface.h"
 #include "gpio.h"
 #include "mem.h"
 #include "espconn.h"
+#include "user_config.h"
 #include "debug.h"
 
-// Setup GPIO2 
+#if (DOOR_PINS) & ~(DOOR_PINS_USABLE)
+  #error "DOOR_PINS has a pin that can't be a door input (see DOOR_PINS_USABLE)"
+#endif
+
+// Where each usable GPIO is routed in the IO mux. GPIO1 and GPIO3 are the UART, 6 to 11
+// the flash, GPIO15 must be low at boot and GPIO16 isn't in the GPIO block at all.
+LOCAL const struct {
+  uint8 pin;
+  uint32 mux;
+  uint8 func;
+} door_mux[] = {
+  { 0, PERIPHS_IO_MUX_GPIO0_U, FUNC_GPIO0 },
+  { 2, PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2 },
+  { 4, PERIPHS_IO_MUX_GPIO4_U, FUNC_GPIO4 },
+  { 5, PERIPHS_IO_MUX_GPIO5_U, FUNC_GPIO5 },
+  { 12, PERIPHS_IO_MUX_MTDI_U, FUNC_GPIO12 },
+  { 13, PERIPHS_IO_MUX_MTCK_U, FUNC_GPIO13 },
+  { 14, PERIPHS_IO_MUX_MTMS_U, FUNC_GPIO14 },
+};
+
+// Make every door pin a GPIO input with the internal pullup resistor on. Connect each
+// one to a tilt switch (or contact) and complete the circuit via a resistor to ground.
+// While the switch is open the pin status will be 1 (HIGH). When swith is closed the
+// pin status will be 0 (LOW). The low power mode uses this too.
+void ICACHE_FLASH_ATTR setup_door_pins(void)
+{
+  uint32 i;
+
+  for (i = 0; i < sizeof(door_mux) / sizeof(door_mux[0]); i++) {
+    if (!(DOOR_PINS & BIT(door_mux[i].pin)))
+      continue;
+    PIN_FUNC_SELECT(door_mux[i].mux, door_mux[i].func);
+    PIN_PULLUP_EN(door_mux[i].mux);
+  }
+  gpio_output_set(0, 0, 0, DOOR_PINS);
+}
+
+// Setup the door pins
 void ICACHE_FLASH_ATTR setup_gpio (void)
 {
+  uint32 pin;
+
   // Initialize the GPIO sub-system
   gpio_init();
+  setup_door_pins();
 
-  // Set GPIO2 to be GPIO2
-  PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO2_U, FUNC_GPIO2);
- 
-  // Set GPIO2 as input and enable the internal pullup resistor. Connect GPIO2
-  // to a tilt switch and then complete the circuit via a resistor to ground.
-  // While the switch is open the pin status will be 1 (HIGH). When swith is
-  // closed the pin status will be 0 (LOW).
-  gpio_output_set(0, 0, 0, BIT2); 
-  PIN_PULLUP_EN(PERIPHS_IO_MUX_GPIO2_U);
+  // Start the debouncer with whatever the pins read right now ... all of them in one
+  // read of the input register.
+  debounce_init(&door_debounce, DOOR_PINS, GPIO_REG_READ(GPIO_IN_ADDRESS), tunables.value[GP_TUNE_DEBOUNCE]);
+
+  // Interrupt on both edges instead of polling the pins. Disable the GPIO interrupt while
+  // we set it up, clear anything stale and then turn it back on. See functions.c for
+  // gpio_intr_handler.
+  ETS_GPIO_INTR_DISABLE();
+  ETS_GPIO_INTR_ATTACH(gpio_intr_handler, NULL);
+  GPIO_REG_WRITE(GPIO_STATUS_W1TC_ADDRESS, DOOR_PINS);
+  for (pin = 0; pin < 16; pin++) {
+    if (DOOR_PINS & BIT(pin))
+      gpio_pin_intr_state_set(GPIO_ID_PIN(pin), GPIO_PIN_INTR_ANYEDGE);
+  }
+  ETS_GPIO_INTR_ENABLE();
+}
+
+// Load our frame signing key (see gpauth.h and AUTH_KEY in user_config.h) and where
+// to carry on from: the epoch from setup_auth_epoch and the first counter to use. A key
+// that doesn't parse is a build mistake; we say so and sign with all zeros, which no
+// receiver will take, rather than quietly send unsigned frames.
+void ICACHE_FLASH_ATTR setup_auth(uint32 epoch, uint32 counter)
+{
+  #ifdef AUTH_KEY
+    if (gp_auth_key(AUTH_KEY, report_auth.key) != 0) {
+      os_memset(report_auth.key, 0, sizeof(report_auth.key));
+      #ifdef DEBUG_ON
+        os_printf("AUTH_KEY is not 32 hex digits!\n");
+      #endif
+    }
+  #endif
+  report_auth.epoch = epoch;
+  report_auth.counter = counter;
+}
+
+// Bump the signing epoch kept in flash at AUTH_EPOCH_SECTOR and return the new one.
+// Erased flash reads as 0xffffffff, which counts as 0. Without AUTH_KEY we leave the
+// flash alone.
+uint32 ICACHE_FLASH_ATTR setup_auth_epoch(void)
+{
+  uint32 epoch = 0;
+
+  #ifdef AUTH_KEY
+    if (!system_param_load(AUTH_EPOCH_SECTOR, 0, &epoch, sizeof(epoch)) || epoch == 0xffffffff)
+      epoch = 0;
+    epoch++;
+    if (!system_param_save_with_protect(AUTH_EPOCH_SECTOR, &epoch, sizeof(epoch))) {
+      #ifdef DEBUG_ON
+        os_printf("Unable to save the signing epoch!\n");
+      #endif
+    }
+    #ifdef DEBUG_ON
+      os_printf("Signing epoch %d\n", epoch);
+    #endif
+  #endif
+  return epoch;
 }
 
 // Part 1 of setup udp_espconn structure as a UDP connection block. Notice that we
@@ -35,8 +124,9 @@ void ICACHE_FLASH_ATTR setup_udp(struct espconn *p_espconn)
   // Zero out the potential junk that may be in our structure's proto.udp member
   p_espconn->proto.udp = (esp_udp *) os_zalloc(sizeof (esp_udp));
 
-  // Set a local port for our UDP server. Just pick any available port.
-  p_espconn->proto.udp->local_port = espconn_port();
+  // Our local port is GP_PORT, so gptune knows where to find receive_callback (the
+  // receivers answer wherever the frames come from anyway).
+  p_espconn->proto.udp->local_port = GP_PORT;
 
 }
 
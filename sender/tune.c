@@ -0,0 +1,182 @@
+// tune.c
+// Remote tuning (see gptune.h). gptune (receiver/host) sends TUNE frames to our report
+// port, GP_PORT, and receive_callback hands them to tune_receive. The values are in
+// tunables; everything that used to read HEARTBEAT_MIN_MS, DEBOUNCE_MS and friends
+// reads them from there, and user_config.h only has the defaults now.
+//
+// A change takes effect straight away, no reboot:
+//   - heartbeat: the new intervals are put in heartbeat and a heartbeat goes out now
+//     with the new promise (heartbeat_retune), so the receiver never holds us to the
+//     old one;
+//   - debounce: the sample period changes, from the next sample on;
+//   - coalesce, health, sleep, awake: read where they are used.
+//
+// GP_TUNE_SAVE and GP_TUNE_DEFAULTS write them to flash at TUNE_SECTOR as well, and
+// tune_load reads them back first thing at boot, low power wakes included. What comes
+// back from flash goes through gp_tune_check like anything from the network, so a
+// record from another build or a half written sector means the defaults, not a stuck
+// sender.
+//
+// Only a sender with AUTH_KEY can be tuned at all (receive_callback drops TUNE frames
+// otherwise). A TUNE has to carry our signature and be newer (epoch, counter) than the
+// last one we took, which is what keeps someone on the soft-AP from turning the
+// heartbeat off. That pair is in the flash record too, and every TUNE but a GET is
+// written there before it takes effect; if the write fails nothing changes and the
+// answer says GP_TUNE_FLASH. So a TUNE recorded before a reboot is still old after it.
+// A GET changes nothing, so it is not worth a flash write. The answer is not signed; it
+// moves nothing.
+
+#include "c_types.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "espconn.h"
+#include "user_config.h"
+#include "garage_proto.h"
+#include "gpauth.h"
+#include "gptune.h"
+#include "debug.h"
+
+#define TUNE_FLASH_MAGIC 0x32545047
+
+// What goes to flash. count lets a later build with more tunables keep these; 0 means
+// none were saved, only the TUNE pair.
+typedef struct {
+  uint32 magic;
+  uint32 count;
+  uint32 epoch;                     // the newest TUNE we took
+  uint32 counter;
+  uint32 value[GP_TUNE_COUNT + 1];
+} tune_flash_t;
+
+gp_tunables_t tunables;
+
+LOCAL const uint32 tune_defaults[GP_TUNE_COUNT + 1] = {
+  0, HEARTBEAT_MIN_MS, HEARTBEAT_MAX_MS, HEARTBEAT_JITTER_PCT, DEBOUNCE_MS, COALESCE_MS,
+  HEALTH_INTERVAL_MS, SLEEP_HEARTBEAT_S, AWAKE_TIMEOUT_MS
+};
+
+// What is in flash; only a GET moves the pair on without writing it
+LOCAL tune_flash_t tune_flash;
+
+// The defaults, then whatever was saved over them. Call it before anything reads
+// tunables.
+void ICACHE_FLASH_ATTR tune_load(void)
+{
+  uint32 values[GP_TUNE_COUNT + 1];
+  uint32 i;
+
+  gp_tune_init(&tunables, tune_defaults);
+  if (!system_param_load(TUNE_SECTOR, 0, &tune_flash, sizeof(tune_flash)) || tune_flash.magic != TUNE_FLASH_MAGIC ||
+      tune_flash.count > GP_TUNE_COUNT) {
+    os_memset(&tune_flash, 0, sizeof(tune_flash));
+    tune_flash.magic = TUNE_FLASH_MAGIC;
+    return;
+  }
+  for (i = 0; i <= GP_TUNE_COUNT; i++)
+    values[i] = i <= tune_flash.count ? tune_flash.value[i] : tune_defaults[i];
+  if (gp_tune_check(values) != 0) {
+    #ifdef DEBUG_ON
+      os_printf("Saved tunables out of range, using the defaults\n");
+    #endif
+    tune_flash.count = 0;
+    return;
+  }
+  for (i = 0; i <= GP_TUNE_COUNT; i++)
+    tunables.value[i] = values[i];
+  #ifdef DEBUG_ON
+    os_printf("Tunables from flash: heartbeat %d .. %d ms, debounce %d ms\n", values[GP_TUNE_HB_MIN],
+              values[GP_TUNE_HB_MAX], values[GP_TUNE_DEBOUNCE]);
+  #endif
+}
+
+#ifdef AUTH_KEY
+
+// Write the record with a TUNE's (epoch, counter), and with p_values (NULL keeps the
+// ones saved before). Nothing changes in RAM unless the write worked.
+LOCAL uint8 ICACHE_FLASH_ATTR tune_save(uint32 epoch, uint32 counter, const uint32 *p_values)
+{
+  tune_flash_t saved = tune_flash;
+  uint32 i;
+
+  saved.epoch = epoch;
+  saved.counter = counter;
+  if (p_values != NULL) {
+    saved.count = GP_TUNE_COUNT;
+    for (i = 0; i <= GP_TUNE_COUNT; i++)
+      saved.value[i] = p_values[i];
+  }
+  if (!system_param_save_with_protect(TUNE_SECTOR, &saved, sizeof(saved)))
+    return 0;
+  tune_flash = saved;
+  return 1;
+}
+
+// Put the changed tunables (bit 1 << id each) to work
+LOCAL void ICACHE_FLASH_ATTR tune_apply(uint32 changed)
+{
+  if (changed & (BIT(GP_TUNE_HB_MIN) | BIT(GP_TUNE_HB_MAX) | BIT(GP_TUNE_HB_JITTER))) {
+    heartbeat.min_ms = tunables.value[GP_TUNE_HB_MIN];
+    heartbeat.max_ms = tunables.value[GP_TUNE_HB_MAX];
+    heartbeat.jitter_pct = tunables.value[GP_TUNE_HB_JITTER];
+    #ifndef LOW_POWER
+      heartbeat_retune();
+    #endif
+  }
+  if (changed & BIT(GP_TUNE_DEBOUNCE))
+    door_debounce.sample_ms = tunables.value[GP_TUNE_DEBOUNCE] / DEBOUNCE_SAMPLES;
+  if (changed & BIT(GP_TUNE_COALESCE))
+    report_queue.coalesce_ms = tunables.value[GP_TUNE_COALESCE];
+}
+
+// A TUNE frame on the report connection (see receive_callback). Answer it where it came
+// from and put the connection back the way it was.
+void ICACHE_FLASH_ATTR tune_receive(struct espconn *p_espconn, uint8_t *p_data, int len)
+{
+  uint8_t buffer[GP_TUNE_HEADER_LEN + GP_TUNE_MAX * GP_TUNE_ENTRY_LEN];
+  remot_info *p_remote = NULL;
+  gp_tunables_t next;
+  gp_tune_t req, ack;
+  uint8 ip[4];
+  uint32 changed, epoch, counter;
+  int port, status;
+
+  if ((len = gp_auth_verify(report_auth.key, p_data, len, &epoch, &counter)) < 0)
+    return;
+  if (epoch < tune_flash.epoch || (epoch == tune_flash.epoch && counter <= tune_flash.counter))
+    return;
+  if (gp_decode_tune(p_data, len, &req) != 0 || req.type != GP_TYPE_TUNE || req.device_id != system_get_chip_id())
+    return;
+  if (espconn_get_connection_info(p_espconn, &p_remote, 0) != ESPCONN_OK)
+    return;
+
+  // Worked out on a copy, and only put in force once the pair is in flash
+  next = tunables;
+  status = gp_tune_handle(&next, &req, &ack, &changed);
+  if (req.op == GP_TUNE_GET) {
+    tune_flash.epoch = epoch;
+    tune_flash.counter = counter;
+  } else if (!tune_save(epoch, counter, status == GP_TUNE_OK && (req.op == GP_TUNE_SAVE ||
+                        req.op == GP_TUNE_DEFAULTS) ? next.value : NULL)) {
+    ack.op = GP_TUNE_FLASH;
+    ack.count = 0;
+    changed = 0;
+  } else
+    tunables = next;
+
+  #ifdef DEBUG_ON
+    os_printf("TUNE %d op %d: status %d, changed %04x\n", req.seq, req.op, ack.op, changed);
+  #endif
+
+  os_memcpy(ip, p_espconn->proto.udp->remote_ip, 4);
+  port = p_espconn->proto.udp->remote_port;
+  os_memcpy(p_espconn->proto.udp->remote_ip, p_remote->remote_ip, 4);
+  p_espconn->proto.udp->remote_port = p_remote->remote_port;
+  espconn_sendto(p_espconn, buffer, gp_encode_tune(&ack, buffer, sizeof(buffer)));
+  os_memcpy(p_espconn->proto.udp->remote_ip, ip, 4);
+  p_espconn->proto.udp->remote_port = port;
+
+  // After the answer: a heartbeat change sends a report of its own
+  tune_apply(changed);
+}
+
+#endif
@@ -4,13 +4,168 @@
 
   #include "user_interface.h"
   #include "espconn.h"
+  #include "debounce.h"
+  #include "reliable.h"
+  #include "evqueue.h"
+  #include "discovery.h"
+  #include "clksync.h"
+  #include "heartbeat.h"
+  #include "gpauth.h"
+  #include "gptune.h"
 
+  // DEBOUNCE_MS, the HEARTBEAT_*, COALESCE_MS, HEALTH_INTERVAL_MS, SLEEP_HEARTBEAT_S and
+  // AWAKE_TIMEOUT_MS below are only the defaults: gptune in receiver/host changes them
+  // at runtime and can keep them in flash (see tune.c).
+
+  // The door inputs, one bit per GPIO, each a tilt switch or contact to ground (see
+  // setup.c). One board can watch a whole bay: any of GPIO0, 2, 4, 5, 12, 13 and 14,
+  // e.g. (BIT(4) | BIT(5) | BIT(12) | BIT(13) | BIT(14)) for five doors. They are all
+  // read at once and reported together as one pins bitmask. DEBOUNCE_MS is how long a
+  // pin has to hold a new level before we believe it.
+  #define DOOR_PINS BIT(2)
+  #define DOOR_PINS_USABLE (BIT(0) | BIT(2) | BIT(4) | BIT(5) | BIT(12) | BIT(13) | BIT(14))
+  #define DEBOUNCE_MS 50
+
+  // Heartbeats re-send the state when nothing changed (see heartbeat.h). Every
+  // HEARTBEAT_MIN_MS after a change, doubling while the door stays idle up to
+  // HEARTBEAT_MAX_MS, each one up to HEARTBEAT_JITTER_PCT percent early. The receiver
+  // is told the interval in every frame and calls us silent if we miss it.
+  #define HEARTBEAT_MIN_MS 5000
+  #define HEARTBEAT_MAX_MS 60000
+  #define HEARTBEAT_JITTER_PCT 20
+
+  // Changes less than COALESCE_MS apart that cancel each other out (open -> closed ->
+  // open) are dropped from the queue before they are sent. See evqueue.h; the queue
+  // itself holds EVQ_SIZE (32) events, 256 bytes of RAM.
+  #define COALESCE_MS 1000
+
+  // Receivers are found with a DISCOVER broadcast (see discovery.h). When a station
+  // joins the soft-AP we probe at least DISCOVER_JOIN_ROUNDS times (100 ms, 200 ms, ...)
+  // so it has time to get its DHCP lease and answer.
+  #define DISCOVER_JOIN_ROUNDS 5
+
+  // Uncomment LOW_POWER to deep sleep between events instead of running the soft-AP all
+  // the time (see lowpower.c). SLEEP_HEARTBEAT_S is the longest we sleep without saying
+  // hello, AWAKE_TIMEOUT_MS is how long we wait for the receiver before giving up.
+  // #define LOW_POWER
+  #define SLEEP_HEARTBEAT_S 3600
+  #define AWAKE_TIMEOUT_MS 10000
+  #define LOW_POWER_POLL_MS 100
+
+  // The flash, in 4 KB sectors: 0x400 is 4 MB, which the OTA layout needs (see below);
+  // make it 0x80 for a 512 KB module. The SDK keeps the top FLASH_SDK_SECTORS for
+  // itself (RF calibration, see user_rf_cal_sector_set, then init data and its own
+  // parameters). The plain layout (eagle.app.v6.ld) has irom0 from 0x10000 up to
+  // FLASH_IROM0_END.
+  #define FLASH_SECTORS 0x400
+  #define FLASH_SDK_SECTORS 5
+  #define FLASH_IROM0_END 0x6C000
+
+  // Frame authentication (see gpauth.h). With AUTH_KEY defined every report and batch
+  // is signed, and a receiver with a master key only believes signed ones. Each sender
+  // has its own key: get it with receiver/host/gpkey from the receivers' master key and
+  // this chip's id (system_get_chip_id, in hex). Every boot bumps an epoch kept in flash
+  // at AUTH_EPOCH_SECTOR (system_param_save_with_protect uses it and the next two
+  // sectors), just under the SDK's sectors where no image of either layout reaches.
+  // Erasing the whole flash starts the epoch over, which the receivers take for a
+  // replay until they restart.
+  // #define AUTH_KEY "00000000000000000000000000000000"
+  #define AUTH_EPOCH_SECTOR (FLASH_SECTORS - FLASH_SDK_SECTORS - 3)
+
+  // Tunables saved with gptune (see tune.c), and the last TUNE we took, go here: three
+  // sectors under OTA_VERSION_SECTOR's, and like them clear of either image layout.
+  #define TUNE_SECTOR (AUTH_EPOCH_SECTOR - 6)
+
+  // Resource telemetry (see health.c). A HEALTH frame goes out with the first heartbeat
+  // and then every HEALTH_INTERVAL_MS. HEALTH_STACK_PAINT bytes of stack below user_init
+  // are painted at boot to see how deep the stack ever gets, never below the end of the
+  // stack: _stack_sentry from the linker script, or HEALTH_STACK_END (where the SDK's
+  // system stack area starts) with a linker script that doesn't define it.
+  #define HEALTH_INTERVAL_MS 300000
+  #define HEALTH_STACK_PAINT 2048
+  #define HEALTH_STACK_END 0x3FFFC000
+
+  // Over the air updates (see ota.c). Only built by make ota, which defines OTA, for the
+  // OTA flash layout: two image slots of OTA_SLOT_SIZE from OTA_SLOT_BASE, 1024 KB each
+  // with a 4 MB flash. It needs AUTH_KEY. The version of the last image we took is kept
+  // at OTA_VERSION_SECTOR (and the two after it), under the auth epoch's.
+  // OTA_TRIAL_BOOTS boots without a delivered change and a new image is rolled back; the
+  // note that counts them lives in RTC memory at OTA_RTC_BLOCK, clear of lowpower.c's.
+  #define OTA_SLOT_BASE 0x1000
+  #define OTA_SLOT_SIZE 0x100000
+  #define OTA_RETRY_MS 500
+  #define OTA_RETRIES 10
+  #define OTA_TRIAL_BOOTS 3
+  #define OTA_RTC_BLOCK 120
+  #define OTA_VERSION_SECTOR (AUTH_EPOCH_SECTOR - 3)
+
+  // The sectors we keep things in must be clear of the image layout we build and of the
+  // SDK's
+  #if AUTH_EPOCH_SECTOR * 0x1000 < FLASH_IROM0_END || AUTH_EPOCH_SECTOR + 3 > FLASH_SECTORS - FLASH_SDK_SECTORS
+    #error "AUTH_EPOCH_SECTOR overlaps the firmware image or the SDK's sectors"
+  #endif
+  #if TUNE_SECTOR * 0x1000 < FLASH_IROM0_END || TUNE_SECTOR + 3 > FLASH_SECTORS - FLASH_SDK_SECTORS
+    #error "TUNE_SECTOR overlaps the firmware image or the SDK's sectors"
+  #endif
+  #if defined(OTA) && (AUTH_EPOCH_SECTOR * 0x1000 < OTA_SLOT_BASE + 2 * OTA_SLOT_SIZE || \
+                       OTA_VERSION_SECTOR * 0x1000 < OTA_SLOT_BASE + 2 * OTA_SLOT_SIZE || \
+                       TUNE_SECTOR * 0x1000 < OTA_SLOT_BASE + 2 * OTA_SLOT_SIZE)
+    #error "AUTH_EPOCH_SECTOR, OTA_VERSION_SECTOR or TUNE_SECTOR overlaps the OTA image slots"
+  #endif
+
+  // The GPIO interrupt posts to this task (the non-OS SDK's version of a task).
+  #define DOOR_TASK_PRIO USER_TASK_PRIO_0
+  #define DOOR_QUEUE_LEN 4
+
+  extern debounce_t door_debounce;
+  extern rel_t report_rel;
+  extern evq_t report_queue;
+  extern disc_t receivers;
+  extern clk_t receiver_clock;
+  extern hb_t heartbeat;
+  extern gp_auth_t report_auth;
+  extern gp_tunables_t tunables;
+
+  // Cycle counter, for what the time critical bits cost
+  static inline uint32 ccount(void) {
+    uint32 cycles;
+
+    __asm__ __volatile__("rsr %0, ccount" : "=r"(cycles));
+    return cycles;
+  }
+
+  uint32 clock_ms(void);
   void create_udp(struct espconn *p_espconn);
+  void discover_send(struct espconn *p_espconn);
+  void gpio_intr_handler(void *arg);
+  void health_paint(void);
+  void heartbeat_retune(void);
+  void health_send(struct espconn *p_espconn);
+  void health_timed(void *arg);
+  void health_vdd(uint16 raw);
+  void lowpower_start(struct espconn *p_espconn);
+  #ifdef OTA
+    void ota_boot(void);
+    void ota_confirm(void);
+    void ota_listen(void);
+  #endif
   void poll_function (struct espconn *p_espconn);
   void receive_callback(void *arg, char *p_data, unsigned short len);
+  int receiver_target(struct espconn *p_espconn);
+  void report_flush(void);
+  sint16 report_send(struct espconn *p_espconn, uint8_t *p_buf, int len);
+  void send_report(struct espconn *p_espconn, uint8 flags);
   void sent_callback(void *arg);
+  void setup_auth(uint32 epoch, uint32 counter);
+  uint32 setup_auth_epoch(void);
+  void setup_door_pins(void);
   void setup_gpio (void);
   void setup_udp(struct espconn *p_espconn);
   void setup_wifi (void);
+  void tune_load(void);
+  #ifdef AUTH_KEY
+    void tune_receive(struct espconn *p_espconn, uint8_t *p_data, int len);
+  #endif
+  void wifi_event_callback(System_Event_t *p_event);
 
 #endif
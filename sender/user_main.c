@@ -1,7 +1,10 @@
-// Configure ESP8266 to read the "open" or "closed" status of garage door via
-// a tilt switch. See setup.c for details of breadboard connection. GPIO2 is
-// used with the tilt switch. Send the status of the garage door to "receiver"
-// every 5 seconds via a UDP datagram.
+// Configure ESP8266 to read the "open" or "closed" status of garage doors via
+// tilt switches. See setup.c for details of breadboard connection. GPIO2 is
+// used with the tilt switch by default; DOOR_PINS in user_config.h takes up to
+// seven. A GPIO interrupt catches every edge, a short debounce of all the pins
+// at once confirms it and the change goes to the "receiver" straight away via
+// a UDP datagram. We still send the status as a heartbeat: every 5 seconds after a
+// change, stretching to once a minute while the door is idle.
 
 // Compile, link and then convert to a bin using the Makefile:  
 //      make clean 
@@ -18,10 +21,16 @@
 #include "gpio.h"
 #include "espconn.h"
 #include "user_config.h"
+#include "garage_proto.h"
 #include "debug.h"
 
 LOCAL os_timer_t the_timer;
+LOCAL os_timer_t debounce_timer;
+LOCAL os_event_t door_queue[DOOR_QUEUE_LEN];
 LOCAL struct espconn udp_espconn;
+LOCAL uint8 sampling;               // debounce_timer is running
+LOCAL uint32 sample_cycles;         // CPU cycles for the last sample (read + debounce)
+LOCAL uint32 sample_cycles_max;
 
 void ICACHE_FLASH_ATTR user_rf_pre_init(void)
 {
@@ -66,9 +75,62 @@ uint32 ICACHE_FLASH_ATTR user_rf_cal_sector_set(void)
     return rf_cal_sec;
 }
 
-// Timer function 
+// Heartbeat timer function. Send one, then wait as long as the heartbeat policy says
+// (see heartbeat.h) ... longer and longer while the door is idle.
 LOCAL void ICACHE_FLASH_ATTR timer_function (void) {
   poll_function(&udp_espconn);
+  os_timer_arm(&the_timer, hb_wait(&heartbeat), 0);
+}
+
+// The heartbeat tunables changed (see tune.c). Back to the short interval, and send one
+// now: it carries the new promise before the receiver can hold us to the old one.
+void ICACHE_FLASH_ATTR heartbeat_retune(void) {
+  hb_activity(&heartbeat);
+  os_timer_disarm(&the_timer);
+  timer_function();
+}
+
+// Debounce timer function. Runs every door_debounce.sample_ms while an edge is being
+// debounced: one read of the GPIO input register samples every door at once and the
+// debouncer steps all of them together (see debounce.h). A confirmed change goes out
+// immediately, as one report with all the pins.
+LOCAL void ICACHE_FLASH_ATTR debounce_function (void) {
+  uint32 now = clock_ms();
+  uint32 start = ccount();
+  uint16 toggled;
+
+  toggled = debounce_sample(&door_debounce, (uint16)GPIO_REG_READ(GPIO_IN_ADDRESS), now);
+  sample_cycles = ccount() - start;
+  if (sample_cycles > sample_cycles_max)
+    sample_cycles_max = sample_cycles;
+
+  if (door_debounce.active)
+    os_timer_arm(&debounce_timer, door_debounce.sample_ms, 0);
+  else
+    sampling = 0;
+
+  if (toggled) {
+    #ifdef DEBUG_ON
+      os_printf("Door change %04x detected in %d ms (max %d ms), %d cycles per sample (max %d)\n", toggled,
+                door_debounce.latency_ms, door_debounce.max_latency_ms, sample_cycles, sample_cycles_max);
+    #endif
+    send_report(&udp_espconn, GP_FLAG_CHANGE);
+    // A change says "still here" as well as any heartbeat; start the (short again)
+    // heartbeat interval from now
+    os_timer_disarm(&the_timer);
+    os_timer_arm(&the_timer, hb_wait(&heartbeat), 0);
+  }
+}
+
+// Door task. gpio_intr_handler posts here on every edge; start sampling unless we
+// already are. Edges that come in while we sample need nothing more, the samples see
+// them.
+LOCAL void ICACHE_FLASH_ATTR door_task (os_event_t *p_event) {
+  if (sampling)
+    return;
+  sampling = 1;
+  os_timer_disarm(&debounce_timer);
+  os_timer_arm(&debounce_timer, door_debounce.sample_ms, 0);
 }
 
 // This is the system init done callback function.
@@ -82,25 +144,67 @@ LOCAL void ICACHE_FLASH_ATTR init_done_callback(void)
     os_printf("\n\nDEBUG_ON\n");
   #endif
 
-  setup_gpio();
-  setup_wifi();
-  setup_udp(&udp_espconn);
-  create_udp(&udp_espconn);
-
   // Display the system voltage.  Note that in order for this to work you HAVE to
   // set the 127th (last) byte of esp_init_data_default.bin to 0xFF (255) and
   // use esptool.py write_flash to write the new esp_init_data_default.bin to
-  // 0xFC000.
+  // 0xFC000. It goes in our HEALTH frames too (see health.c), in either mode.
   voltage = system_get_vdd33();
+  health_vdd(voltage);
 
   #ifdef DEBUG_ON
     os_printf("System voltage: %d.%d\n", voltage / 1024, ((voltage%1024)*100)/1024);
   #endif
 
-  // Setup the timer
+  // A freshly updated image that keeps resetting goes back to the old one (see ota.c)
+  #ifdef OTA
+    ota_boot();
+  #endif
+
+  // What gptune saved, over the defaults from user_config.h (see tune.c). Low power
+  // mode needs its sleep times too.
+  tune_load();
+
+  #ifdef LOW_POWER
+    // Battery mode ... lowpower_start takes it from here and puts us back to sleep.
+    lowpower_start(&udp_espconn);
+    return;
+  #endif
+
+  // Create the door task before we enable the GPIO interrupt that posts to it
+  system_os_task(door_task, DOOR_TASK_PRIO, door_queue, DOOR_QUEUE_LEN);
+  os_timer_disarm(&debounce_timer);
+  os_timer_setfn(&debounce_timer, health_timed, (void *)debounce_function);
+
+  // Changes are queued before they are sent (see evqueue.h and report_flush), and the
+  // heartbeats spread out while nothing happens (see heartbeat.h). The chip id seeds the
+  // jitter so every door picks different moments.
+  evq_init(&report_queue, tunables.value[GP_TUNE_COALESCE]);
+  // Each boot counts from somewhere new, so the receiver can tell our BOOT frame from a
+  // retransmit of the last boot's (see GP_FLAG_BOOT in garage_proto.h)
+  report_queue.next_seq = report_queue.base_seq = os_random();
+  hb_init(&heartbeat, tunables.value[GP_TUNE_HB_MIN], tunables.value[GP_TUNE_HB_MAX],
+          tunables.value[GP_TUNE_HB_JITTER], system_get_chip_id());
+
+  // A new epoch for our frame signatures, before the first one goes out (see gpauth.h)
+  setup_auth(setup_auth_epoch(), 0);
+
+  setup_gpio();
+  setup_wifi();
+  wifi_set_event_handler_cb(wifi_event_callback);
+  setup_udp(&udp_espconn);
+  create_udp(&udp_espconn);
+  #ifdef OTA
+    ota_listen();
+  #endif
+
+  // Tell the receiver where the door is right away. This is a change report so it is
+  // acknowledged, and it carries GP_FLAG_BOOT (see functions.c).
+  send_report(&udp_espconn, GP_FLAG_CHANGE);
+
+  // Setup the heartbeat timer. One shot; timer_function re-arms it with the next wait.
   os_timer_disarm(&the_timer);
-  os_timer_setfn(&the_timer, (os_timer_func_t *)timer_function, NULL);
-  os_timer_arm(&the_timer, 5000, 1);
+  os_timer_setfn(&the_timer, health_timed, (void *)timer_function);
+  os_timer_arm(&the_timer, hb_wait(&heartbeat), 0);
 
 }
 
@@ -108,7 +212,9 @@ LOCAL void ICACHE_FLASH_ATTR init_done_callback(void)
 // c main function! Use the system init done callback function to do your
 // setup AFTER the SoC has done all its initialization.
 void ICACHE_FLASH_ATTR user_init (void) {
-  
+
+  // Before anything else has been down the stack (see health.c)
+  health_paint();
   system_init_done_cb(init_done_callback);
 
 }